@@ -0,0 +1,95 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// Measures the latency of calls from the host into a warm VM through
+// libxanadu: calls of a small function, of a method bound to an instance,
+// and of a function that calls back into a host native. Each is called
+// repeatedly for about a second and the time per call is printed.
+//
+// Usage: call_bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "xanadu.h"
+
+// Processor time each kind of call is measured for, in seconds
+#define BENCH_SECONDS 1.0
+
+// Calls made between two looks at the clock
+#define BATCH 10000
+
+// Functions the host calls
+static const char *source =
+	"subdivision add(a, b) { limelight a + b; }\n"
+	"overtune Counter {\n"
+	"\tinit() { todays.count = 0; }\n"
+	"\tstep(n) { todays.count = todays.count + n; limelight todays.count; }\n"
+	"}\n"
+	"yyz counter = Counter();\n"
+	"yyz step = counter.step;\n"
+	"subdivision twice(x) { limelight host_double(x) + x; }\n";
+
+// Native called back by twice()
+static XanaduValue host_double(XanaduVM *vm, int argCount,
+			       const XanaduValue *args, void *data)
+{
+	(*(long *)data)++;
+	return XANADU_NUMBER_VAL(XANADU_AS_NUMBER(args[0]) * 2);
+}
+
+// Calls a global repeatedly with two or one numbers and prints the time per
+// call
+static void bench(XanaduVM *vm, const char *name, int argCount)
+{
+	XanaduValue callee;
+	if (!xanadu_get_global(vm, name, &callee)) {
+		fprintf(stderr, "Undefined global '%s'.\n", name);
+		exit(70);
+	}
+
+	XanaduValue args[2] = { XANADU_NUMBER_VAL(1), XANADU_NUMBER_VAL(2) };
+	XanaduValue result;
+	long calls = 0;
+	double sum = 0;
+	clock_t start = clock();
+	double seconds;
+
+	do {
+		for (int i = 0; i < BATCH; i++) {
+			if (xanadu_call(vm, callee, argCount, args, &result) !=
+			    XANADU_OK)
+				exit(70);
+			sum += XANADU_AS_NUMBER(result);
+		}
+		calls += BATCH;
+		seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	} while (seconds < BENCH_SECONDS);
+
+	printf("%-8s %10ld calls %9.1f ns/call  (checksum %.0f)\n", name, calls,
+	       seconds * 1e9 / calls, sum);
+}
+
+int main(void)
+{
+	XanaduVM *vm = xanadu_new_vm();
+	if (vm == NULL) {
+		fprintf(stderr, "Not enough memory.\n");
+		return 74;
+	}
+
+	long callbacks = 0;
+	xanadu_define_native(vm, "host_double", host_double, &callbacks);
+	if (xanadu_run_source(vm, source) != XANADU_OK)
+		return 65;
+
+	bench(vm, "add", 2);
+	bench(vm, "step", 1);
+	bench(vm, "twice", 1);
+	printf("%ld callbacks into the host\n", callbacks);
+
+	xanadu_free_vm(vm);
+	return 0;
+}
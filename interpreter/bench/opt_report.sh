@@ -0,0 +1,14 @@
+#!/bin/sh
+# Prints the bytecode size and timings of every benchmark at each
+# optimization level.
+#
+# Usage: bench/opt_report.sh [path to xi]
+
+XI=${1:-./build/xi}
+DIR=$(dirname "$0")
+
+for file in "$DIR"/*.xa; do
+	echo "== $(basename "$file")"
+	"$XI" --opt-report "$file" || exit 1
+	echo
+done
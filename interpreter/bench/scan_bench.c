@@ -0,0 +1,153 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// Measures the throughput of the scanner in MB/s. It scans the given files,
+// or two generated sources, one heavy in comments, strings and numbers and
+// one in keywords and identifiers, repeatedly for about a second and prints
+// how fast each was tokenized. Building it with -DSCANNER_NO_SIMD measures
+// the scalar scanner.
+//
+// Usage: scan_bench [file...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+// Size of the generated source
+#define GENERATED_SIZE (8 * 1024 * 1024)
+
+// Processor time each source is scanned for, in seconds
+#define BENCH_SECONDS 1.0
+
+// Reads a whole file into a null-terminated buffer.
+static char *read_file(const char *path, size_t *length)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+
+	fseek(file, 0L, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+
+	char *buffer = malloc((size_t)size + 1);
+	if (buffer == NULL ||
+	    fread(buffer, 1, (size_t)size, file) != (size_t)size) {
+		free(buffer);
+		fclose(file);
+		return NULL;
+	}
+	buffer[size] = '\0';
+	fclose(file);
+	*length = (size_t)size;
+	return buffer;
+}
+
+// Lines of a source that looks like our generated programs: indented
+// statements with long literals and comments.
+static const char *literalLines[] = {
+	"// Generated table of constants, do not edit by hand\n",
+	"yyz table_%d = 31415926535897932384626.4338327950288;\n",
+	"blabla \"row %d of the generated table, kept as a string\";\n",
+	"\t\tfreewill (table_%d > 1000000) {\n",
+	"\t\t\t\tlimelight table_%d * 2718281828459045;   // scaled\n",
+	"\t\t}\n",
+	NULL
+};
+
+// Lines of a source made of keywords and identifiers that start like them.
+static const char *identifierLines[] = {
+	"yyz circumstances_%d = subdivision_count + workingmans_grind_total;\n",
+	"freewill (counterpoint_flag or limelight_level and syrinx_mode) {\n",
+	"blabla todays.cygnus_value + overtune_width * blabla_%d;\n",
+	"} counterpoint { limelight todays.workingmans_grinder(yyz_%d); }\n",
+	"workingmans_grind (true and freewill_%d) circumstances_index = cygnus;\n",
+	NULL
+};
+
+// Generates a source by repeating `lines`, which each contain one %d.
+static char *generate_source(const char **lines, size_t *length)
+{
+	char *buffer = malloc(GENERATED_SIZE + 256);
+	if (buffer == NULL)
+		return NULL;
+
+	size_t count = 0;
+	for (int i = 0; count < GENERATED_SIZE; i++) {
+		if (lines[i] == NULL)
+			i = 0;
+		count += (size_t)sprintf(buffer + count, lines[i], (int)count);
+	}
+	*length = count;
+	return buffer;
+}
+
+// Scans the source until the end and returns the number of tokens.
+static long scan_all(const char *source)
+{
+	long tokens = 0;
+	init_scanner(source);
+	for (;;) {
+		Token token = scan_token();
+		tokens++;
+		if (token.type == TOKEN_EOF)
+			return tokens;
+	}
+}
+
+// Scans a source repeatedly and prints its throughput.
+static void bench(const char *name, const char *source, size_t length)
+{
+	long tokens = 0;
+	int runs = 0;
+	clock_t start = clock();
+	double seconds;
+
+	do {
+		tokens = scan_all(source);
+		runs++;
+		seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	} while (seconds < BENCH_SECONDS);
+
+	double megabytes = (double)length * runs / (1024.0 * 1024.0);
+	printf("%-24s %8.2f MB %9ld tokens %9.1f MB/s\n", name,
+	       (double)length / (1024.0 * 1024.0), tokens,
+	       megabytes / seconds);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t length;
+
+	if (argc < 2) {
+		const char **sources[] = { literalLines, identifierLines };
+		const char *names[] = { "<literals>", "<identifiers>" };
+
+		for (int i = 0; i < 2; i++) {
+			char *source = generate_source(sources[i], &length);
+			if (source == NULL) {
+				fprintf(stderr, "Not enough memory.\n");
+				return 74;
+			}
+			bench(names[i], source, length);
+			free(source);
+		}
+		return 0;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		char *source = read_file(argv[i], &length);
+		if (source == NULL) {
+			fprintf(stderr, "Could not read file \"%s\".\n",
+				argv[i]);
+			return 74;
+		}
+		bench(argv[i], source, length);
+		free(source);
+	}
+	return 0;
+}
@@ -0,0 +1,175 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file is the public interface of libxanadu, which embeds the Xanadu
+// interpreter in C programs. A program creates any number of VMs, runs
+// source or bytecode in them, and then looks up the globals they defined
+// and calls them. C functions registered as natives can be called from
+// Xanadu code and call back into the VM.
+//
+// A VM may be used by one thread at a time; separate VMs share nothing.
+// Values holding objects stay alive while they are reachable from a global
+// or from a call in progress, so a host that keeps an object across calls
+// should store it in a global with xanadu_set_global().
+
+#ifndef xanadu_h
+#define xanadu_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Symbols exported by the shared library
+#if defined(__GNUC__)
+#define XANADU_API __attribute__((visibility("default")))
+#else
+#define XANADU_API
+#endif
+
+// Macros for creating Xanadu values from C values
+#define XANADU_BOOL_VAL(value) \
+	((XanaduValue){ XANADU_VAL_BOOL, { .boolean = (value) } })
+#define XANADU_NIL_VAL ((XanaduValue){ XANADU_VAL_NIL, { .number = 0 } })
+#define XANADU_NUMBER_VAL(value) \
+	((XanaduValue){ XANADU_VAL_NUMBER, { .number = (value) } })
+
+// Macros for extracting C values from Xanadu values
+#define XANADU_AS_BOOL(value) ((value).as.boolean)
+#define XANADU_AS_NUMBER(value) ((value).as.number)
+
+// Macros for checking the type of a Xanadu value
+#define XANADU_IS_BOOL(value) ((value).type == XANADU_VAL_BOOL)
+#define XANADU_IS_NIL(value) ((value).type == XANADU_VAL_NIL)
+#define XANADU_IS_NUMBER(value) ((value).type == XANADU_VAL_NUMBER)
+#define XANADU_IS_OBJ(value) ((value).type == XANADU_VAL_OBJ)
+
+// A virtual machine with its own globals and heap
+typedef struct VM XanaduVM;
+
+// Type of a Xanadu value
+typedef enum {
+	XANADU_VAL_BOOL, // Boolean value
+	XANADU_VAL_NIL, // Nil value
+	XANADU_VAL_NUMBER, // Number value
+	XANADU_VAL_OBJ, // Object owned by the VM: string, function, instance...
+} XanaduValueType;
+
+// A Xanadu value, passed by value like the VM's own
+typedef struct {
+	XanaduValueType type; // Type of the value
+	union {
+		bool boolean; // Boolean value
+		double number; // Numeric value
+		void *obj; // Object pointer
+	} as;
+} XanaduValue;
+
+// Outcome of running or calling code
+typedef enum {
+	XANADU_OK, // The code ran to the end
+	XANADU_COMPILE_ERROR, // The source didn't compile, nothing ran
+	XANADU_RUNTIME_ERROR // The code stopped at a runtime error
+} XanaduResult;
+
+// A C function callable from Xanadu code
+// Parameters:
+//   vm - The VM the function is called from
+//   argCount - Number of arguments
+//   args - The arguments, valid until the function returns
+//   data - The data the function was registered with
+// Returns:
+//   The value of the call
+typedef XanaduValue (*XanaduNative)(XanaduVM *vm, int argCount,
+				    const XanaduValue *args, void *data);
+
+// Create a VM. Errors are reported on the standard error stream.
+// Returns:
+//   The new VM, or NULL if there isn't enough memory
+XANADU_API XanaduVM *xanadu_new_vm(void);
+
+// Free a VM and every object it owns
+XANADU_API void xanadu_free_vm(XanaduVM *vm);
+
+// Set the optimization level of the code compiled from now on, from 0
+// (none) to 2; out of range levels are clamped
+XANADU_API void xanadu_set_optimization_level(XanaduVM *vm, int level);
+
+// Compile and run source code as a program, then the tasks it started
+// until every one has finished. The globals it defines stay in the VM for
+// later runs and calls.
+// Parameters:
+//   vm - The VM to run the code in
+//   source - Null-terminated source code
+// Returns:
+//   Whether the code compiled and ran without errors, its tasks included
+XANADU_API XanaduResult xanadu_run_source(XanaduVM *vm, const char *source);
+
+// Run a source or bytecode file as a program, then the tasks it started
+// until every one has finished. Modules imported by a source file are found
+// relative to it.
+// Parameters:
+//   vm - The VM to run the file in
+//   path - Path of the file, bytecode files are recognized by their header
+// Returns:
+//   Whether the file loaded, compiled and ran without errors, its tasks
+//   included
+XANADU_API XanaduResult xanadu_run_file(XanaduVM *vm, const char *path);
+
+// Look up a global variable
+// Parameters:
+//   vm - The VM whose globals are searched
+//   name - Null-terminated name of the global
+//   value - Receives the value of the global
+// Returns:
+//   Whether the global is defined
+XANADU_API bool xanadu_get_global(XanaduVM *vm, const char *name,
+				  XanaduValue *value);
+
+// Define or assign a global variable
+XANADU_API void xanadu_set_global(XanaduVM *vm, const char *name,
+				  XanaduValue value);
+
+// Call a closure, bound method, class or native with arguments. Natives
+// may call back into the VM; a runtime error only stops the innermost call.
+// Parameters:
+//   vm - The VM that owns the callee
+//   callee - The value to call
+//   argCount - Number of arguments
+//   args - The arguments, may be NULL if there are none
+//   result - Receives the returned value, nil after an error
+// Returns:
+//   XANADU_OK, or XANADU_RUNTIME_ERROR if the call failed
+XANADU_API XanaduResult xanadu_call(XanaduVM *vm, XanaduValue callee,
+				    int argCount, const XanaduValue *args,
+				    XanaduValue *result);
+
+// Define a global native function that is passed `data` on every call
+XANADU_API void xanadu_define_native(XanaduVM *vm, const char *name,
+				     XanaduNative function, void *data);
+
+// Create a string. Equal strings are the same object.
+// Parameters:
+//   vm - The VM that owns the string
+//   chars - The characters of the string, copied
+//   length - Number of characters
+// Returns:
+//   The string, which is collected unless it is reachable from the VM
+XANADU_API XanaduValue xanadu_string(XanaduVM *vm, const char *chars,
+				     int length);
+
+// Check if a value is a string
+XANADU_API bool xanadu_is_string(XanaduValue value);
+
+// Get the null-terminated characters of a string value, and their number
+// if `length` isn't NULL
+XANADU_API const char *xanadu_string_chars(XanaduValue value, int *length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,21 +17,25 @@ void init_chunk(Chunk *chunk)
 	chunk->capacity =
 		0; // Capacity of the chunk (number of bytes it can hold)
 	chunk->code = NULL; // Pointer to the array of bytecode
-	chunk->lines =
-		NULL; // Pointer to the array of line numbers corresponding to bytecode
+	chunk->lineCount = 0; // Number of runs in the line table
+	chunk->lineCapacity = 0; // Capacity of the line table
+	chunk->lines = NULL; // Pointer to the line table
 	init_value_array(&chunk->constants); // Initialize the constants array
 }
 
 // Frees the resources used by a Chunk structure.
 // Deallocates memory for the code and line arrays and frees the constants array.
 // Reinitializes the chunk to its default state.
-void free_chunk(Chunk *chunk)
+void free_chunk(VM *vm, Chunk *chunk)
 {
-	FREE_ARRAY(uint8_t, chunk->code,
-		   chunk->capacity); // Free memory for bytecode array
-	FREE_ARRAY(int, chunk->lines,
-		   chunk->capacity); // Free memory for line number array
-	free_value_array(&chunk->constants); // Free memory for constants array
+	// Chunks loaded from a bytecode image borrow their code and lines
+	if (chunk->capacity > 0) {
+		FREE_ARRAY(vm, uint8_t, chunk->code,
+			   chunk->capacity); // Free memory for bytecode array
+		FREE_ARRAY(vm, LineRun, chunk->lines,
+			   chunk->lineCapacity); // Free memory for line table
+	}
+	free_value_array(vm, &chunk->constants); // Free memory for constants array
 	init_chunk(chunk); // Reinitialize the chunk
 }
 
@@ -39,10 +43,11 @@ void free_chunk(Chunk *chunk)
 // Also records the line number associated with the byte in the chunk.
 //
 // Parameters:
+//   vm - The VM the chunk's memory is charged to
 //   chunk - The chunk to write to
 //   byte - The byte to write
 //   line - The line number associated with the byte
-void write_chunk(Chunk *chunk, uint8_t byte, int line)
+void write_chunk(VM *vm, Chunk *chunk, uint8_t byte, int line)
 {
 	// Check if the chunk needs more capacity and grow if necessary
 	if (chunk->capacity < chunk->count + 1) {
@@ -50,33 +55,93 @@ void write_chunk(Chunk *chunk, uint8_t byte, int line)
 		chunk->capacity =
 			GROW_CAPACITY(oldCapacity); // Compute new capacity
 		chunk->code =
-			GROW_ARRAY(uint8_t, chunk->code, oldCapacity,
+			GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity,
 				   chunk->capacity); // Resize bytecode array
-		chunk->lines =
-			GROW_ARRAY(int, chunk->lines, oldCapacity,
-				   chunk->capacity); // Resize line number array
 	}
 
 	chunk->code[chunk->count] = byte; // Store the byte in the code array
-	chunk->lines[chunk->count] = line; // Store the associated line number
+
+	// Start a new run if the line changed since the previous byte
+	if (chunk->lineCount == 0 ||
+	    chunk->lines[chunk->lineCount - 1].line != line) {
+		if (chunk->lineCapacity < chunk->lineCount + 1) {
+			int oldCapacity = chunk->lineCapacity;
+			chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+			chunk->lines = GROW_ARRAY(vm, LineRun, chunk->lines,
+						  oldCapacity,
+						  chunk->lineCapacity);
+		}
+		chunk->lines[chunk->lineCount].offset = chunk->count;
+		chunk->lines[chunk->lineCount].line = line;
+		chunk->lineCount++;
+	}
+
 	chunk->count++; // Increment the count of bytes in the chunk
 }
 
+// Returns the source line of the byte at `offset` in the chunk.
+// Finds the last run that starts at or before the offset by binary search.
+int get_line(Chunk *chunk, int offset)
+{
+	int low = 0;
+	int high = chunk->lineCount - 1;
+
+	if (high < 0)
+		return 0;
+
+	while (low < high) {
+		int mid = low + (high - low + 1) / 2;
+		if (chunk->lines[mid].offset <= offset)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return chunk->lines[low].line;
+}
+
+// Shrinks the arrays of a finished chunk to their counts. Shrinking never
+// triggers a garbage collection, so this is safe at any point.
+void shrink_chunk(VM *vm, Chunk *chunk)
+{
+	// Borrowed code and lines belong to their image
+	if (chunk->capacity > 0) {
+		chunk->lines = GROW_ARRAY(vm, LineRun, chunk->lines,
+					  chunk->lineCapacity,
+					  chunk->lineCount);
+		chunk->lineCapacity = chunk->lineCount;
+		chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code,
+					 chunk->capacity, chunk->count);
+		chunk->capacity = chunk->count;
+	}
+
+	ValueArray *constants = &chunk->constants;
+	constants->values = GROW_ARRAY(vm, Value, constants->values,
+				       constants->capacity, constants->count);
+	constants->capacity = constants->count;
+}
+
 // Adds a constant value to the chunk's constants array and returns its index.
 // Pushes the value onto the stack, writes it to the constants array, then pops it off the stack.
 //
 // Parameters:
+//   vm - The VM the chunk's memory is charged to
 //   chunk - The chunk to add the constant to
 //   value - The constant value to add
 //
 // Returns:
 //   The index of the added constant in the constants array
-int add_constant(Chunk *chunk, Value value)
+int add_constant(VM *vm, Chunk *chunk, Value value)
 {
-	push(value); // Push the value onto the stack
-	write_value_array(&chunk->constants,
+	// Threads compiling modules can't collect and don't own the VM's stack
+	if (threadHeap != NULL) {
+		write_value_array(vm, &chunk->constants, value);
+		return chunk->constants.count - 1;
+	}
+
+	push(vm, value); // Push the value onto the stack
+	write_value_array(vm, &chunk->constants,
 			  value); // Write the value to the constants array
-	pop(); // Pop the value off the stack
+	pop(vm); // Pop the value off the stack
 	return chunk->constants.count -
 	       1; // Return the index of the newly added constant
 }
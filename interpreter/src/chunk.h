@@ -24,6 +24,8 @@ typedef enum {
 	OP_SET_GLOBAL, // Set a global variable
 	OP_GET_LOCAL, // Retrieve a local variable
 	OP_SET_LOCAL, // Set a local variable
+	OP_GET_LOCAL_LONG, // Retrieve a local variable with a 16-bit slot index
+	OP_SET_LOCAL_LONG, // Set a local variable with a 16-bit slot index
 	OP_GET_UPVALUE, // Retrieve an upvalue (captured variable)
 	OP_SET_UPVALUE, // Set an upvalue (captured variable)
 	OP_EQUAL, // Compare two values for equality
@@ -32,6 +34,9 @@ typedef enum {
 	OP_JUMP_IF_FALSE, // Jump to a specified instruction if the top value is false
 	OP_JUMP, // Unconditionally jump to a specified instruction
 	OP_LOOP, // Jump back to a previous instruction to create a loop
+	OP_JUMP_IF_FALSE_LONG, // OP_JUMP_IF_FALSE with a 24-bit offset
+	OP_JUMP_LONG, // OP_JUMP with a 24-bit offset
+	OP_LOOP_LONG, // OP_LOOP with a 24-bit offset
 	OP_ADD, // Add the top two values on the stack
 	OP_SUBTRACT, // Subtract the top value from the second-to-top value on the stack
 	OP_MULTIPLY, // Multiply the top two values on the stack
@@ -48,15 +53,44 @@ typedef enum {
 	OP_GET_PROPERTY, // Retrieve a property from an object
 	OP_SET_PROPERTY, // Set a property on an object
 	OP_INVOKE, // Invoke a method on an object
+	OP_INLINE_GUARD, // Enter an inlined call, or make the call if the callee changed
+	OP_INLINE_EXIT, // Replace an inlined callee and its arguments with the result
+	OP_IMPORT, // Run a module the first time it is imported and push nil
+	OP_ARRAY, // Replace the top values of the stack with an array of them
+	OP_GET_INDEX, // Replace an array or map and an index with the element
+	OP_SET_INDEX, // Store the top value at an index of the array or map below
+	OP_MAP, // Replace the top key and value pairs of the stack with a map
+	OP_MODULO, // Remainder of the second-to-top value divided by the top
+	OP_FLOOR_DIVIDE, // Divide the top two values and round down
+	OP_BIT_AND, // Bitwise and of the top two values on the stack
+	OP_BIT_OR, // Bitwise or of the top two values on the stack
+	OP_BIT_XOR, // Bitwise exclusive or of the top two values on the stack
+	OP_SHIFT_LEFT, // Shift the second-to-top value left by the top value
+	OP_SHIFT_RIGHT, // Shift the second-to-top value right by the top value
 } OpCode;
 
+// Flags of the descriptor byte emitted for every upvalue after OP_CLOSURE.
+// The descriptor is followed by the upvalue's index, which is a single byte
+// unless UPVALUE_LONG_INDEX is set, in which case it takes two bytes.
+#define UPVALUE_LOCAL 0x01 // Captures a local of the enclosing function
+#define UPVALUE_LONG_INDEX 0x02 // The index is encoded in 16 bits
+#define UPVALUE_COPY 0x04 // Copies a local that never changes instead of sharing it
+
+// A run of consecutive bytes of code compiled from the same source line.
+typedef struct {
+	int offset; // Offset of the first byte of the run
+	int line; // Source line of every byte in the run
+} LineRun;
+
 // Represents a chunk of bytecode, which is a sequence of VM instructions.
 // The chunk contains the bytecode itself, line numbers for debugging, and a list of constant values.
 typedef struct {
 	int count; // Number of bytes currently in the chunk
-	int capacity; // Total capacity of the bytecode array
+	int capacity; // Total capacity of the bytecode array, 0 if code and lines are borrowed
 	uint8_t *code; // Array of bytecode instructions
-	int *lines; // Array of line numbers corresponding to each bytecode instruction
+	int lineCount; // Number of runs in the line table
+	int lineCapacity; // Capacity of the line table
+	LineRun *lines; // Line table, one run per change of line in ascending offset order
 	ValueArray constants; // Array of constant values used in the bytecode
 } Chunk;
 
@@ -67,26 +101,36 @@ void init_chunk(Chunk *chunk);
 // Frees the resources used by a Chunk structure.
 // Deallocates memory for the bytecode array, line number array, and constants array.
 // Reinitializes the chunk to its default state.
-void free_chunk(Chunk *chunk);
+void free_chunk(VM *vm, Chunk *chunk);
 
 // Appends a byte to the chunk and records the line number associated with the byte.
+// A new line run is only started when the line differs from the previous byte's.
 // Expands the capacity of the chunk if necessary.
 //
 // Parameters:
+//   vm - The VM the chunk's memory is charged to
 //   chunk - The chunk to write to
 //   byte - The byte to append to the chunk
 //   line - The line number associated with the byte
-void write_chunk(Chunk *chunk, uint8_t byte, int line);
+void write_chunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
+
+// Returns the source line of the byte at `offset` in the chunk.
+int get_line(Chunk *chunk, int offset);
+
+// Shrinks the code, line table and constants of a finished chunk so that
+// it keeps no more memory than it uses.
+void shrink_chunk(VM *vm, Chunk *chunk);
 
 // Adds a constant value to the chunk's constants array and returns its index.
 // Pushes the value onto the stack, writes it to the constants array, then pops it off the stack.
 //
 // Parameters:
+//   vm - The VM the chunk's memory is charged to
 //   chunk - The chunk to add the constant to
 //   value - The constant value to add
 //
 // Returns:
 //   The index of the newly added constant in the constants array
-int add_constant(Chunk *chunk, Value value);
+int add_constant(VM *vm, Chunk *chunk, Value value);
 
 #endif
@@ -10,6 +10,7 @@
 #include <stdint.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 /*#define DEBUG_PRINT_CODE*/
 /*#define DEBUG_TRACE_EXECUTION*/
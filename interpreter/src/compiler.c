@@ -11,7 +11,11 @@
 #include "chunk.h"
 #include "object.h"
 #include "memory.h"
+#include "ir.h"
+#include "optimizer.h"
+#include "vm.h"
 
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,6 +30,7 @@ typedef struct {
 	Token previous; // Previously processed token
 	bool had_error; // Tracks if any errors occurred during parsing
 	bool panic_mode; // Signals that the parser is in panic mode
+	VM *vm; // VM the compiled functions belong to
 } Parser;
 
 // Enum defining operator precedence for Xanadu language.
@@ -36,8 +41,12 @@ typedef enum {
 	PREC_AND, // and
 	PREC_EQUALITY, // == !=
 	PREC_COMPARISON, // < > <= >=
+	PREC_BIT_OR, // |
+	PREC_BIT_XOR, // ^
+	PREC_BIT_AND, // &
+	PREC_SHIFT, // << >>
 	PREC_TERM, // + -
-	PREC_FACTOR, // * /
+	PREC_FACTOR, // * / ~/ %
 	PREC_UNARY, // ! -
 	PREC_CALL, // . ()
 	PREC_PRIMARY // Highest precedence (literals, etc.)
@@ -58,11 +67,13 @@ typedef struct {
 	Token name; // Name of the local variable
 	int depth; // Depth of the variable's scope (scope level)
 	bool isCaptured; // Whether the variable has been captured (closure)
+	bool isFinal; // Whether the value never changes once it's on the stack
+	int start; // IR index from which the value is on the stack, -1 before
 } Local;
 
 // Struct representing an upvalue in closures.
 typedef struct {
-	uint8_t index; // Index of the upvalue in the function
+	uint16_t index; // Index of the upvalue in the function
 	bool isLocal; // Whether the upvalue is local
 } Upvalue;
 
@@ -80,10 +91,13 @@ typedef struct Compiler {
 		enclosing; // Pointer to the enclosing compiler (for nested scopes)
 	ObjFunction *function; // The function being compiled
 	FunctionType type; // The type of function being compiled
-	Local locals[UINT8_COUNT]; // Array of local variables
+	Local *locals; // Growable array of local variables
+	int localCapacity; // Capacity of the locals array
 	Upvalue upvalues[UINT8_COUNT]; // Array of upvalues for closures
 	int localCount; // Number of local variables in the function
 	int scopeDepth; // Current scope depth (for managing local variables)
+	IrFunction ir; // Instructions of the function, lowered by end_compiler()
+	LazyFunction *lazy; // Names of the upvalues of a deferred body, or NULL
 } Compiler;
 
 // ClassCompiler struct tracks the state of class compilation.
@@ -94,10 +108,16 @@ typedef struct ClassCompiler {
 } ClassCompiler;
 
 // Global variables for the parser, compiler, and current chunk being compiled.
-Parser parser;
-Compiler *current = NULL;
-ClassCompiler *currentClass = NULL;
+// Each thread has its own, since modules are compiled in parallel.
+_Thread_local Parser parser;
+_Thread_local Compiler *current = NULL;
+_Thread_local ClassCompiler *currentClass = NULL;
 Chunk *compiling_chunk; // Current chunk being compiled
+static _Thread_local InlineTable inlines; // Top-level functions that can be inlined
+static _Thread_local ObjString *lazySource = NULL; // Source being compiled with deferred bodies
+static _Thread_local const char *moduleDirectory; // Directory imports are relative to
+static _Thread_local const char *moduleName; // Path of the module being compiled, NULL for a program
+static _Thread_local ModuleList *moduleImports; // Receives the imports, may be NULL
 //#################
 
 // Function declarations (used throughout the file).
@@ -109,20 +129,25 @@ static void consume(TokenType type, const char *message);
 
 // Compilation-related function declarations.
 static void expression(void);
-static void emit_byte(uint8_t byte);
+static void emit_op(uint8_t op);
 static Chunk *current_chunk(void);
 static ObjFunction *end_compiler(void);
 static void emit_return(void);
-static void emit_bytes(uint8_t byte1, uint8_t byte2);
+static void emit_op_arg(int op, int operand);
+static void emit_instr(int op, int operand, int extra);
 static void emit_loop(int loopStart);
 static int emit_jump(uint8_t instruction);
+static int emit_label(void);
 static void emit_constant(Value value);
-static void patch_jump(int offset);
+static void patch_jump(int label);
 
 // Xanadu function calls and expressions.
 static void call(bool canAssign);
 static void dot(bool canAssign);
-static uint8_t make_constant(Value value);
+static void array(bool canAssign);
+static void map(bool canAssign);
+static void subscript(bool canAssign);
+static int make_constant(Value value);
 static void unary(bool canAssign);
 static void grouping(bool canAssign);
 static void binary(bool canAssign);
@@ -138,7 +163,8 @@ static void begin_scope(void);
 static void end_scope(void);
 static uint8_t argument_list(void);
 static void add_local(Token name);
-static int add_upvalue(Compiler *compiler, uint8_t index, bool isLocal);
+static Local *reserve_local(void);
+static int add_upvalue(Compiler *compiler, uint16_t index, bool isLocal);
 static void mark_initialized(void);
 static bool check(TokenType type);
 static bool match(TokenType type);
@@ -150,11 +176,12 @@ static void for_statement(void);
 static void return_statement(void);
 static void synchronize(void);
 static void var_declaration(void);
-static uint8_t parse_variable(const char *errorMessage);
-static uint8_t identifier_constant(Token *name);
+static void import_declaration(void);
+static int parse_variable(const char *errorMessage);
+static int identifier_constant(Token *name);
 static int resolve_local(Compiler *compiler, Token *name);
 static bool identifiers_equal(Token *a, Token *b);
-static void define_variable(uint8_t global);
+static void define_variable(int global);
 static void declare_variable(void);
 static void fun_declaration(void);
 static void function(FunctionType type);
@@ -162,36 +189,55 @@ static void variable(bool canAssign);
 static Token synthetic_token(const char *text);
 static void _this(bool canAssign);
 static void named_variable(Token name, bool canAssign);
+static void mark_upvalue_assigned(Compiler *compiler, int index);
+static void resolve_captures(Local *local, int slot);
 static int resolve_upvalue(Compiler *compiler, Token *name);
-static void init_compiler(Compiler *compiler, FunctionType type);
+static void init_compiler(Compiler *compiler, FunctionType type,
+			  ObjFunction *function);
+static void function_body(void);
+static void skim_function_body(void);
 static void and_(bool canAssign);
 static void or_(bool canAssign);
 //#####################
 
 // Function definitions
 
-// Initialize the compiler.
-static void init_compiler(Compiler *compiler, FunctionType type)
+// Initialize the compiler. A new function is created unless one is given.
+static void init_compiler(Compiler *compiler, FunctionType type,
+			  ObjFunction *function)
 {
 	compiler->function = NULL;
 	compiler->type = type;
 	compiler->enclosing =
 		current; // Link to the enclosing compiler for nested functions
+	compiler->locals = NULL;
+	compiler->localCapacity = 0;
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
-	compiler->function = new_function(); // Create a new function object
-	current = compiler; // Update the current compiler reference
+	init_ir(parser.vm, &compiler->ir);
+	compiler->lazy = NULL;
+	if (function != NULL) {
+		compiler->function = function; // Compile a deferred body
+		current = compiler;
+	} else {
+		compiler->function =
+			new_function(parser.vm); // Create a new function object
+		current = compiler; // Update the current compiler reference
+	}
 
 	// If we're compiling a function (not the main script), assign the function's name.
-	if (type != TYPE_SCRIPT) {
-		current->function->name = copy_string(parser.previous.start,
-						      parser.previous.length);
+	if (type != TYPE_SCRIPT && function == NULL) {
+		current->function->name =
+			copy_string(parser.vm, parser.previous.start,
+				    parser.previous.length);
 	}
 
 	// Reserve the first slot for the "this" reference in methods and initializers.
-	Local *local = &current->locals[current->localCount++];
+	Local *local = reserve_local();
 	local->depth = 0; // This variable is in the outermost scope.
 	local->isCaptured = false; // Mark as not captured yet.
+	local->isFinal = true; // The receiver can't be assigned.
+	local->start = 0;
 
 	// If compiling a method, assign the name "this"; otherwise, leave it empty.
 	if (type != TYPE_FUNCTION) {
@@ -204,14 +250,33 @@ static void init_compiler(Compiler *compiler, FunctionType type)
 }
 
 // Compile the source string into a function.
-ObjFunction *compile(const char *source)
+ObjFunction *compile(VM *vm, const char *source)
+{
+	return compile_module(vm, source, ".", NULL, NULL);
+}
+
+// Compile the source of a module or program into its script function.
+ObjFunction *compile_module(VM *vm, const char *source, const char *directory,
+			    const char *name, ModuleList *imports)
 {
+	parser.vm = vm;
+	moduleDirectory = directory;
+	moduleName = name;
+	moduleImports = imports;
+
+	// Deferred bodies are compiled from a copy of the source that lives as
+	// long as they do.
+	if (vm->lazyCompilation) {
+		lazySource = copy_string(vm, source, (int)strlen(source));
+		source = lazySource->chars;
+	}
 	init_scanner(source); // Tokenize the source string.
 
 	Compiler compiler;
 	init_compiler(
-		&compiler,
-		TYPE_SCRIPT); // Initialize the compiler for the top-level script.
+		&compiler, TYPE_SCRIPT,
+		NULL); // Initialize the compiler for the top-level script.
+	init_inline_table(vm, &inlines);
 
 	parser.had_error = false; // Reset the error state.
 	parser.panic_mode = false;
@@ -225,18 +290,89 @@ ObjFunction *compile(const char *source)
 
 	// Finish the compilation and return the function.
 	ObjFunction *function = end_compiler();
+	free_inline_table(&inlines);
+	lazySource = NULL;
+	moduleDirectory = NULL;
+	moduleName = NULL;
+	moduleImports = NULL;
 	return parser.had_error ? NULL : function;
 }
 
+// Compile the body of a function whose compilation was deferred.
+bool compile_lazy_function(VM *vm, ObjFunction *function)
+{
+	parser.vm = vm;
+	LazyFunction *lazy = function->lazy;
+	init_scanner_at(lazy->source->chars + lazy->offset,
+			(size_t)(lazy->source->length - lazy->offset),
+			lazy->line);
+
+	// Restore the class the function was declared in, for 'todays' and 'syrinx'
+	ClassCompiler classCompiler;
+	classCompiler.enclosing = NULL;
+	classCompiler.has_super_class = lazy->hasSuperclass;
+	currentClass = lazy->inClass ? &classCompiler : NULL;
+
+	Compiler compiler;
+	init_compiler(&compiler, (FunctionType)lazy->type, function);
+	compiler.lazy = lazy;
+	init_inline_table(vm, &inlines);
+	lazySource = lazy->source; // Nested functions are deferred as well
+
+	parser.had_error = false;
+	parser.panic_mode = false;
+	advance();
+
+	function->arity = 0; // Counted again by the parameter list
+	begin_scope();
+	function_body();
+	end_compiler();
+
+	free_inline_table(&inlines);
+	lazySource = NULL;
+	currentClass = NULL;
+	if (parser.had_error)
+		return false;
+
+	function->lazy = NULL;
+	FREE_ARRAY(vm, ObjString *, lazy->upvalueNames, function->upvalueCount);
+	FREE(vm, LazyFunction, lazy);
+	return true;
+}
+
+// Set whether the following compilations defer function bodies.
+void set_lazy_compilation(VM *vm, bool lazy)
+{
+	vm->lazyCompilation = lazy;
+}
+
+// Set the optimization level used by every following compilation.
+void set_optimization_level(VM *vm, int level)
+{
+	vm->optimizationLevel = level;
+}
+
+// Get the optimization level used by compile().
+int get_optimization_level(VM *vm)
+{
+	return vm->optimizationLevel;
+}
+
 // Mark values in the compiler's scope as roots (for garbage collection).
-void mark_compiler_roots()
+void mark_compiler_roots(VM *vm)
 {
+	// The thread may be compiling for another VM, or nothing at all
+	if (parser.vm != vm)
+		return;
+
 	Compiler *compiler = current;
 	while (compiler != NULL) {
-		mark_object((Obj *)compiler->function);
+		mark_object(vm, (Obj *)compiler->function);
 		compiler =
 			compiler->enclosing; // Move to the enclosing compiler.
 	}
+	mark_inline_table(vm, &inlines);
+	mark_object(vm, (Obj *)lazySource);
 }
 
 // Compile an expression by following precedence rules.
@@ -252,6 +388,37 @@ static ObjFunction *end_compiler(void)
 	emit_return(); // Emit return statement for the function.
 	ObjFunction *function = current->function;
 
+	// The locals of the outermost scope are only released by the return.
+	for (int i = 0; i < current->localCount; i++)
+		resolve_captures(&current->locals[i], i);
+
+	// Optimize the IR and lower it into the function's chunk.
+	if (!parser.had_error) {
+		optimize_ir(&current->ir, function, &inlines,
+			    parser.vm->optimizationLevel);
+		// The frame holds the callee and arguments, then the locals
+		// and temporaries the code pushes on top of them
+		int slots = function->arity + 1;
+		const char *message =
+			lower_ir(&current->ir, current_chunk(), &slots);
+		if (message != NULL)
+			error(message);
+		if (slots > function->slotCount)
+			function->slotCount = slots;
+		if (function->slotCount > FRAME_SLOTS_MAX)
+			error("Function needs more stack than a call can have.");
+		shrink_chunk(parser.vm, current_chunk());
+	}
+
+	// Functions declared at the top level can be inlined into later calls.
+	if (!parser.had_error &&
+	    parser.vm->optimizationLevel >= OPT_LEVEL_INLINE &&
+	    current->type == TYPE_FUNCTION && current->enclosing != NULL &&
+	    current->enclosing->type == TYPE_SCRIPT &&
+	    current->enclosing->scopeDepth == 0) {
+		add_inline_candidate(&inlines, function, &current->ir);
+	}
+
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.had_error) {
 		disassemble_chunk(current_chunk(),
@@ -261,6 +428,8 @@ static ObjFunction *end_compiler(void)
 	}
 #endif
 
+	FREE_ARRAY(parser.vm, Local, current->locals, current->localCapacity);
+	free_ir(&current->ir);
 	current = current->enclosing; // Pop the compiler off the stack.
 	return function;
 }
@@ -277,35 +446,59 @@ static void binary(bool canAssign)
 	// Emit the corresponding bytecode based on the operator type.
 	switch (operatorType) {
 	case TOKEN_BANG_EQUAL:
-		emit_bytes(OP_EQUAL, OP_NOT);
+		emit_op(OP_EQUAL);
+		emit_op(OP_NOT);
 		break; // !=
 	case TOKEN_EQUAL_EQUAL:
-		emit_byte(OP_EQUAL);
+		emit_op(OP_EQUAL);
 		break; // ==
 	case TOKEN_GREATER:
-		emit_byte(OP_GREATER);
+		emit_op(OP_GREATER);
 		break; // >
 	case TOKEN_GREATER_EQUAL:
-		emit_bytes(OP_LESS, OP_NOT);
+		emit_op(OP_LESS);
+		emit_op(OP_NOT);
 		break; // >=
 	case TOKEN_LESS:
-		emit_byte(OP_LESS);
+		emit_op(OP_LESS);
 		break; // <
 	case TOKEN_LESS_EQUAL:
-		emit_bytes(OP_GREATER, OP_NOT);
+		emit_op(OP_GREATER);
+		emit_op(OP_NOT);
 		break; // <=
 	case TOKEN_PLUS:
-		emit_byte(OP_ADD);
+		emit_op(OP_ADD);
 		break; // +
 	case TOKEN_MINUS:
-		emit_byte(OP_SUBTRACT);
+		emit_op(OP_SUBTRACT);
 		break; // -
 	case TOKEN_STAR:
-		emit_byte(OP_MULTIPLY);
+		emit_op(OP_MULTIPLY);
 		break; // *
 	case TOKEN_SLASH:
-		emit_byte(OP_DIVIDE);
+		emit_op(OP_DIVIDE);
 		break; // /
+	case TOKEN_TILDE_SLASH:
+		emit_op(OP_FLOOR_DIVIDE);
+		break; // ~/
+	case TOKEN_PERCENT:
+		emit_op(OP_MODULO);
+		break; // %
+	case TOKEN_AMPERSAND:
+		emit_op(OP_BIT_AND);
+		break; // &
+	case TOKEN_PIPE:
+		emit_op(OP_BIT_OR);
+		break; // |
+	case TOKEN_CARET:
+		emit_op(OP_BIT_XOR);
+		break; // ^
+	case TOKEN_LESS_LESS:
+		emit_op(OP_SHIFT_LEFT);
+		break; // <<
+	case TOKEN_GREATER_GREATER:
+		emit_op(OP_SHIFT_RIGHT);
+		break; // >>
 	default:
 		return; // Unreachable.
 	}
@@ -316,47 +509,102 @@ static void call(bool canAssign)
 {
 	uint8_t argCount =
 		argument_list(); // Parse arguments and get their count.
-	emit_bytes(OP_CALL, argCount); // Emit bytecode for the function call.
+	emit_op_arg(OP_CALL, argCount); // Emit bytecode for the function call.
 }
 
 // Compile a field or method access using the dot operator.
 static void dot(bool canAssign)
 {
 	consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-	uint8_t name = identifier_constant(&parser.previous);
+	int name = identifier_constant(&parser.previous);
 
 	// Handle property assignment.
 	if (canAssign && match(TOKEN_EQUAL)) {
 		expression(); // Compile the right-hand side of the assignment.
-		emit_bytes(OP_SET_PROPERTY,
+		emit_op_arg(OP_SET_PROPERTY,
 			   name); // Emit bytecode to set the property.
 	}
 	// Handle method invocation.
 	else if (match(TOKEN_LEFT_PAREN)) {
 		uint8_t argCount =
 			argument_list(); // Parse the method's arguments.
-		emit_bytes(OP_INVOKE, name); // Invoke the method.
-		emit_byte(argCount); // Emit the argument count.
+		emit_instr(OP_INVOKE, name,
+			   argCount); // Invoke the method with its argument count.
 	}
 	// Handle property access.
 	else {
-		emit_bytes(OP_GET_PROPERTY,
+		emit_op_arg(OP_GET_PROPERTY,
 			   name); // Emit bytecode to get the property.
 	}
 }
 
+// Compile an array literal, whose elements are pushed in order and then
+// collected into the array.
+static void array(bool canAssign)
+{
+	int count = 0;
+	if (!check(TOKEN_RIGHT_BRACKET)) {
+		do {
+			expression(); // Parse the next element.
+			if (count == 255) {
+				error("Can't have more than 255 elements in an "
+				      "array literal.");
+			}
+			count++;
+		} while (match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+	emit_op_arg(OP_ARRAY, count);
+}
+
+// Compile a map literal, whose keys and values are pushed in pairs and then
+// collected into the map. Braces only start a map inside an expression, a
+// statement starting with one is a block.
+static void map(bool canAssign)
+{
+	int count = 0;
+	if (!check(TOKEN_RIGHT_BRACE)) {
+		do {
+			expression(); // Parse the key.
+			consume(TOKEN_EXTENDS, "Expect ':' after map key.");
+			expression(); // Parse the value.
+			if (count == 255) {
+				error("Can't have more than 255 entries in a "
+				      "map literal.");
+			}
+			count++;
+		} while (match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+	emit_op_arg(OP_MAP, count);
+}
+
+// Compile an element access or assignment using brackets.
+static void subscript(bool canAssign)
+{
+	expression(); // Compile the index.
+	consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+	if (canAssign && match(TOKEN_EQUAL)) {
+		expression(); // Compile the right-hand side of the assignment.
+		emit_op(OP_SET_INDEX);
+	} else {
+		emit_op(OP_GET_INDEX);
+	}
+}
+
 // Compile a literal value (e.g., true, false, nil).
 static void literal(bool canAssign)
 {
 	switch (parser.previous.type) {
 	case TOKEN_FALSE:
-		emit_byte(OP_FALSE);
+		emit_op(OP_FALSE);
 		break; // Compile `false` as bytecode.
 	case TOKEN_NIL:
-		emit_byte(OP_NIL);
+		emit_op(OP_NIL);
 		break; // Compile `nil` as bytecode.
 	case TOKEN_TRUE:
-		emit_byte(OP_TRUE);
+		emit_op(OP_TRUE);
 		break; // Compile `true` as bytecode.
 	default:
 		return; // Unreachable.
@@ -368,74 +616,64 @@ static void emit_return(void)
 {
 	// If the current function is an initializer, return `this`.
 	if (current->type == TYPE_INITIALIZER) {
-		emit_bytes(OP_GET_LOCAL, 0); // The first local (0) is `this`.
+		emit_op_arg(OP_GET_LOCAL, 0); // The first local (0) is `this`.
 	} else {
-		emit_byte(OP_NIL); // Otherwise, return `nil`.
+		emit_op(OP_NIL); // Otherwise, return `nil`.
 	}
 
-	emit_byte(OP_RETURN); // Emit the return bytecode.
+	emit_op(OP_RETURN); // Emit the return bytecode.
 }
 
-// Emits bytecode for a loop operation in the VM.
-// The loop begins at loopStart and wraps back to the current location.
+// Emits a jump back to the loop start label, which the backend encodes as OP_LOOP.
 static void emit_loop(int loopStart)
 {
-	emit_byte(OP_LOOP); // Emit the loop opcode.
-
-	// Calculate the offset to jump back to loopStart.
-	int offset = current_chunk()->count - loopStart + 2;
-
-	// Ensure the offset fits within the maximum allowed size.
-	if (offset > UINT16_MAX)
-		error("Loop body too large.");
-
-	// Emit the offset as two bytes.
-	emit_byte((offset >> 8) & 0xff); // Higher byte.
-	emit_byte(offset & 0xff); // Lower byte.
+	emit_ir_label(&current->ir, OP_JUMP, loopStart, parser.previous.line);
 }
 
-// Emits a jump instruction and reserves space for the jump offset.
-// Returns the position in the bytecode where the offset needs to be patched later.
+// Emits a jump instruction to a new label and returns the label,
+// which is later placed by patch_jump().
 static int emit_jump(uint8_t instruction)
 {
-	emit_byte(instruction); // Emit the jump instruction.
-
-	// Reserve two bytes for the offset (to be patched later).
-	emit_byte(0xff);
-	emit_byte(0xff);
+	int label = new_ir_label(&current->ir);
+	emit_ir_label(&current->ir, instruction, label, parser.previous.line);
+	return label;
+}
 
-	// Return the index of the first byte of the reserved offset.
-	return current_chunk()->count - 2;
+// Places a new label at the current position and returns it.
+static int emit_label(void)
+{
+	int label = new_ir_label(&current->ir);
+	patch_jump(label);
+	return label;
 }
 
 // Emits a constant value as bytecode by adding it to the constants table.
 static void emit_constant(Value value)
 {
-	emit_bytes(
-		OP_CONSTANT,
-		make_constant(value)); // Emit constant instruction with index.
+	emit_op_arg(OP_CONSTANT,
+		    make_constant(value)); // Emit constant instruction with index.
 }
 
-// Patches a previously emitted jump by updating its offset.
-// The jump is relative to the position 'offset' in the bytecode.
-static void patch_jump(int offset)
+// Patches a previously emitted jump by placing its label at the current position.
+static void patch_jump(int label)
 {
-	// Calculate the jump distance from the offset to the current position.
-	int jump = current_chunk()->count - offset - 2;
-
-	// Ensure the jump fits within the maximum size.
-	if (jump > UINT16_MAX) {
-		error("Too much code to jump over.");
-	}
-
-	// Patch the two-byte offset in the bytecode.
-	current_chunk()->code[offset] = (jump >> 8) & 0xff; // Higher byte.
-	current_chunk()->code[offset + 1] = jump & 0xff; // Lower byte.
+	emit_ir_label(&current->ir, IR_LABEL, label, parser.previous.line);
 }
 
-// Compiles a numeric literal into bytecode by converting the lexeme to a double.
+// Compiles a numeric literal into bytecode. Literals without a fractional
+// part are integers, unless they are too large for one.
 static void number(bool can_assign)
 {
+	if (memchr(parser.previous.start, '.', parser.previous.length) ==
+	    NULL) {
+		errno = 0;
+		long long value = strtoll(parser.previous.start, NULL, 10);
+		if (errno != ERANGE) {
+			emit_constant(INT_VAL((int64_t)value));
+			return;
+		}
+	}
+
 	double value = strtod(parser.previous.start,
 			      NULL); // Convert string to double.
 	emit_constant(NUMBER_VAL(value)); // Emit the number as a constant.
@@ -445,7 +683,7 @@ static void number(bool can_assign)
 static void string(bool can_assign)
 {
 	// Copy the string (ignoring the quotes) and emit it as a constant.
-	emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1,
+	emit_constant(OBJ_VAL(copy_string(parser.vm, parser.previous.start + 1,
 					  parser.previous.length - 2)));
 }
 
@@ -479,24 +717,22 @@ static void super_(bool canAssign)
 	// Expect a method call on 'super' (e.g., super.method()).
 	consume(TOKEN_DOT, "Expect '.' after 'super'.");
 	consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-	uint8_t name =
-		identifier_constant(&parser.previous); // Get method name.
+	int name = identifier_constant(&parser.previous); // Get method name.
 
 	// Check if it's a method call or property access.
-	named_variable(synthetic_token("this"),
-		       false); // Load 'this' before method call.
+	named_variable(synthetic_token("todays"),
+		       false); // Load 'todays' before method call.
 	if (match(TOKEN_LEFT_PAREN)) {
 		uint8_t argCount =
 			argument_list(); // Parse the method arguments.
 		named_variable(synthetic_token("super"),
 			       false); // Load 'super'.
-		emit_bytes(OP_SUPER_INVOKE,
-			   name); // Emit the super method invocation.
-		emit_byte(argCount); // Emit argument count.
+		emit_instr(OP_SUPER_INVOKE, name,
+			   argCount); // Emit the super method invocation.
 	} else {
 		named_variable(synthetic_token("super"),
 			       false); // Load 'super'.
-		emit_bytes(OP_GET_SUPER,
+		emit_op_arg(OP_GET_SUPER,
 			   name); // Emit bytecode for property access.
 	}
 }
@@ -515,14 +751,43 @@ static void _this(bool canAssign)
 }
 
 // Compiles a function declaration, including its parameters and body.
+// When compilation is lazy the body is only skimmed and compiled on the
+// function's first call.
 static void function(FunctionType type)
 {
 	Compiler compiler;
-	init_compiler(&compiler,
-		      type); // Initialize a new compiler for the function.
+	init_compiler(&compiler, type,
+		      NULL); // Initialize a new compiler for the function.
 	begin_scope(); // Begin a new local scope.
 
-	// Parse the function parameters.
+	ObjFunction *function;
+	if (lazySource != NULL) {
+		skim_function_body();
+		function = current->function;
+		FREE_ARRAY(parser.vm, Local, current->locals,
+			   current->localCapacity);
+		free_ir(&current->ir);
+		current = current->enclosing;
+	} else {
+		function_body();
+		function = end_compiler(); // End function compilation.
+	}
+
+	emit_op_arg(
+		OP_CLOSURE,
+		make_constant(OBJ_VAL(function))); // Emit the closure bytecode.
+
+	// Emit upvalue data for the closure. The backend picks the width of each index.
+	for (int i = 0; i < function->upvalueCount; i++) {
+		emit_instr(IR_UPVALUE,
+			   compiler.upvalues[i].isLocal ? UPVALUE_LOCAL : 0,
+			   compiler.upvalues[i].index);
+	}
+}
+
+// Compiles the parameter list of a function.
+static void parameters(void)
+{
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 	if (!check(TOKEN_RIGHT_PAREN)) { // Parse each parameter.
 		do {
@@ -532,30 +797,110 @@ static void function(FunctionType type)
 				error_at_current(
 					"Can't have more than 255 parameters.");
 			}
-			uint8_t constant = parse_variable(
+			int constant = parse_variable(
 				"Expect parameter name."); // Parse parameter name.
 			define_variable(constant); // Define the parameter.
 		} while (match(
 			TOKEN_COMMA)); // Continue parsing parameters if there are commas.
 	}
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+}
+
+// Compiles the parameters and body of the current function.
+static void function_body(void)
+{
+	parameters();
 
 	// Parse the function body.
 	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
 	block();
+}
 
-	ObjFunction *function = end_compiler(); // End function compilation.
-	emit_bytes(
-		OP_CLOSURE,
-		make_constant(OBJ_VAL(function))); // Emit the closure bytecode.
+// Captures a variable a deferred body may refer to. The body isn't parsed,
+// so every name in it that resolves to a variable of an enclosing function is
+// captured, and assigned if an '=' follows it.
+static void skim_name(Token name, bool assigned, Token *names)
+{
+	if (resolve_local(current, &name) != -1)
+		return; // A parameter, or the receiver of a method
+
+	int count = current->function->upvalueCount;
+	int index = resolve_upvalue(current, &name);
+	if (index == -1)
+		return;
+	if (index == count)
+		names[index] = name;
+	if (assigned)
+		mark_upvalue_assigned(current, index);
+}
+
+// Skims the parameters and body of the current function, which is compiled
+// by compile_lazy_function() on its first call. Only the parameters are
+// parsed, the body's braces are matched to find its end and its names are
+// resolved to lay out the closure's upvalues.
+static void skim_function_body(void)
+{
+	Token names[UINT8_COUNT];
+	int offset = (int)(parser.current.start - lazySource->chars);
+	int line = parser.current.line;
+
+	parameters();
+	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+	TokenType before = TOKEN_LEFT_BRACE;
+	for (int depth = 1; depth > 0;) {
+		if (check(TOKEN_EOF)) {
+			error_at_current("Expect '}' after block.");
+			return;
+		}
+		advance();
 
-	// Emit upvalue data for the closure.
+		bool assigned = check(TOKEN_EQUAL);
+		switch (parser.previous.type) {
+		case TOKEN_LEFT_BRACE:
+			depth++;
+			break;
+		case TOKEN_RIGHT_BRACE:
+			depth--;
+			break;
+		case TOKEN_IDENTIFIER:
+			if (before != TOKEN_DOT) // Not a property name
+				skim_name(parser.previous, assigned, names);
+			break;
+		case TOKEN_SUPER:
+			skim_name(synthetic_token("super"), false, names);
+			skim_name(synthetic_token("todays"), false, names);
+			break;
+		case TOKEN_THIS:
+			skim_name(synthetic_token("todays"), false, names);
+			break;
+		default:
+			break;
+		}
+		before = parser.previous.type;
+	}
+
+	// The function is a root of the collector while it is being compiled
+	ObjFunction *function = current->function;
+	LazyFunction *lazy = ALLOCATE(parser.vm, LazyFunction, 1);
+	lazy->source = lazySource;
+	lazy->offset = offset;
+	lazy->line = line;
+	lazy->type = current->type;
+	lazy->inClass = currentClass != NULL;
+	lazy->hasSuperclass = currentClass != NULL &&
+			      currentClass->has_super_class;
+	lazy->upvalueNames = NULL;
+	function->lazy = lazy;
+
+	ObjString **upvalueNames =
+		ALLOCATE(parser.vm, ObjString *, function->upvalueCount);
+	for (int i = 0; i < function->upvalueCount; i++)
+		upvalueNames[i] = NULL;
+	lazy->upvalueNames = upvalueNames;
 	for (int i = 0; i < function->upvalueCount; i++) {
-		emit_byte(compiler.upvalues[i].isLocal ?
-				  1 :
-				  0); // Emit whether the upvalue is local.
-		emit_byte(
-			compiler.upvalues[i].index); // Emit the upvalue's index.
+		upvalueNames[i] = copy_string(parser.vm, names[i].start,
+					      names[i].length);
 	}
 }
 
@@ -563,7 +908,7 @@ static void function(FunctionType type)
 static void method()
 {
 	consume(TOKEN_IDENTIFIER, "Expect method name.");
-	uint8_t constant = identifier_constant(
+	int constant = identifier_constant(
 		&parser.previous); // Get the method name constant.
 
 	// Check if this method is an initializer (constructor).
@@ -575,7 +920,7 @@ static void method()
 
 	// Compile the method as a function.
 	function(type);
-	emit_bytes(OP_METHOD, constant); // Emit the method definition bytecode.
+	emit_op_arg(OP_METHOD, constant); // Emit the method definition bytecode.
 }
 
 // Compiles a class declaration, including inheritance, methods, and properties.
@@ -583,11 +928,11 @@ static void class_declaration()
 {
 	consume(TOKEN_IDENTIFIER, "Expect class name.");
 	Token className = parser.previous; // Save the class name token.
-	uint8_t nameConstant = identifier_constant(
+	int nameConstant = identifier_constant(
 		&parser.previous); // Create a constant for the class name.
 	declare_variable(); // Declare the class name in the current scope.
 
-	emit_bytes(OP_CLASS,
+	emit_op_arg(OP_CLASS,
 		   nameConstant); // Emit bytecode to create the class.
 	define_variable(nameConstant); // Define the class variable.
 
@@ -613,7 +958,7 @@ static void class_declaration()
 		define_variable(0);
 
 		named_variable(className, false); // Load the class name.
-		emit_byte(OP_INHERIT); // Emit bytecode for inheritance.
+		emit_op(OP_INHERIT); // Emit bytecode for inheritance.
 		classCompiler.has_super_class = true;
 	}
 
@@ -624,7 +969,7 @@ static void class_declaration()
 		method(); // Compile each method.
 	}
 	consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-	emit_byte(OP_POP); // Pop the class off the stack.
+	emit_op(OP_POP); // Pop the class off the stack.
 
 	// If the class has a superclass, end its scope.
 	if (classCompiler.has_super_class) {
@@ -635,18 +980,12 @@ static void class_declaration()
 	currentClass = currentClass->enclosing;
 }
 
-// Convert a value to a constant index within a chunk. Returns the index as a uint8_t.
-// If the constant exceeds the maximum (UINT8_MAX), an error is reported.
-static uint8_t make_constant(Value value)
+// Adds a value to the chunk's compile-time constant pool and returns its index.
+// The backend keeps only the constants the optimized code still uses and merges
+// identical ones, so the limit of 256 constants per chunk is checked there.
+static int make_constant(Value value)
 {
-	int constant = add_constant(current_chunk(), value);
-	if (constant > UINT8_MAX) {
-		error("Too many constants in one chunk.");
-		return 0; // Returns 0 in case of error.
-	}
-
-	return (uint8_t)
-		constant; // Returns the constant index as an 8-bit value.
+	return add_constant(parser.vm, current_chunk(), value);
 }
 
 // Parses a grouping expression, such as an expression enclosed in parentheses (e.g., (x + y)).
@@ -658,7 +997,7 @@ static void grouping(bool can_assign)
 		"Expect ')' after expression."); // Ensure the closing ')'.
 }
 
-// Parses a unary operation (e.g., -x). It processes the operand and emits the corresponding bytecode.
+// Parses a unary operation (e.g., -x or !x). It processes the operand and emits the corresponding bytecode.
 static void unary(bool can_assign)
 {
 	TokenType operatorType = parser.previous.type;
@@ -668,8 +1007,11 @@ static void unary(bool can_assign)
 
 	// Emit the bytecode instruction based on the operator type.
 	switch (operatorType) {
+	case TOKEN_BANG:
+		emit_op(OP_NOT); // Logical not of the operand (e.g., !x).
+		break;
 	case TOKEN_MINUS:
-		emit_byte(OP_NEGATE); // Negate the operand (e.g., -x).
+		emit_op(OP_NEGATE); // Negate the operand (e.g., -x).
 		break;
 	default:
 		return; // Unreachable case, should never occur.
@@ -683,8 +1025,11 @@ ParseRule rules[] = {
 			       PREC_CALL }, // Grouping or function call
 	[TOKEN_RIGHT_PAREN] = { NULL, NULL,
 				PREC_NONE }, // Right parenthesis (no action)
-	[TOKEN_LEFT_BRACE] = { NULL, NULL, PREC_NONE }, // Left brace
+	[TOKEN_LEFT_BRACE] = { map, NULL, PREC_NONE }, // Map literal
 	[TOKEN_RIGHT_BRACE] = { NULL, NULL, PREC_NONE }, // Right brace
+	[TOKEN_LEFT_BRACKET] = { array, subscript,
+				 PREC_CALL }, // Array literal or element access
+	[TOKEN_RIGHT_BRACKET] = { NULL, NULL, PREC_NONE }, // Right bracket
 	[TOKEN_COMMA] = { NULL, NULL, PREC_NONE }, // Comma
 	[TOKEN_DOT] = { NULL, dot,
 			PREC_CALL }, // Dot operator for object property access
@@ -694,6 +1039,10 @@ ParseRule rules[] = {
 	[TOKEN_SEMICOLON] = { NULL, NULL, PREC_NONE }, // Semicolon
 	[TOKEN_SLASH] = { NULL, binary, PREC_FACTOR }, // Division operator
 	[TOKEN_STAR] = { NULL, binary, PREC_FACTOR }, // Multiplication operator
+	[TOKEN_PERCENT] = { NULL, binary, PREC_FACTOR }, // Remainder operator
+	[TOKEN_AMPERSAND] = { NULL, binary, PREC_BIT_AND }, // Bitwise and
+	[TOKEN_PIPE] = { NULL, binary, PREC_BIT_OR }, // Bitwise or
+	[TOKEN_CARET] = { NULL, binary, PREC_BIT_XOR }, // Bitwise exclusive or
 	[TOKEN_BANG] = { unary, NULL, PREC_NONE }, // Logical NOT (unary)
 	[TOKEN_BANG_EQUAL] = { NULL, binary,
 			       PREC_EQUALITY }, // Not equal operator
@@ -708,6 +1057,10 @@ ParseRule rules[] = {
 			 PREC_COMPARISON }, // Less than comparison
 	[TOKEN_LESS_EQUAL] = { NULL, binary,
 			       PREC_COMPARISON }, // Less or equal comparison
+	[TOKEN_LESS_LESS] = { NULL, binary, PREC_SHIFT }, // Shift left
+	[TOKEN_GREATER_GREATER] = { NULL, binary, PREC_SHIFT }, // Shift right
+	[TOKEN_TILDE_SLASH] = { NULL, binary,
+				PREC_FACTOR }, // Division rounded down
 	[TOKEN_IDENTIFIER] = { variable, NULL,
 			       PREC_NONE }, // Identifier for variables
 	[TOKEN_STRING] = { string, NULL, PREC_NONE }, // String literal
@@ -720,6 +1073,7 @@ ParseRule rules[] = {
 	[TOKEN_FOR] = { NULL, NULL, PREC_NONE }, // For loop
 	[TOKEN_FUN] = { NULL, NULL, PREC_NONE }, // Function declaration
 	[TOKEN_IF] = { NULL, NULL, PREC_NONE }, // If statement
+	[TOKEN_IMPORT] = { NULL, NULL, PREC_NONE }, // Module import
 	[TOKEN_NIL] = { literal, NULL, PREC_NONE }, // Nil (null) literal
 	[TOKEN_OR] = { NULL, or_, PREC_OR }, // Logical OR
 	[TOKEN_PRINT] = { NULL, NULL, PREC_NONE }, // Print statement
@@ -808,8 +1162,14 @@ static void error_at(Token *token, const char *message)
 	parser.panic_mode =
 		true; // Enter panic mode, suppressing further error reports.
 
-	// Display the error location and message.
-	fprintf(stderr, "[line %d] Error", token->line);
+	// Display the error location and message. Modules compiled in parallel
+	// print whole messages.
+	flockfile(stderr);
+	if (moduleName != NULL)
+		fprintf(stderr, "[line %d of %s] Error", token->line,
+			moduleName);
+	else
+		fprintf(stderr, "[line %d] Error", token->line);
 
 	if (token->type == TOKEN_EOF) {
 		fprintf(stderr, " at end"); // Error at the end of file.
@@ -821,6 +1181,7 @@ static void error_at(Token *token, const char *message)
 	}
 
 	fprintf(stderr, ": %s\n", message); // Display the error message.
+	funlockfile(stderr);
 	parser.had_error = true; // Mark that an error occurred.
 }
 
@@ -877,6 +1238,10 @@ static void declaration(void)
 	else if (match(TOKEN_VAR)) {
 		var_declaration();
 	}
+	// Check for a module import and handle it
+	else if (match(TOKEN_IMPORT)) {
+		import_declaration();
+	}
 	// If none of the above, handle it as a general statement
 	else {
 		statement();
@@ -898,21 +1263,41 @@ static bool identifiers_equal(Token *a, Token *b)
 	return memcmp(a->start, b->start, a->length) == 0;
 }
 
+// Claims the next slot of the current function's locals array, growing it if needed.
+// Also keeps track of the most slots the function ever uses at once.
+static Local *reserve_local(void)
+{
+	if (current->localCapacity < current->localCount + 1) {
+		int oldCapacity = current->localCapacity;
+		current->localCapacity = GROW_CAPACITY(oldCapacity);
+		current->locals = GROW_ARRAY(parser.vm, Local, current->locals,
+					     oldCapacity,
+					     current->localCapacity);
+	}
+
+	Local *local = &current->locals[current->localCount++];
+	if (current->localCount > current->function->slotCount)
+		current->function->slotCount = current->localCount;
+	return local;
+}
+
 // Adds a new local variable to the local variable array.
 // The variable is initialized with default values and an error is thrown
 // if the maximum local variable limit is exceeded.
 static void add_local(Token name)
 {
-	// Check if the maximum number of local variables (UINT8_COUNT) is reached
-	if (current->localCount == UINT8_COUNT) {
+	// Check if the locals already fill the most a frame can hold
+	if (current->localCount == FRAME_SLOTS_MAX) {
 		error("Too many local variables in function."); // Throw error if limit is exceeded
 		return;
 	}
 
-	// Get a pointer to the next available slot in the locals array and increment localCount
-	Local *local = &current->locals[current->localCount++];
+	// Get a pointer to the next available slot in the locals array
+	Local *local = reserve_local();
 	local->name = name; // Assign the variable's name
 	local->isCaptured = false; // Initialize as not captured by a closure
+	local->isFinal = true; // Until it is assigned
+	local->start = -1; // Its value is pushed by the declaration
 	local->depth =
 		-1; // Mark as uninitialized, meaning it's in the process of being defined
 }
@@ -920,13 +1305,14 @@ static void add_local(Token name)
 // Define a variable either globally or in the current local scope.
 // If inside a local scope, mark the variable as initialized.
 // Otherwise, define the variable globally by emitting the appropriate bytecode.
-static void define_variable(uint8_t global)
+static void define_variable(int global)
 {
 	if (current->scopeDepth > 0) {
 		mark_initialized(); // Mark the variable as initialized in the current scope.
+		current->locals[current->localCount - 1].start = current->ir.count;
 		return;
 	}
-	emit_bytes(OP_DEFINE_GLOBAL,
+	emit_op_arg(OP_DEFINE_GLOBAL,
 		   global); // Emit bytecode to define a global variable.
 }
 
@@ -958,7 +1344,7 @@ static void and_(bool canAssign)
 	int endJump = emit_jump(
 		OP_JUMP_IF_FALSE); // Emit jump if the left-hand side is false.
 
-	emit_byte(OP_POP); // Discard the left-hand side result if true.
+	emit_op(OP_POP); // Discard the left-hand side result if true.
 	parse_precedence(PREC_AND); // Parse the right-hand side.
 
 	patch_jump(endJump); // Patch the jump to continue execution.
@@ -974,7 +1360,7 @@ static void or_(bool can_assign)
 		OP_JUMP); // Jump to the end if the left-hand side is true.
 
 	patch_jump(elseJump); // Patch the false jump.
-	emit_byte(OP_POP); // Discard the left-hand side result if false.
+	emit_op(OP_POP); // Discard the left-hand side result if false.
 
 	parse_precedence(PREC_OR); // Parse the right-hand side.
 	patch_jump(
@@ -983,7 +1369,7 @@ static void or_(bool can_assign)
 
 // Parse and compile a variable declaration, resolving its scope (local/global).
 // If it's global, return the index in the constant pool; otherwise, mark it locally.
-static uint8_t parse_variable(const char *errorMessage)
+static int parse_variable(const char *errorMessage)
 {
 	consume(TOKEN_IDENTIFIER, errorMessage); // Ensure a valid identifier.
 
@@ -1010,13 +1396,13 @@ static void mark_initialized(void)
 // Handles both initialization and default assignment (i.e., `nil`).
 static void var_declaration(void)
 {
-	uint8_t global = parse_variable(
+	int global = parse_variable(
 		"Expect variable name."); // Parse the variable name.
 
 	if (match(TOKEN_EQUAL)) {
 		expression(); // Parse the initializer expression.
 	} else {
-		emit_byte(OP_NIL); // Default to `nil` if no initializer.
+		emit_op(OP_NIL); // Default to `nil` if no initializer.
 	}
 	consume(TOKEN_SEMICOLON,
 		"Expect ';' after variable declaration."); // Ensure the declaration ends with a semicolon.
@@ -1025,10 +1411,50 @@ static void var_declaration(void)
 		global); // Define the variable in the appropriate scope.
 }
 
+// Parse and compile a module import (e.g., `caravan "lib/math.xa";`). The
+// module's path is resolved when compiling, and the import runs the
+// module's script unless it already ran.
+static void import_declaration(void)
+{
+	consume(TOKEN_STRING, "Expect module path after 'caravan'.");
+	Token path = parser.previous;
+
+	if (current->enclosing != NULL || current->scopeDepth > 0) {
+		error("Can only import modules at the top level.");
+		return;
+	}
+
+	// The path without its quotes
+	char *relative = malloc((size_t)path.length - 1);
+	if (relative == NULL) {
+		error("Not enough memory to import module.");
+		return;
+	}
+	memcpy(relative, path.start + 1, (size_t)path.length - 2);
+	relative[path.length - 2] = '\0';
+
+	char *resolved = resolve_module_path(moduleDirectory, relative);
+	free(relative);
+	if (resolved == NULL) {
+		error("Could not find module.");
+		return;
+	}
+
+	if (moduleImports != NULL)
+		add_module(moduleImports, resolved);
+	emit_op_arg(OP_IMPORT,
+		    make_constant(OBJ_VAL(copy_string(
+			    parser.vm, resolved, (int)strlen(resolved)))));
+	free(resolved);
+	emit_op(OP_POP); // The import leaves nil on the stack
+
+	consume(TOKEN_SEMICOLON, "Expect ';' after module path.");
+}
+
 // Parse and compile a function declaration statement (e.g., `fun foo() {...}`).
 static void fun_declaration(void)
 {
-	uint8_t global = parse_variable(
+	int global = parse_variable(
 		"Expect function name."); // Parse the function name.
 	mark_initialized(); // Mark the function name as initialized in the current scope.
 
@@ -1038,10 +1464,10 @@ static void fun_declaration(void)
 
 // Add a string identifier to the constant pool and return its index.
 // This is used to reference variables, functions, etc., by their names.
-static uint8_t identifier_constant(Token *name)
+static int identifier_constant(Token *name)
 {
 	return make_constant(OBJ_VAL(copy_string(
-		name->start,
+		parser.vm, name->start,
 		name->length))); // Convert the identifier to a constant.
 }
 
@@ -1082,20 +1508,24 @@ static void named_variable(Token name, bool can_assign)
 	}
 
 	if (can_assign && match(TOKEN_EQUAL)) {
+		// Closures can't capture a copy of a variable that changes.
+		if (setOp == OP_SET_LOCAL)
+			current->locals[arg].isFinal = false;
+		else if (setOp == OP_SET_UPVALUE)
+			mark_upvalue_assigned(current, arg);
+
 		expression(); // Compile the right-hand side of the assignment.
-		emit_bytes(
-			setOp,
-			(uint8_t)arg); // Emit the appropriate bytecode for assignment.
+		emit_op_arg(setOp,
+			    arg); // Emit the appropriate bytecode for assignment.
 	} else {
-		emit_bytes(
-			getOp,
-			(uint8_t)arg); // Emit bytecode to load the variable's value.
+		emit_op_arg(getOp,
+			    arg); // Emit bytecode to load the variable's value.
 	}
 }
 
 // Add an upvalue (captured variable) to the current function.
 // Returns the index of the upvalue or reuses an existing one if it was already added.
-static int add_upvalue(Compiler *compiler, uint8_t index, bool isLocal)
+static int add_upvalue(Compiler *compiler, uint16_t index, bool isLocal)
 {
 	int upvalueCount = compiler->function->upvalueCount;
 
@@ -1123,28 +1553,80 @@ static int add_upvalue(Compiler *compiler, uint8_t index, bool isLocal)
 // Returns the index of the upvalue or -1 if not found.
 static int resolve_upvalue(Compiler *compiler, Token *name)
 {
-	if (compiler->enclosing == NULL)
+	if (compiler->enclosing == NULL) {
+		// A deferred body resolves the upvalues laid out when it was skimmed
+		if (compiler->lazy != NULL) {
+			for (int i = 0; i < compiler->function->upvalueCount; i++) {
+				ObjString *upvalue = compiler->lazy->upvalueNames[i];
+				if (upvalue->length == name->length &&
+				    memcmp(upvalue->chars, name->start,
+					   name->length) == 0)
+					return i;
+			}
+		}
 		return -1; // No enclosing function to search in.
+	}
 
 	int local = resolve_local(compiler->enclosing, name);
 	if (local != -1) {
 		compiler->enclosing->locals[local].isCaptured =
 			true; // Mark the local variable as captured.
+		// A function that refers to itself is closed over before its
+		// closure is stored in the variable, so there is nothing to copy.
+		if (compiler->enclosing->locals[local].start < 0)
+			compiler->enclosing->locals[local].isFinal = false;
 		return add_upvalue(
-			compiler, (uint8_t)local,
+			compiler, (uint16_t)local,
 			true); // Add the local variable as an upvalue.
 	}
 
 	int upvalue = resolve_upvalue(compiler->enclosing, name);
 	if (upvalue != -1) {
 		return add_upvalue(
-			compiler, (uint8_t)upvalue,
+			compiler, (uint16_t)upvalue,
 			false); // Add the upvalue from the enclosing function.
 	}
 
 	return -1; // Return -1 if the upvalue is not found.
 }
 
+// Marks the local variable an upvalue resolves to as assigned.
+static void mark_upvalue_assigned(Compiler *compiler, int index)
+{
+	// The upvalues of a deferred body were marked when it was skimmed
+	if (compiler->enclosing == NULL)
+		return;
+
+	Upvalue *upvalue = &compiler->upvalues[index];
+	if (upvalue->isLocal) {
+		compiler->enclosing->locals[upvalue->index].isFinal = false;
+	} else {
+		mark_upvalue_assigned(compiler->enclosing, upvalue->index);
+	}
+}
+
+// Decides how closures capture a local variable that goes out of scope.
+//
+// A captured variable that is never assigned holds the same value for its
+// whole lifetime, so closures copy it into a closed upvalue when they are
+// created instead of sharing an open upvalue that has to be looked up and
+// closed. The captures have all been emitted by now, after `local->start`.
+// The variable is no longer captured afterwards.
+static void resolve_captures(Local *local, int slot)
+{
+	if (!local->isCaptured || !local->isFinal)
+		return;
+
+	IrFunction *ir = &current->ir;
+	for (int i = local->start; i < ir->count; i++) {
+		IrInstr *instr = &ir->code[i];
+		if (instr->op == IR_UPVALUE &&
+		    (instr->operand & UPVALUE_LOCAL) && instr->extra == slot)
+			instr->operand |= UPVALUE_COPY;
+	}
+	local->isCaptured = false;
+}
+
 // Synchronizes the parser after a panic (error recovery).
 // It advances through tokens until it finds a point where it can resume parsing
 // (e.g., at a statement boundary like `;` or keywords that begin a new statement).
@@ -1165,6 +1647,7 @@ static void synchronize(void)
 		case TOKEN_WHILE:
 		case TOKEN_PRINT:
 		case TOKEN_RETURN:
+		case TOKEN_IMPORT:
 			return;
 
 		default:
@@ -1228,11 +1711,14 @@ static void end_scope(void)
 	while (current->localCount > 0 &&
 	       current->locals[current->localCount - 1].depth >
 		       current->scopeDepth) {
+		resolve_captures(&current->locals[current->localCount - 1],
+				 current->localCount - 1);
+
 		// If the variable is captured by a closure, close the upvalue
 		if (current->locals[current->localCount - 1].isCaptured) {
-			emit_byte(OP_CLOSE_UPVALUE);
+			emit_op(OP_CLOSE_UPVALUE);
 		} else {
-			emit_byte(OP_POP); // Otherwise, just pop the variable
+			emit_op(OP_POP); // Otherwise, just pop the variable
 		}
 		current->localCount--;
 	}
@@ -1267,7 +1753,7 @@ static void expression_statement(void)
 	expression(); // Compile the expression
 	consume(TOKEN_SEMICOLON,
 		"Expect ';' after expression."); // Ensure semicolon
-	emit_byte(OP_POP); // Discard the result of the expression
+	emit_op(OP_POP); // Discard the result of the expression
 }
 
 // Compiles a for loop.
@@ -1286,7 +1772,7 @@ static void for_statement(void)
 		expression_statement(); // Handle regular expression in the initializer
 	}
 
-	int loopStart = current_chunk()->count; // Mark the start of the loop
+	int loopStart = emit_label(); // Mark the start of the loop
 
 	// Parse the condition clause.
 	int exitJump = -1;
@@ -1295,15 +1781,15 @@ static void for_statement(void)
 		consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 		exitJump = emit_jump(
 			OP_JUMP_IF_FALSE); // Jump out if condition is false
-		emit_byte(OP_POP); // Pop condition result
+		emit_op(OP_POP); // Pop condition result
 	}
 
 	// Parse the increment clause.
 	if (!match(TOKEN_RIGHT_PAREN)) {
 		int bodyJump = emit_jump(OP_JUMP); // Jump to loop body
-		int incrementStart = current_chunk()->count;
+		int incrementStart = emit_label();
 		expression(); // Parse increment expression
-		emit_byte(OP_POP); // Discard result of increment expression
+		emit_op(OP_POP); // Discard result of increment expression
 		consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
 		emit_loop(loopStart); // Jump back to the start of the loop
@@ -1317,7 +1803,7 @@ static void for_statement(void)
 	// Patch exit jump if there's a condition.
 	if (exitJump != -1) {
 		patch_jump(exitJump);
-		emit_byte(OP_POP); // Pop condition result
+		emit_op(OP_POP); // Pop condition result
 	}
 
 	end_scope(); // End the scope
@@ -1332,12 +1818,12 @@ static void if_statement(void)
 
 	int thenJump = emit_jump(
 		OP_JUMP_IF_FALSE); // Jump to else if condition is false
-	emit_byte(OP_POP); // Pop condition result
+	emit_op(OP_POP); // Pop condition result
 	statement(); // Compile the "then" branch
 
 	int elseJump = emit_jump(OP_JUMP); // Jump over the else branch
 	patch_jump(thenJump); // Patch the jump to the else branch
-	emit_byte(OP_POP); // Pop the result if condition was false
+	emit_op(OP_POP); // Pop the result if condition was false
 
 	if (match(TOKEN_ELSE)) {
 		statement(); // Compile the "else" branch
@@ -1352,7 +1838,7 @@ static void print_statement(void)
 {
 	expression(); // Compile the expression to print
 	consume(TOKEN_SEMICOLON, "Expect ';' after value."); // Ensure semicolon
-	emit_byte(OP_PRINT); // Emit the bytecode for print
+	emit_op(OP_PRINT); // Emit the bytecode for print
 }
 
 // Compiles a return statement.
@@ -1370,15 +1856,14 @@ static void return_statement(void)
 		}
 		expression(); // Compile the return value expression
 		consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-		emit_byte(OP_RETURN); // Emit return with value
+		emit_op(OP_RETURN); // Emit return with value
 	}
 }
 
 // Compiles a while loop.
 static void while_statement(void)
 {
-	int loop_start =
-		current_chunk()->count; // Mark the loop's start position
+	int loop_start = emit_label(); // Mark the loop's start position
 
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
 	expression(); // Compile the condition expression
@@ -1386,27 +1871,32 @@ static void while_statement(void)
 
 	int exitJump = emit_jump(
 		OP_JUMP_IF_FALSE); // Jump out of loop if condition is false
-	emit_byte(OP_POP); // Pop condition result
+	emit_op(OP_POP); // Pop condition result
 	statement(); // Compile the loop body
 
 	emit_loop(loop_start); // Jump back to the start of the loop
 
 	patch_jump(exitJump); // Patch the jump to the end of the loop
-	emit_byte(OP_POP); // Pop condition result
+	emit_op(OP_POP); // Pop condition result
+}
+
+// Appends an instruction with two operands to the current function's IR.
+static void emit_instr(int op, int operand, int extra)
+{
+	emit_ir(&current->ir, op, operand, extra,
+		parser.previous.line); // Record the instruction with line info
 }
 
-// Emits a single byte of bytecode to the current chunk.
-static void emit_byte(uint8_t byte)
+// Appends an instruction without operands to the current function's IR.
+static void emit_op(uint8_t op)
 {
-	write_chunk(current_chunk(), byte,
-		    parser.previous.line); // Write the byte with line info
+	emit_instr(op, 0, 0);
 }
 
-// Emits multiple bytes of bytecode to the current chunk.
-static void emit_bytes(uint8_t byte1, uint8_t byte2)
+// Appends an instruction with a single operand to the current function's IR.
+static void emit_op_arg(int op, int operand)
 {
-	emit_byte(byte1);
-	emit_byte(byte2);
+	emit_instr(op, operand, 0);
 }
 
 //#####################
@@ -10,11 +10,52 @@
 
 #include "chunk.h"
 #include "object.h"
+#include "module.h"
 
-// Compile the source string into a function.
-ObjFunction *compile(const char *source);
+// Compile the source string into a function. Modules it imports are looked
+// up relative to the working directory and compiled when first imported.
+ObjFunction *compile(VM *vm, const char *source);
 
-// Mark values in the compiler's scope as roots (for garbage collection).
-void mark_compiler_roots();
+// Compile the source of a module or program into its script function. Any
+// thread can compile a module while the VM's thread waits for it, allocating
+// into its heap, see memory.h. The compiler's state is kept per thread, so
+// threads running different VMs compile at the same time.
+//
+// Parameters:
+//   vm - VM the function belongs to
+//   source - Source to compile
+//   directory - Directory that imported paths are relative to
+//   name - Path of the module shown in errors, NULL for a program
+//   imports - Receives the resolved paths of the modules the source imports,
+//             or NULL
+//
+// Returns:
+//   The script function, or NULL if there were compile errors
+ObjFunction *compile_module(VM *vm, const char *source, const char *directory,
+			    const char *name, ModuleList *imports);
+
+// Set the optimization level used by every following compilation for a VM.
+// Level 0 lowers the parser's output as is, see optimizer.h for the others.
+void set_optimization_level(VM *vm, int level);
+
+// Get the optimization level set by set_optimization_level().
+int get_optimization_level(VM *vm);
+
+// Set whether the following compilations for a VM defer function bodies
+// until the function is first called, so the cost of compiling scales with
+// the code that runs. Syntax errors in a deferred body are only reported
+// when it is compiled, and a program with deferred bodies can't be saved as
+// bytecode.
+void set_lazy_compilation(VM *vm, bool lazy);
+
+// Compile the deferred body of a function, whose `lazy` field is set.
+//
+// Returns:
+//   Whether the body compiled, errors are reported like those of compile()
+bool compile_lazy_function(VM *vm, ObjFunction *function);
+
+// Mark values in the compiler's scope as roots (for garbage collection), if
+// the calling thread is compiling for `vm`.
+void mark_compiler_roots(VM *vm);
 
 #endif
@@ -33,6 +33,25 @@ static int jump_instruction(const char *name, int sign, Chunk *chunk,
 	return offset + 3;
 }
 
+static int long_jump_instruction(const char *name, int sign, Chunk *chunk,
+				 int offset)
+{
+	uint32_t jump = (uint32_t)(chunk->code[offset + 1] << 16);
+	jump |= (uint32_t)(chunk->code[offset + 2] << 8);
+	jump |= chunk->code[offset + 3];
+	printf("%-16s %4d -> %d\n", name, offset,
+	       offset + 4 + sign * (int)jump);
+	return offset + 4;
+}
+
+static int short_instruction(const char *name, Chunk *chunk, int offset)
+{
+	uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+	slot |= chunk->code[offset + 2];
+	printf("%-16s %4d\n", name, slot);
+	return offset + 3;
+}
+
 static int byte_instruction(const char *name, Chunk *chunk, int offset)
 {
 	uint8_t slot = chunk->code[offset + 1];
@@ -50,6 +69,18 @@ static int constant_instruction(const char *name, Chunk *chunk, int offset)
 	return offset + 2;
 }
 
+static int guard_instruction(const char *name, Chunk *chunk, int offset)
+{
+	uint8_t constant = chunk->code[offset + 1];
+	uint8_t argCount = chunk->code[offset + 2];
+	uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+	jump |= chunk->code[offset + 4];
+	printf("%-16s (%d args) %4d '", name, argCount, constant);
+	print_value(chunk->constants.values[constant]);
+	printf("' -> %d\n", offset + 5 + jump);
+	return offset + 5;
+}
+
 static int invoke_instruction(const char *name, Chunk *chunk, int offset)
 {
 	uint8_t constant = chunk->code[offset + 1];
@@ -64,10 +95,11 @@ int disassemble_instruction(Chunk *chunk, int offset)
 {
 	printf("%04d ", offset);
 
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+	int line = get_line(chunk, offset);
+	if (offset > 0 && line == get_line(chunk, offset - 1)) {
 		printf("   | ");
 	} else {
-		printf("%4d ", chunk->lines[offset]);
+		printf("%4d ", line);
 	}
 
 	uint8_t instruction = chunk->code[offset];
@@ -108,18 +140,31 @@ int disassemble_instruction(Chunk *chunk, int offset)
 		return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
 	case OP_GET_GLOBAL:
 		return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+	case OP_IMPORT:
+		return constant_instruction("OP_IMPORT", chunk, offset);
 	case OP_SET_GLOBAL:
 		return constant_instruction("OP_SET_GLOBAL", chunk, offset);
 	case OP_GET_LOCAL:
 		return byte_instruction("OP_GET_LOCAL", chunk, offset);
 	case OP_SET_LOCAL:
 		return byte_instruction("OP_SET_LOCAL", chunk, offset);
+	case OP_GET_LOCAL_LONG:
+		return short_instruction("OP_GET_LOCAL_LONG", chunk, offset);
+	case OP_SET_LOCAL_LONG:
+		return short_instruction("OP_SET_LOCAL_LONG", chunk, offset);
 	case OP_JUMP:
 		return jump_instruction("OP_JUMP", 1, chunk, offset);
 	case OP_JUMP_IF_FALSE:
 		return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
 	case OP_LOOP:
 		return jump_instruction("OP_LOOP", -1, chunk, offset);
+	case OP_JUMP_LONG:
+		return long_jump_instruction("OP_JUMP_LONG", 1, chunk, offset);
+	case OP_JUMP_IF_FALSE_LONG:
+		return long_jump_instruction("OP_JUMP_IF_FALSE_LONG", 1, chunk,
+					     offset);
+	case OP_LOOP_LONG:
+		return long_jump_instruction("OP_LOOP_LONG", -1, chunk, offset);
 	case OP_CALL:
 		return byte_instruction("OP_CALL", chunk, offset);
 	case OP_GET_UPVALUE:
@@ -136,10 +181,15 @@ int disassemble_instruction(Chunk *chunk, int offset)
 		ObjFunction *function =
 			AS_FUNCTION(chunk->constants.values[constant]);
 		for (int j = 0; j < function->upvalueCount; j++) {
-			int isLocal = chunk->code[offset++];
+			int start = offset;
+			int flags = chunk->code[offset++];
 			int index = chunk->code[offset++];
-			printf("%04d      |                     %s %d\n",
-			       offset - 2, isLocal ? "local" : "upvalue",
+			if (flags & UPVALUE_LONG_INDEX)
+				index = (index << 8) | chunk->code[offset++];
+			printf("%04d      |                     %s %d\n", start,
+			       (flags & UPVALUE_COPY)  ? "copy" :
+			       (flags & UPVALUE_LOCAL) ? "local" :
+							 "upvalue",
 			       index);
 		}
 		return offset;
@@ -162,6 +212,32 @@ int disassemble_instruction(Chunk *chunk, int offset)
 		return constant_instruction("OP_GET_SUPER", chunk, offset);
 	case OP_SUPER_INVOKE:
 		return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+	case OP_INLINE_GUARD:
+		return guard_instruction("OP_INLINE_GUARD", chunk, offset);
+	case OP_INLINE_EXIT:
+		return byte_instruction("OP_INLINE_EXIT", chunk, offset);
+	case OP_ARRAY:
+		return byte_instruction("OP_ARRAY", chunk, offset);
+	case OP_GET_INDEX:
+		return simple_instruction("OP_GET_INDEX", offset);
+	case OP_SET_INDEX:
+		return simple_instruction("OP_SET_INDEX", offset);
+	case OP_MAP:
+		return byte_instruction("OP_MAP", chunk, offset);
+	case OP_MODULO:
+		return simple_instruction("OP_MODULO", offset);
+	case OP_FLOOR_DIVIDE:
+		return simple_instruction("OP_FLOOR_DIVIDE", offset);
+	case OP_BIT_AND:
+		return simple_instruction("OP_BIT_AND", offset);
+	case OP_BIT_OR:
+		return simple_instruction("OP_BIT_OR", offset);
+	case OP_BIT_XOR:
+		return simple_instruction("OP_BIT_XOR", offset);
+	case OP_SHIFT_LEFT:
+		return simple_instruction("OP_SHIFT_LEFT", offset);
+	case OP_SHIFT_RIGHT:
+		return simple_instruction("OP_SHIFT_RIGHT", offset);
 	default:
 		printf("Unknown opcode %d\n", instruction);
 		return offset + 1;
@@ -0,0 +1,524 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the kernels behind the natives of float arrays, in a
+// scalar version and, on x86-64, SSE2 and AVX versions. SSE2 is part of
+// every x86-64 processor. The AVX kernels are compiled for AVX function by
+// function, so the rest of the interpreter still runs on processors
+// without it, and they're only picked when the processor has it. The
+// natives get the kernels they use as their data.
+
+#include "floats.h"
+
+#include "vm.h"
+#include "memory.h"
+#include "object.h"
+
+#include <limits.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FLOATS_X86
+#include <immintrin.h>
+#endif
+
+// Implementations of the bulk operations, each over `count` elements
+typedef struct {
+	void (*add)(double *out, const double *a, const double *b, int count);
+	void (*multiply)(double *out, const double *a, const double *b,
+			 int count);
+	void (*scale)(double *out, const double *a, double factor, int count);
+	double (*dot)(const double *a, const double *b, int count);
+	double (*sum)(const double *a, int count);
+	double (*min)(const double *a, int count); // count > 0
+	double (*max)(const double *a, int count); // count > 0
+	void (*prefix_sum)(double *out, const double *a, int count);
+} Kernels;
+
+static void add_scalar(double *out, const double *a, const double *b,
+		       int count)
+{
+	for (int i = 0; i < count; i++)
+		out[i] = a[i] + b[i];
+}
+
+static void multiply_scalar(double *out, const double *a, const double *b,
+			    int count)
+{
+	for (int i = 0; i < count; i++)
+		out[i] = a[i] * b[i];
+}
+
+static void scale_scalar(double *out, const double *a, double factor,
+			 int count)
+{
+	for (int i = 0; i < count; i++)
+		out[i] = a[i] * factor;
+}
+
+static double dot_scalar(const double *a, const double *b, int count)
+{
+	double sum = 0;
+	for (int i = 0; i < count; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+static double sum_scalar(const double *a, int count)
+{
+	double sum = 0;
+	for (int i = 0; i < count; i++)
+		sum += a[i];
+	return sum;
+}
+
+// NaNs are skipped unless the first element is one, as they are by the
+// SIMD kernels
+static double min_scalar(const double *a, int count)
+{
+	double min = a[0];
+	for (int i = 1; i < count; i++)
+		if (a[i] < min)
+			min = a[i];
+	return min;
+}
+
+static double max_scalar(const double *a, int count)
+{
+	double max = a[0];
+	for (int i = 1; i < count; i++)
+		if (a[i] > max)
+			max = a[i];
+	return max;
+}
+
+static void prefix_sum_scalar(double *out, const double *a, int count)
+{
+	double sum = 0;
+	for (int i = 0; i < count; i++) {
+		sum += a[i];
+		out[i] = sum;
+	}
+}
+
+static const Kernels scalarKernels = {
+	add_scalar, multiply_scalar, scale_scalar,    dot_scalar,
+	sum_scalar, min_scalar,	     max_scalar,      prefix_sum_scalar,
+};
+
+#ifdef FLOATS_X86
+
+static void add_sse2(double *out, const double *a, const double *b,
+		     int count)
+{
+	int i = 0;
+	for (; i + 2 <= count; i += 2)
+		_mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i),
+						  _mm_loadu_pd(b + i)));
+	add_scalar(out + i, a + i, b + i, count - i);
+}
+
+static void multiply_sse2(double *out, const double *a, const double *b,
+			  int count)
+{
+	int i = 0;
+	for (; i + 2 <= count; i += 2)
+		_mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i),
+						  _mm_loadu_pd(b + i)));
+	multiply_scalar(out + i, a + i, b + i, count - i);
+}
+
+static void scale_sse2(double *out, const double *a, double factor,
+		       int count)
+{
+	__m128d scale = _mm_set1_pd(factor);
+	int i = 0;
+	for (; i + 2 <= count; i += 2)
+		_mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), scale));
+	scale_scalar(out + i, a + i, factor, count - i);
+}
+
+// Adds the two halves of a register
+static double horizontal_sum_sse2(__m128d sums)
+{
+	return _mm_cvtsd_f64(_mm_add_sd(sums, _mm_unpackhi_pd(sums, sums)));
+}
+
+// Two accumulators keep two additions in flight
+static double dot_sse2(const double *a, const double *b, int count)
+{
+	__m128d sums0 = _mm_setzero_pd();
+	__m128d sums1 = _mm_setzero_pd();
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		sums0 = _mm_add_pd(sums0, _mm_mul_pd(_mm_loadu_pd(a + i),
+						     _mm_loadu_pd(b + i)));
+		sums1 = _mm_add_pd(sums1, _mm_mul_pd(_mm_loadu_pd(a + i + 2),
+						     _mm_loadu_pd(b + i + 2)));
+	}
+	return horizontal_sum_sse2(_mm_add_pd(sums0, sums1)) +
+	       dot_scalar(a + i, b + i, count - i);
+}
+
+static double sum_sse2(const double *a, int count)
+{
+	__m128d sums0 = _mm_setzero_pd();
+	__m128d sums1 = _mm_setzero_pd();
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		sums0 = _mm_add_pd(sums0, _mm_loadu_pd(a + i));
+		sums1 = _mm_add_pd(sums1, _mm_loadu_pd(a + i + 2));
+	}
+	return horizontal_sum_sse2(_mm_add_pd(sums0, sums1)) +
+	       sum_scalar(a + i, count - i);
+}
+
+// minpd returns its second operand when either is a NaN, so the running
+// minimum goes second to skip NaN elements
+static double min_sse2(const double *a, int count)
+{
+	__m128d mins = _mm_set1_pd(a[0]);
+	int i = 0;
+	for (; i + 2 <= count; i += 2)
+		mins = _mm_min_pd(_mm_loadu_pd(a + i), mins);
+	mins = _mm_min_sd(_mm_unpackhi_pd(mins, mins), mins);
+	double min = _mm_cvtsd_f64(mins);
+	return i < count && a[i] < min ? a[i] : min;
+}
+
+static double max_sse2(const double *a, int count)
+{
+	__m128d maxes = _mm_set1_pd(a[0]);
+	int i = 0;
+	for (; i + 2 <= count; i += 2)
+		maxes = _mm_max_pd(_mm_loadu_pd(a + i), maxes);
+	maxes = _mm_max_sd(_mm_unpackhi_pd(maxes, maxes), maxes);
+	double max = _mm_cvtsd_f64(maxes);
+	return i < count && a[i] > max ? a[i] : max;
+}
+
+// Each pair of elements is summed in the register, [x0, x0 + x1], before
+// the sum of the elements before it is added to both
+static void prefix_sum_sse2(double *out, const double *a, int count)
+{
+	__m128d carry = _mm_setzero_pd();
+	int i = 0;
+	for (; i + 2 <= count; i += 2) {
+		__m128d x = _mm_loadu_pd(a + i);
+		x = _mm_add_pd(x, _mm_unpacklo_pd(_mm_setzero_pd(), x));
+		x = _mm_add_pd(x, carry);
+		_mm_storeu_pd(out + i, x);
+		carry = _mm_unpackhi_pd(x, x);
+	}
+	if (i < count)
+		out[i] = _mm_cvtsd_f64(carry) + a[i];
+}
+
+static const Kernels sse2Kernels = {
+	add_sse2, multiply_sse2, scale_sse2, dot_sse2,
+	sum_sse2, min_sse2,	 max_sse2,   prefix_sum_sse2,
+};
+
+#define AVX __attribute__((target("avx")))
+
+AVX static void add_avx(double *out, const double *a, const double *b,
+			int count)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+		_mm256_storeu_pd(out + i,
+				 _mm256_add_pd(_mm256_loadu_pd(a + i),
+					       _mm256_loadu_pd(b + i)));
+	add_scalar(out + i, a + i, b + i, count - i);
+}
+
+AVX static void multiply_avx(double *out, const double *a, const double *b,
+			     int count)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+		_mm256_storeu_pd(out + i,
+				 _mm256_mul_pd(_mm256_loadu_pd(a + i),
+					       _mm256_loadu_pd(b + i)));
+	multiply_scalar(out + i, a + i, b + i, count - i);
+}
+
+AVX static void scale_avx(double *out, const double *a, double factor,
+			  int count)
+{
+	__m256d scale = _mm256_set1_pd(factor);
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+		_mm256_storeu_pd(out + i,
+				 _mm256_mul_pd(_mm256_loadu_pd(a + i), scale));
+	scale_scalar(out + i, a + i, factor, count - i);
+}
+
+// Adds the four elements of a register
+AVX static double horizontal_sum_avx(__m256d sums)
+{
+	__m128d half = _mm_add_pd(_mm256_castpd256_pd128(sums),
+				  _mm256_extractf128_pd(sums, 1));
+	return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+AVX static double dot_avx(const double *a, const double *b, int count)
+{
+	__m256d sums0 = _mm256_setzero_pd();
+	__m256d sums1 = _mm256_setzero_pd();
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		sums0 = _mm256_add_pd(sums0,
+				      _mm256_mul_pd(_mm256_loadu_pd(a + i),
+						    _mm256_loadu_pd(b + i)));
+		sums1 = _mm256_add_pd(
+			sums1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+					     _mm256_loadu_pd(b + i + 4)));
+	}
+	return horizontal_sum_avx(_mm256_add_pd(sums0, sums1)) +
+	       dot_scalar(a + i, b + i, count - i);
+}
+
+AVX static double sum_avx(const double *a, int count)
+{
+	__m256d sums0 = _mm256_setzero_pd();
+	__m256d sums1 = _mm256_setzero_pd();
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		sums0 = _mm256_add_pd(sums0, _mm256_loadu_pd(a + i));
+		sums1 = _mm256_add_pd(sums1, _mm256_loadu_pd(a + i + 4));
+	}
+	return horizontal_sum_avx(_mm256_add_pd(sums0, sums1)) +
+	       sum_scalar(a + i, count - i);
+}
+
+AVX static double min_avx(const double *a, int count)
+{
+	__m256d mins = _mm256_set1_pd(a[0]);
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+		mins = _mm256_min_pd(_mm256_loadu_pd(a + i), mins);
+	__m128d half = _mm_min_pd(_mm256_extractf128_pd(mins, 1),
+				  _mm256_castpd256_pd128(mins));
+	half = _mm_min_sd(_mm_unpackhi_pd(half, half), half);
+	double min = _mm_cvtsd_f64(half);
+	for (; i < count; i++)
+		if (a[i] < min)
+			min = a[i];
+	return min;
+}
+
+AVX static double max_avx(const double *a, int count)
+{
+	__m256d maxes = _mm256_set1_pd(a[0]);
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+		maxes = _mm256_max_pd(_mm256_loadu_pd(a + i), maxes);
+	__m128d half = _mm_max_pd(_mm256_extractf128_pd(maxes, 1),
+				  _mm256_castpd256_pd128(maxes));
+	half = _mm_max_sd(_mm_unpackhi_pd(half, half), half);
+	double max = _mm_cvtsd_f64(half);
+	for (; i < count; i++)
+		if (a[i] > max)
+			max = a[i];
+	return max;
+}
+
+// Each group of four elements is summed in the register in two steps,
+// [x0, x0 + x1, x2, x2 + x3] and then the sum of the lower half added to
+// the upper half, before the sum of the elements before it is added
+AVX static void prefix_sum_avx(double *out, const double *a, int count)
+{
+	__m256d zero = _mm256_setzero_pd();
+	__m256d carry = zero;
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m256d x = _mm256_loadu_pd(a + i);
+		__m256d shifted = _mm256_permute_pd(x, 0x5); // x1 x0 x3 x2
+		x = _mm256_add_pd(x, _mm256_blend_pd(zero, shifted, 0xa));
+		__m256d low = _mm256_permute2f128_pd(x, x, 0x08); // 0 0 y0 y1
+		x = _mm256_add_pd(x, _mm256_permute_pd(low, 0xc));
+		x = _mm256_add_pd(x, carry);
+		_mm256_storeu_pd(out + i, x);
+		__m256d high = _mm256_permute2f128_pd(x, x, 0x11);
+		carry = _mm256_permute_pd(high, 0xf);
+	}
+	double sum = _mm_cvtsd_f64(_mm256_castpd256_pd128(carry));
+	for (; i < count; i++) {
+		sum += a[i];
+		out[i] = sum;
+	}
+}
+
+static const Kernels avxKernels = {
+	add_avx, multiply_avx, scale_avx, dot_avx,
+	sum_avx, min_avx,      max_avx,	  prefix_sum_avx,
+};
+
+#endif
+
+// Picks the fastest kernels the processor supports
+static const Kernels *select_kernels(void)
+{
+#ifdef FLOATS_X86
+	if (__builtin_cpu_supports("avx"))
+		return &avxKernels;
+	if (__builtin_cpu_supports("sse2"))
+		return &sse2Kernels;
+#endif
+	return &scalarKernels;
+}
+
+// Create a float array of zeros, or of the numbers of an array
+static Value float_array_native(VM *vm, int argCount, Value *args,
+				void *data)
+{
+	if (argCount == 1 && IS_NUMBER(args[0])) {
+		double count = AS_NUMBER(args[0]);
+		if (!(count >= 0 && count <= INT_MAX) || count != (int)count)
+			return native_error(vm, "Expected a whole number of "
+						"elements.");
+		return OBJ_VAL(new_float_array(vm, (int)count));
+	}
+
+	if (argCount != 1 || !IS_ARRAY(args[0]))
+		return native_error(vm, "Expected a number of elements or an "
+					"array of numbers.");
+
+	// The array is an argument, so it stays reachable
+	ValueArray *elements = &AS_ARRAY(args[0])->elements;
+	for (int i = 0; i < elements->count; i++) {
+		if (!IS_NUMBER(elements->values[i]))
+			return native_error(vm,
+					    "Expected an array of numbers.");
+	}
+
+	ObjFloatArray *array = new_float_array(vm, elements->count);
+	for (int i = 0; i < elements->count; i++)
+		array->values[i] = AS_NUMBER(elements->values[i]);
+	return OBJ_VAL(array);
+}
+
+// Check the arguments of a native that takes two float arrays of the same
+// length
+static bool is_float_pair(int argCount, Value *args)
+{
+	return argCount == 2 && IS_FLOAT_ARRAY(args[0]) &&
+	       IS_FLOAT_ARRAY(args[1]) &&
+	       AS_FLOAT_ARRAY(args[0])->count == AS_FLOAT_ARRAY(args[1])->count;
+}
+
+static Value floats_add_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (!is_float_pair(argCount, args))
+		return native_error(vm, "Expected two float arrays of the same "
+					"length.");
+
+	ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+	ObjFloatArray *b = AS_FLOAT_ARRAY(args[1]);
+	ObjFloatArray *result = new_float_array(vm, a->count);
+	((const Kernels *)data)->add(result->values, a->values, b->values,
+				     a->count);
+	return OBJ_VAL(result);
+}
+
+static Value floats_multiply_native(VM *vm, int argCount, Value *args,
+				    void *data)
+{
+	if (!is_float_pair(argCount, args))
+		return native_error(vm, "Expected two float arrays of the same "
+					"length.");
+
+	ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+	ObjFloatArray *b = AS_FLOAT_ARRAY(args[1]);
+	ObjFloatArray *result = new_float_array(vm, a->count);
+	((const Kernels *)data)->multiply(result->values, a->values,
+					  b->values, a->count);
+	return OBJ_VAL(result);
+}
+
+static Value floats_scale_native(VM *vm, int argCount, Value *args,
+				 void *data)
+{
+	if (argCount != 2 || !IS_FLOAT_ARRAY(args[0]) || !IS_NUMBER(args[1]))
+		return native_error(vm, "Expected a float array and a number.");
+
+	ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+	ObjFloatArray *result = new_float_array(vm, a->count);
+	((const Kernels *)data)->scale(result->values, a->values,
+				       AS_NUMBER(args[1]), a->count);
+	return OBJ_VAL(result);
+}
+
+static Value floats_dot_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (!is_float_pair(argCount, args))
+		return native_error(vm, "Expected two float arrays of the same "
+					"length.");
+
+	ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+	ObjFloatArray *b = AS_FLOAT_ARRAY(args[1]);
+	return NUMBER_VAL(
+		((const Kernels *)data)->dot(a->values, b->values, a->count));
+}
+
+static Value floats_sum_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_FLOAT_ARRAY(args[0]))
+		return native_error(vm, "Expected a float array.");
+
+	ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+	return NUMBER_VAL(((const Kernels *)data)->sum(a->values, a->count));
+}
+
+static Value floats_min_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_FLOAT_ARRAY(args[0]) ||
+	    AS_FLOAT_ARRAY(args[0])->count == 0)
+		return native_error(vm, "Expected a float array that isn't "
+					"empty.");
+
+	ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+	return NUMBER_VAL(((const Kernels *)data)->min(a->values, a->count));
+}
+
+static Value floats_max_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_FLOAT_ARRAY(args[0]) ||
+	    AS_FLOAT_ARRAY(args[0])->count == 0)
+		return native_error(vm, "Expected a float array that isn't "
+					"empty.");
+
+	ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+	return NUMBER_VAL(((const Kernels *)data)->max(a->values, a->count));
+}
+
+static Value floats_prefix_sum_native(VM *vm, int argCount, Value *args,
+				      void *data)
+{
+	if (argCount != 1 || !IS_FLOAT_ARRAY(args[0]))
+		return native_error(vm, "Expected a float array.");
+
+	ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+	ObjFloatArray *result = new_float_array(vm, a->count);
+	((const Kernels *)data)->prefix_sum(result->values, a->values,
+					    a->count);
+	return OBJ_VAL(result);
+}
+
+void define_float_natives(VM *vm)
+{
+	// The kernels are constant, so the natives only borrow them
+	void *kernels = (void *)select_kernels();
+	define_native(vm, "float_array", float_array_native, NULL, 0);
+	define_native(vm, "floats_add", floats_add_native, kernels, 0);
+	define_native(vm, "floats_multiply", floats_multiply_native, kernels,
+		      0);
+	define_native(vm, "floats_scale", floats_scale_native, kernels, 0);
+	define_native(vm, "floats_dot", floats_dot_native, kernels, 0);
+	define_native(vm, "floats_sum", floats_sum_native, kernels, 0);
+	define_native(vm, "floats_min", floats_min_native, kernels, 0);
+	define_native(vm, "floats_max", floats_max_native, kernels, 0);
+	define_native(vm, "floats_prefix_sum", floats_prefix_sum_native,
+		      kernels, 0);
+}
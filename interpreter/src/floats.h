@@ -0,0 +1,38 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the natives of float arrays, which keep numbers as
+// plain doubles so that a single call processes every element with SIMD
+// instructions instead of running a loop of bytecode over boxed values.
+// Elements are read and written with brackets like those of any array.
+//
+// Scripts use them through these natives:
+//   float_array(count) - create a float array of `count` zeros
+//   float_array(array) - create a float array of the numbers of an array
+//   floats_add(a, b) - a new float array of the sums of the elements
+//   floats_multiply(a, b) - a new float array of the products of the
+//                           elements
+//   floats_scale(a, factor) - a new float array of the elements times a
+//                             number
+//   floats_dot(a, b) - the dot product of two float arrays
+//   floats_sum(a) - the sum of the elements
+//   floats_min(a) - the smallest element
+//   floats_max(a) - the largest element
+//   floats_prefix_sum(a) - a new float array whose every element is the
+//                          sum of the elements up to it
+//
+// Sums are added in a different order than a loop adds them, so their
+// last digits may differ from what the loop computes.
+
+#ifndef xanadu_floats_h
+#define xanadu_floats_h
+
+#include "common.h"
+#include "value.h"
+
+// Defines the natives of float arrays in a VM, with the fastest kernels
+// the processor supports.
+void define_float_natives(VM *vm);
+
+#endif
@@ -0,0 +1,464 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the construction of the intermediate representation and the backend
+// that lowers it into bytecode. The backend picks the encoding of every jump, local slot and
+// upvalue descriptor, and builds the final constant pool of the chunk.
+
+#include <string.h>
+
+#include "ir.h"
+#include "memory.h"
+#include "value.h"
+
+// Initializes an empty IR.
+void init_ir(VM *vm, IrFunction *ir)
+{
+	ir->vm = vm;
+	ir->count = 0;
+	ir->capacity = 0;
+	ir->code = NULL;
+	ir->labelCount = 0;
+}
+
+// Frees the instructions of an IR and resets it.
+void free_ir(IrFunction *ir)
+{
+	FREE_ARRAY(ir->vm, IrInstr, ir->code, ir->capacity);
+	init_ir(ir->vm, ir);
+}
+
+// Appends an instruction and returns its index.
+int emit_ir(IrFunction *ir, int op, int operand, int extra, int line)
+{
+	// Grow the instruction array if necessary
+	if (ir->capacity < ir->count + 1) {
+		int oldCapacity = ir->capacity;
+		ir->capacity = GROW_CAPACITY(oldCapacity);
+		ir->code = GROW_ARRAY(ir->vm, IrInstr, ir->code, oldCapacity,
+				      ir->capacity);
+	}
+
+	IrInstr *instr = &ir->code[ir->count];
+	instr->op = op;
+	instr->operand = operand;
+	instr->extra = extra;
+	instr->label = -1;
+	instr->line = line;
+	return ir->count++;
+}
+
+// Appends a jump or label instruction for `label` and returns its index.
+int emit_ir_label(IrFunction *ir, int op, int label, int line)
+{
+	int index = emit_ir(ir, op, 0, 0, line);
+	ir->code[index].label = label;
+	return index;
+}
+
+// Allocates a new label id.
+int new_ir_label(IrFunction *ir)
+{
+	return ir->labelCount++;
+}
+
+// Drops all IR_NOP instructions, keeping the order of the rest.
+void compact_ir(IrFunction *ir)
+{
+	int to = 0;
+	for (int from = 0; from < ir->count; from++) {
+		if (ir->code[from].op != IR_NOP)
+			ir->code[to++] = ir->code[from];
+	}
+	ir->count = to;
+}
+
+// Returns whether the instruction's operand is a constant pool index.
+bool ir_has_constant(int op)
+{
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_GET_SUPER:
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+	case OP_CLASS:
+	case OP_METHOD:
+	case OP_CLOSURE:
+	case OP_INLINE_GUARD:
+	case OP_IMPORT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Returns whether the instruction refers to a label it may continue at.
+bool ir_has_label(int op)
+{
+	return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_INLINE_GUARD;
+}
+
+// Returns the net number of values an instruction pushes, as run() executes it.
+int ir_stack_effect(IrInstr *instr)
+{
+	switch (instr->op) {
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_CLOSURE:
+	case OP_CLASS:
+	case OP_IMPORT:
+		return 1;
+	case OP_POP:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_PROPERTY:
+	case OP_GET_SUPER:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_MODULO:
+	case OP_FLOOR_DIVIDE:
+	case OP_BIT_AND:
+	case OP_BIT_OR:
+	case OP_BIT_XOR:
+	case OP_SHIFT_LEFT:
+	case OP_SHIFT_RIGHT:
+	case OP_GET_INDEX:
+	case OP_PRINT:
+	case OP_CLOSE_UPVALUE:
+	case OP_INHERIT:
+	case OP_METHOD:
+	case OP_RETURN:
+		return -1;
+	case OP_CALL:
+		return -instr->operand;
+	case OP_INVOKE:
+		return -instr->extra;
+	case OP_SUPER_INVOKE:
+		return -instr->extra - 1;
+	case OP_INLINE_EXIT:
+		return -instr->operand - 1;
+	case OP_ARRAY:
+		return 1 - instr->operand;
+	case OP_MAP:
+		return 1 - 2 * instr->operand;
+	case OP_SET_INDEX:
+		return -2;
+	default:
+		return 0; // Sets, property reads, unary operators, jumps and pseudo ops
+	}
+}
+
+// Returns the number of bytes an instruction takes in the chunk.
+// Jumps are three bytes, or four once they have been widened.
+static int instruction_size(IrInstr *instr, bool wide)
+{
+	switch (instr->op) {
+	case IR_LABEL:
+	case IR_NOP:
+		return 0;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+		return wide ? 4 : 3;
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+		return instr->operand > UINT8_MAX ? 3 : 2;
+	case IR_UPVALUE:
+		return instr->extra > UINT8_MAX ? 3 : 2;
+	case OP_INLINE_GUARD:
+		return 5;
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+		return 3;
+	case OP_CALL:
+	case OP_INLINE_EXIT:
+	case OP_ARRAY:
+	case OP_MAP:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+		return 2;
+	default:
+		return ir_has_constant(instr->op) ? 2 : 1;
+	}
+}
+
+// Returns the distance a jump has to cover in the given layout. Backward
+// distances are positive as well, since they are encoded as OP_LOOP.
+static int jump_distance(int start, int size, int target)
+{
+	int end = start + size;
+	return target >= end ? target - end : end - target;
+}
+
+// Maps every compile-time constant the IR refers to onto the final pool.
+// Constants that folded away or belonged to removed code are dropped and
+// identical constants share a slot. Numbers are compared bit for bit so 0
+// and -0 (and NaNs) stay distinct.
+static const char *build_constants(IrFunction *ir, ValueArray *from,
+				   ValueArray *to, int *map)
+{
+	for (int i = 0; i < from->count; i++)
+		map[i] = -1;
+
+	for (int i = 0; i < ir->count; i++) {
+		IrInstr *instr = &ir->code[i];
+		if (!ir_has_constant(instr->op) || map[instr->operand] != -1)
+			continue;
+
+		Value value = from->values[instr->operand];
+		int index = -1;
+		for (int j = 0; j < to->count && index == -1; j++) {
+			Value other = to->values[j];
+			if (other.type != value.type)
+				continue;
+			if (IS_DOUBLE(value) ?
+				    memcmp(&value.as.number, &other.as.number,
+					   sizeof(double)) == 0 :
+				    values_equal(value, other))
+				index = j;
+		}
+
+		if (index == -1) {
+			if (to->count == UINT8_COUNT)
+				return "Too many constants in one chunk.";
+			// `value` is still reachable through the compile-time pool,
+			// so a collection triggered here can't free it.
+			write_value_array(ir->vm, to, value);
+			index = to->count - 1;
+		}
+		map[instr->operand] = index;
+	}
+
+	return NULL;
+}
+
+// Writes an instruction's bytes to the chunk.
+static void write_instruction(VM *vm, Chunk *chunk, IrInstr *instr,
+			      int operand, int size)
+{
+	int line = instr->line;
+
+	switch (instr->op) {
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+		if (size == 3) {
+			write_chunk(vm, chunk,
+				    instr->op == OP_GET_LOCAL ?
+					    OP_GET_LOCAL_LONG :
+					    OP_SET_LOCAL_LONG,
+				    line);
+			write_chunk(vm, chunk, (operand >> 8) & 0xff, line);
+		} else {
+			write_chunk(vm, chunk, instr->op, line);
+		}
+		write_chunk(vm, chunk, operand & 0xff, line);
+		break;
+	case IR_UPVALUE: {
+		// Flags byte followed by a one or two byte index
+		int index = instr->extra;
+		if (size == 3) {
+			write_chunk(vm, chunk, operand | UPVALUE_LONG_INDEX,
+				    line);
+			write_chunk(vm, chunk, (index >> 8) & 0xff, line);
+		} else {
+			write_chunk(vm, chunk, operand, line);
+		}
+		write_chunk(vm, chunk, index & 0xff, line);
+		break;
+	}
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+		write_chunk(vm, chunk, instr->op, line);
+		write_chunk(vm, chunk, operand, line);
+		write_chunk(vm, chunk, instr->extra, line);
+		break;
+	case IR_LABEL:
+	case IR_NOP:
+		break;
+	default:
+		write_chunk(vm, chunk, instr->op, line);
+		if (size == 2)
+			write_chunk(vm, chunk, operand, line);
+		break;
+	}
+}
+
+// Writes an inline guard: the function it checks for, the argument count of
+// the call and the distance to the code after the inlined body.
+static const char *write_guard(VM *vm, Chunk *chunk, IrInstr *instr,
+			       int constant, int start, int target)
+{
+	int distance = target - (start + 5);
+	if (distance < 0 || distance > UINT16_MAX)
+		return "Inlined function too large.";
+
+	write_chunk(vm, chunk, OP_INLINE_GUARD, instr->line);
+	write_chunk(vm, chunk, constant, instr->line);
+	write_chunk(vm, chunk, instr->extra, instr->line);
+	write_chunk(vm, chunk, (distance >> 8) & 0xff, instr->line);
+	write_chunk(vm, chunk, distance & 0xff, instr->line);
+	return NULL;
+}
+
+// Writes a jump, choosing OP_LOOP for backward jumps and the 24-bit forms
+// for distances past 16 bits.
+static const char *write_jump(VM *vm, Chunk *chunk, IrInstr *instr,
+			      int start, int size, int target)
+{
+	bool backward = target < start + size;
+	int distance = jump_distance(start, size, target);
+	uint8_t op = instr->op;
+
+	if (backward) {
+		if (op != OP_JUMP)
+			return "Conditional jumps can't go backward.";
+		op = OP_LOOP;
+	}
+	if (distance > 0xffffff)
+		return backward ? "Loop body too large." :
+				  "Too much code to jump over.";
+
+	if (size == 4) {
+		op = op == OP_JUMP	    ? OP_JUMP_LONG :
+		     op == OP_JUMP_IF_FALSE ? OP_JUMP_IF_FALSE_LONG :
+					      OP_LOOP_LONG;
+		write_chunk(vm, chunk, op, instr->line);
+		write_chunk(vm, chunk, (distance >> 16) & 0xff, instr->line);
+	} else {
+		write_chunk(vm, chunk, op, instr->line);
+	}
+	write_chunk(vm, chunk, (distance >> 8) & 0xff, instr->line);
+	write_chunk(vm, chunk, distance & 0xff, instr->line);
+	return NULL;
+}
+
+// Returns the most values the stack holds while the IR runs, starting out
+// with `depth` values. Code is walked in order, and a label continues with
+// the deepest of the code before it and the jumps to it seen so far, which
+// covers the code behind breaks and returns. `labels` has room for a depth
+// per label.
+static int max_stack_depth(IrFunction *ir, int depth, int *labels)
+{
+	for (int i = 0; i < ir->labelCount; i++)
+		labels[i] = -1;
+
+	int max = depth;
+	for (int i = 0; i < ir->count; i++) {
+		IrInstr *instr = &ir->code[i];
+		if (instr->op == IR_LABEL && labels[instr->label] > depth)
+			depth = labels[instr->label];
+
+		if (ir_has_label(instr->op)) {
+			// A guard that jumps leaves the call's result in place
+			// of its arguments
+			int target = depth + ir_stack_effect(instr);
+			if (instr->op == OP_INLINE_GUARD)
+				target -= instr->extra;
+			if (target > labels[instr->label])
+				labels[instr->label] = target;
+		}
+
+		depth += ir_stack_effect(instr);
+		if (depth > max)
+			max = depth;
+	}
+	return max;
+}
+
+// Lowers the IR into bytecode.
+//
+// Every jump starts out in its short form. After laying out the code, jumps
+// whose distance doesn't fit in 16 bits are widened, which moves the code
+// behind them, so the layout is repeated until no jump changes. Jumps only
+// ever grow, so this terminates.
+const char *lower_ir(IrFunction *ir, Chunk *chunk, int *slots)
+{
+	VM *vm = ir->vm;
+	ValueArray *compiled = &chunk->constants;
+	int constantCount = compiled->count;
+	int *map = ALLOCATE(vm, int, constantCount);
+	int *offsets = ALLOCATE(vm, int, ir->count);
+	int *labels = ALLOCATE(vm, int, ir->labelCount);
+	bool *wide = ALLOCATE(vm, bool, ir->count);
+
+	ValueArray constants;
+	init_value_array(&constants);
+	const char *message =
+		build_constants(ir, compiled, &constants, map);
+
+	*slots = max_stack_depth(ir, *slots, labels);
+	for (int i = 0; i < ir->count; i++)
+		wide[i] = false;
+	for (int i = 0; i < ir->labelCount; i++)
+		labels[i] = 0;
+
+	bool changed = true;
+	while (changed && message == NULL) {
+		// Lay out the code with the current jump widths
+		int offset = 0;
+		for (int i = 0; i < ir->count; i++) {
+			offsets[i] = offset;
+			if (ir->code[i].op == IR_LABEL)
+				labels[ir->code[i].label] = offset;
+			offset += instruction_size(&ir->code[i], wide[i]);
+		}
+
+		// Widen the jumps that no longer fit
+		changed = false;
+		for (int i = 0; i < ir->count; i++) {
+			IrInstr *instr = &ir->code[i];
+			if (instr->op == OP_INLINE_GUARD ||
+			    !ir_has_label(instr->op) || wide[i])
+				continue;
+			if (jump_distance(offsets[i], 3, labels[instr->label]) >
+			    UINT16_MAX) {
+				wide[i] = true;
+				changed = true;
+			}
+		}
+	}
+
+	for (int i = 0; i < ir->count && message == NULL; i++) {
+		IrInstr *instr = &ir->code[i];
+		int size = instruction_size(instr, wide[i]);
+
+		// From here on the IR refers to the final pool
+		if (ir_has_constant(instr->op))
+			instr->operand = map[instr->operand];
+
+		if (instr->op == OP_INLINE_GUARD) {
+			message = write_guard(vm, chunk, instr, instr->operand,
+					      offsets[i], labels[instr->label]);
+		} else if (ir_has_label(instr->op)) {
+			message = write_jump(vm, chunk, instr, offsets[i], size,
+					     labels[instr->label]);
+		} else {
+			write_instruction(vm, chunk, instr, instr->operand,
+					  size);
+		}
+	}
+
+	// Swap in the final pool once nothing can allocate anymore
+	free_value_array(vm, compiled);
+	*compiled = constants;
+
+	FREE_ARRAY(vm, int, map, constantCount);
+	FREE_ARRAY(vm, int, offsets, ir->count);
+	FREE_ARRAY(vm, int, labels, ir->labelCount);
+	FREE_ARRAY(vm, bool, wide, ir->count);
+	return message;
+}
@@ -0,0 +1,89 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the intermediate representation the parser builds for every function.
+// It is a list of instructions with symbolic jump labels, which the optimizer rewrites and the
+// backend lowers into a bytecode chunk.
+
+#ifndef xanadu_ir_h
+#define xanadu_ir_h
+
+#include "common.h"
+#include "chunk.h"
+
+// Pseudo instructions that only exist in the IR. They are numbered past the
+// last opcode so they can share the `op` field with real instructions.
+typedef enum {
+	IR_LABEL = UINT8_COUNT, // Jump target, `label` is its id
+	IR_UPVALUE, // Upvalue descriptor following OP_CLOSURE
+	IR_NOP // Removed instruction, dropped when the IR is compacted
+} IrPseudoOp;
+
+// A single IR instruction.
+//
+// Jumps (OP_JUMP and OP_JUMP_IF_FALSE) and inline guards store their target
+// in `label` and the backend picks the encoding: OP_LOOP for backward jumps
+// and the long forms for offsets past 16 bits. Instructions that index the
+// constant pool store the index into the chunk's compile-time pool, which the
+// backend compacts.
+typedef struct {
+	int op; // OpCode or IrPseudoOp
+	int operand; // Slot, constant, argument count or upvalue flags
+	int extra; // Argument count of invokes and guards, index of upvalue descriptors
+	int label; // Label of jumps, guards and IR_LABEL, -1 otherwise
+	int line; // Source line of the instruction
+} IrInstr;
+
+// The IR of a function being compiled.
+typedef struct {
+	VM *vm; // VM the instructions are allocated from
+	int count; // Number of instructions
+	int capacity; // Capacity of the instruction array
+	IrInstr *code; // Instructions in program order
+	int labelCount; // Number of labels handed out by new_ir_label()
+} IrFunction;
+
+// Initializes an empty IR whose memory is charged to `vm`.
+void init_ir(VM *vm, IrFunction *ir);
+
+// Frees the instructions of an IR and resets it.
+void free_ir(IrFunction *ir);
+
+// Appends an instruction without a label and returns its index.
+int emit_ir(IrFunction *ir, int op, int operand, int extra, int line);
+
+// Appends a jump or label instruction for `label` and returns its index.
+int emit_ir_label(IrFunction *ir, int op, int label, int line);
+
+// Allocates a new label id. The label is placed by emitting IR_LABEL.
+int new_ir_label(IrFunction *ir);
+
+// Drops all IR_NOP instructions.
+void compact_ir(IrFunction *ir);
+
+// Returns whether the instruction's operand is a constant pool index.
+bool ir_has_constant(int op);
+
+// Returns whether the instruction refers to a label it may continue at.
+bool ir_has_label(int op);
+
+// Returns how many values an instruction adds to the stack (negative if it
+// removes them) when execution continues with the next instruction. A guard
+// that jumps to its label leaves `extra` fewer values than it found instead.
+int ir_stack_effect(IrInstr *instr);
+
+// Lowers the IR into `chunk`, whose constant pool holds the compile-time
+// constants the IR refers to. Only referenced constants are kept and
+// identical ones are merged. The constant operands of the IR are rewritten
+// to index the final pool.
+//
+// `slots` holds the values a call of the function starts out with, the
+// callee and its arguments, and is set to the most values its frame ever
+// holds, locals and temporaries alike.
+//
+// Returns:
+//   NULL on success, otherwise an error message
+const char *lower_ir(IrFunction *ir, Chunk *chunk, int *slots);
+
+#endif
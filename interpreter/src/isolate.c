@@ -0,0 +1,955 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the implementation of isolates and channels. Values
+// cross between VMs as messages, flat buffers written by walking the object
+// graph of the sender and read back into objects of the receiver. Both walks
+// keep their own stack, so deep structures like long linked lists don't
+// overflow the thread's. Instances reached more than once, cycles included,
+// are written once and referred to by their index afterwards.
+
+#include "isolate.h"
+
+#include "vm.h"
+#include "loop.h"
+#include "memory.h"
+#include "module.h"
+#include "object.h"
+#include "source.h"
+#include "error.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Tags that start every value of a message
+typedef enum {
+	TAG_NIL,
+	TAG_TRUE,
+	TAG_FALSE,
+	TAG_NUMBER, // Followed by the double
+	TAG_INT, // Followed by the integer
+	TAG_STRING, // Followed by the length and the characters
+	TAG_INSTANCE, // Followed by the class name, the field count, the field
+		      // names and then the field values
+	TAG_SEEN, // Followed by the index of an instance already in the message
+	TAG_CHANNEL, // Followed by the index of the channel in the message
+} Tag;
+
+// Values copied out of a VM, in no VM's heap
+typedef struct Message {
+	struct Message *next; // Next message queued on the same channel
+	uint8_t *bytes; // The values, one after the other
+	size_t length; // Length of the values in bytes
+	size_t capacity; // Capacity of the bytes array
+	Channel **channels; // Channels the values refer to, one reference each
+	int channelCount; // Number of channels
+	int channelCapacity; // Capacity of the channels array
+} Message;
+
+struct Channel {
+	pthread_mutex_t lock; // Guards the queue and the closed flag
+	pthread_cond_t ready; // Signaled when a message arrives or it closes
+	Message *head; // Oldest message, NULL if there is none
+	Message *tail; // Newest message
+	bool closed; // Whether senders are done
+	atomic_int references; // Objects and messages referring to the channel
+};
+
+struct Isolate {
+	Isolate *next; // Next isolate waiting for a thread of the pool
+	char *path; // Resolved path of the file to run
+	char *name; // Global to call once the file ran
+	Message *arguments; // Arguments of the call
+	Message *result; // Value the call returned, NULL if it failed
+	bool finished; // Whether it finished, guarded by the pool's lock
+	atomic_int references; // Objects referring to it, and itself if running
+};
+
+// Threads that run isolates. A thread is started whenever an isolate is
+// spawned while no idle thread is left for it, so isolates that wait on each
+// other can't deadlock the pool; threads are kept for later isolates once
+// idle.
+static struct {
+	pthread_mutex_t lock; // Guards everything below
+	pthread_cond_t work; // Signaled when an isolate is queued or it stops
+	pthread_cond_t finished; // Broadcast when an isolate finishes
+	Isolate *head; // Oldest isolate waiting for a thread
+	Isolate *tail; // Newest isolate waiting for a thread
+	pthread_t *threads; // Threads started so far
+	int threadCount; // Number of threads
+	int threadCapacity; // Capacity of the threads array
+	int idle; // Threads waiting for an isolate
+	int queued; // Isolates waiting for a thread
+	int running; // Isolates spawned that didn't finish yet
+	bool stopping; // Whether idle threads exit
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER,
+	   .work = PTHREAD_COND_INITIALIZER,
+	   .finished = PTHREAD_COND_INITIALIZER };
+
+// Writes values into a message
+typedef struct {
+	Message *message; // Message being written
+	Value *stack; // Values left to write, the next one on top
+	int count; // Number of values on the stack
+	int capacity; // Capacity of the stack
+	Obj **seen; // Instances written so far, open addressed by pointer
+	int *indices; // Index in the message of each instance in `seen`
+	int seenCount; // Number of instances written
+	int seenCapacity; // Capacity of the seen table, a power of two
+	const char *error; // Why the last value couldn't be written, or NULL
+} Writer;
+
+// Instance whose field values are being read
+typedef struct {
+	ObjInstance *instance; // The instance
+	int remaining; // Fields left to read
+	size_t names; // Offset of the name of the next field
+} ReadFrame;
+
+// Reads values out of a message into a VM
+typedef struct {
+	const Message *message; // Message being read
+	size_t offset; // Offset of the next value
+	int base; // Index in the VM's received array of the first instance
+	ReadFrame *frames; // Instances being read, the innermost on top
+	int count; // Number of frames
+	int capacity; // Capacity of the frames array
+	char error[128]; // Why the last value couldn't be read
+} Reader;
+
+// Grows an array with malloc(), since messages live outside of every VM
+static void *grow(void *array, int *capacity, size_t size)
+{
+	int newCapacity = *capacity < 8 ? 8 : *capacity * 2;
+	void *result = realloc(array, size * (size_t)newCapacity);
+	if (result == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+	*capacity = newCapacity;
+	return result;
+}
+
+// Adds a reference to a channel
+static void retain_channel(Channel *channel)
+{
+	atomic_fetch_add(&channel->references, 1);
+}
+
+// Creates an empty message
+static Message *new_message(void)
+{
+	Message *message = calloc(1, sizeof(Message));
+	if (message == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+	return message;
+}
+
+// Frees a message and drops its references to channels
+static void free_message(Message *message)
+{
+	if (message == NULL)
+		return;
+	for (int i = 0; i < message->channelCount; i++)
+		release_channel(message->channels[i]);
+	free(message->channels);
+	free(message->bytes);
+	free(message);
+}
+
+// Appends bytes to a message
+static void write_bytes(Message *message, const void *bytes, size_t length)
+{
+	if (message->length + length > message->capacity) {
+		size_t capacity = message->capacity < 64 ? 64 :
+							   message->capacity;
+		while (capacity < message->length + length)
+			capacity *= 2;
+		message->bytes = realloc(message->bytes, capacity);
+		if (message->bytes == NULL)
+			error_msg_exit("Failed to allocate memory in %s",
+				       __FILE__);
+		message->capacity = capacity;
+	}
+	memcpy(message->bytes + message->length, bytes, length);
+	message->length += length;
+}
+
+static void write_byte(Message *message, uint8_t byte)
+{
+	write_bytes(message, &byte, 1);
+}
+
+static void write_u32(Message *message, uint32_t value)
+{
+	write_bytes(message, &value, sizeof(value));
+}
+
+static void write_string(Message *message, ObjString *string)
+{
+	write_u32(message, (uint32_t)string->length);
+	write_bytes(message, string->chars, (size_t)string->length);
+}
+
+// Slot of an instance in the seen table, which is either the instance or
+// empty
+static int seen_slot(Writer *writer, Obj *object)
+{
+	uint32_t mask = (uint32_t)writer->seenCapacity - 1;
+	uint32_t index = (uint32_t)(((uintptr_t)object >> 4) * 2654435761u) &
+			 mask;
+	while (writer->seen[index] != NULL && writer->seen[index] != object)
+		index = (index + 1) & mask;
+	return (int)index;
+}
+
+// Looks up an instance written before, or records it as the next one.
+//
+// Returns:
+//   The instance's index in the message if it was written before, or -1
+static int find_seen(Writer *writer, Obj *object)
+{
+	if ((writer->seenCount + 1) * 2 > writer->seenCapacity) {
+		Obj **oldSeen = writer->seen;
+		int *oldIndices = writer->indices;
+		int oldCapacity = writer->seenCapacity;
+
+		writer->seenCapacity = oldCapacity < 16 ? 16 : oldCapacity * 2;
+		writer->seen =
+			calloc((size_t)writer->seenCapacity, sizeof(Obj *));
+		writer->indices = malloc(sizeof(int) *
+					 (size_t)writer->seenCapacity);
+		if (writer->seen == NULL || writer->indices == NULL)
+			error_msg_exit("Failed to allocate memory in %s",
+				       __FILE__);
+
+		for (int i = 0; i < oldCapacity; i++) {
+			if (oldSeen[i] == NULL)
+				continue;
+			int slot = seen_slot(writer, oldSeen[i]);
+			writer->seen[slot] = oldSeen[i];
+			writer->indices[slot] = oldIndices[i];
+		}
+		free(oldSeen);
+		free(oldIndices);
+	}
+
+	int slot = seen_slot(writer, object);
+	if (writer->seen[slot] != NULL)
+		return writer->indices[slot];
+
+	writer->seen[slot] = object;
+	writer->indices[slot] = writer->seenCount++;
+	return -1;
+}
+
+static void init_writer(Writer *writer)
+{
+	writer->message = new_message();
+	writer->stack = NULL;
+	writer->count = 0;
+	writer->capacity = 0;
+	writer->seen = NULL;
+	writer->indices = NULL;
+	writer->seenCount = 0;
+	writer->seenCapacity = 0;
+	writer->error = NULL;
+}
+
+// Frees the writer's own memory and hands over its message, which is NULL
+// if a value couldn't be written
+static Message *finish_writer(Writer *writer)
+{
+	free(writer->stack);
+	free(writer->seen);
+	free(writer->indices);
+	if (writer->error != NULL) {
+		free_message(writer->message);
+		return NULL;
+	}
+	return writer->message;
+}
+
+static void push_write(Writer *writer, Value value)
+{
+	if (writer->count == writer->capacity)
+		writer->stack = grow(writer->stack, &writer->capacity,
+				     sizeof(Value));
+	writer->stack[writer->count++] = value;
+}
+
+// Writes a value and every object it reaches. Nothing is allocated from
+// the VM, so the values can't be collected while they're written.
+//
+// Returns:
+//   Whether the value could be sent, `error` says why not otherwise
+static bool write_value(Writer *writer, Value value)
+{
+	Message *message = writer->message;
+	push_write(writer, value);
+
+	while (writer->count > 0) {
+		value = writer->stack[--writer->count];
+
+		if (IS_NIL(value)) {
+			write_byte(message, TAG_NIL);
+		} else if (IS_BOOL(value)) {
+			write_byte(message,
+				   AS_BOOL(value) ? TAG_TRUE : TAG_FALSE);
+		} else if (IS_INT(value)) {
+			write_byte(message, TAG_INT);
+			write_bytes(message, &AS_INT(value), sizeof(int64_t));
+		} else if (IS_NUMBER(value)) {
+			double number = AS_NUMBER(value);
+			write_byte(message, TAG_NUMBER);
+			write_bytes(message, &number, sizeof(number));
+		} else if (IS_STRING(value)) {
+			write_byte(message, TAG_STRING);
+			write_string(message, AS_STRING(value));
+		} else if (IS_CHANNEL(value)) {
+			if (message->channelCount == message->channelCapacity)
+				message->channels = grow(
+					message->channels,
+					&message->channelCapacity,
+					sizeof(Channel *));
+			retain_channel(AS_CHANNEL(value));
+			message->channels[message->channelCount] =
+				AS_CHANNEL(value);
+			write_byte(message, TAG_CHANNEL);
+			write_u32(message, (uint32_t)message->channelCount++);
+		} else if (IS_INSTANCE(value)) {
+			int index = find_seen(writer, AS_OBJ(value));
+			if (index >= 0) {
+				write_byte(message, TAG_SEEN);
+				write_u32(message, (uint32_t)index);
+				continue;
+			}
+
+			ObjInstance *instance = AS_INSTANCE(value);
+			Table *fields = &instance->fields;
+			uint32_t fieldCount = 0;
+			for (int i = 0; i < fields->capacity; i++)
+				if (fields->entries[i].key != NULL)
+					fieldCount++;
+
+			write_byte(message, TAG_INSTANCE);
+			write_string(message, instance->class_->name);
+			write_u32(message, fieldCount);
+			for (int i = 0; i < fields->capacity; i++)
+				if (fields->entries[i].key != NULL)
+					write_string(message,
+						     fields->entries[i].key);
+
+			// Pushed backwards so they're written in name order
+			for (int i = fields->capacity - 1; i >= 0; i--)
+				if (fields->entries[i].key != NULL)
+					push_write(writer,
+						   fields->entries[i].value);
+		} else {
+			writer->error = "Only nil, booleans, numbers, strings, "
+					"instances and channels can be sent "
+					"between isolates.";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Copies a VM's values into a new message.
+//
+// Returns:
+//   The message, or NULL after reporting why a value couldn't be sent
+static Message *write_message(VM *vm, int count, Value *values)
+{
+	Writer writer;
+	init_writer(&writer);
+	for (int i = 0; i < count; i++)
+		if (!write_value(&writer, values[i]))
+			break;
+
+	if (writer.error != NULL)
+		native_error(vm, "%s", writer.error);
+	return finish_writer(&writer);
+}
+
+static void begin_reading(VM *vm, Reader *reader, const Message *message)
+{
+	reader->message = message;
+	reader->offset = 0;
+	reader->base = vm->received.count;
+	reader->frames = NULL;
+	reader->count = 0;
+	reader->capacity = 0;
+	reader->error[0] = '\0';
+}
+
+// Lets the collector have the instances read. Values the caller still
+// needs have to be reachable before it allocates again.
+static void end_reading(VM *vm, Reader *reader)
+{
+	vm->received.count = reader->base;
+	free(reader->frames);
+}
+
+static uint32_t read_u32(Reader *reader)
+{
+	uint32_t value;
+	memcpy(&value, reader->message->bytes + reader->offset, sizeof(value));
+	reader->offset += sizeof(value);
+	return value;
+}
+
+// Reads a string of the message into the VM, which doesn't allocate if the
+// VM has the string already
+static ObjString *read_string(VM *vm, Reader *reader)
+{
+	uint32_t length = read_u32(reader);
+	const char *chars = (const char *)reader->message->bytes +
+			    reader->offset;
+	reader->offset += length;
+	return copy_string(vm, chars, (int)length);
+}
+
+// Creates an instance of the class with the name that comes next, giving
+// it the fields whose names follow with nil values for now.
+//
+// Returns:
+//   The instance, or NULL if the VM has no such class
+static ObjInstance *read_instance(VM *vm, Reader *reader)
+{
+	ObjString *name = read_string(vm, reader);
+	Value klass;
+	if (!table_get_from_table(&vm->globals, name, &klass) ||
+	    !IS_CLASS(klass)) {
+		snprintf(reader->error, sizeof(reader->error),
+			 "Class '%s' of a received instance is not defined.",
+			 name->chars);
+		return NULL;
+	}
+
+	ObjInstance *instance = new_instance(vm, AS_CLASS(klass));
+	push(vm, OBJ_VAL(instance));
+	write_value_array(vm, &vm->received, OBJ_VAL(instance));
+	pop(vm);
+
+	if (reader->count == reader->capacity)
+		reader->frames = grow(reader->frames, &reader->capacity,
+				      sizeof(ReadFrame));
+	ReadFrame *frame = &reader->frames[reader->count++];
+	frame->instance = instance;
+	frame->remaining = (int)read_u32(reader);
+	frame->names = reader->offset;
+
+	for (int i = 0; i < frame->remaining; i++) {
+		push(vm, OBJ_VAL(read_string(vm, reader)));
+		insert_into_table(vm, &instance->fields,
+				  AS_STRING(vm->stackTop[-1]), NIL_VAL);
+		pop(vm);
+	}
+	return instance;
+}
+
+// Reads the next value of a message and every object it reaches into a VM.
+// Instances stay reachable until end_reading(), other objects have to be
+// made reachable by the caller before it allocates.
+//
+// Returns:
+//   Whether the value could be read, `error` says why not otherwise
+static bool read_value(VM *vm, Reader *reader, Value *result)
+{
+	const uint8_t *bytes = reader->message->bytes;
+	int outer = reader->count;
+
+	for (;;) {
+		Value value;
+		bool fields = false;
+
+		switch (bytes[reader->offset++]) {
+		case TAG_NIL:
+			value = NIL_VAL;
+			break;
+		case TAG_TRUE:
+			value = BOOL_VAL(true);
+			break;
+		case TAG_FALSE:
+			value = BOOL_VAL(false);
+			break;
+		case TAG_NUMBER: {
+			double number;
+			memcpy(&number, bytes + reader->offset, sizeof(number));
+			reader->offset += sizeof(number);
+			value = NUMBER_VAL(number);
+			break;
+		}
+		case TAG_INT: {
+			int64_t integer;
+			memcpy(&integer, bytes + reader->offset,
+			       sizeof(integer));
+			reader->offset += sizeof(integer);
+			value = INT_VAL(integer);
+			break;
+		}
+		case TAG_STRING:
+			value = OBJ_VAL(read_string(vm, reader));
+			break;
+		case TAG_CHANNEL: {
+			Channel *channel =
+				reader->message->channels[read_u32(reader)];
+			retain_channel(channel);
+			value = OBJ_VAL(new_channel(vm, channel));
+			break;
+		}
+		case TAG_SEEN:
+			value = vm->received.values[reader->base +
+						    (int)read_u32(reader)];
+			break;
+		case TAG_INSTANCE: {
+			ObjInstance *instance = read_instance(vm, reader);
+			if (instance == NULL) {
+				reader->count = outer;
+				return false;
+			}
+			value = OBJ_VAL(instance);
+			fields = true;
+			break;
+		}
+		default:
+			error_msg_exit("Corrupt message in %s", __FILE__);
+		}
+
+		// The value belongs to the innermost instance below its own
+		// frame, or is the result
+		int owner = reader->count - 1 - (fields ? 1 : 0);
+		if (owner < outer) {
+			*result = value;
+		} else {
+			ReadFrame *frame = &reader->frames[owner];
+			size_t offset = reader->offset;
+			reader->offset = frame->names;
+
+			// The field exists, so nothing is allocated
+			push(vm, value);
+			ObjString *name = read_string(vm, reader);
+			insert_into_table(vm, &frame->instance->fields, name,
+					  value);
+			pop(vm);
+
+			frame->names = reader->offset;
+			reader->offset = offset;
+			frame->remaining--;
+		}
+
+		while (reader->count > outer &&
+		       reader->frames[reader->count - 1].remaining == 0)
+			reader->count--;
+		if (reader->count == outer)
+			return true;
+	}
+}
+
+// Creates a channel with one reference
+static Channel *create_channel(void)
+{
+	Channel *channel = malloc(sizeof(Channel));
+	if (channel == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+
+	pthread_mutex_init(&channel->lock, NULL);
+	pthread_cond_init(&channel->ready, NULL);
+	channel->head = NULL;
+	channel->tail = NULL;
+	channel->closed = false;
+	atomic_init(&channel->references, 1);
+	return channel;
+}
+
+void release_channel(Channel *channel)
+{
+	if (atomic_fetch_sub(&channel->references, 1) != 1)
+		return;
+
+	Message *message = channel->head;
+	while (message != NULL) {
+		Message *next = message->next;
+		free_message(message);
+		message = next;
+	}
+	pthread_cond_destroy(&channel->ready);
+	pthread_mutex_destroy(&channel->lock);
+	free(channel);
+}
+
+void release_isolate(Isolate *isolate)
+{
+	if (atomic_fetch_sub(&isolate->references, 1) != 1)
+		return;
+
+	free(isolate->path);
+	free(isolate->name);
+	free_message(isolate->arguments);
+	free_message(isolate->result);
+	free(isolate);
+}
+
+// Calls the global function of an isolate with its arguments once its file
+// ran, and keeps what it returned
+static void call_isolate(VM *vm, Isolate *isolate)
+{
+	ObjString *name =
+		copy_string(vm, isolate->name, (int)strlen(isolate->name));
+	Value callee;
+	if (!table_get_from_table(&vm->globals, name, &callee)) {
+		fprintf(stderr, "Undefined function '%s' in isolate \"%s\".\n",
+			isolate->name, isolate->path);
+		return;
+	}
+
+	Reader reader;
+	int argCount = 0;
+	bool read = true;
+	push(vm, callee);
+	begin_reading(vm, &reader, isolate->arguments);
+	while (reader.offset < isolate->arguments->length) {
+		Value argument;
+		if (!read_value(vm, &reader, &argument)) {
+			read = false;
+			break;
+		}
+		push(vm, argument);
+		argCount++;
+	}
+	end_reading(vm, &reader);
+
+	if (!read) {
+		fprintf(stderr, "%s\n", reader.error);
+		vm->stackTop -= argCount + 1;
+		return;
+	}
+
+	// The tasks it started finish before its result is sent back
+	Value result;
+	if (call_function(vm, argCount, &result) != INTERPRET_OK)
+		return;
+	push(vm, result);
+	bool tasksRan = run_loop(vm);
+	pop(vm);
+	if (!tasksRan)
+		return;
+
+	Writer writer;
+	init_writer(&writer);
+	if (!write_value(&writer, result))
+		fprintf(stderr, "%s\n", writer.error);
+	isolate->result = finish_writer(&writer);
+}
+
+// Runs an isolate in a VM of its own
+static void run_isolate(Isolate *isolate)
+{
+	VM *vm = malloc(sizeof(VM));
+	if (vm == NULL) {
+		fprintf(stderr, "Not enough memory to run \"%s\".\n",
+			isolate->path);
+		return;
+	}
+	init_vm(vm);
+
+	Source source;
+	if (!load_source(isolate->path, &source)) {
+		fprintf(stderr, "Could not read file \"%s\": %s.\n",
+			isolate->path, strerror(errno));
+	} else {
+		ObjFunction *function =
+			compile_program(vm, source.chars, isolate->path);
+		free_source(&source);
+
+		if (function != NULL &&
+		    interpret_function(vm, function) == INTERPRET_OK)
+			call_isolate(vm, isolate);
+	}
+
+	free_vm(vm);
+	free(vm);
+}
+
+// Runs queued isolates until the pool stops
+static void *pool_thread(void *arg)
+{
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.head == NULL && !pool.stopping) {
+			pool.idle++;
+			pthread_cond_wait(&pool.work, &pool.lock);
+			pool.idle--;
+		}
+		if (pool.head == NULL)
+			break;
+
+		Isolate *isolate = pool.head;
+		pool.head = isolate->next;
+		if (pool.head == NULL)
+			pool.tail = NULL;
+		pool.queued--;
+		pthread_mutex_unlock(&pool.lock);
+
+		run_isolate(isolate);
+
+		pthread_mutex_lock(&pool.lock);
+		isolate->finished = true;
+		pool.running--;
+		pthread_cond_broadcast(&pool.finished);
+		pthread_mutex_unlock(&pool.lock);
+
+		release_isolate(isolate);
+		pthread_mutex_lock(&pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+// Queues an isolate for the pool, starting a thread for it unless an idle
+// one is left over once every queued isolate has one. A woken thread counts
+// as idle until it takes an isolate, so idle threads alone would be counted
+// twice by isolates queued back to back.
+//
+// Returns:
+//   Whether a thread will run it
+static bool queue_isolate(Isolate *isolate)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (pool.idle <= pool.queued) {
+		if (pool.threadCount == pool.threadCapacity)
+			pool.threads = grow(pool.threads, &pool.threadCapacity,
+					    sizeof(pthread_t));
+		if (pthread_create(&pool.threads[pool.threadCount], NULL,
+				   pool_thread, NULL) != 0) {
+			pthread_mutex_unlock(&pool.lock);
+			return false;
+		}
+		pool.threadCount++;
+	}
+
+	isolate->next = NULL;
+	if (pool.tail != NULL)
+		pool.tail->next = isolate;
+	else
+		pool.head = isolate;
+	pool.tail = isolate;
+	pool.queued++;
+	pool.running++;
+	pthread_cond_signal(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	return true;
+}
+
+void wait_isolates(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (pool.running > 0)
+		pthread_cond_wait(&pool.finished, &pool.lock);
+	pool.stopping = true;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (int i = 0; i < pool.threadCount; i++)
+		pthread_join(pool.threads[i], NULL);
+
+	pthread_mutex_lock(&pool.lock);
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.threadCount = 0;
+	pool.threadCapacity = 0;
+	pool.stopping = false;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// Copies a C string
+static char *copy_chars(const char *chars)
+{
+	char *copy = strdup(chars);
+	if (copy == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+	return copy;
+}
+
+// spawn(path, name, args...)
+static Value spawn_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount < 2 || !IS_STRING(args[0]) || !IS_STRING(args[1]))
+		return native_error(vm, "spawn() takes a path, the name of a "
+					"function and its arguments.");
+
+	char *path = resolve_module_path(
+		vm->directory != NULL ? vm->directory : ".",
+		AS_CSTRING(args[0]));
+	if (path == NULL)
+		return native_error(vm, "Could not find isolate file \"%s\".",
+				    AS_CSTRING(args[0]));
+
+	Message *arguments = write_message(vm, argCount - 2, args + 2);
+	if (arguments == NULL) {
+		free(path);
+		return NIL_VAL;
+	}
+
+	Isolate *isolate = malloc(sizeof(Isolate));
+	if (isolate == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+	isolate->path = path;
+	isolate->name = copy_chars(AS_CSTRING(args[1]));
+	isolate->arguments = arguments;
+	isolate->result = NULL;
+	isolate->finished = false;
+	// One reference for the object and one for the thread running it
+	atomic_init(&isolate->references, 2);
+
+	if (!queue_isolate(isolate)) {
+		atomic_store(&isolate->references, 1);
+		release_isolate(isolate);
+		return native_error(vm, "Could not start a thread.");
+	}
+	return OBJ_VAL(new_isolate(vm, isolate));
+}
+
+// join(isolate)
+static Value join_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_ISOLATE(args[0]))
+		return native_error(vm, "join() takes an isolate.");
+
+	Isolate *isolate = AS_ISOLATE(args[0]);
+	pthread_mutex_lock(&pool.lock);
+	while (!isolate->finished)
+		pthread_cond_wait(&pool.finished, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	// An isolate that failed reported why on its own thread
+	if (isolate->result == NULL)
+		return NIL_VAL;
+
+	Reader reader;
+	Value result = NIL_VAL;
+	begin_reading(vm, &reader, isolate->result);
+	bool read = read_value(vm, &reader, &result);
+	end_reading(vm, &reader);
+	if (!read)
+		return native_error(vm, "%s", reader.error);
+	return result;
+}
+
+// channel()
+static Value channel_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 0)
+		return native_error(vm, "channel() takes no arguments.");
+	return OBJ_VAL(new_channel(vm, create_channel()));
+}
+
+// send(channel, value)
+static Value send_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 2 || !IS_CHANNEL(args[0]))
+		return native_error(vm, "send() takes a channel and a value.");
+
+	Message *message = write_message(vm, 1, args + 1);
+	if (message == NULL)
+		return NIL_VAL;
+
+	Channel *channel = AS_CHANNEL(args[0]);
+	pthread_mutex_lock(&channel->lock);
+	if (channel->closed) {
+		pthread_mutex_unlock(&channel->lock);
+		free_message(message);
+		return native_error(vm, "Can't send on a closed channel.");
+	}
+
+	message->next = NULL;
+	if (channel->tail != NULL)
+		channel->tail->next = message;
+	else
+		channel->head = message;
+	channel->tail = message;
+	pthread_cond_signal(&channel->ready);
+	pthread_mutex_unlock(&channel->lock);
+	return NIL_VAL;
+}
+
+// receive(channel)
+static Value receive_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_CHANNEL(args[0]))
+		return native_error(vm, "receive() takes a channel.");
+
+	Channel *channel = AS_CHANNEL(args[0]);
+	pthread_mutex_lock(&channel->lock);
+	while (channel->head == NULL && !channel->closed)
+		pthread_cond_wait(&channel->ready, &channel->lock);
+
+	Message *message = channel->head;
+	if (message != NULL) {
+		channel->head = message->next;
+		if (channel->head == NULL)
+			channel->tail = NULL;
+	}
+	pthread_mutex_unlock(&channel->lock);
+
+	// Closed and drained
+	if (message == NULL)
+		return NIL_VAL;
+
+	Reader reader;
+	Value result = NIL_VAL;
+	begin_reading(vm, &reader, message);
+	bool read = read_value(vm, &reader, &result);
+	end_reading(vm, &reader);
+	free_message(message);
+	if (!read)
+		return native_error(vm, "%s", reader.error);
+	return result;
+}
+
+// close(channel), or close(fd) for a descriptor of the event loop
+static Value close_native(VM *vm, int argCount, Value *args, void *data)
+{
+	// Descriptors of the event loop are closed with the same native
+	if (argCount == 1 && IS_NUMBER(args[0])) {
+		int fd = (int)AS_NUMBER(args[0]);
+		if (!close_descriptor(vm, fd))
+			return native_error(vm,
+					    "Could not close descriptor %d: %s.",
+					    fd, strerror(errno));
+		return NIL_VAL;
+	}
+	if (argCount != 1 || !IS_CHANNEL(args[0]))
+		return native_error(vm,
+				    "close() takes a channel or a descriptor.");
+
+	Channel *channel = AS_CHANNEL(args[0]);
+	pthread_mutex_lock(&channel->lock);
+	channel->closed = true;
+	pthread_cond_broadcast(&channel->ready);
+	pthread_mutex_unlock(&channel->lock);
+	return NIL_VAL;
+}
+
+// processors()
+static Value processors_native(VM *vm, int argCount, Value *args, void *data)
+{
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	return NUMBER_VAL(processors > 0 ? (double)processors : 1.0);
+}
+
+void define_isolate_natives(VM *vm)
+{
+	define_native(vm, "spawn", spawn_native, NULL, 0);
+	define_native(vm, "join", join_native, NULL, 0);
+	define_native(vm, "channel", channel_native, NULL, 0);
+	define_native(vm, "send", send_native, NULL, 0);
+	define_native(vm, "receive", receive_native, NULL, 0);
+	define_native(vm, "close", close_native, NULL, 0);
+	define_native(vm, "processors", processors_native, NULL, 0);
+}
@@ -0,0 +1,51 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains isolates, VMs that run a file on a thread of a shared
+// pool, and the channels they talk over. Isolates share no objects: a value
+// sent over a channel, passed to an isolate or returned by one is copied
+// into a message outside of every heap and rebuilt in the receiving VM.
+// Only channels themselves are shared, by reference counting.
+//
+// Scripts use them through these natives:
+//   spawn(path, name, args...) - run the file at `path`, relative to the
+//                                program's, in a new isolate, then call
+//                                its global `name` with `args`
+//   join(isolate) - wait for an isolate and return what its call returned
+//   channel() - create a channel
+//   send(channel, value) - queue a copy of a value, never blocks
+//   receive(channel) - take the oldest value, waiting for one if there is
+//                      none, or nil once the channel is closed and empty
+//   close(channel) - let receivers know that nothing more will be sent;
+//                    a descriptor of the event loop is closed instead
+//   processors() - number of processors isolates can run on
+
+#ifndef xanadu_isolate_h
+#define xanadu_isolate_h
+
+#include "common.h"
+#include "value.h"
+
+// A queue of messages that any number of threads send to and receive from
+typedef struct Channel Channel;
+
+// A file running in a VM of its own on a thread of the pool
+typedef struct Isolate Isolate;
+
+// Defines the natives of isolates and channels in a VM.
+void define_isolate_natives(VM *vm);
+
+// Drops a reference to a channel, freeing it and the messages it still
+// holds with the last one.
+void release_channel(Channel *channel);
+
+// Drops a reference to an isolate. An isolate that is still running keeps
+// a reference of its own until it finishes.
+void release_isolate(Isolate *isolate);
+
+// Waits until every isolate spawned so far, and every isolate they spawn,
+// has finished, and stops the threads of the pool.
+void wait_isolates(void);
+
+#endif
@@ -21,27 +21,28 @@ void init_table(Table *table)
 }
 
 // Free's used memory and resets table to initiale state
-void free_table(Table *table)
+void free_table(VM *vm, Table *table)
 {
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(vm, Entry, table->entries, table->capacity);
 	init_table(table);
 }
 
 // Copy contents of one table into another
-void table_add_all(Table *from, Table *to)
+void table_add_all(VM *vm, Table *from, Table *to)
 {
 	for (int i = 0; i < from->capacity; ++i) {
 		Entry *entry = &from->entries[i];
 		if (entry->key != NULL) {
-			insert_into_table(to, entry->key, entry->value);
+			insert_into_table(vm, to, entry->key, entry->value);
 		}
 	}
 }
 
-// Find table entry
+// Find table entry. Capacities are powers of two, so the index of a hash
+// is masked rather than divided.
 static Entry *find_entry(Entry *entries, int capacity, ObjString *key)
 {
-	uint32_t index = key->hash % capacity;
+	uint32_t index = key->hash & (capacity - 1);
 	Entry *tombstone = NULL;
 
 	for (;;) {
@@ -60,7 +61,7 @@ static Entry *find_entry(Entry *entries, int capacity, ObjString *key)
 			return entry;
 		}
 
-		index = (index + 1) % capacity;
+		index = (index + 1) & (capacity - 1);
 	}
 }
 
@@ -101,10 +102,10 @@ bool delete_from_table(Table *table, ObjString *key)
 }
 
 // Update tables capacity
-static void adjust_capacity(Table *table, int capacity)
+static void adjust_capacity(VM *vm, Table *table, int capacity)
 {
 	// Allocate memory of old table
-	Entry *entries = ALLOCATE(Entry, capacity);
+	Entry *entries = ALLOCATE(vm, Entry, capacity);
 	for (int i = 0; i < capacity; ++i) {
 		entries[i].key = NULL;
 		entries[i].value = NIL_VAL;
@@ -122,10 +123,11 @@ static void adjust_capacity(Table *table, int capacity)
 		Entry *dest = find_entry(entries, capacity, entry->key);
 		dest->key = entry->key;
 		dest->value = entry->value;
+		table->count++;
 	}
 
 	// Free memory of old table
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(vm, Entry, table->entries, table->capacity);
 
 	table->entries = entries;
 	table->capacity = capacity;
@@ -138,7 +140,7 @@ ObjString *table_find_string(Table *table, const char *chars, int length,
 	if (table->count == 0)
 		return NULL;
 
-	uint32_t index = hash % table->capacity;
+	uint32_t index = hash & (table->capacity - 1);
 	for (;;) {
 		Entry *entry = &table->entries[index];
 		if (entry->key == NULL) {
@@ -152,18 +154,18 @@ ObjString *table_find_string(Table *table, const char *chars, int length,
 			return entry->key;
 		}
 
-		index = (index + 1) % table->capacity;
+		index = (index + 1) & (table->capacity - 1);
 	}
 }
 
 // Add object into loopup table
-bool insert_into_table(Table *table, ObjString *key, Value value)
+bool insert_into_table(VM *vm, Table *table, ObjString *key, Value value)
 {
 	// Check if array fits new array
 	// grow array if not
 	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
 		int capacity = GROW_CAPACITY(table->capacity);
-		adjust_capacity(table, capacity);
+		adjust_capacity(vm, table, capacity);
 	}
 
 	// Insert entry
@@ -186,3 +188,179 @@ void table_remove_white(Table *table)
 		}
 	}
 }
+
+// Initialise a table keyed by values
+void init_value_table(ValueTable *table)
+{
+	table->count = 0;
+	table->size = 0;
+	table->capacity = 0;
+	table->entries = NULL;
+}
+
+// Free's used memory and resets table to initiale state
+void free_value_table(VM *vm, ValueTable *table)
+{
+	FREE_ARRAY(vm, ValueEntry, table->entries, table->capacity);
+	init_value_table(table);
+}
+
+// Mix the bits of a number or pointer into a hash
+static uint32_t hash_bits(uint64_t bits)
+{
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdULL;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+// Hash a key so that keys that are == hash the same
+static uint32_t hash_value(Value key)
+{
+	switch (key.type) {
+	case VAL_BOOL:
+		return AS_BOOL(key) ? 1 : 2;
+	case VAL_NUMBER:
+	case VAL_INT: {
+		// 0 and -0 are equal keys, and integers hash like the double
+		// with their value
+		double number = AS_NUMBER(key) == 0 ? 0 : AS_NUMBER(key);
+		uint64_t bits;
+		memcpy(&bits, &number, sizeof(bits));
+		return hash_bits(bits);
+	}
+	case VAL_OBJ:
+		// Strings are interned, so equal strings are the same object
+		if (IS_STRING(key))
+			return AS_STRING(key)->hash;
+		return hash_bits((uintptr_t)AS_OBJ(key));
+	default:
+		return 0;
+	}
+}
+
+// Compare keys the way values_equal() does, without the call
+static inline bool keys_equal(Value a, Value b)
+{
+	if (a.type != b.type)
+		return IS_NUMBER(a) && IS_NUMBER(b) && values_equal(a, b);
+	switch (a.type) {
+	case VAL_BOOL:
+		return AS_BOOL(a) == AS_BOOL(b);
+	case VAL_NUMBER:
+		return AS_NUMBER(a) == AS_NUMBER(b);
+	case VAL_INT:
+		return AS_INT(a) == AS_INT(b);
+	case VAL_OBJ:
+		return AS_OBJ(a) == AS_OBJ(b);
+	default:
+		return true;
+	}
+}
+
+// Find the entry of a key, or the entry it would be inserted in
+static ValueEntry *find_value_entry(ValueEntry *entries, int capacity,
+				    Value key)
+{
+	uint32_t index = hash_value(key) & (capacity - 1);
+	ValueEntry *tombstone = NULL;
+
+	for (;;) {
+		ValueEntry *entry = &entries[index];
+		if (IS_NIL(entry->key)) {
+			if (IS_NIL(entry->value))
+				return tombstone != NULL ? tombstone : entry;
+			if (tombstone == NULL)
+				tombstone = entry;
+		} else if (keys_equal(entry->key, key)) {
+			return entry;
+		}
+
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+// Update the capacity of a table keyed by values, dropping its tombstones
+static void adjust_value_capacity(VM *vm, ValueTable *table, int capacity)
+{
+	ValueEntry *entries = ALLOCATE(vm, ValueEntry, capacity);
+	for (int i = 0; i < capacity; ++i) {
+		entries[i].key = NIL_VAL;
+		entries[i].value = NIL_VAL;
+	}
+
+	table->count = 0;
+	for (int i = 0; i < table->capacity; ++i) {
+		ValueEntry *entry = &table->entries[i];
+		if (IS_NIL(entry->key))
+			continue;
+
+		ValueEntry *dest = find_value_entry(entries, capacity,
+						    entry->key);
+		*dest = *entry;
+		table->count++;
+	}
+
+	FREE_ARRAY(vm, ValueEntry, table->entries, table->capacity);
+	table->entries = entries;
+	table->capacity = capacity;
+}
+
+// Add or replace the value of a key
+bool insert_into_value_table(VM *vm, ValueTable *table, Value key,
+			     Value value)
+{
+	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+		// Only grow if the tombstones aren't what fills the table
+		int capacity = table->size + 1 > table->capacity / 2 ?
+				       GROW_CAPACITY(table->capacity) :
+				       table->capacity;
+		adjust_value_capacity(vm, table, capacity);
+	}
+
+	ValueEntry *entry =
+		find_value_entry(table->entries, table->capacity, key);
+	bool isNewKey = IS_NIL(entry->key);
+	if (isNewKey) {
+		if (IS_NIL(entry->value))
+			table->count++;
+		table->size++;
+	}
+
+	entry->key = key;
+	entry->value = value;
+	return isNewKey;
+}
+
+// Get the value of a key
+bool value_table_get(ValueTable *table, Value key, Value *value)
+{
+	if (table->size == 0)
+		return false;
+
+	ValueEntry *entry =
+		find_value_entry(table->entries, table->capacity, key);
+	if (IS_NIL(entry->key))
+		return false;
+
+	*value = entry->value;
+	return true;
+}
+
+// Delete a key and its value
+bool delete_from_value_table(ValueTable *table, Value key)
+{
+	if (table->size == 0)
+		return false;
+
+	ValueEntry *entry =
+		find_value_entry(table->entries, table->capacity, key);
+	if (IS_NIL(entry->key))
+		return false;
+
+	// Place a tombstone in the entry.
+	entry->key = NIL_VAL;
+	entry->value = BOOL_VAL(true);
+	table->size--;
+	return true;
+}
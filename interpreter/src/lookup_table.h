@@ -24,11 +24,11 @@ typedef struct {
 // Initialise look up table
 void init_table(Table *table);
 // Free's used memory and resets table to initiale state
-void free_table(Table *table);
+void free_table(VM *vm, Table *table);
 // Add object into loopup table
-bool insert_into_table(Table *table, ObjString *key, Value value);
+bool insert_into_table(VM *vm, Table *table, ObjString *key, Value value);
 // Copy contents of one table into another
-void table_add_all(Table *from, Table *to);
+void table_add_all(VM *vm, Table *from, Table *to);
 // Get value from table
 bool table_get_from_table(Table *table, ObjString *key, Value *value);
 // Delete value from table
@@ -38,4 +38,30 @@ ObjString *table_find_string(Table *table, const char *chars, int length,
 			     uint32_t hash);
 void table_remove_white(Table *table);
 
+// Entry of a table keyed by values
+typedef struct {
+	Value key; // Entry key, nil if the entry is free
+	Value value; // Entry value, true in a tombstone
+} ValueEntry;
+
+// Table keyed by any value but nil, which compares keys the way == does
+typedef struct {
+	int count; // Entries in use, tombstones included
+	int size; // Keys in the table
+	int capacity; // Capacity count, a power of two
+	ValueEntry *entries; // Array of entries
+} ValueTable;
+
+// Initialise a table keyed by values
+void init_value_table(ValueTable *table);
+// Free's used memory and resets table to initiale state
+void free_value_table(VM *vm, ValueTable *table);
+// Add or replace the value of a key
+bool insert_into_value_table(VM *vm, ValueTable *table, Value key,
+			     Value value);
+// Get the value of a key
+bool value_table_get(ValueTable *table, Value key, Value *value);
+// Delete a key and its value
+bool delete_from_value_table(ValueTable *table, Value key);
+
 #endif
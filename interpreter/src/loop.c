@@ -0,0 +1,816 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the implementation of the event loop. Every task and
+// every native waiting outside of a task is a waiter, registered with epoll
+// for the descriptor it waits on or kept in a heap of timers. A turn of the
+// loop resumes the tasks in the run queue, then waits for the earliest
+// event and queues the tasks it wakes. A task that has to wait leaves its
+// native call on its stack and yields, and the call is made again when the
+// loop resumes it, so natives never keep state across the suspension
+// besides the progress of a write.
+
+// pipe2() is a GNU extension
+#define _GNU_SOURCE
+
+#include "loop.h"
+
+#include "vm.h"
+#include "memory.h"
+#include "object.h"
+#include "lookup_table.h"
+#include "error.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Events a turn of the loop takes from epoll at most
+#define EVENTS_MAX 64
+
+// Bytes a single read returns at most
+#define READ_MAX (1 << 24)
+
+// A task, or a native outside of any task, waiting for a descriptor or a
+// timer
+typedef struct Waiter {
+	ObjFiber *fiber; // The task's fiber, NULL for a native outside of one
+	int fd; // Descriptor waited on, -1 if none
+	uint32_t events; // EPOLLIN or EPOLLOUT
+	double deadline; // Time the timer fires at
+	int timer; // Index in the heap of timers, -1 if not in it
+	bool ready; // Whether the descriptor or timer woke it
+	bool started; // Whether the task was resumed before
+	bool queued; // Whether the task is in the run queue
+	size_t written; // Bytes of the task's write done so far
+	struct Waiter *next; // Next task in the run queue
+	struct Waiter *prevTask; // Previous task in the list of tasks
+	struct Waiter *nextTask; // Next task in the list of tasks
+} Waiter;
+
+// What waits on a descriptor, at most one waiter in each direction
+typedef struct {
+	Waiter *reader; // Waiting to read, or NULL
+	Waiter *writer; // Waiting to write, or NULL
+	bool registered; // Whether epoll watches the descriptor
+	bool nonBlocking; // Whether the loop opened it without blocking
+} Watch;
+
+struct Loop {
+	int epoll; // The epoll instance
+	Waiter *running; // Task the loop is resuming, NULL if there is none
+	Waiter *head; // First task of the run queue
+	Waiter *tail; // Last task of the run queue
+	int queued; // Number of tasks in the run queue
+	Waiter *tasks; // Every task that hasn't finished
+	int taskCount; // Number of them
+	Waiter **timers; // Heap of timers, the earliest first
+	int timerCount; // Number of timers
+	int timerCapacity; // Capacity of the heap
+	Watch *watches; // Watch of each descriptor, by number
+	int watchCapacity; // Number of watches
+	int watching; // Waiters registered with epoll
+	ObjClass *pipeClass; // Class of what pipe() returns, NULL until then
+	ObjClass *socketPairClass; // Class of what socketpair() returns
+};
+
+static void wake(Loop *loop, Waiter *waiter);
+
+// Returns the monotonic time in seconds
+static double now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// Returns the loop of a VM, creating it on first use, or NULL if epoll
+// can't be set up
+static Loop *get_loop(VM *vm)
+{
+	if (vm->loop != NULL)
+		return vm->loop;
+
+	int epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll < 0)
+		return NULL;
+
+	Loop *loop = calloc(1, sizeof(Loop));
+	if (loop == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+	loop->epoll = epoll;
+	vm->loop = loop;
+	return loop;
+}
+
+static void init_waiter(Waiter *waiter, ObjFiber *fiber)
+{
+	memset(waiter, 0, sizeof(Waiter));
+	waiter->fiber = fiber;
+	waiter->fd = -1;
+	waiter->timer = -1;
+}
+
+// Returns the watch of a descriptor, growing the array to hold it
+static Watch *get_watch(Loop *loop, int fd)
+{
+	if (fd >= loop->watchCapacity) {
+		int capacity = loop->watchCapacity < 64 ? 64 :
+							  loop->watchCapacity;
+		while (capacity <= fd)
+			capacity *= 2;
+
+		Watch *watches = realloc(loop->watches,
+					 sizeof(Watch) * (size_t)capacity);
+		if (watches == NULL)
+			error_msg_exit("Failed to allocate memory in %s",
+				       __FILE__);
+		memset(watches + loop->watchCapacity, 0,
+		       sizeof(Watch) *
+			       (size_t)(capacity - loop->watchCapacity));
+		loop->watches = watches;
+		loop->watchCapacity = capacity;
+	}
+	return &loop->watches[fd];
+}
+
+// Registers a waiter for a descriptor becoming ready to read or write.
+// Descriptors stay registered for both, edge-triggered, from their first
+// wait until they're closed, so waits cost no calls to epoll_ctl() and
+// the edges of descriptors nobody waits on are dropped. A waiter only
+// waits after an operation found the descriptor not ready, so the edge
+// that wakes it is still to come.
+static bool watch_descriptor(Loop *loop, Waiter *waiter, int fd,
+			     uint32_t events)
+{
+	Watch *watch = get_watch(loop, fd);
+	Waiter **slot = events == EPOLLIN ? &watch->reader : &watch->writer;
+	if (*slot != NULL) {
+		errno = EBUSY;
+		return false;
+	}
+
+	if (!watch->registered) {
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = fd;
+		if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+			return false;
+		watch->registered = true;
+	}
+
+	*slot = waiter;
+	waiter->fd = fd;
+	waiter->events = events;
+	loop->watching++;
+	return true;
+}
+
+static void unwatch_descriptor(Loop *loop, Waiter *waiter)
+{
+	if (waiter->fd < 0)
+		return;
+
+	Watch *watch = &loop->watches[waiter->fd];
+	if (waiter->events == EPOLLIN)
+		watch->reader = NULL;
+	else
+		watch->writer = NULL;
+	waiter->fd = -1;
+	loop->watching--;
+}
+
+// Forgets what the loop knew about a descriptor number, which was closed
+// or is new
+static void reset_watch(Loop *loop, int fd, bool nonBlocking)
+{
+	Watch *watch = get_watch(loop, fd);
+	if (watch->reader != NULL)
+		wake(loop, watch->reader);
+	if (watch->writer != NULL)
+		wake(loop, watch->writer);
+	watch->registered = false;
+	watch->nonBlocking = nonBlocking;
+}
+
+static void swap_timers(Loop *loop, int a, int b)
+{
+	Waiter *waiter = loop->timers[a];
+	loop->timers[a] = loop->timers[b];
+	loop->timers[b] = waiter;
+	loop->timers[a]->timer = a;
+	loop->timers[b]->timer = b;
+}
+
+// Moves a timer of the heap up or down to where its deadline belongs
+static void sift_timer(Loop *loop, int index)
+{
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (loop->timers[parent]->deadline <=
+		    loop->timers[index]->deadline)
+			break;
+		swap_timers(loop, parent, index);
+		index = parent;
+	}
+
+	for (;;) {
+		int child = index * 2 + 1;
+		if (child >= loop->timerCount)
+			break;
+		if (child + 1 < loop->timerCount &&
+		    loop->timers[child + 1]->deadline <
+			    loop->timers[child]->deadline)
+			child++;
+		if (loop->timers[index]->deadline <=
+		    loop->timers[child]->deadline)
+			break;
+		swap_timers(loop, index, child);
+		index = child;
+	}
+}
+
+static void add_timer(Loop *loop, Waiter *waiter, double deadline)
+{
+	if (loop->timerCount == loop->timerCapacity) {
+		loop->timerCapacity =
+			loop->timerCapacity < 8 ? 8 : loop->timerCapacity * 2;
+		loop->timers = realloc(loop->timers,
+				       sizeof(Waiter *) *
+					       (size_t)loop->timerCapacity);
+		if (loop->timers == NULL)
+			error_msg_exit("Failed to allocate memory in %s",
+				       __FILE__);
+	}
+
+	waiter->deadline = deadline;
+	waiter->timer = loop->timerCount;
+	loop->timers[loop->timerCount++] = waiter;
+	sift_timer(loop, waiter->timer);
+}
+
+static void remove_timer(Loop *loop, Waiter *waiter)
+{
+	int index = waiter->timer;
+	if (index < 0)
+		return;
+
+	waiter->timer = -1;
+	loop->timerCount--;
+	if (index == loop->timerCount)
+		return;
+	loop->timers[index] = loop->timers[loop->timerCount];
+	loop->timers[index]->timer = index;
+	sift_timer(loop, index);
+}
+
+// Appends a task to the run queue
+static void queue_task(Loop *loop, Waiter *waiter)
+{
+	if (waiter->queued)
+		return;
+
+	waiter->queued = true;
+	waiter->next = NULL;
+	if (loop->tail != NULL)
+		loop->tail->next = waiter;
+	else
+		loop->head = waiter;
+	loop->tail = waiter;
+	loop->queued++;
+}
+
+// Ends the wait of a waiter, queueing it if it's a task
+static void wake(Loop *loop, Waiter *waiter)
+{
+	unwatch_descriptor(loop, waiter);
+	remove_timer(loop, waiter);
+	waiter->ready = true;
+	if (waiter->fiber != NULL)
+		queue_task(loop, waiter);
+}
+
+// Forgets a task whose fiber is done
+static void finish_task(Loop *loop, Waiter *waiter)
+{
+	unwatch_descriptor(loop, waiter);
+	remove_timer(loop, waiter);
+	if (waiter->prevTask != NULL)
+		waiter->prevTask->nextTask = waiter->nextTask;
+	else
+		loop->tasks = waiter->nextTask;
+	if (waiter->nextTask != NULL)
+		waiter->nextTask->prevTask = waiter->prevTask;
+	loop->taskCount--;
+	free(waiter);
+}
+
+// Resumes a task until it waits, yields or finishes. A task that yields
+// without waiting runs again on the next turn.
+// Returns:
+//   Whether it didn't fail
+static bool resume_task(VM *vm, Loop *loop, Waiter *waiter)
+{
+	ObjFiber *fiber = waiter->fiber;
+	fiber->state = waiter->started ? FIBER_SUSPENDED : FIBER_NEW;
+	waiter->started = true;
+
+	Waiter *outer = loop->running;
+	loop->running = waiter;
+	push(vm, OBJ_VAL(fiber));
+	Value result;
+	InterpretResult status = call_function(vm, 0, &result);
+	loop->running = outer;
+
+	if (fiber->state == FIBER_DONE) {
+		finish_task(loop, waiter);
+		return status == INTERPRET_OK;
+	}
+
+	fiber->state = FIBER_WAITING;
+	if (waiter->fd < 0 && waiter->timer < 0)
+		queue_task(loop, waiter);
+	return true;
+}
+
+// Runs a turn of the loop: resumes the tasks queued before it started, then
+// waits for descriptors and timers unless a task can run already, and
+// wakes the waiters that are ready.
+// Returns:
+//   Whether no task failed
+static bool turn(VM *vm, Loop *loop)
+{
+	for (int count = loop->queued; count > 0 && loop->head != NULL;
+	     count--) {
+		Waiter *waiter = loop->head;
+		loop->head = waiter->next;
+		if (loop->head == NULL)
+			loop->tail = NULL;
+		waiter->queued = false;
+		loop->queued--;
+		if (!resume_task(vm, loop, waiter))
+			return false;
+	}
+
+	int timeout = -1;
+	if (loop->head != NULL) {
+		timeout = 0;
+	} else if (loop->timerCount > 0) {
+		double wait = loop->timers[0]->deadline - now();
+		timeout = wait <= 0 ? 0 : (int)(wait * 1000) + 1;
+	} else if (loop->watching == 0) {
+		return true; // Nothing can wake anything
+	}
+
+	struct epoll_event events[EVENTS_MAX];
+	int count = epoll_wait(loop->epoll, events, EVENTS_MAX, timeout);
+	for (int i = 0; i < count; i++) {
+		Watch *watch = &loop->watches[events[i].data.fd];
+		uint32_t ready = events[i].events;
+		// Errors and hang-ups are reported by the read or write
+		if (ready & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+			ready |= EPOLLIN | EPOLLOUT;
+		if (watch->reader != NULL && (ready & EPOLLIN))
+			wake(loop, watch->reader);
+		if (watch->writer != NULL && (ready & EPOLLOUT))
+			wake(loop, watch->writer);
+	}
+
+	double time = now();
+	while (loop->timerCount > 0 && loop->timers[0]->deadline <= time)
+		wake(loop, loop->timers[0]);
+	return true;
+}
+
+// Runs the event loop until every task has finished
+bool run_loop(VM *vm)
+{
+	Loop *loop = vm->loop;
+	while (loop != NULL && loop->taskCount > 0) {
+		if (!turn(vm, loop))
+			return false;
+	}
+	return true;
+}
+
+// Returns the task the running native was called from, or NULL if it
+// can't be suspended by the loop
+static Waiter *current_task(VM *vm, Loop *loop)
+{
+	Waiter *task = loop->running;
+	if (task == NULL || task->fiber != vm->fiber || !can_yield(vm))
+		return NULL;
+	return task;
+}
+
+// Outcome of waiting from a native
+typedef enum {
+	WAIT_READY, // What it waited for is ready
+	WAIT_SUSPEND, // The native's task waits, the native returns
+		      // native_wait() and is called again once it's ready
+	WAIT_FAILED, // The native failed and returns the error's value
+} WaitResult;
+
+// Waits from a native for a descriptor to be ready, or until a deadline if
+// `fd` is negative. A task is suspended; anywhere else the loop runs until
+// the wait is over.
+static WaitResult wait_for(VM *vm, Loop *loop, int fd, uint32_t events,
+			   double deadline)
+{
+	Waiter *task = current_task(vm, loop);
+	Waiter local;
+	Waiter *waiter = task != NULL ? task : &local;
+	if (task == NULL)
+		init_waiter(&local, NULL);
+
+	waiter->ready = false;
+	if (fd < 0) {
+		add_timer(loop, waiter, deadline);
+	} else if (!watch_descriptor(loop, waiter, fd, events)) {
+		if (errno == EBUSY)
+			native_error(vm, "Descriptor %d is waited on already.",
+				     fd);
+		else
+			native_error(vm, "Could not wait for descriptor %d: %s.",
+				     fd, strerror(errno));
+		return WAIT_FAILED;
+	}
+	if (task != NULL)
+		return WAIT_SUSPEND;
+
+	while (!local.ready) {
+		if (!turn(vm, loop)) {
+			unwatch_descriptor(loop, &local);
+			remove_timer(loop, &local);
+			native_error(vm, "A task failed.");
+			return WAIT_FAILED;
+		}
+	}
+	return WAIT_READY;
+}
+
+// Checks if an operation on a descriptor would block. Those the loop
+// opened never do, others may be blocking and are polled first.
+static bool would_block(Loop *loop, int fd, short events)
+{
+	if (fd < loop->watchCapacity && loop->watches[fd].nonBlocking)
+		return false;
+
+	struct pollfd poller = { .fd = fd, .events = events };
+	if (poll(&poller, 1, 0) == 0) {
+		errno = EAGAIN;
+		return true;
+	}
+	return false;
+}
+
+// Checks if a value is a descriptor number
+static bool is_descriptor(Value value)
+{
+	return IS_NUMBER(value) && AS_NUMBER(value) >= 0 &&
+	       AS_NUMBER(value) <= INT_MAX &&
+	       AS_NUMBER(value) == (int)AS_NUMBER(value);
+}
+
+// Returns the loop for a native, or NULL after reporting why there is none
+static Loop *native_loop(VM *vm)
+{
+	Loop *loop = get_loop(vm);
+	if (loop == NULL)
+		native_error(vm, "Could not create the event loop: %s.",
+			     strerror(errno));
+	return loop;
+}
+
+// task(function)
+static Value task_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_CLOSURE(args[0]) ||
+	    AS_CLOSURE(args[0])->function->arity != 0)
+		return native_error(
+			vm, "task() takes a function without parameters.");
+
+	Loop *loop = native_loop(vm);
+	if (loop == NULL)
+		return NIL_VAL;
+
+	ObjFiber *fiber = new_fiber(vm, AS_CLOSURE(args[0]));
+	fiber->state = FIBER_WAITING;
+
+	Waiter *waiter = malloc(sizeof(Waiter));
+	if (waiter == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+	init_waiter(waiter, fiber);
+	waiter->nextTask = loop->tasks;
+	if (loop->tasks != NULL)
+		loop->tasks->prevTask = waiter;
+	loop->tasks = waiter;
+	loop->taskCount++;
+	queue_task(loop, waiter);
+	return OBJ_VAL(fiber);
+}
+
+// run_tasks()
+static Value run_tasks_native(VM *vm, int argCount, Value *args,
+			      void *data)
+{
+	if (argCount != 0)
+		return native_error(vm, "run_tasks() takes no arguments.");
+	if (vm->loop != NULL && vm->loop->running != NULL)
+		return native_error(vm, "Can't run the tasks from a task.");
+	if (!run_loop(vm))
+		return native_error(vm, "A task failed.");
+	return NIL_VAL;
+}
+
+// read(fd, count)
+static Value read_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 2 || !is_descriptor(args[0]) || !IS_NUMBER(args[1]) ||
+	    AS_NUMBER(args[1]) < 1)
+		return native_error(vm, "read() takes a descriptor and a "
+					"number of bytes.");
+
+	Loop *loop = native_loop(vm);
+	if (loop == NULL)
+		return NIL_VAL;
+
+	int fd = (int)AS_NUMBER(args[0]);
+	size_t count = AS_NUMBER(args[1]) < READ_MAX ?
+			       (size_t)AS_NUMBER(args[1]) :
+			       READ_MAX;
+	// Only a timer's wake-up is kept for the next call
+	Waiter *task = current_task(vm, loop);
+	if (task != NULL)
+		task->ready = false;
+
+	char *buffer = malloc(count);
+	if (buffer == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+
+	for (;;) {
+		ssize_t length = would_block(loop, fd, POLLIN) ?
+					 -1 :
+					 read(fd, buffer, count);
+		if (length >= 0) {
+			Value result = NIL_VAL;
+			if (length > 0)
+				result = OBJ_VAL(copy_string(vm, buffer,
+							     (int)length));
+			free(buffer);
+			return result;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			free(buffer);
+			return native_error(
+				vm, "Could not read from descriptor %d: %s.",
+				fd, strerror(errno));
+		}
+
+		WaitResult wait = wait_for(vm, loop, fd, EPOLLIN, 0);
+		if (wait != WAIT_READY) {
+			free(buffer);
+			return wait == WAIT_SUSPEND ? native_wait(vm) : NIL_VAL;
+		}
+	}
+}
+
+// write(fd, string)
+static Value write_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 2 || !is_descriptor(args[0]) || !IS_STRING(args[1]))
+		return native_error(
+			vm, "write() takes a descriptor and a string.");
+
+	Loop *loop = native_loop(vm);
+	if (loop == NULL)
+		return NIL_VAL;
+
+	int fd = (int)AS_NUMBER(args[0]);
+	ObjString *string = AS_STRING(args[1]);
+	// A task's write goes on where it stopped when it's made again
+	Waiter *task = current_task(vm, loop);
+	size_t done = 0;
+	if (task != NULL)
+		task->ready = false;
+	size_t *written = task != NULL ? &task->written : &done;
+
+	while (*written < (size_t)string->length) {
+		size_t count = (size_t)string->length - *written;
+		// Blocking pipes take this much at once when they're writable
+		if (count > PIPE_BUF && (fd >= loop->watchCapacity ||
+					 !loop->watches[fd].nonBlocking))
+			count = PIPE_BUF;
+
+		ssize_t length = would_block(loop, fd, POLLOUT) ?
+					 -1 :
+					 write(fd, string->chars + *written,
+					       count);
+		if (length >= 0) {
+			*written += (size_t)length;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			*written = 0;
+			return native_error(
+				vm, "Could not write to descriptor %d: %s.",
+				fd, strerror(errno));
+		}
+
+		WaitResult wait = wait_for(vm, loop, fd, EPOLLOUT, 0);
+		if (wait == WAIT_SUSPEND)
+			return native_wait(vm);
+		if (wait == WAIT_FAILED) {
+			*written = 0;
+			return NIL_VAL;
+		}
+	}
+
+	*written = 0;
+	return NUMBER_VAL(string->length);
+}
+
+// sleep(seconds)
+static Value sleep_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_NUMBER(args[0]) || !(AS_NUMBER(args[0]) >= 0))
+		return native_error(vm, "sleep() takes a number of seconds.");
+
+	Loop *loop = native_loop(vm);
+	if (loop == NULL)
+		return NIL_VAL;
+
+	// A task is called again once its timer woke it
+	Waiter *task = current_task(vm, loop);
+	if (task != NULL && task->ready) {
+		task->ready = false;
+		return NIL_VAL;
+	}
+
+	WaitResult wait =
+		wait_for(vm, loop, -1, 0, now() + AS_NUMBER(args[0]));
+	return wait == WAIT_SUSPEND ? native_wait(vm) : NIL_VAL;
+}
+
+// open(path, mode)
+static Value open_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 2 || !IS_STRING(args[0]) || !IS_STRING(args[1]))
+		return native_error(vm, "open() takes a path and a mode.");
+
+	Loop *loop = native_loop(vm);
+	if (loop == NULL)
+		return NIL_VAL;
+
+	const char *mode = AS_CSTRING(args[1]);
+	int flags;
+	if (strcmp(mode, "r") == 0)
+		flags = O_RDONLY;
+	else if (strcmp(mode, "w") == 0)
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+	else if (strcmp(mode, "a") == 0)
+		flags = O_WRONLY | O_CREAT | O_APPEND;
+	else
+		return native_error(vm, "Unknown mode \"%s\".", mode);
+
+	int fd = open(AS_CSTRING(args[0]), flags | O_NONBLOCK | O_CLOEXEC,
+		      0666);
+	if (fd < 0)
+		return native_error(vm, "Could not open file \"%s\": %s.",
+				    AS_CSTRING(args[0]), strerror(errno));
+	reset_watch(loop, fd, true);
+	return NUMBER_VAL(fd);
+}
+
+// Sets a field of the instance on top of the stack
+static void set_field(VM *vm, const char *name, Value value)
+{
+	push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+	insert_into_table(vm, &AS_INSTANCE(vm->stackTop[-2])->fields,
+			  AS_STRING(vm->stackTop[-1]), value);
+	pop(vm);
+}
+
+// Returns an instance holding two new non-blocking descriptors, of a
+// class created on first use
+static Value new_pair(VM *vm, Loop *loop, ObjClass **klass,
+		      const char *className, const char *first,
+		      const char *second, int fds[2])
+{
+	reset_watch(loop, fds[0], true);
+	reset_watch(loop, fds[1], true);
+
+	if (*klass == NULL) {
+		push(vm, OBJ_VAL(copy_string(vm, className,
+					     (int)strlen(className))));
+		*klass = new_class(vm, AS_STRING(vm->stackTop[-1]));
+		pop(vm);
+	}
+
+	push(vm, OBJ_VAL(new_instance(vm, *klass)));
+	set_field(vm, first, NUMBER_VAL(fds[0]));
+	set_field(vm, second, NUMBER_VAL(fds[1]));
+	return pop(vm);
+}
+
+// pipe()
+static Value pipe_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 0)
+		return native_error(vm, "pipe() takes no arguments.");
+
+	Loop *loop = native_loop(vm);
+	if (loop == NULL)
+		return NIL_VAL;
+
+	int fds[2];
+	if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+		return native_error(vm, "Could not create a pipe: %s.",
+				    strerror(errno));
+	return new_pair(vm, loop, &loop->pipeClass, "Pipe", "reader",
+			"writer", fds);
+}
+
+// socketpair()
+static Value socketpair_native(VM *vm, int argCount, Value *args,
+			       void *data)
+{
+	if (argCount != 0)
+		return native_error(vm, "socketpair() takes no arguments.");
+
+	Loop *loop = native_loop(vm);
+	if (loop == NULL)
+		return NIL_VAL;
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+		       fds) < 0)
+		return native_error(vm, "Could not create sockets: %s.",
+				    strerror(errno));
+	return new_pair(vm, loop, &loop->socketPairClass, "SocketPair",
+			"left", "right", fds);
+}
+
+// Closes a descriptor. Its waiters are woken, and their reads and writes
+// fail when they're made again.
+bool close_descriptor(VM *vm, int fd)
+{
+	Loop *loop = vm->loop;
+	if (loop != NULL && fd >= 0 && fd < loop->watchCapacity)
+		reset_watch(loop, fd, false);
+	return close(fd) == 0;
+}
+
+void define_loop_natives(VM *vm)
+{
+	define_native(vm, "task", task_native, NULL, 0);
+	define_native(vm, "run_tasks", run_tasks_native, NULL, 0);
+	define_native(vm, "read", read_native, NULL, 0);
+	define_native(vm, "write", write_native, NULL, 0);
+	define_native(vm, "sleep", sleep_native, NULL, 0);
+	define_native(vm, "open", open_native, NULL, 0);
+	define_native(vm, "pipe", pipe_native, NULL, 0);
+	define_native(vm, "socketpair", socketpair_native, NULL, 0);
+}
+
+void mark_loop(VM *vm)
+{
+	Loop *loop = vm->loop;
+	if (loop == NULL)
+		return;
+
+	for (Waiter *task = loop->tasks; task != NULL; task = task->nextTask)
+		mark_object(vm, (Obj *)task->fiber);
+	mark_object(vm, (Obj *)loop->pipeClass);
+	mark_object(vm, (Obj *)loop->socketPairClass);
+}
+
+void free_loop(VM *vm)
+{
+	Loop *loop = vm->loop;
+	if (loop == NULL)
+		return;
+
+	while (loop->tasks != NULL) {
+		Waiter *task = loop->tasks;
+		loop->tasks = task->nextTask;
+		free(task);
+	}
+	free(loop->timers);
+	free(loop->watches);
+	close(loop->epoll);
+	free(loop);
+	vm->loop = NULL;
+}
@@ -0,0 +1,55 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the event loop of a VM, which runs tasks: fibers that
+// the loop resumes whenever the descriptor or timer they wait on is ready,
+// so that one thread serves any number of them. Descriptors are numbers;
+// those the loop opens are non-blocking.
+//
+// Scripts use it through these natives:
+//   task(function) - run a function without parameters as a task, which
+//                    starts once the running code waits or finishes
+//   run_tasks() - run the loop until every task has finished
+//   read(fd, count) - read at most `count` bytes as a string once some
+//                     are available, or nil at the end of the input
+//   write(fd, string) - write a whole string, returning its length
+//   sleep(seconds) - wait for a number of seconds
+//   open(path, mode) - open a file for "r"eading, "w"riting or "a"ppending
+//   pipe() - create a pipe, a Pipe instance with `reader` and `writer`
+//   socketpair() - create a pair of connected sockets, a SocketPair
+//                  instance with `left` and `right`
+//   close(fd) - close a descriptor, failing the waits on it
+//
+// In a task, waiting suspends it and lets the loop run the others. Anywhere
+// else, waiting runs the loop until the wait is over.
+
+#ifndef xanadu_loop_h
+#define xanadu_loop_h
+
+#include "common.h"
+#include "value.h"
+
+// The event loop of a VM, created on first use
+typedef struct Loop Loop;
+
+// Defines the natives of the event loop in a VM.
+void define_loop_natives(VM *vm);
+
+// Runs the event loop until every task has finished.
+// Returns:
+//   Whether no task failed
+bool run_loop(VM *vm);
+
+// Closes a descriptor, waking whatever waits on it.
+// Returns:
+//   Whether it was open
+bool close_descriptor(VM *vm, int fd);
+
+// Marks the tasks and objects the loop holds for the garbage collector.
+void mark_loop(VM *vm);
+
+// Frees the loop of a VM. The descriptors it opened stay open.
+void free_loop(VM *vm);
+
+#endif
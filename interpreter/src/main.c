@@ -3,105 +3,375 @@
 // license that can be found in the LICENSE file.
 
 #include "vm.h"
+#include "compiler.h"
+#include "module.h"
+#include "isolate.h"
+#include "loop.h"
+#include "optimizer.h"
+#include "profile.h"
+#include "serialize.h"
+#include "source.h"
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// File the collapsed call stacks of --profile are written to by default
+#define PROFILE_STACKS "profile.folded"
+
+// Size of a compiled program, summed over all of its functions
+typedef struct {
+	int functions; // Number of functions, including the script
+	int bytes; // Bytes of bytecode
+	int constants; // Entries in the constant pools
+} ProgramSize;
 
 // Functioin declaration
-static void repl();
-static void run_file(const char *path);
-static char *read_file(const char *path);
+static void repl(VM *vm);
+static void run_file(VM *vm, const char *path, bool cache,
+		     const char *profile);
+static void compile_file(VM *vm, const char *path, const char *output);
+static Source read_file(const char *path);
+static Source read_source(VM *vm, const char *path, SourceKey *key);
+static char *cache_path(const char *path);
+static void opt_report(VM *vm, const char *path);
+static void usage(void);
 //######################
 
 int main(int argc, char *argv[])
 {
+	static VM vm; // Too large for the stack
+	const char *path = NULL;
+	const char *output = NULL;
+	const char *profile = NULL;
+	bool report = false;
+	bool compileOnly = false;
+	bool cache = true;
+	bool lazy = false;
+	int optimizationLevel = OPT_LEVEL_DEFAULT;
+
+	// Parse command line options
+	for (int i = 1; i < argc; i++) {
+		const char *level = NULL;
+
+		if (strncmp(argv[i], "--opt-level=", 12) == 0) {
+			level = argv[i] + 12;
+		} else if (strcmp(argv[i], "--opt-level") == 0 && i + 1 < argc) {
+			level = argv[++i];
+		} else if (strcmp(argv[i], "--opt-report") == 0) {
+			report = true;
+		} else if (strcmp(argv[i], "--compile") == 0) {
+			compileOnly = true;
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			output = argv[++i];
+		} else if (strcmp(argv[i], "--no-cache") == 0) {
+			cache = false;
+		} else if (strcmp(argv[i], "--lazy") == 0) {
+			lazy = true;
+		} else if (strcmp(argv[i], "--profile") == 0) {
+			profile = PROFILE_STACKS;
+		} else if (strncmp(argv[i], "--profile=", 10) == 0 &&
+			   argv[i][10] != '\0') {
+			profile = argv[i] + 10;
+		} else if (path == NULL && (argv[i][0] != '-' ||
+					    strcmp(argv[i], STDIN_PATH) == 0)) {
+			path = argv[i];
+		} else {
+			usage();
+		}
+
+		if (level != NULL) {
+			char *end;
+			long value = strtol(level, &end, 10);
+			if (*level == '\0' || *end != '\0' || value < OPT_LEVEL_NONE ||
+			    value > OPT_LEVEL_MAX)
+				usage();
+			optimizationLevel = (int)value;
+		}
+	}
+
+	// The report runs the file once per level, each in a fresh VM
+	if (report) {
+		if (path == NULL)
+			usage();
+		opt_report(&vm, path);
+		wait_isolates();
+		return EXIT_SUCCESS;
+	}
+
+	if ((compileOnly || output != NULL) && (path == NULL || lazy))
+		usage();
+	if (profile != NULL && (path == NULL || compileOnly))
+		usage();
+
+	// Standard input has no path to put its bytecode next to
+	if (compileOnly && output == NULL && strcmp(path, STDIN_PATH) == 0)
+		usage();
+
 	// Start up virtual machine
-	init_vm();
+	init_vm(&vm);
+	set_optimization_level(&vm, optimizationLevel);
+	set_lazy_compilation(&vm, lazy);
 
 	// Check for given xanadu file
-	if (argc == 1) {
-		repl(); // run command line interpreter
-	} else if (argc == 2) {
-		run_file(argv[1]); // run file interpreter
+	if (compileOnly) {
+		compile_file(&vm, path, output); // write bytecode file
+	} else if (path == NULL) {
+		repl(&vm); // run command line interpreter
 	} else {
-		// Insufficient number of arguments, exit with error message
-		fprintf(stderr, "Usage: xi [path]\n");
-		exit(64);
+		run_file(&vm, path, cache, profile); // run file interpreter
 	}
 
-	// Close virtual machine
-	free_vm();
+	// Let the isolates the program spawned finish, then close the VM
+	wait_isolates();
+	free_vm(&vm);
 	return EXIT_SUCCESS;
 }
 
 // Functioin Definition
 
+// Print usage and exit with error
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: xi [--opt-level=N] [--opt-report] [--no-cache] [--lazy]\n"
+		"          [--profile[=stacks]] [path]\n"
+		"       xi --compile [-o output] path\n"
+		"  path           source or bytecode file, - to read the source from\n"
+		"                 standard input, the REPL is started without one\n"
+		"  --opt-level=N  optimization level, %d (none) to %d (default %d)\n"
+		"  --opt-report   compare bytecode size and run time of every level\n"
+		"  --compile      write the bytecode of path to output (default "
+		"path" XAC_EXTENSION ")\n"
+		"  --no-cache     don't use or write path" XAC_EXTENSION
+		" when running path\n"
+		"  --lazy         compile functions on their first call\n"
+		"  --profile      sample the calls while path runs, report the\n"
+		"                 lines with the most samples and write the call\n"
+		"                 stacks for flame graphs to stacks (default "
+		PROFILE_STACKS ")\n",
+		OPT_LEVEL_NONE, OPT_LEVEL_MAX, OPT_LEVEL_DEFAULT);
+	exit(64);
+}
+
+// Add up the size of a function and every function nested in it
+static void measure(ObjFunction *function, ProgramSize *size)
+{
+	size->functions++;
+	size->bytes += function->chunk.count;
+	size->constants += function->chunk.constants.count;
+
+	for (int i = 0; i < function->chunk.constants.count; i++) {
+		Value constant = function->chunk.constants.values[i];
+		if (IS_FUNCTION(constant))
+			measure(AS_FUNCTION(constant), size);
+	}
+}
+
+// Milliseconds of processor time since `start`
+static double elapsed_ms(clock_t start)
+{
+	return (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+// Compile and run a file at every optimization level and print
+// the bytecode size and timings of each. The program's own output
+// is discarded. The VM is started afresh for every level.
+static void opt_report(VM *vm, const char *path)
+{
+	Source source = read_file(path);
+
+	printf("%-6s %10s %11s %10s %11s %11s\n", "level", "functions",
+	       "code bytes", "constants", "compile ms", "run ms");
+
+	for (int level = OPT_LEVEL_NONE; level <= OPT_LEVEL_MAX; level++) {
+		init_vm(vm);
+		set_optimization_level(vm, level);
+
+		clock_t start = clock();
+		ObjFunction *function = compile_program(vm, source.chars, path);
+		double compileTime = elapsed_ms(start);
+		if (function == NULL)
+			exit(65);
+
+		ProgramSize size = { 0, 0, 0 };
+		measure(function, &size);
+
+		// Silence the program while it runs
+		fflush(stdout);
+		int saved = dup(STDOUT_FILENO);
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		close(null);
+
+		start = clock();
+		InterpretResult result = interpret_function(vm, function);
+		if (result == INTERPRET_OK && !run_loop(vm))
+			result = INTERPRET_RUNTIME_ERROR;
+		double runTime = elapsed_ms(start);
+
+		fflush(stdout);
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+
+		printf("%-6d %10d %11d %10d %11.2f %11.2f%s\n", level,
+		       size.functions, size.bytes, size.constants, compileTime,
+		       runTime,
+		       result == INTERPRET_OK ? "" : "  (runtime error)");
+		free_vm(vm);
+	}
+
+	free_source(&source);
+}
+
 // Command line interpreter
-static void repl(void)
+static void repl(VM *vm)
 {
-	// input buffer
-	char line[1024];
+	// input buffer, grown by getline() to fit the longest line
+	char *line = NULL;
+	size_t capacity = 0;
 	// input loop
 	for (;;) {
 		printf("> ");
 
-		if (!fgets(line, sizeof(line), stdin)) {
+		if (getline(&line, &capacity, stdin) < 0) {
 			printf("\n");
 			break;
 		}
 
-		// intepreter input
-		interpret(line);
+		// intepreter input, then the tasks it started
+		if (interpret(vm, line) == INTERPRET_OK)
+			run_loop(vm);
 	}
+	free(line);
 }
 
-// File interpreter
-static void run_file(const char *path)
+// File interpreter. Bytecode files are run as they are. A source file is run
+// from its cached bytecode if the cache was compiled from the same source at
+// the same optimization level, and is cached after compiling otherwise,
+// unless its functions are compiled lazily and can't be saved yet. Source
+// read from standard input is never cached. With `profile` set, the run is
+// profiled and its call stacks are written to that file.
+static void run_file(VM *vm, const char *path, bool cache,
+		     const char *profile)
 {
-	// Read from file
-	char *source = read_file(path);
-	// interpret read input
-	InterpretResult result = interpret(source);
-	free(source);
-
-	// Exit on compile error
-	if (result == INTERPRET_COMPILE_ERROR)
-		exit(65);
-	if (result == INTERPRET_RUNTIME_ERROR)
+	ObjFunction *function;
+	bool standardInput = strcmp(path, STDIN_PATH) == 0;
+
+	if (!standardInput && is_bytecode_file(path)) {
+		function = load_bytecode(vm, path, NULL);
+		if (function == NULL) {
+			fprintf(stderr, "Could not load bytecode file \"%s\".\n",
+				path);
+			exit(74);
+		}
+	} else {
+		SourceKey key;
+		Source source = read_source(vm, path, &key);
+		char *cached = cache && !standardInput ? cache_path(path) : NULL;
+
+		function = cached != NULL ? load_bytecode(vm, cached, &key) :
+					    NULL;
+		if (function == NULL) {
+			function = compile_program(vm, source.chars, path);
+			// Exit on compile error
+			if (function == NULL)
+				exit(65);
+			// A cache that can't be written only costs the next run time
+			if (cached != NULL && !vm->lazyCompilation)
+				save_bytecode(function, &key, cached);
+		}
+
+		free(cached);
+		free_source(&source);
+	}
+
+	if (profile != NULL && !start_profile(vm)) {
+		fprintf(stderr, "Could not start the profiler: %s.\n",
+			strerror(errno));
+		exit(71);
+	}
+
+	// interpret compiled script, then let the tasks it started finish
+	InterpretResult result = interpret_function(vm, function);
+	bool failed = result == INTERPRET_RUNTIME_ERROR || !run_loop(vm);
+
+	if (profile != NULL) {
+		fflush(stdout);
+		stop_profile(vm, stderr, profile);
+	}
+	if (failed)
 		exit(70);
 }
 
-// Read from given file
-static char *read_file(const char *path)
+// Compile a source file and write its bytecode to `output`, or next to the
+// source if it is NULL
+static void compile_file(VM *vm, const char *path, const char *output)
 {
-	FILE *file = fopen(path, "rb");
-	if (file == NULL) {
-		fprintf(stderr, "Could not open file \"%s\".\n", path);
+	SourceKey key;
+	Source source = read_source(vm, path, &key);
+	char *cached = output == NULL ? cache_path(path) : NULL;
+	if (output == NULL)
+		output = cached;
+
+	ObjFunction *function = compile_program(vm, source.chars, path);
+	if (function == NULL)
+		exit(65);
+	if (!save_bytecode(function, &key, output)) {
+		fprintf(stderr, "Could not write bytecode file \"%s\".\n",
+			output);
 		exit(74);
 	}
 
-	fseek(file, 0L, SEEK_END);
-	size_t fileSize = ftell(file);
-	rewind(file);
+	free(cached);
+	free_source(&source);
+}
+
+// Read a source file and describe it for its bytecode cache
+static Source read_source(VM *vm, const char *path, SourceKey *key)
+{
+	Source source = read_file(path);
 
-	// Allocate read buffer memory
-	char *buffer = (char *)malloc(fileSize + 1);
-	if (buffer == NULL) {
+	struct stat info;
+	key->hash = hash_source(source.chars, source.length);
+	key->mtime = stat(path, &info) == 0 ? (int64_t)info.st_mtime : 0;
+	key->optLevel = (uint8_t)get_optimization_level(vm);
+	return source;
+}
+
+// Path of the cached bytecode of a source file
+static char *cache_path(const char *path)
+{
+	size_t length = strlen(path);
+	char *cached = malloc(length + sizeof(XAC_EXTENSION));
+	if (cached == NULL) {
 		fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
 		exit(74);
 	}
 
-	// Read from file
-	size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-	if (bytesRead < fileSize) {
-		fprintf(stderr, "Could not read file \"%s\".\n", path);
+	memcpy(cached, path, length);
+	memcpy(cached + length, XAC_EXTENSION, sizeof(XAC_EXTENSION));
+	return cached;
+}
+
+// Load a source file, or standard input, and exit if it can't be read
+static Source read_file(const char *path)
+{
+	Source source;
+	if (!load_source(path, &source)) {
+		if (errno == ENOMEM)
+			fprintf(stderr, "Not enough memory to read \"%s\".\n",
+				path);
+		else
+			fprintf(stderr, "Could not read file \"%s\": %s.\n",
+				path, strerror(errno));
 		exit(74);
 	}
-
-	// Append string termination character
-	buffer[bytesRead] = '\0';
-
-	fclose(file);
-	return buffer;
+	return source;
 }
 
 //#####################
@@ -11,38 +11,49 @@
 #include "error.h"
 #include "object.h"
 #include "vm.h"
+#include "serialize.h"
 #include "compiler.h"
+#include "isolate.h"
+#include "loop.h"
+#include "profile.h"
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
 
+_Thread_local Heap *threadHeap = NULL;
+
 // Reallocate memory for a given pointer.
 // Adjusts the allocated memory from oldSize to newSize.
 // Updates the VM's bytesAllocated count and may trigger garbage collection
 // if the new allocation exceeds the current threshold.
 //
 // Parameters:
+//   vm - The VM the memory is charged to
 //   pointer - Pointer to the memory to reallocate
 //   oldSize - Previous size of the memory allocation
 //   newSize - New size of the memory allocation
 //
 // Returns:
 //   A pointer to the reallocated memory
-void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize)
 {
-	vm.bytesAllocated += newSize - oldSize;
+	// Threads compiling modules account for their own memory and never collect
+	if (threadHeap != NULL)
+		threadHeap->bytesAllocated += newSize - oldSize;
+	else
+		vm->bytesAllocated += newSize - oldSize;
 
-	if (newSize > oldSize) {
+	if (newSize > oldSize && threadHeap == NULL) {
 #ifdef DEBUG_STRESS_GC
 		// Force garbage collection for testing purposes
-		collect_garbage();
+		collect_garbage(vm);
 #endif
 
 		// Perform garbage collection if memory usage exceeds the threshold
-		if (vm.bytesAllocated > vm.nextGC) {
-			collect_garbage();
+		if (vm->bytesAllocated > vm->nextGC) {
+			collect_garbage(vm);
 		}
 	}
 
@@ -62,8 +73,9 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 // Releases memory and resources associated with the object.
 //
 // Parameters:
+//   vm - The VM that owns the object
 //   object - The object to free
-static void free_object(Obj *object)
+static void free_object(VM *vm, Obj *object)
 {
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %d\n", (void *)object, object->type);
@@ -72,62 +84,199 @@ static void free_object(Obj *object)
 	// Free memory based on the object type
 	switch (object->type) {
 	case OBJ_BOUND_METHOD:
-		FREE(ObjBoundMethod, object);
+		FREE(vm, ObjBoundMethod, object);
+		break;
+	case OBJ_CHANNEL:
+		release_channel(((ObjChannel *)object)->channel);
+		FREE(vm, ObjChannel, object);
+		break;
+	case OBJ_ISOLATE:
+		release_isolate(((ObjIsolate *)object)->isolate);
+		FREE(vm, ObjIsolate, object);
 		break;
 	case OBJ_INSTANCE: {
 		ObjInstance *instance = (ObjInstance *)object;
-		free_table(&instance->fields);
-		FREE(ObjInstance, object);
+		free_table(vm, &instance->fields);
+		FREE(vm, ObjInstance, object);
 		break;
 	}
 	case OBJ_CLASS: {
 		ObjClass *klass = (ObjClass *)object;
-		free_table(&klass->methods);
-		FREE(ObjClass, object);
+		free_table(vm, &klass->methods);
+		FREE(vm, ObjClass, object);
 		break;
 	}
 	case OBJ_STRING: {
 		ObjString *string = (ObjString *)object;
-		FREE_ARRAY(char, string->chars, string->length + 1);
-		FREE(ObjString, object);
+		FREE_ARRAY(vm, char, string->chars, string->length + 1);
+		FREE(vm, ObjString, object);
 		break;
 	}
 	case OBJ_FUNCTION: {
 		ObjFunction *function = (ObjFunction *)object;
-		free_chunk(&function->chunk);
-		FREE(ObjFunction, object);
+		free_chunk(vm, &function->chunk);
+		if (function->lazy != NULL) {
+			FREE_ARRAY(vm, ObjString *,
+				   function->lazy->upvalueNames,
+				   function->upvalueCount);
+			FREE(vm, LazyFunction, function->lazy);
+		}
+		FREE(vm, ObjFunction, object);
 		break;
 	}
-	case OBJ_NATIVE:
-		FREE(ObjNative, object);
+	case OBJ_NATIVE: {
+		ObjNative *native = (ObjNative *)object;
+		if (native->dataSize > 0)
+			reallocate(vm, native->data, native->dataSize, 0);
+		FREE(vm, ObjNative, object);
 		break;
+	}
 	case OBJ_CLOSURE: {
 		ObjClosure *closure = (ObjClosure *)object;
-		FREE_ARRAY(ObjUpvalue *, closure->upvalues,
+		FREE_ARRAY(vm, ObjUpvalue *, closure->upvalues,
 			   closure->upvalueCount);
-		FREE(ObjClosure, object);
+		FREE(vm, ObjClosure, object);
 		break;
 	}
 	case OBJ_UPVALUE:
-		FREE(ObjUpvalue, object);
+		FREE(vm, ObjUpvalue, object);
 		break;
+	case OBJ_FIBER: {
+		ObjFiber *fiber = (ObjFiber *)object;
+		if (fiber->stackCapacity > 0) {
+			FREE_ARRAY(vm, Value, fiber->stack,
+				   fiber->stackCapacity);
+			FREE_ARRAY(vm, ObjUpvalue *, fiber->openUpvalues,
+				   fiber->stackCapacity);
+			FREE_ARRAY(vm, CallFrame, fiber->frames, FRAMES_MAX);
+		}
+		FREE(vm, ObjFiber, object);
+		break;
+	}
+	case OBJ_ARRAY:
+		free_value_array(vm, &((ObjArray *)object)->elements);
+		FREE(vm, ObjArray, object);
+		break;
+	case OBJ_MAP:
+		free_value_table(vm, &((ObjMap *)object)->table);
+		FREE(vm, ObjMap, object);
+		break;
+	case OBJ_FLOAT_ARRAY: {
+		ObjFloatArray *array = (ObjFloatArray *)object;
+		FREE_ARRAY(vm, double, array->values, array->count);
+		FREE(vm, ObjFloatArray, object);
+		break;
+	}
+	}
+}
+
+// Initializes an empty heap
+void init_heap(Heap *heap)
+{
+	heap->objects = NULL;
+	heap->bytesAllocated = 0;
+	init_table(&heap->strings);
+}
+
+// Returns the string the VM keeps in place of a string of a heap being
+// adopted.
+static ObjString *adopted_string(Heap *heap, ObjString *string)
+{
+	Value interned;
+	if (string != NULL &&
+	    table_get_from_table(&heap->strings, string, &interned) &&
+	    !IS_NIL(interned))
+		return AS_STRING(interned);
+	return string;
+}
+
+// Adopts the objects of a heap into the VM. Allocations made meanwhile are
+// charged to the heap, so they can't start a collection that would see its
+// objects half moved.
+void adopt_heap(VM *vm, Heap *heap)
+{
+	threadHeap = heap;
+
+	// Intern the heap's strings into the VM, remembering the copies other
+	// heaps adopted first. Those copies replace the heap's own.
+	for (int i = 0; i < heap->strings.capacity; i++) {
+		Entry *entry = &heap->strings.entries[i];
+		if (entry->key == NULL)
+			continue;
+
+		ObjString *string = entry->key;
+		ObjString *interned = table_find_string(
+			&vm->strings, string->chars, string->length,
+			string->hash);
+		if (interned == NULL)
+			insert_into_table(vm, &vm->strings, string, NIL_VAL);
+		else
+			entry->value = OBJ_VAL(interned);
+	}
+
+	// Strings are only referenced by the functions compiled into the heap
+	for (Obj *object = heap->objects; object != NULL;
+	     object = object->next) {
+		if (object->type != OBJ_FUNCTION)
+			continue;
+
+		ObjFunction *function = (ObjFunction *)object;
+		ValueArray *constants = &function->chunk.constants;
+		function->name = adopted_string(heap, function->name);
+		for (int i = 0; i < constants->count; i++) {
+			if (IS_STRING(constants->values[i]))
+				constants->values[i] = OBJ_VAL(adopted_string(
+					heap, AS_STRING(constants->values[i])));
+		}
+
+		LazyFunction *lazy = function->lazy;
+		if (lazy != NULL) {
+			lazy->source = adopted_string(heap, lazy->source);
+			for (int i = 0; lazy->upvalueNames != NULL &&
+					i < function->upvalueCount;
+			     i++) {
+				lazy->upvalueNames[i] = adopted_string(
+					heap, lazy->upvalueNames[i]);
+			}
+		}
 	}
+
+	// Free the replaced strings and move everything else into the VM
+	Obj **link = &heap->objects;
+	while (*link != NULL) {
+		Obj *object = *link;
+		if (object->type == OBJ_STRING &&
+		    adopted_string(heap, (ObjString *)object) !=
+			    (ObjString *)object) {
+			*link = object->next;
+			free_object(vm, object);
+		} else {
+			link = &object->next;
+		}
+	}
+	*link = vm->objects;
+	vm->objects = heap->objects;
+
+	free_table(vm, &heap->strings);
+	threadHeap = NULL;
+	vm->bytesAllocated += heap->bytesAllocated;
+	init_heap(heap);
 }
 
 // Free all objects currently in the Xanadu VM.
 // This includes iterating through and freeing each object in the list.
 //
 // This function also frees the gray stack used for garbage collection.
-void free_objects(void)
+void free_objects(VM *vm)
 {
-	Obj *object = vm.objects;
+	Obj *object = vm->objects;
 	while (object != NULL) {
 		Obj *next = object->next;
-		free_object(object);
+		free_object(vm, object);
 		object = next;
 	}
 
-	free(vm.gray_stack);
+	free(vm->gray_stack);
 }
 
 // Mark a Xanadu object for garbage collection.
@@ -135,8 +284,9 @@ void free_objects(void)
 // collected during garbage collection.
 //
 // Parameters:
+//   vm - The VM collecting garbage
 //   object - The object to mark
-void mark_object(Obj *object)
+void mark_object(VM *vm, Obj *object)
 {
 	if (object == NULL)
 		return;
@@ -153,36 +303,38 @@ void mark_object(Obj *object)
 	object->is_marked = true;
 
 	// Ensure there is enough space in the gray stack
-	if (vm.gray_capacity < vm.gray_count + 1) {
-		vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-		vm.gray_stack = (Obj **)realloc(
-			vm.gray_stack, sizeof(Obj *) * vm.gray_capacity);
+	if (vm->gray_capacity < vm->gray_count + 1) {
+		vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+		vm->gray_stack = (Obj **)realloc(
+			vm->gray_stack, sizeof(Obj *) * vm->gray_capacity);
 	}
 
-	vm.gray_stack[vm.gray_count++] = object;
+	vm->gray_stack[vm->gray_count++] = object;
 
-	if (vm.gray_stack == NULL)
+	if (vm->gray_stack == NULL)
 		exit(1);
 }
 
 // Mark a Xanadu value for garbage collection if it is a heap object.
 //
 // Parameters:
+//   vm - The VM collecting garbage
 //   value - The value to mark
-void mark_value(Value value)
+void mark_value(VM *vm, Value value)
 {
 	if (IS_OBJ(value))
-		mark_object(AS_OBJ(value));
+		mark_object(vm, AS_OBJ(value));
 }
 
 // Mark all values in an array for garbage collection.
 //
 // Parameters:
+//   vm - The VM collecting garbage
 //   array - The array of values to mark
-static void mark_array(ValueArray *array)
+static void mark_array(VM *vm, ValueArray *array)
 {
 	for (int i = 0; i < array->count; i++) {
-		mark_value(array->values[i]);
+		mark_value(vm, array->values[i]);
 	}
 }
 
@@ -191,8 +343,9 @@ static void mark_array(ValueArray *array)
 // collected prematurely.
 //
 // Parameters:
+//   vm - The VM collecting garbage
 //   object - The object to process
-static void blacken_object(Obj *object)
+static void blacken_object(VM *vm, Obj *object)
 {
 #ifdef DEBUG_LOG_GC
 	printf("%p blacken ", (void *)object);
@@ -204,42 +357,90 @@ static void blacken_object(Obj *object)
 	switch (object->type) {
 	case OBJ_BOUND_METHOD: {
 		ObjBoundMethod *bound = (ObjBoundMethod *)object;
-		mark_value(bound->receiver);
-		mark_object((Obj *)bound->method);
+		mark_value(vm, bound->receiver);
+		mark_object(vm, (Obj *)bound->method);
 		break;
 	}
 	case OBJ_INSTANCE: {
 		ObjInstance *instance = (ObjInstance *)object;
-		mark_object((Obj *)instance->class_);
-		mark_table(&instance->fields);
+		mark_object(vm, (Obj *)instance->class_);
+		mark_table(vm, &instance->fields);
 		break;
 	}
 	case OBJ_CLASS: {
 		ObjClass *klass = (ObjClass *)object;
-		mark_object((Obj *)klass->name);
-		mark_table(&klass->methods);
+		mark_object(vm, (Obj *)klass->name);
+		mark_table(vm, &klass->methods);
 		break;
 	}
 	case OBJ_CLOSURE: {
 		ObjClosure *closure = (ObjClosure *)object;
-		mark_object((Obj *)closure->function);
+		mark_object(vm, (Obj *)closure->function);
 		for (int i = 0; i < closure->upvalueCount; i++) {
-			mark_object((Obj *)closure->upvalues[i]);
+			mark_object(vm, (Obj *)closure->upvalues[i]);
 		}
 		break;
 	}
 	case OBJ_UPVALUE:
-		mark_value(((ObjUpvalue *)object)->closed);
+		mark_value(vm, ((ObjUpvalue *)object)->closed);
+		// An open upvalue keeps the stack it points into alive
+		mark_object(vm, (Obj *)((ObjUpvalue *)object)->fiber);
+		break;
+	case OBJ_FIBER: {
+		ObjFiber *fiber = (ObjFiber *)object;
+		mark_object(vm, (Obj *)fiber->closure);
+		mark_object(vm, (Obj *)fiber->caller);
+
+		// The stack of the running fiber is marked from the VM's
+		// registers, its saved ones are stale
+		if (fiber == vm->fiber)
+			break;
+		for (Value *slot = fiber->stack; slot < fiber->stackTop;
+		     slot++) {
+			mark_value(vm, *slot);
+		}
+		for (int i = 0; i < fiber->frameCount; i++) {
+			mark_object(vm, (Obj *)fiber->frames[i].closure);
+		}
+		for (int i = 0; i < fiber->openTop; i++) {
+			mark_object(vm, (Obj *)fiber->openUpvalues[i]);
+		}
 		break;
+	}
 	case OBJ_FUNCTION: {
 		ObjFunction *function = (ObjFunction *)object;
-		mark_object((Obj *)function->name);
-		mark_array(&function->chunk.constants);
+		mark_object(vm, (Obj *)function->name);
+		mark_object(vm, (Obj *)function->closure);
+		mark_array(vm, &function->chunk.constants);
+		if (function->lazy != NULL) {
+			mark_object(vm, (Obj *)function->lazy->source);
+			for (int i = 0; function->lazy->upvalueNames != NULL &&
+					i < function->upvalueCount;
+			     i++) {
+				mark_object(vm, (Obj *)function->lazy
+							 ->upvalueNames[i]);
+			}
+		}
 		break;
 	}
+	case OBJ_ARRAY:
+		mark_array(vm, &((ObjArray *)object)->elements);
+		break;
+	case OBJ_MAP: {
+		ValueTable *table = &((ObjMap *)object)->table;
+		for (int i = 0; i < table->capacity; i++) {
+			mark_value(vm, table->entries[i].key);
+			mark_value(vm, table->entries[i].value);
+		}
+		break;
+	}
+	case OBJ_FLOAT_ARRAY:
 	case OBJ_NATIVE:
 	case OBJ_STRING:
-		// No additional marking required for native and string objects
+	case OBJ_CHANNEL:
+	case OBJ_ISOLATE:
+		// No additional marking required for native and string objects,
+		// or for references to what other threads share
 		break;
 	}
 }
@@ -247,13 +448,14 @@ static void blacken_object(Obj *object)
 // Mark all global variables in the given table for garbage collection.
 //
 // Parameters:
+//   vm - The VM collecting garbage
 //   table - The table containing global variables to mark
-void mark_table(Table *table)
+void mark_table(VM *vm, Table *table)
 {
 	for (int i = 0; i < table->capacity; i++) {
 		Entry *entry = &table->entries[i];
-		mark_object((Obj *)entry->key);
-		mark_value(entry->value);
+		mark_object(vm, (Obj *)entry->key);
+		mark_value(vm, entry->value);
 	}
 }
 
@@ -262,41 +464,54 @@ void mark_table(Table *table)
 //
 // This function sets the initial state for the garbage collector by marking
 // all live objects.
-static void mark_roots()
+static void mark_roots(VM *vm)
 {
 	// Mark values on the stack
-	for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-		mark_value(*slot);
+	for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+		mark_value(vm, *slot);
 	}
 
 	// Mark closures in the call frames
-	for (int i = 0; i < vm.frameCount; i++) {
-		mark_object((Obj *)vm.frames[i].closure);
+	for (int i = 0; i < vm->frameCount; i++) {
+		mark_object(vm, (Obj *)vm->frames[i].closure);
 	}
 
 	// Mark open upvalues
-	for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
-	     upvalue = upvalue->next) {
-		mark_object((Obj *)upvalue);
+	for (int i = 0; i < vm->openTop; i++) {
+		mark_object(vm, (Obj *)vm->openUpvalues[i]);
 	}
 
+	// Mark the running fiber, the fibers that resumed it and the main one
+	mark_object(vm, (Obj *)vm->fiber);
+	mark_object(vm, (Obj *)vm->mainFiber);
+
+	// Mark the tasks of the event loop
+	mark_loop(vm);
+
+	// Mark the objects of a message being received
+	mark_array(vm, &vm->received);
+
 	// Mark global variables
-	mark_table(&vm.globals);
+	mark_table(vm, &vm->globals);
+	mark_table(vm, &vm->modules);
+
+	// Mark functions loaded from bytecode images
+	mark_images(vm);
 
 	// Mark constants and literals
-	mark_compiler_roots();
-	mark_object((Obj *)vm.init_string);
+	mark_compiler_roots(vm);
+	mark_object(vm, (Obj *)vm->init_string);
 }
 
 // Trace and mark all reachable objects from the gray stack.
 //
 // This function processes all objects in the gray stack and marks their
 // references, transitioning them to the black state.
-static void trace_references()
+static void trace_references(VM *vm)
 {
-	while (vm.gray_count > 0) {
-		Obj *object = vm.gray_stack[--vm.gray_count];
-		blacken_object(object);
+	while (vm->gray_count > 0) {
+		Obj *object = vm->gray_stack[--vm->gray_count];
+		blacken_object(vm, object);
 	}
 }
 
@@ -304,10 +519,10 @@ static void trace_references()
 //
 // This function reclaims memory for objects that were not reachable during
 // the garbage collection phase.
-static void sweep()
+static void sweep(VM *vm)
 {
 	Obj *previous = NULL;
-	Obj *object = vm.objects;
+	Obj *object = vm->objects;
 	while (object != NULL) {
 		if (object->is_marked) {
 			object->is_marked = false;
@@ -319,10 +534,10 @@ static void sweep()
 			if (previous != NULL) {
 				previous->next = object;
 			} else {
-				vm.objects = object;
+				vm->objects = object;
 			}
 
-			free_object(unreached);
+			free_object(vm, unreached);
 			// Continue sweeping from the next object
 		}
 	}
@@ -332,25 +547,28 @@ static void sweep()
 // This involves marking roots, tracing references, and sweeping unreachable objects.
 //
 // This function updates the threshold for the next garbage collection cycle.
-void collect_garbage(void)
+void collect_garbage(VM *vm)
 {
 #ifdef DEBUG_LOG_GC
 	printf("-- gc begin\n");
-	size_t before = vm.bytesAllocated;
+	size_t before = vm->bytesAllocated;
 #endif
 
-	mark_roots(); // Mark all roots in the VM
-	trace_references(); // Trace and mark all reachable objects
-	table_remove_white(&vm.strings); // Remove and free unreferenced strings
-	sweep(); // Free all unreachable objects
+	// Samples point to functions this collection could free
+	drain_profile(vm);
+
+	mark_roots(vm); // Mark all roots in the VM
+	trace_references(vm); // Trace and mark all reachable objects
+	table_remove_white(&vm->strings); // Remove and free unreferenced strings
+	sweep(vm); // Free all unreachable objects
 
 	// Set the threshold for the next garbage collection
-	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+	vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
 	printf("-- gc end\n");
 	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-	       before - vm.bytesAllocated, before, vm.bytesAllocated,
-	       vm.nextGC);
+	       before - vm->bytesAllocated, before, vm->bytesAllocated,
+	       vm->nextGC);
 #endif
 }
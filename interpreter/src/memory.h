@@ -17,80 +17,112 @@
 // It updates the array's memory allocation from an old size to a new size.
 //
 // Parameters:
+//   vm - The VM the memory is charged to
 //   type - The type of elements in the array
 //   pointer - Pointer to the array to reallocate
 //   oldCount - Previous number of elements in the array
 //   newCount - New number of elements in the array
-#define GROW_ARRAY(type, pointer, oldCount, newCount)          \
-	(type *)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount)          \
+	(type *)reallocate(vm, pointer, sizeof(type) * (oldCount), \
 			   sizeof(type) * (newCount))
 
 // Macro to free the memory allocated for an array.
 // The memory for the array is deallocated based on its old size.
 //
 // Parameters:
+//   vm - The VM the memory is charged to
 //   type - The type of elements in the array
 //   pointer - Pointer to the array to free
 //   oldCount - Number of elements previously in the array
-#define FREE_ARRAY(type, pointer, oldCount) \
-	reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+	reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
 // Macro to free memory allocated for a single object.
 // Resizes the memory allocation to 0, effectively deallocating it.
 //
 // Parameters:
+//   vm - The VM the memory is charged to
 //   type - The type of the object
 //   pointer - Pointer to the object to free
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 // Macro to allocate memory for an array of a given type and count.
 // This initializes the memory allocation for the specified number of elements.
 //
 // Parameters:
+//   vm - The VM the memory is charged to
 //   type - The type of elements in the array
 //   count - Number of elements to allocate memory for
-#define ALLOCATE(type, count) \
-	(type *)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+	(type *)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
 // Function to reallocate memory for a given pointer.
-// It resizes the allocated memory from oldSize to newSize.
+// It resizes the allocated memory from oldSize to newSize, and may collect
+// the garbage of the VM it is charged to.
 //
 // Parameters:
+//   vm - The VM the memory is charged to
 //   pointer - Pointer to the memory to reallocate
 //   oldSize - Previous size of the allocated memory
 //   newSize - New size of the allocated memory
 //
 // Returns:
 //   A pointer to the reallocated memory
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize);
+
+// Allocations of a thread that compiles a module while the VM's thread
+// waits for it. Its objects and interned strings are kept apart from the
+// VM's, which the thread only reads, and allocating into a heap never
+// collects garbage.
+typedef struct {
+	Obj *objects; // Objects allocated into the heap
+	size_t bytesAllocated; // Bytes allocated into the heap, net of frees
+	Table strings; // Strings interned into the heap that the VM didn't have
+} Heap;
+
+// Heap the calling thread allocates into, NULL for the VM's own.
+extern _Thread_local Heap *threadHeap;
+
+// Initializes an empty heap.
+void init_heap(Heap *heap);
+
+// Moves the objects of a heap into the VM on the VM's thread, once no thread
+// allocates into it anymore. Strings the VM interned in the meantime replace
+// the heap's copies in the functions of the heap. Nothing is collected
+// while this runs, but the objects are garbage afterwards unless the caller
+// makes them reachable before allocating.
+void adopt_heap(VM *vm, Heap *heap);
 
 // Function to free the memory used by the list of objects.
 // This is typically used to clean up memory used by objects in the VM.
-void free_objects(void);
+void free_objects(VM *vm);
 
 // Function to perform garbage collection for unused Xanadu variables.
 // This function reclaims memory occupied by variables that are no longer in use.
-void collect_garbage(void);
+void collect_garbage(VM *vm);
 
 // Function to mark a Xanadu value for garbage collection.
 // This function ensures that the value is not prematurely reclaimed by the garbage collector.
 //
 // Parameters:
+//   vm - The VM collecting garbage
 //   value - The value to be marked
-void mark_value(Value value);
+void mark_value(VM *vm, Value value);
 
 // Function to mark a Xanadu object for garbage collection.
 // This function ensures that the object is not prematurely reclaimed by the garbage collector.
 //
 // Parameters:
+//   vm - The VM collecting garbage
 //   object - The object to be marked
-void mark_object(Obj *object);
+void mark_object(VM *vm, Obj *object);
 
 // Function to mark all global Xanadu variables for garbage collection.
 // This function iterates through global variables and marks them to prevent premature collection.
 //
 // Parameters:
+//   vm - The VM collecting garbage
 //   table - The table containing global variables to be marked
-void mark_table(Table *table);
+void mark_table(VM *vm, Table *table);
 
 #endif
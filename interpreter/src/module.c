@@ -0,0 +1,299 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "module.h"
+#include "compiler.h"
+#include "error.h"
+#include "memory.h"
+#include "source.h"
+#include "vm.h"
+
+// Most modules compiled in one round. Their functions are all kept on the
+// VM's stack while they are registered.
+#define MODULE_BATCH 64
+
+// A module compiled in a round.
+typedef struct {
+	char *path; // Resolved path of the module, owned by the import list
+	Source source; // Source of the module
+	bool loaded; // Whether the source could be loaded
+	Heap heap; // Objects allocated while compiling the module
+	ModuleList imports; // Modules the module imports
+	ObjFunction *function; // Script function, NULL if it didn't compile
+} ModuleJob;
+
+// The modules of a round, which the VM's thread and the workers it starts
+// take one at a time.
+typedef struct {
+	VM *vm; // VM the modules are compiled for
+	ModuleJob *jobs; // Modules of the round
+	int count; // Number of modules
+	atomic_int next; // Next module to take
+} ModuleRound;
+
+void init_module_list(ModuleList *list)
+{
+	list->count = 0;
+	list->capacity = 0;
+	list->paths = NULL;
+}
+
+void free_module_list(ModuleList *list)
+{
+	for (int i = 0; i < list->count; i++)
+		free(list->paths[i]);
+	free(list->paths);
+	init_module_list(list);
+}
+
+// Copies `length` characters of a path into a new null-terminated string.
+static char *copy_path(const char *path, size_t length)
+{
+	char *copy = malloc(length + 1);
+	if (copy == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+	memcpy(copy, path, length);
+	copy[length] = '\0';
+	return copy;
+}
+
+void add_module(ModuleList *list, const char *path)
+{
+	if (list->capacity < list->count + 1) {
+		int capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+		char **paths = realloc(list->paths, sizeof(char *) * capacity);
+		if (paths == NULL)
+			error_msg_exit("Failed to allocate memory in %s",
+				       __FILE__);
+		list->paths = paths;
+		list->capacity = capacity;
+	}
+	list->paths[list->count++] = copy_path(path, strlen(path));
+}
+
+// Returns the directory of a file, which sources without a file have in the
+// working directory.
+static char *directory_of(const char *path)
+{
+	const char *slash = NULL;
+	if (path != NULL && strcmp(path, STDIN_PATH) != 0)
+		slash = strrchr(path, '/');
+
+	if (slash == NULL)
+		return copy_path(".", 1);
+	if (slash == path)
+		return copy_path("/", 1);
+	return copy_path(path, (size_t)(slash - path));
+}
+
+char *resolve_module_path(const char *directory, const char *path)
+{
+	size_t directoryLength = strlen(directory);
+	size_t length = strlen(path);
+	char *joined = malloc(directoryLength + length + 2);
+	if (joined == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+
+	if (path[0] == '/')
+		memcpy(joined, path, length + 1);
+	else
+		sprintf(joined, "%s/%s", directory, path);
+
+	char *resolved = realpath(joined, NULL);
+	free(joined);
+	return resolved;
+}
+
+// Returns the module registered under a path, if there is one.
+static bool find_module(VM *vm, const char *path, Value *module)
+{
+	ObjString *key = copy_string(vm, path, (int)strlen(path));
+	return table_get_from_table(&vm->modules, key, module);
+}
+
+// Registers a module under its path. The module must be reachable.
+static void register_module(VM *vm, const char *path, Value module)
+{
+	ObjString *key = copy_string(vm, path, (int)strlen(path));
+	push(vm, OBJ_VAL(key));
+	insert_into_table(vm, &vm->modules, key, module);
+	pop(vm);
+}
+
+// Compiles a module into its own heap.
+static void compile_job(VM *vm, ModuleJob *job)
+{
+	char *directory = directory_of(job->path);
+
+	threadHeap = &job->heap;
+	job->function = compile_module(vm, job->source.chars, directory,
+				       job->path, &job->imports);
+	threadHeap = NULL;
+
+	free(directory);
+}
+
+// Compiles modules of a round until none is left.
+static void *compile_worker(void *arg)
+{
+	ModuleRound *round = arg;
+	for (;;) {
+		int index = atomic_fetch_add(&round->next, 1);
+		if (index >= round->count)
+			return NULL;
+		if (round->jobs[index].loaded)
+			compile_job(round->vm, &round->jobs[index]);
+	}
+}
+
+// Compiles the modules of a round on as many threads as there are
+// processors, the VM's thread being one of them. A round that can't start
+// threads is compiled by the VM's thread alone.
+static void compile_round(ModuleRound *round)
+{
+	pthread_t threads[MODULE_BATCH];
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	int threadCount = round->count < processors ? round->count :
+						      (int)processors;
+	int started = 0;
+
+	while (started < threadCount - 1 &&
+	       pthread_create(&threads[started], NULL, compile_worker,
+			      round) == 0)
+		started++;
+
+	compile_worker(round);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+// Compiles the modules of an import list and those they import, a round at
+// a time, and registers them. Paths are appended to the list as modules
+// import them.
+//
+// Returns:
+//   Whether every module compiled
+static bool compile_modules(VM *vm, ModuleList *imports)
+{
+	ModuleJob jobs[MODULE_BATCH];
+	bool compiled = true;
+	int first = 0;
+
+	while (compiled && first < imports->count) {
+		// Take the next modules that weren't compiled before
+		int count = 0;
+		while (first < imports->count && count < MODULE_BATCH) {
+			char *path = imports->paths[first++];
+			Value module;
+			bool taken = find_module(vm, path, &module);
+			for (int i = 0; i < count && !taken; i++)
+				taken = strcmp(jobs[i].path, path) == 0;
+			if (taken)
+				continue;
+
+			ModuleJob *job = &jobs[count++];
+			job->path = path;
+			job->loaded = load_source(path, &job->source);
+			job->function = NULL;
+			init_heap(&job->heap);
+			init_module_list(&job->imports);
+			if (!job->loaded) {
+				fprintf(stderr,
+					"Could not read module \"%s\": %s.\n",
+					path, strerror(errno));
+				compiled = false;
+			}
+		}
+
+		ModuleRound round;
+		round.vm = vm;
+		round.jobs = jobs;
+		round.count = count;
+		atomic_init(&round.next, 0);
+		compile_round(&round);
+
+		// Every heap is adopted before anything is allocated, since
+		// the others may refer to strings only the VM holds
+		for (int i = 0; i < count; i++) {
+			adopt_heap(vm, &jobs[i].heap);
+			push(vm, jobs[i].function != NULL ?
+				     OBJ_VAL(jobs[i].function) :
+				     NIL_VAL);
+		}
+
+		for (int i = 0; i < count; i++) {
+			ModuleJob *job = &jobs[i];
+			if (job->function != NULL)
+				register_module(vm, job->path,
+						OBJ_VAL(job->function));
+			else
+				compiled = false;
+
+			for (int j = 0; j < job->imports.count; j++)
+				add_module(imports, job->imports.paths[j]);
+			free_module_list(&job->imports);
+			if (job->loaded)
+				free_source(&job->source);
+		}
+
+		for (int i = 0; i < count; i++)
+			pop(vm);
+	}
+
+	return compiled;
+}
+
+void set_program_directory(VM *vm, const char *path)
+{
+	free(vm->directory);
+	vm->directory = directory_of(path);
+}
+
+ObjFunction *compile_program(VM *vm, const char *source, const char *path)
+{
+	ModuleList imports;
+	init_module_list(&imports);
+
+	set_program_directory(vm, path);
+	ObjFunction *function = compile_module(vm, source, vm->directory,
+					       NULL, &imports);
+
+	if (function != NULL) {
+		push(vm, OBJ_VAL(function));
+
+		// A module that imports the program doesn't run it again
+		char *resolved = NULL;
+		if (path != NULL && strcmp(path, STDIN_PATH) != 0)
+			resolved = realpath(path, NULL);
+		if (resolved != NULL)
+			register_module(vm, resolved, BOOL_VAL(true));
+		free(resolved);
+
+		if (!compile_modules(vm, &imports))
+			function = NULL;
+		pop(vm);
+	}
+
+	free_module_list(&imports);
+	return function;
+}
+
+bool load_module(VM *vm, ObjString *path)
+{
+	ModuleList imports;
+	init_module_list(&imports);
+	add_module(&imports, path->chars);
+
+	bool loaded = compile_modules(vm, &imports);
+	free_module_list(&imports);
+	return loaded;
+}
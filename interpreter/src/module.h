@@ -0,0 +1,70 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains modules, the files a program imports with `caravan "path";`. Each module is
+// compiled once per VM into a script function of its own, which runs the first time the module
+// is imported and defines its globals for the whole program. The modules of a program are
+// compiled before it starts, a round of imports at a time with each round compiled in parallel.
+
+#ifndef xanadu_module_h
+#define xanadu_module_h
+
+#include "common.h"
+#include "object.h"
+
+// Paths of the modules imported by a compiled source.
+typedef struct {
+	int count; // Number of paths
+	int capacity; // Capacity of the paths array
+	char **paths; // Resolved paths, owned by the list
+} ModuleList;
+
+// Initializes an empty list.
+void init_module_list(ModuleList *list);
+
+// Frees the paths of a list and resets it.
+void free_module_list(ModuleList *list);
+
+// Appends a copy of a resolved path to a list.
+void add_module(ModuleList *list, const char *path);
+
+// Resolves the path of an import against the directory of the importing
+// file.
+//
+// Returns:
+//   The canonical path of the module, to be released with free(), or NULL if
+//   it doesn't exist
+char *resolve_module_path(const char *directory, const char *path);
+
+// Makes the directory of a program's file the one the files it spawns as
+// isolates are relative to, like its imports.
+//
+// Parameters:
+//   vm - VM running the program
+//   path - Path of the program's source or bytecode file, or NULL if it has
+//          none, which makes it the working directory
+void set_program_directory(VM *vm, const char *path);
+
+// Compiles a program and every module it imports, directly or not, and
+// registers the modules with the VM so they run when first imported.
+//
+// Parameters:
+//   vm - VM the program and its modules are compiled for
+//   source - Source of the program
+//   path - Path of the program's file, which imports are relative to, or
+//          NULL if it has none
+//
+// Returns:
+//   The program's script function, or NULL if it or a module didn't compile
+ObjFunction *compile_program(VM *vm, const char *source, const char *path);
+
+// Compiles a module that a VM imported without compiling it with its
+// program, like those imported by code loaded from bytecode or typed into
+// the REPL, along with the modules it imports.
+//
+// Returns:
+//   Whether the module compiled and was registered
+bool load_module(VM *vm, ObjString *path);
+
+#endif
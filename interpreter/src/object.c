@@ -2,8 +2,8 @@
 // Use of this source code is governed by an MIT
 // license that can be found in the LICENSE file.
 
-#define ALLOCATE_OBJ(type, objectType) \
-	(type *)allocate_object(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+	(type *)allocate_object(vm, sizeof(type), objectType)
 
 #include <stdint.h>
 #include <stdio.h>
@@ -28,6 +28,89 @@ static void print_function(ObjFunction *function)
 	printf("<fn %s>", function->name->chars);
 }
 
+// Arrays and maps being printed, innermost last, so that one inside itself
+// is printed as [...] or {...} instead of forever
+#define PRINT_DEPTH_MAX 64
+static _Thread_local Obj *printing[PRINT_DEPTH_MAX];
+static _Thread_local int printingCount = 0;
+
+// Check if an array or map can be printed, and remember that it's being
+// printed if so
+// Parameters:
+//   object - The array or map
+// Returns:
+//   false if it's being printed already, or too deep to print
+static bool begin_printing(Obj *object)
+{
+	for (int i = 0; i < printingCount; i++) {
+		if (printing[i] == object)
+			return false;
+	}
+	if (printingCount == PRINT_DEPTH_MAX)
+		return false;
+
+	printing[printingCount++] = object;
+	return true;
+}
+
+// Print the elements of an array between brackets
+// Parameters:
+//   array - The array to print
+static void print_array(ObjArray *array)
+{
+	if (!begin_printing((Obj *)array)) {
+		printf("[...]");
+		return;
+	}
+
+	printf("[");
+	for (int i = 0; i < array->elements.count; i++) {
+		if (i > 0)
+			printf(", ");
+		print_value(array->elements.values[i]);
+	}
+	printf("]");
+	printingCount--;
+}
+
+// Print the elements of a float array between brackets
+// Parameters:
+//   array - The array to print
+static void print_float_array(ObjFloatArray *array)
+{
+	printf("[");
+	for (int i = 0; i < array->count; i++)
+		printf(i > 0 ? ", %g" : "%g", array->values[i]);
+	printf("]");
+}
+
+// Print the keys and values of a map between braces
+// Parameters:
+//   map - The map to print
+static void print_map(ObjMap *map)
+{
+	if (!begin_printing((Obj *)map)) {
+		printf("{...}");
+		return;
+	}
+
+	printf("{");
+	bool first = true;
+	for (int i = 0; i < map->table.capacity; i++) {
+		ValueEntry *entry = &map->table.entries[i];
+		if (IS_NIL(entry->key))
+			continue;
+		if (!first)
+			printf(", ");
+		print_value(entry->key);
+		printf(": ");
+		print_value(entry->value);
+		first = false;
+	}
+	printf("}");
+	printingCount--;
+}
+
 // Print the representation of an object to the output stream
 // Parameters:
 //   value - The value representing the object to print
@@ -66,23 +149,44 @@ void print_object(Value value)
 		// Print upvalue placeholder
 		printf("upvalue");
 		break;
+	case OBJ_CHANNEL:
+		printf("<channel>");
+		break;
+	case OBJ_ISOLATE:
+		printf("<isolate>");
+		break;
+	case OBJ_FIBER:
+		printf("<fiber>");
+		break;
+	case OBJ_ARRAY:
+		print_array(AS_ARRAY(value));
+		break;
+	case OBJ_MAP:
+		print_map(AS_MAP(value));
+		break;
+	case OBJ_FLOAT_ARRAY:
+		print_float_array(AS_FLOAT_ARRAY(value));
+		break;
 	}
 }
 
 // Allocate a new object of a specified type and size
 // Parameters:
+//   vm - The VM that owns the object
 //   size - The size of the object to allocate
 //   type - The type of the object being allocated
 // Returns:
 //   A pointer to the newly allocated object
-static Obj *allocate_object(size_t size, ObjType type)
+static Obj *allocate_object(VM *vm, size_t size, ObjType type)
 {
 	// Allocate memory for the new object
-	Obj *object = (Obj *)reallocate(NULL, 0, size);
+	Obj *object = (Obj *)reallocate(vm, NULL, 0, size);
+	Obj **objects = threadHeap != NULL ? &threadHeap->objects :
+					      &vm->objects;
 	object->type = type;
-	object->next = vm.objects; // Link new object into the list
+	object->next = *objects; // Link new object into the list
 	object->is_marked = false; // Initial state: not marked for GC
-	vm.objects = object; // Update the head of the list
+	*objects = object; // Update the head of the list
 
 #ifdef DEBUG_LOG_GC
 	// Log the allocation if debugging GC
@@ -109,120 +213,170 @@ static uint32_t hash_string(const char *key, int length)
 
 // Allocate a new ObjString and initialize it
 // Parameters:
+//   vm - The VM that owns the object
 //   chars - The character array for the string
 //   length - The length of the string
 //   hash - The precomputed hash value of the string
 // Returns:
 //   A pointer to the newly allocated ObjString
-static ObjString *allocate_string(char *chars, int length, uint32_t hash)
+static ObjString *allocate_string(VM *vm, char *chars, int length,
+				  uint32_t hash)
 {
 	// Allocate and initialize a new string object
-	ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+	ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
 	string->length = length;
 	string->chars = chars;
 	string->hash = hash;
 
+	// A thread compiling a module interns into its own heap, which
+	// doesn't collect
+	if (threadHeap != NULL) {
+		insert_into_table(vm, &threadHeap->strings, string, NIL_VAL);
+		return string;
+	}
+
 	// Manage the object in the GC and insert into the hash table
-	push(OBJ_VAL(string));
-	insert_into_table(&vm.strings, string, NIL_VAL);
-	pop();
+	push(vm, OBJ_VAL(string));
+	insert_into_table(vm, &vm->strings, string, NIL_VAL);
+	pop(vm);
 
 	return string;
 }
 
+// Find an interned string, which on a thread compiling a module may be the
+// VM's or one interned into the thread's heap
+static ObjString *find_interned(VM *vm, const char *chars, int length,
+				uint32_t hash)
+{
+	ObjString *interned =
+		table_find_string(&vm->strings, chars, length, hash);
+	if (interned == NULL && threadHeap != NULL)
+		interned = table_find_string(&threadHeap->strings, chars,
+					     length, hash);
+	return interned;
+}
+
 // Copy a string into a new ObjString and return it
 // Parameters:
+//   vm - The VM that owns the object
 //   chars - The character array of the string to copy
 //   length - The length of the string
 // Returns:
 //   A pointer to the new ObjString
-ObjString *copy_string(const char *chars, int length)
+ObjString *copy_string(VM *vm, const char *chars, int length)
 {
 	// Compute hash value of the string
 	uint32_t hash = hash_string(chars, length);
 	// Check if the string is already interned
-	ObjString *interned =
-		table_find_string(&vm.strings, chars, length, hash);
+	ObjString *interned = find_interned(vm, chars, length, hash);
 
 	if (interned != NULL)
 		return interned; // Return existing string if found
 
 	// Allocate memory for a new string and copy the contents
-	char *heap_chars = ALLOCATE(char, length + 1);
+	char *heap_chars = ALLOCATE(vm, char, length + 1);
 	memcpy(heap_chars, chars, length);
 	heap_chars[length] = '\0'; // Null-terminate the string
 
 	// Allocate and return the new string object
-	return allocate_string(heap_chars, length, hash);
+	return allocate_string(vm, heap_chars, length, hash);
 }
 
 // Create a new ObjString by taking ownership of an existing character array
 // Parameters:
+//   vm - The VM that owns the object
 //   chars - The character array for the string (will be freed if already interned)
 //   length - The length of the string
 // Returns:
 //   A pointer to the new ObjString
-ObjString *take_string(char *chars, int length)
+ObjString *take_string(VM *vm, char *chars, int length)
 {
 	// Compute hash value of the string
 	uint32_t hash = hash_string(chars, length);
 
 	// Check if the string is already interned
-	ObjString *interned =
-		table_find_string(&vm.strings, chars, length, hash);
+	ObjString *interned = find_interned(vm, chars, length, hash);
 	if (interned != NULL) {
 		// Free the old memory and return the interned string
-		FREE_ARRAY(char, chars, length + 1);
+		FREE_ARRAY(vm, char, chars, length + 1);
 		return interned;
 	}
 
 	// Allocate and return the new string object
-	return allocate_string(chars, length, hash);
+	return allocate_string(vm, chars, length, hash);
 }
 
 // Create a new ObjFunction object
+// Parameters:
+//   vm - The VM that owns the function
 // Returns:
 //   A pointer to the newly created ObjFunction
-ObjFunction *new_function(void)
+ObjFunction *new_function(VM *vm)
 {
 	// Allocate and initialize a new function object
-	ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+	ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
 	function->arity = 0; // Default arity is 0
 	function->upvalueCount = 0; // No upvalues initially
+	function->slotCount = 0; // No locals initially
 	function->name = NULL; // Function name is not set
+	function->closure = NULL; // Created by the first shared_closure()
+	function->image = NULL; // Not loaded from a bytecode image
+	function->imageIndex = 0;
+	function->lazy = NULL; // Compiled eagerly
 
 	// Initialize the bytecode chunk for the function
 	init_chunk(&function->chunk);
 	return function;
 }
 
+// Get the closure shared by all uses of a function without upvalues
+// Parameters:
+//   vm - The VM that owns the object
+//   function - The function that the closure wraps
+// Returns:
+//   The function's shared ObjClosure, created on the first call
+ObjClosure *shared_closure(VM *vm, ObjFunction *function)
+{
+	if (function->closure == NULL)
+		function->closure = new_closure(vm, function);
+	return function->closure;
+}
+
 // Create a new ObjNative object for a native function
 // Parameters:
+//   vm - The VM that owns the object
 //   function - The native function pointer
+//   data - Data passed to the function on every call
+//   dataSize - Bytes of data freed with the native, 0 if borrowed
 // Returns:
 //   A pointer to the newly created ObjNative
-ObjNative *new_native(NativeFn function)
+ObjNative *new_native(VM *vm, NativeFn function, void *data,
+		      size_t dataSize)
 {
-	ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+	ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
 	native->function = function; // Set the native function pointer
+	native->data = data;
+	native->dataSize = dataSize;
 	return native;
 }
 
 // Create a new ObjClosure object
 // Parameters:
+//   vm - The VM that owns the object
 //   function - The function that this closure wraps
 // Returns:
 //   A pointer to the newly created ObjClosure
-ObjClosure *new_closure(ObjFunction *function)
+ObjClosure *new_closure(VM *vm, ObjFunction *function)
 {
 	// Allocate and initialize upvalues
-	ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
+	ObjUpvalue **upvalues =
+		ALLOCATE(vm, ObjUpvalue *, function->upvalueCount);
 	for (int i = 0; i < function->upvalueCount; i++) {
 		upvalues[i] = NULL; // Upvalues are initially uninitialized
 	}
 
 	// Create and initialize the closure object
-	ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+	ObjClosure *closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
 	closure->function = function;
 	closure->upvalues = upvalues;
 	closure->upvalueCount = function->upvalueCount;
@@ -231,26 +385,28 @@ ObjClosure *new_closure(ObjFunction *function)
 
 // Create a new ObjUpvalue object
 // Parameters:
+//   vm - The VM that owns the object
 //   slot - The location of the upvalue on the stack
 // Returns:
 //   A pointer to the newly created ObjUpvalue
-ObjUpvalue *new_upvalue(Value *slot)
+ObjUpvalue *new_upvalue(VM *vm, Value *slot)
 {
-	ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+	ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
 	upvalue->location = slot; // Set the location of the upvalue
-	upvalue->next = NULL; // No next upvalue initially
 	upvalue->closed = NIL_VAL; // Initial closed value is NIL
+	upvalue->fiber = NULL; // Set by the VM when it points into a stack
 	return upvalue;
 }
 
 // Create a new ObjClass object
 // Parameters:
+//   vm - The VM that owns the object
 //   name - The name of the class
 // Returns:
 //   A pointer to the newly created ObjClass
-ObjClass *new_class(ObjString *name)
+ObjClass *new_class(VM *vm, ObjString *name)
 {
-	ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+	ObjClass *klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
 	klass->name = name; // Set the class name
 	init_table(&klass->methods); // Initialize the class methods table
 
@@ -259,12 +415,13 @@ ObjClass *new_class(ObjString *name)
 
 // Create a new ObjInstance object
 // Parameters:
+//   vm - The VM that owns the object
 //   class_ - The class to which this instance belongs
 // Returns:
 //   A pointer to the newly created ObjInstance
-ObjInstance *new_instance(ObjClass *class_)
+ObjInstance *new_instance(VM *vm, ObjClass *class_)
 {
-	ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+	ObjInstance *instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
 	instance->class_ = class_; // Set the class of the instance
 	init_table(&instance->fields); // Initialize the instance fields table
 	return instance;
@@ -272,14 +429,129 @@ ObjInstance *new_instance(ObjClass *class_)
 
 // Create a new ObjBoundMethod object
 // Parameters:
+//   vm - The VM that owns the object
 //   receiver - The instance that the method is bound to
 //   method - The method (closure) being bound
 // Returns:
 //   A pointer to the newly created ObjBoundMethod
-ObjBoundMethod *new_bound_method(Value receiver, ObjClosure *method)
+ObjBoundMethod *new_bound_method(VM *vm, Value receiver,
+				 ObjClosure *method)
 {
-	ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+	ObjBoundMethod *bound =
+		ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
 	bound->receiver = receiver; // Set the bound instance
 	bound->method = method; // Set the bound method (closure)
 	return bound;
 }
+
+// Create a new ObjChannel object
+// Parameters:
+//   vm - The VM that owns the object
+//   channel - The channel, whose reference the object takes over
+// Returns:
+//   A pointer to the newly created ObjChannel
+ObjChannel *new_channel(VM *vm, struct Channel *channel)
+{
+	ObjChannel *object = ALLOCATE_OBJ(vm, ObjChannel, OBJ_CHANNEL);
+	object->channel = channel;
+	return object;
+}
+
+// Create a new ObjIsolate object
+// Parameters:
+//   vm - The VM that owns the object
+//   isolate - The isolate, whose reference the object takes over
+// Returns:
+//   A pointer to the newly created ObjIsolate
+ObjIsolate *new_isolate(VM *vm, struct Isolate *isolate)
+{
+	ObjIsolate *object = ALLOCATE_OBJ(vm, ObjIsolate, OBJ_ISOLATE);
+	object->isolate = isolate;
+	return object;
+}
+
+// Create a new ObjFiber object with a small stack, its function at the
+// bottom of it, and no frames
+// Parameters:
+//   vm - The VM that owns the object
+//   closure - The function the fiber runs, NULL for the main fiber, which
+//             runs on the VM's stack and gets no stack of its own
+// Returns:
+//   A pointer to the newly created ObjFiber
+ObjFiber *new_fiber(VM *vm, ObjClosure *closure)
+{
+	// The arrays are allocated before the object, which nothing roots yet
+	int capacity = 0;
+	Value *stack = NULL;
+	CallFrame *frames = NULL;
+	ObjUpvalue **openUpvalues = NULL;
+	if (closure != NULL) {
+		capacity = FIBER_STACK_MIN + STACK_HEADROOM;
+		frames = ALLOCATE(vm, CallFrame, FRAMES_MAX);
+		openUpvalues = ALLOCATE(vm, ObjUpvalue *, capacity);
+		for (int i = 0; i < capacity; i++)
+			openUpvalues[i] = NULL;
+		stack = ALLOCATE(vm, Value, capacity);
+		stack[0] = OBJ_VAL(closure);
+	}
+
+	ObjFiber *fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+	fiber->closure = closure;
+	fiber->caller = NULL;
+	fiber->state = FIBER_NEW;
+	fiber->stack = stack;
+	fiber->stackTop = closure != NULL ? stack + 1 : NULL;
+	fiber->stackEnd = closure != NULL ? stack + FIBER_STACK_MIN : NULL;
+	fiber->stackCapacity = capacity;
+	fiber->frames = frames;
+	fiber->frameCount = 0;
+	fiber->baseFrame = -1;
+	fiber->openUpvalues = openUpvalues;
+	fiber->openTop = 0;
+	fiber->retryArgs = -1;
+	return fiber;
+}
+
+// Create a new empty ObjArray object
+// Parameters:
+//   vm - The VM that owns the array
+// Returns:
+//   A pointer to the newly created ObjArray
+ObjArray *new_array(VM *vm)
+{
+	ObjArray *array = ALLOCATE_OBJ(vm, ObjArray, OBJ_ARRAY);
+	init_value_array(&array->elements);
+	return array;
+}
+
+// Create a new empty ObjMap object
+// Parameters:
+//   vm - The VM that owns the map
+// Returns:
+//   A pointer to the newly created ObjMap
+ObjMap *new_map(VM *vm)
+{
+	ObjMap *map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+	init_value_table(&map->table);
+	return map;
+}
+
+// Create a new ObjFloatArray object whose elements are all 0
+// Parameters:
+//   vm    - The VM that owns the array
+//   count - The number of elements
+// Returns:
+//   A pointer to the newly created ObjFloatArray
+ObjFloatArray *new_float_array(VM *vm, int count)
+{
+	// The elements are allocated before the object, which nothing roots
+	double *values = ALLOCATE(vm, double, count);
+	for (int i = 0; i < count; i++)
+		values[i] = 0;
+
+	ObjFloatArray *array =
+		ALLOCATE_OBJ(vm, ObjFloatArray, OBJ_FLOAT_ARRAY);
+	array->count = count;
+	array->values = values;
+	return array;
+}
@@ -34,7 +34,7 @@
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 
 // Convert a Value to an ObjNative object
-#define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
 
 // Convert a Value to an ObjClosure object
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
@@ -60,6 +60,42 @@
 // Convert a Value to an ObjBoundMethod object
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
 
+// Check if a Value is a channel object
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
+
+// Convert a Value to the channel an ObjChannel refers to
+#define AS_CHANNEL(value) (((ObjChannel *)AS_OBJ(value))->channel)
+
+// Check if a Value is an isolate object
+#define IS_ISOLATE(value) isObjType(value, OBJ_ISOLATE)
+
+// Convert a Value to the isolate an ObjIsolate refers to
+#define AS_ISOLATE(value) (((ObjIsolate *)AS_OBJ(value))->isolate)
+
+// Check if a Value is a fiber object
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
+
+// Convert a Value to an ObjFiber object
+#define AS_FIBER(value) ((ObjFiber *)AS_OBJ(value))
+
+// Check if a Value is an array object
+#define IS_ARRAY(value) isObjType(value, OBJ_ARRAY)
+
+// Convert a Value to an ObjArray object
+#define AS_ARRAY(value) ((ObjArray *)AS_OBJ(value))
+
+// Check if a Value is a map object
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+
+// Convert a Value to an ObjMap object
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+
+// Check if a Value is a float array object
+#define IS_FLOAT_ARRAY(value) isObjType(value, OBJ_FLOAT_ARRAY)
+
+// Convert a Value to an ObjFloatArray object
+#define AS_FLOAT_ARRAY(value) ((ObjFloatArray *)AS_OBJ(value))
+
 // Enum for different object types in the VM
 typedef enum {
 	OBJ_STRING, // String object
@@ -70,6 +106,12 @@ typedef enum {
 	OBJ_CLASS, // Class object
 	OBJ_INSTANCE, // Instance of a class
 	OBJ_BOUND_METHOD, // Bound method object
+	OBJ_CHANNEL, // Reference to a channel between isolates
+	OBJ_ISOLATE, // Reference to an isolate running on another thread
+	OBJ_FIBER, // Fiber with a call stack of its own
+	OBJ_ARRAY, // Growable array of values
+	OBJ_MAP, // Hash map from values to values
+	OBJ_FLOAT_ARRAY, // Fixed number of unboxed doubles
 } ObjType;
 
 // Base structure for all objects in the Xanadu VM
@@ -79,22 +121,42 @@ struct Obj {
 	bool is_marked; // Flag indicating if the object is marked for garbage collection
 };
 
+// Where to find the body of a function that is compiled on its first call.
+// The function's upvalues are already laid out, and its body resolves them
+// by name since the compilers of the enclosing functions are gone by then.
+typedef struct {
+	ObjString *source; // Source text the function was declared in
+	int offset; // Offset of the parameter list in the source
+	int line; // Line of the parameter list
+	int type; // FunctionType the body is compiled as
+	bool inClass; // Whether the function is declared inside a class
+	bool hasSuperclass; // Whether that class has a superclass
+	ObjString **upvalueNames; // Name of each upvalue, NULL until set
+} LazyFunction;
+
 // Object representing a function in the VM
 typedef struct {
 	Obj obj; // Base object structure
+	struct ObjClosure *closure; // Closure shared by every use, if it captures nothing
 	int arity; // Number of arguments the function takes
 	Chunk chunk; // Bytecode chunk representing the function's code
 	ObjString *name; // Name of the function
 	int upvalueCount; // Number of upvalues captured by the function
+	int slotCount; // Most stack slots a call uses, locals and temporaries
+	struct Image *image; // Image to load the constants from before the first call, or NULL
+	uint32_t imageIndex; // Index of the function in its image
+	LazyFunction *lazy; // Body to compile before the first call, or NULL
 } ObjFunction;
 
 // Type for native functions (C functions callable from the VM)
-typedef Value (*NativeFn)(int argCount, Value *args);
+typedef Value (*NativeFn)(VM *vm, int argCount, Value *args, void *data);
 
 // Object representing a native function (C function) in the VM
 typedef struct {
 	Obj obj; // Base object structure
 	NativeFn function; // Pointer to the C function
+	void *data; // Passed to the function on every call
+	size_t dataSize; // Bytes of data freed with the native, 0 if borrowed
 } ObjNative;
 
 // Object representing a string in the VM
@@ -109,18 +171,25 @@ struct ObjString {
 typedef struct ObjUpvalue {
 	Obj obj; // Base object structure
 	Value *location; // Pointer to the stack location of the upvalue
-	struct ObjUpvalue *next; // Pointer to the next upvalue in the list
 	Value closed; // The value of the closed-over variable
+	struct ObjFiber *fiber; // Fiber whose stack holds it while it's open
 } ObjUpvalue;
 
 // Object representing a closure (function with captured upvalues) in the VM
-typedef struct {
+typedef struct ObjClosure {
 	Obj obj; // Base object structure
 	ObjFunction *function; // The function that this closure wraps
 	ObjUpvalue **upvalues; // Array of upvalues captured by the closure
 	int upvalueCount; // Number of upvalues associated with the closure
 } ObjClosure;
 
+// A call in progress
+typedef struct {
+	ObjClosure *closure; // The function being run
+	uint8_t *ip; // Next instruction to run
+	Value *slots; // First stack slot of the call, holding the callee
+} CallFrame;
+
 // Object representing a class in the VM
 typedef struct {
 	Obj obj; // Base object structure
@@ -142,6 +211,71 @@ typedef struct {
 	ObjClosure *method; // The method (closure) being bound
 } ObjBoundMethod;
 
+// Object holding a reference to a channel, which VMs on other threads may
+// hold references to as well
+typedef struct {
+	Obj obj; // Base object structure
+	struct Channel *channel; // The channel, released when this is freed
+} ObjChannel;
+
+// Object holding a reference to an isolate spawned by the VM
+typedef struct {
+	Obj obj; // Base object structure
+	struct Isolate *isolate; // The isolate, released when this is freed
+} ObjIsolate;
+
+// Where a fiber is in its life
+typedef enum {
+	FIBER_NEW, // Created, its function hasn't started
+	FIBER_RUNNING, // Running, or waiting for a fiber it resumed
+	FIBER_SUSPENDED, // Stopped at a yield until it's resumed
+	FIBER_WAITING, // A task that only the event loop resumes
+	FIBER_DONE, // Its function returned or failed
+} FiberState;
+
+// Object representing a fiber: a call stack of its own, which runs until
+// it yields and later resumes where it yielded. The registers of the
+// running fiber are kept in the VM and saved here when it switches away.
+typedef struct ObjFiber {
+	Obj obj; // Base object structure
+	ObjClosure *closure; // The function the fiber runs
+	struct ObjFiber *caller; // The fiber that resumed it, while it runs
+	FiberState state; // Where the fiber is in its life
+	Value *stack; // Its value stack
+	Value *stackTop; // Saved stack top
+	Value *stackEnd; // Calls may not use the slots from here up
+	int stackCapacity; // Number of slots of the stack, 0 if it's the VM's
+	CallFrame *frames; // Its call frames
+	int frameCount; // Saved number of frames in use
+	int baseFrame; // Saved frames below the innermost call into the VM
+	ObjUpvalue **openUpvalues; // Open upvalue of each stack slot, or NULL
+	int openTop; // Saved slot from which there are no open upvalues
+	int retryArgs; // Arguments of a native call made again once it's
+		       // resumed, -1 if there is none
+} ObjFiber;
+
+// Object representing an array, whose elements are stored one after the
+// other and grow as they're appended
+typedef struct {
+	Obj obj; // Base object structure
+	ValueArray elements; // The elements in order
+} ObjArray;
+
+// Object representing a map, which hashes numbers, strings and booleans by
+// value and other objects by identity
+typedef struct {
+	Obj obj; // Base object structure
+	ValueTable table; // The keys and their values
+} ObjMap;
+
+// Object representing an array of numbers stored as plain doubles, which
+// natives process in bulk
+typedef struct {
+	Obj obj; // Base object structure
+	int count; // Number of elements, fixed when it's created
+	double *values; // The elements
+} ObjFloatArray;
+
 // Check if a value is of a specific object type
 // Parameters:
 //   value - The value to check
@@ -155,11 +289,12 @@ static inline bool isObjType(Value value, ObjType type)
 
 // Create a new ObjString by copying the provided string
 // Parameters:
+//   vm     - The VM that owns the string
 //   chars  - The string to copy
 //   length - Length of the string
 // Returns:
 //   A pointer to the newly created ObjString
-ObjString *copy_string(const char *chars, int length);
+ObjString *copy_string(VM *vm, const char *chars, int length);
 
 // Print the type and value of an object to standard output
 // Parameters:
@@ -168,58 +303,130 @@ void print_object(Value value);
 
 // Create a new ObjString by taking ownership of the provided string
 // Parameters:
+//   vm     - The VM that owns the string
 //   chars  - The string to take ownership of
 //   length - Length of the string
 // Returns:
 //   A pointer to the newly created ObjString
-ObjString *take_string(char *chars, int length);
+ObjString *take_string(VM *vm, char *chars, int length);
 
 // Create a new ObjFunction object
+// Parameters:
+//   vm - The VM that owns the function
 // Returns:
 //   A pointer to the newly created ObjFunction
-ObjFunction *new_function(void);
+ObjFunction *new_function(VM *vm);
 
 // Create a new ObjNative object
 // Parameters:
+//   vm       - The VM that owns the object
 //   function - The native function to wrap
+//   data     - Data passed to the function on every call
+//   dataSize - Bytes of data allocated from the VM and freed with the
+//              native, or 0 if the data outlives it
 // Returns:
 //   A pointer to the newly created ObjNative
-ObjNative *new_native(NativeFn function);
+ObjNative *new_native(VM *vm, NativeFn function, void *data,
+		      size_t dataSize);
 
 // Create a new ObjClosure object
 // Parameters:
+//   vm       - The VM that owns the closure
 //   function - The function that the closure wraps
 // Returns:
 //   A pointer to the newly created ObjClosure
-ObjClosure *new_closure(ObjFunction *function);
+ObjClosure *new_closure(VM *vm, ObjFunction *function);
+
+// Get the closure of a function that captures no upvalues. All closures of
+// such a function behave the same, so a single one is created on first use
+// and kept alive by the function.
+// Parameters:
+//   vm       - The VM that owns the function
+//   function - The function, whose upvalueCount must be 0
+// Returns:
+//   The function's shared ObjClosure
+ObjClosure *shared_closure(VM *vm, ObjFunction *function);
 
 // Create a new ObjUpvalue object
 // Parameters:
+//   vm   - The VM that owns the upvalue
 //   slot - Pointer to the stack location of the upvalue
 // Returns:
 //   A pointer to the newly created ObjUpvalue
-ObjUpvalue *new_upvalue(Value *slot);
+ObjUpvalue *new_upvalue(VM *vm, Value *slot);
 
 // Create a new ObjClass object
 // Parameters:
+//   vm   - The VM that owns the class
 //   name - The name of the class
 // Returns:
 //   A pointer to the newly created ObjClass
-ObjClass *new_class(ObjString *name);
+ObjClass *new_class(VM *vm, ObjString *name);
 
 // Create a new ObjInstance object
 // Parameters:
+//   vm     - The VM that owns the instance
 //   class_ - The class that the instance belongs to
 // Returns:
 //   A pointer to the newly created ObjInstance
-ObjInstance *new_instance(ObjClass *class_);
+ObjInstance *new_instance(VM *vm, ObjClass *class_);
 
 // Create a new ObjBoundMethod object
 // Parameters:
+//   vm       - The VM that owns the bound method
 //   receiver - The instance to which the method is bound
 //   method   - The method (closure) being bound
 // Returns:
 //   A pointer to the newly created ObjBoundMethod
-ObjBoundMethod *new_bound_method(Value receiver, ObjClosure *method);
+ObjBoundMethod *new_bound_method(VM *vm, Value receiver,
+				 ObjClosure *method);
+
+// Create a new ObjChannel object
+// Parameters:
+//   vm      - The VM that owns the object
+//   channel - The channel, whose reference the object takes over
+// Returns:
+//   A pointer to the newly created ObjChannel
+ObjChannel *new_channel(VM *vm, struct Channel *channel);
+
+// Create a new ObjIsolate object
+// Parameters:
+//   vm      - The VM that owns the object
+//   isolate - The isolate, whose reference the object takes over
+// Returns:
+//   A pointer to the newly created ObjIsolate
+ObjIsolate *new_isolate(VM *vm, struct Isolate *isolate);
+
+// Create a new ObjFiber object with a small stack, its function at the
+// bottom of it, and no frames
+// Parameters:
+//   vm - The VM that owns the object
+//   closure - The function the fiber runs, NULL for the main fiber, which
+//             runs on the VM's stack and gets no stack of its own
+// Returns:
+//   A pointer to the newly created ObjFiber
+ObjFiber *new_fiber(VM *vm, ObjClosure *closure);
+
+// Create a new empty ObjArray object
+// Parameters:
+//   vm - The VM that owns the array
+// Returns:
+//   A pointer to the newly created ObjArray
+ObjArray *new_array(VM *vm);
+
+// Create a new empty ObjMap object
+// Parameters:
+//   vm - The VM that owns the map
+// Returns:
+//   A pointer to the newly created ObjMap
+ObjMap *new_map(VM *vm);
+
+// Create a new ObjFloatArray object whose elements are all 0
+// Parameters:
+//   vm    - The VM that owns the array
+//   count - The number of elements
+// Returns:
+//   A pointer to the newly created ObjFloatArray
+ObjFloatArray *new_float_array(VM *vm, int count);
 
 #endif
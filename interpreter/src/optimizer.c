@@ -0,0 +1,841 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the optimization passes that run on a function's IR. Every pass replaces
+// the instructions it removes with IR_NOP, and the IR is compacted once all passes are done.
+
+#include <string.h>
+
+#include "optimizer.h"
+#include "memory.h"
+#include "object.h"
+
+// Upper bound on the rounds of passes, in case a pass keeps undoing another.
+#define MAX_ROUNDS 16
+
+// Upper bound on the jumps followed when threading a single jump.
+#define MAX_HOPS 8
+
+// Returns whether an instruction is a jump to a label.
+static bool is_jump(int op)
+{
+	return op == OP_JUMP || op == OP_JUMP_IF_FALSE;
+}
+
+// Returns the index of the first instruction at or after `from` that isn't
+// a label or a removed instruction, or the instruction count if there is none.
+static int next_instruction(IrFunction *ir, int from)
+{
+	while (from < ir->count &&
+	       (ir->code[from].op == IR_LABEL || ir->code[from].op == IR_NOP))
+		from++;
+	return from;
+}
+
+// Returns the index of the instruction whose result an instruction consumes,
+// or -1 if it can't be known at compile time because a label, and therefore
+// possibly a jump from elsewhere, lies in between.
+static int previous_instruction(IrFunction *ir, int from)
+{
+	int i = from - 1;
+	while (i >= 0 && ir->code[i].op == IR_NOP)
+		i--;
+	if (i < 0 || ir->code[i].op == IR_LABEL || ir->code[i].op == IR_UPVALUE)
+		return -1;
+	return i;
+}
+
+// Reads the value pushed by a literal instruction.
+// Returns false if the instruction isn't a literal.
+static bool literal_value(IrInstr *instr, Chunk *chunk, Value *value)
+{
+	switch (instr->op) {
+	case OP_CONSTANT:
+		*value = chunk->constants.values[instr->operand];
+		return true;
+	case OP_NIL:
+		*value = NIL_VAL;
+		return true;
+	case OP_TRUE:
+		*value = BOOL_VAL(true);
+		return true;
+	case OP_FALSE:
+		*value = BOOL_VAL(false);
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Turns an instruction into the literal that pushes `value`.
+static void set_literal(VM *vm, IrInstr *instr, Chunk *chunk, Value value)
+{
+	instr->extra = 0;
+	if (IS_NIL(value)) {
+		instr->op = OP_NIL;
+	} else if (IS_BOOL(value)) {
+		instr->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+	} else {
+		instr->op = OP_CONSTANT;
+		instr->operand = add_constant(vm, chunk, value);
+	}
+}
+
+// Returns whether a value is false in a condition, like the VM's is_falsey().
+static bool falsey(Value value)
+{
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Returns whether an instruction only pushes a value, so it can be dropped
+// together with a POP of that value.
+static bool is_pure_push(int op)
+{
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_UPVALUE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Returns whether an instruction always leaves a number on the stack,
+// or raises a runtime error instead.
+static bool pushes_number(IrInstr *instr, Chunk *chunk)
+{
+	Value value;
+	switch (instr->op) {
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_NEGATE:
+	case OP_MODULO:
+	case OP_FLOOR_DIVIDE:
+	case OP_BIT_AND:
+	case OP_BIT_OR:
+	case OP_BIT_XOR:
+	case OP_SHIFT_LEFT:
+	case OP_SHIFT_RIGHT:
+		return true;
+	case OP_CONSTANT:
+		return literal_value(instr, chunk, &value) && IS_NUMBER(value);
+	default:
+		return false;
+	}
+}
+
+// Evaluates a binary operator on two literals. Returns false for the operand
+// types the VM rejects, so the runtime error is still raised when the code runs.
+static bool evaluate_binary(VM *vm, int op, Value a, Value b,
+			    Value *result)
+{
+	if (op == OP_EQUAL) {
+		*result = BOOL_VAL(values_equal(a, b));
+		return true;
+	}
+
+	if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+		ObjString *left = AS_STRING(a);
+		ObjString *right = AS_STRING(b);
+
+		// Built exactly like the VM's concatenate(), so the result is interned
+		int length = left->length + right->length;
+		char *chars = ALLOCATE(vm, char, length + 1);
+		memcpy(chars, left->chars, left->length);
+		memcpy(chars + left->length, right->chars, right->length);
+		chars[length] = '\0';
+		*result = OBJ_VAL(take_string(vm, chars, length));
+		return true;
+	}
+
+	if (!IS_NUMBER(a) || !IS_NUMBER(b))
+		return false;
+
+	switch (op) {
+	case OP_ADD:
+		*result = add_numbers(a, b);
+		return true;
+	case OP_SUBTRACT:
+		*result = subtract_numbers(a, b);
+		return true;
+	case OP_MULTIPLY:
+		*result = multiply_numbers(a, b);
+		return true;
+	case OP_DIVIDE:
+		*result = divide_numbers(a, b);
+		return true;
+	case OP_GREATER:
+		*result = BOOL_VAL(less_than(b, a));
+		return true;
+	case OP_LESS:
+		*result = BOOL_VAL(less_than(a, b));
+		return true;
+	case OP_MODULO:
+		return modulo_numbers(a, b, result) == NULL;
+	case OP_FLOOR_DIVIDE:
+		return floor_divide_numbers(a, b, result) == NULL;
+	case OP_BIT_AND:
+		return and_numbers(a, b, result) == NULL;
+	case OP_BIT_OR:
+		return or_numbers(a, b, result) == NULL;
+	case OP_BIT_XOR:
+		return xor_numbers(a, b, result) == NULL;
+	case OP_SHIFT_LEFT:
+		return shift_left_numbers(a, b, result) == NULL;
+	case OP_SHIFT_RIGHT:
+		return shift_right_numbers(a, b, result) == NULL;
+	default:
+		return false;
+	}
+}
+
+// Removes an operation whose result equals its left operand, for the
+// identities that hold for every number: x - 0 and x * 1 with integer
+// literals. Additions are left alone since -0 + 0 is 0, divisions since
+// they turn integers into doubles, and operands that may not be numbers
+// too, since the VM raises an error for them.
+static bool simplify_identity(IrFunction *ir, Chunk *chunk, int i)
+{
+	int right = previous_instruction(ir, i);
+	if (right == -1)
+		return false;
+	int left = previous_instruction(ir, right);
+	if (left == -1 || !pushes_number(&ir->code[left], chunk))
+		return false;
+
+	Value value;
+	if (!literal_value(&ir->code[right], chunk, &value) || !IS_INT(value))
+		return false;
+
+	int64_t identity = ir->code[i].op == OP_SUBTRACT ? 0 : 1;
+	if (AS_INT(value) != identity)
+		return false;
+
+	ir->code[right].op = IR_NOP;
+	ir->code[i].op = IR_NOP;
+	return true;
+}
+
+// Evaluates operations on literal operands at compile time and simplifies
+// the code around them:
+//   - unary and binary operators on literals become a single literal, with
+//     results computed exactly like the VM computes them
+//   - double NOTs of values that are already booleans cancel out
+//   - a literal condition turns its conditional jump into either nothing or
+//     an unconditional jump
+//   - a value that is pushed without side effects and popped right away is
+//     dropped
+static bool fold_constants(IrFunction *ir, Chunk *chunk)
+{
+	bool changed = false;
+
+	for (int i = 0; i < ir->count; i++) {
+		IrInstr *instr = &ir->code[i];
+		int operand = previous_instruction(ir, i);
+		if (operand == -1)
+			continue;
+
+		IrInstr *previous = &ir->code[operand];
+		Value a, b, result;
+
+		switch (instr->op) {
+		case OP_NEGATE:
+			// Double negations stay, since negating the smallest
+			// integer gives a double and negating that doesn't
+			// give it back
+			if (literal_value(previous, chunk, &a) && IS_NUMBER(a)) {
+				set_literal(ir->vm, previous, chunk,
+					    negate_number(a));
+				instr->op = IR_NOP;
+				changed = true;
+			}
+			break;
+		case OP_NOT:
+			if (literal_value(previous, chunk, &a)) {
+				set_literal(ir->vm, previous, chunk,
+					    BOOL_VAL(falsey(a)));
+				instr->op = IR_NOP;
+				changed = true;
+			} else if (previous->op == OP_NOT &&
+				   (operand = previous_instruction(ir, operand)) != -1 &&
+				   (ir->code[operand].op == OP_EQUAL ||
+				    ir->code[operand].op == OP_GREATER ||
+				    ir->code[operand].op == OP_LESS)) {
+				// A comparison always pushes a boolean
+				previous->op = IR_NOP;
+				instr->op = IR_NOP;
+				changed = true;
+			}
+			break;
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+			if (simplify_identity(ir, chunk, i)) {
+				changed = true;
+				break;
+			}
+			// Fall through
+		case OP_DIVIDE:
+		case OP_MODULO:
+		case OP_FLOOR_DIVIDE:
+		case OP_BIT_AND:
+		case OP_BIT_OR:
+		case OP_BIT_XOR:
+		case OP_SHIFT_LEFT:
+		case OP_SHIFT_RIGHT:
+		case OP_ADD:
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS: {
+			int left = previous_instruction(ir, operand);
+			if (left == -1 || !literal_value(&ir->code[left], chunk, &a) ||
+			    !literal_value(previous, chunk, &b) ||
+			    !evaluate_binary(ir->vm, instr->op, a, b, &result))
+				break;
+
+			// The operands stay reachable through the constant pool
+			set_literal(ir->vm, &ir->code[left], chunk, result);
+			previous->op = IR_NOP;
+			instr->op = IR_NOP;
+			changed = true;
+			break;
+		}
+		case OP_JUMP_IF_FALSE:
+			if (literal_value(previous, chunk, &a)) {
+				instr->op = falsey(a) ? OP_JUMP : IR_NOP;
+				changed = true;
+			}
+			break;
+		case OP_POP:
+			if (is_pure_push(previous->op)) {
+				previous->op = IR_NOP;
+				instr->op = IR_NOP;
+				changed = true;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return changed;
+}
+
+// Records where every label is placed. Labels that were removed are -1.
+static void find_labels(IrFunction *ir, int *positions)
+{
+	for (int i = 0; i < ir->labelCount; i++)
+		positions[i] = -1;
+	for (int i = 0; i < ir->count; i++) {
+		if (ir->code[i].op == IR_LABEL)
+			positions[ir->code[i].label] = i;
+	}
+}
+
+// Retargets jumps that land on another jump to that jump's destination.
+//
+// An unconditional jump can follow any jump. A conditional jump leaves its
+// condition on the stack, so it can follow another conditional jump, which
+// tests the same value, but only forward: there is no backward conditional
+// jump in the bytecode.
+static bool thread_jumps(IrFunction *ir, int *positions)
+{
+	bool changed = false;
+	find_labels(ir, positions);
+
+	for (int i = 0; i < ir->count; i++) {
+		IrInstr *instr = &ir->code[i];
+		if (!is_jump(instr->op))
+			continue;
+
+		for (int hop = 0; hop < MAX_HOPS; hop++) {
+			int next = next_instruction(ir,
+						    positions[instr->label]);
+			if (next == ir->count)
+				break;
+
+			IrInstr *target = &ir->code[next];
+			if (target->op != OP_JUMP && target->op != instr->op)
+				break;
+			if (target->label == instr->label)
+				break; // Jump to itself
+			if (instr->op == OP_JUMP_IF_FALSE &&
+			    positions[target->label] < i)
+				break;
+
+			instr->label = target->label;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+// Removes jumps to the instruction that follows them anyway.
+static bool remove_redundant_jumps(IrFunction *ir, int *positions)
+{
+	bool changed = false;
+	find_labels(ir, positions);
+
+	for (int i = 0; i < ir->count; i++) {
+		IrInstr *instr = &ir->code[i];
+		if (!is_jump(instr->op))
+			continue;
+
+		// Only labels lie between the jump and its target
+		int target = positions[instr->label];
+		if (target > i && next_instruction(ir, i + 1) > target) {
+			instr->op = IR_NOP;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+// Removes the instructions that can't be reached: everything after an
+// unconditional jump or a return up to the next label some live jump
+// targets. Labels no jump targets are removed as well.
+static bool remove_dead_code(IrFunction *ir, int *references)
+{
+	bool changed = false;
+
+	for (int i = 0; i < ir->labelCount; i++)
+		references[i] = 0;
+	for (int i = 0; i < ir->count; i++) {
+		if (ir_has_label(ir->code[i].op))
+			references[ir->code[i].label]++;
+	}
+
+	bool reachable = true;
+	for (int i = 0; i < ir->count; i++) {
+		IrInstr *instr = &ir->code[i];
+
+		if (instr->op == IR_NOP)
+			continue;
+		if (instr->op == IR_LABEL) {
+			if (references[instr->label] > 0) {
+				reachable = true;
+			} else {
+				instr->op = IR_NOP;
+			}
+			continue;
+		}
+
+		if (!reachable) {
+			// Dropping a jump can make its target unreachable too
+			if (ir_has_label(instr->op))
+				references[instr->label]--;
+			instr->op = IR_NOP;
+			changed = true;
+			continue;
+		}
+
+		if (instr->op == OP_JUMP || instr->op == OP_RETURN)
+			reachable = false;
+	}
+
+	return changed;
+}
+
+// Initializes an empty table of inline candidates.
+void init_inline_table(VM *vm, InlineTable *table)
+{
+	table->vm = vm;
+	table->count = 0;
+	table->capacity = 0;
+	table->candidates = NULL;
+}
+
+// Frees the candidates of a table and resets it.
+void free_inline_table(InlineTable *table)
+{
+	for (int i = 0; i < table->count; i++) {
+		FREE_ARRAY(table->vm, IrInstr, table->candidates[i].code,
+			   table->candidates[i].count);
+	}
+	FREE_ARRAY(table->vm, InlineCandidate, table->candidates,
+		   table->capacity);
+	init_inline_table(table->vm, table);
+}
+
+// Marks the functions and names of the candidates for the garbage collector.
+void mark_inline_table(VM *vm, InlineTable *table)
+{
+	for (int i = 0; i < table->count; i++) {
+		mark_object(vm, (Obj *)table->candidates[i].name);
+		mark_object(vm, (Obj *)table->candidates[i].function);
+	}
+}
+
+// Returns the candidate declared under `name`, or NULL if there is none.
+static InlineCandidate *find_candidate(InlineTable *table, ObjString *name)
+{
+	for (int i = 0; i < table->count; i++) {
+		if (table->candidates[i].name == name)
+			return &table->candidates[i];
+	}
+	return NULL;
+}
+
+// Returns whether an instruction can be part of an inlined body.
+static bool is_inlinable(IrInstr *instr, int arity)
+{
+	switch (instr->op) {
+	case OP_GET_LOCAL:
+		// Slot 0 holds the callee, which only a recursive call reads
+		return instr->operand >= 1 && instr->operand <= arity;
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_GLOBAL:
+	case OP_GET_PROPERTY:
+	case OP_GET_INDEX:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_MODULO:
+	case OP_FLOOR_DIVIDE:
+	case OP_BIT_AND:
+	case OP_BIT_OR:
+	case OP_BIT_XOR:
+	case OP_SHIFT_LEFT:
+	case OP_SHIFT_RIGHT:
+	case OP_NOT:
+	case OP_NEGATE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Registers a top-level function for inlining if its IR qualifies.
+void add_inline_candidate(InlineTable *table, ObjFunction *function,
+			  IrFunction *ir)
+{
+	// The body is a single expression followed by the only return
+	int count = ir->count - 1;
+	if (function->upvalueCount > 0 || function->name == NULL || count < 1 ||
+	    count > INLINE_MAX_INSTRUCTIONS || ir->code[count].op != OP_RETURN)
+		return;
+
+	// The expression leaves only its value on the stack, no locals
+	int depth = 0;
+	for (int i = 0; i < count; i++) {
+		if (!is_inlinable(&ir->code[i], function->arity))
+			return;
+		depth += ir_stack_effect(&ir->code[i]);
+	}
+	if (depth != 1)
+		return;
+
+	InlineCandidate *candidate = find_candidate(table, function->name);
+	if (candidate != NULL) {
+		FREE_ARRAY(table->vm, IrInstr, candidate->code,
+			   candidate->count);
+		candidate->code = NULL;
+		candidate->count = 0;
+	} else {
+		if (table->capacity < table->count + 1) {
+			int oldCapacity = table->capacity;
+			table->capacity = GROW_CAPACITY(oldCapacity);
+			table->candidates =
+				GROW_ARRAY(table->vm, InlineCandidate,
+					   table->candidates,
+					   oldCapacity, table->capacity);
+		}
+		candidate = &table->candidates[table->count++];
+		candidate->name = function->name;
+		candidate->code = NULL;
+		candidate->count = 0;
+	}
+	candidate->function = function;
+
+	IrInstr *code = ALLOCATE(table->vm, IrInstr, count);
+	memcpy(code, ir->code, sizeof(IrInstr) * count);
+	candidate->code = code;
+	candidate->count = count;
+}
+
+// Tracks the stack while walking the IR of a function.
+typedef struct {
+	int depth; // Values in the frame, including the callee slot
+	int *producers; // Instruction that pushed the value at each depth
+	int capacity; // Capacity of the producers array
+} StackState;
+
+// Records that the instruction at `index` left the value on top of the stack.
+static void produce(VM *vm, StackState *stack, int index)
+{
+	if (stack->capacity < stack->depth) {
+		int oldCapacity = stack->capacity;
+		stack->capacity = GROW_CAPACITY(oldCapacity);
+		while (stack->capacity < stack->depth)
+			stack->capacity *= 2;
+		stack->producers = GROW_ARRAY(vm, int, stack->producers,
+					      oldCapacity, stack->capacity);
+	}
+	stack->producers[stack->depth - 1] = index;
+}
+
+// Returns whether an instruction leaves a new value on top of the stack,
+// rather than only popping values or leaving the stack as it is.
+static bool replaces_top(int op)
+{
+	switch (op) {
+	case OP_POP:
+	case OP_PRINT:
+	case OP_DEFINE_GLOBAL:
+	case OP_CLOSE_UPVALUE:
+	case OP_INHERIT:
+	case OP_METHOD:
+	case OP_SET_LOCAL:
+	case OP_SET_GLOBAL:
+	case OP_SET_UPVALUE:
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_RETURN:
+	case IR_LABEL:
+	case IR_UPVALUE:
+	case IR_NOP:
+		return false;
+	default:
+		return true;
+	}
+}
+
+// Splices the body of `candidate` in place of a call whose callee sits at
+// frame slot `base`, behind a guard that makes the call instead if the callee
+// isn't the candidate's function when the code runs.
+static void inline_call(IrFunction *out, Chunk *chunk,
+			InlineCandidate *candidate, int base, IrInstr *call)
+{
+	Chunk *body = &candidate->function->chunk;
+	int argCount = call->operand;
+	int skip = new_ir_label(out);
+
+	int guard = emit_ir_label(out, OP_INLINE_GUARD, skip, call->line);
+	out->code[guard].operand =
+		add_constant(out->vm, chunk, OBJ_VAL(candidate->function));
+	out->code[guard].extra = argCount;
+
+	for (int i = 0; i < candidate->count; i++) {
+		IrInstr instr = candidate->code[i];
+		instr.line = call->line;
+
+		// Parameters are the arguments sitting above the callee
+		if (instr.op == OP_GET_LOCAL)
+			instr.operand += base;
+		if (ir_has_constant(instr.op))
+			instr.operand = add_constant(
+				out->vm, chunk,
+				body->constants.values[instr.operand]);
+
+		int index = emit_ir(out, instr.op, instr.operand, instr.extra,
+				    instr.line);
+		out->code[index].label = instr.label;
+	}
+
+	emit_ir(out, OP_INLINE_EXIT, argCount, 0, call->line);
+	emit_ir_label(out, IR_LABEL, skip, call->line);
+}
+
+// Returns the depth the stack has at the label of a jump or guard that
+// starts out with `depth` values.
+static int label_depth(IrInstr *instr, int depth)
+{
+	depth += ir_stack_effect(instr);
+	if (instr->op == OP_INLINE_GUARD)
+		depth -= instr->extra; // The call's result replaces the arguments
+	return depth;
+}
+
+// Works out the stack depth at every label of a function, counting the
+// callee slot. Labels only reached by jumps further down, like the increment
+// clause of a for loop, are resolved in a later round.
+//
+// Returns:
+//   false if the depths don't add up, in which case nothing may be inlined
+static bool find_label_depths(IrFunction *ir, ObjFunction *function,
+			      int *labelDepths)
+{
+	for (int i = 0; i < ir->labelCount; i++)
+		labelDepths[i] = -1;
+
+	for (int round = 0; round < MAX_ROUNDS; round++) {
+		bool unresolved = false;
+		int depth = function->arity + 1;
+
+		for (int i = 0; i < ir->count; i++) {
+			IrInstr *instr = &ir->code[i];
+
+			if (instr->op == IR_LABEL) {
+				int known = labelDepths[instr->label];
+				if (depth == -1) {
+					depth = known; // Only reached by jumps
+					unresolved |= known == -1;
+				} else if (known == -1) {
+					labelDepths[instr->label] = depth;
+				} else if (known != depth) {
+					return false;
+				}
+			}
+			if (depth == -1)
+				continue; // Not reached so far
+
+			if (ir_has_label(instr->op)) {
+				int target = label_depth(instr, depth);
+				int *known = &labelDepths[instr->label];
+				if (*known == -1) {
+					*known = target;
+				} else if (*known != target) {
+					return false;
+				}
+			}
+
+			depth += ir_stack_effect(instr);
+			if (depth < 0)
+				return false;
+			if (instr->op == OP_JUMP || instr->op == OP_RETURN)
+				depth = -1;
+		}
+
+		if (!unresolved)
+			return true;
+	}
+
+	return false;
+}
+
+// Inlines calls whose callee is loaded from the global of an inline
+// candidate with a matching arity.
+//
+// The parameters of an inlined body become locals of the caller, so the
+// slot of every callee has to be known. The pass follows the stack depth
+// through the function, together with the instruction that pushed each
+// value, and leaves the IR alone if the depths don't add up.
+static bool inline_calls(IrFunction *ir, ObjFunction *function,
+			 InlineTable *inlines)
+{
+	if (inlines == NULL || inlines->count == 0)
+		return false;
+
+	VM *vm = ir->vm;
+	int labelCount = ir->labelCount;
+	int *labelDepths = ALLOCATE(vm, int, labelCount);
+	if (!find_label_depths(ir, function, labelDepths)) {
+		FREE_ARRAY(vm, int, labelDepths, labelCount);
+		return false;
+	}
+
+	Chunk *chunk = &function->chunk;
+	IrFunction out;
+	init_ir(vm, &out);
+	out.labelCount = ir->labelCount;
+
+	// The frame starts out with the callee and the parameters
+	StackState stack = { 0, NULL, 0 };
+	for (int i = 0; i <= function->arity; i++) {
+		stack.depth++;
+		produce(vm, &stack, -1);
+	}
+
+	bool changed = false;
+	for (int i = 0; i < ir->count; i++) {
+		IrInstr instr = ir->code[i];
+
+		// Nothing is known about values that arrive through a jump
+		if (instr.op == IR_LABEL && labelDepths[instr.label] != -1) {
+			int depth = labelDepths[instr.label];
+			for (stack.depth = 1; stack.depth <= depth; stack.depth++)
+				produce(vm, &stack, -1);
+			stack.depth = depth;
+		}
+
+		if (instr.op == OP_CALL && stack.depth > instr.operand) {
+			int base = stack.depth - instr.operand - 1;
+			int producer = stack.producers[base];
+			InlineCandidate *candidate = NULL;
+
+			if (producer >= 0 && ir->code[producer].op == OP_GET_GLOBAL) {
+				Value name = chunk->constants
+						     .values[ir->code[producer].operand];
+				candidate = find_candidate(inlines, AS_STRING(name));
+			}
+
+			if (candidate != NULL &&
+			    candidate->function->arity == instr.operand &&
+			    base + instr.operand <= UINT16_MAX) {
+				inline_call(&out, chunk, candidate, base, &instr);
+				stack.depth -= instr.operand;
+				produce(vm, &stack, i);
+				changed = true;
+				continue;
+			}
+		}
+
+		int index = emit_ir(&out, instr.op, instr.operand, instr.extra,
+				    instr.line);
+		out.code[index].label = instr.label;
+
+		stack.depth += ir_stack_effect(&instr);
+		if (stack.depth > 0 && replaces_top(instr.op))
+			produce(vm, &stack, i);
+	}
+
+	FREE_ARRAY(vm, int, labelDepths, labelCount);
+	FREE_ARRAY(vm, int, stack.producers, stack.capacity);
+
+	if (!changed) {
+		free_ir(&out);
+		return false;
+	}
+
+	free_ir(ir);
+	*ir = out;
+	return true;
+}
+
+// Runs the cleanup passes until the IR stops changing, since each pass can
+// open up work for the others.
+static void run_passes(IrFunction *ir, Chunk *chunk)
+{
+	int *scratch = ALLOCATE(ir->vm, int, ir->labelCount);
+
+	for (int round = 0; round < MAX_ROUNDS; round++) {
+		bool changed = fold_constants(ir, chunk);
+		changed |= thread_jumps(ir, scratch);
+		changed |= remove_redundant_jumps(ir, scratch);
+		changed |= remove_dead_code(ir, scratch);
+		if (!changed)
+			break;
+	}
+
+	FREE_ARRAY(ir->vm, int, scratch, ir->labelCount);
+	compact_ir(ir);
+}
+
+// Runs the passes enabled at `level` over the IR of a function.
+void optimize_ir(IrFunction *ir, ObjFunction *function, InlineTable *inlines,
+		 int level)
+{
+	if (level <= OPT_LEVEL_NONE)
+		return;
+
+	run_passes(ir, &function->chunk);
+
+	// Inlined bodies start out with constant operands and redundant
+	// pushes, so clean up once more after inlining.
+	if (level >= OPT_LEVEL_INLINE && inline_calls(ir, function, inlines))
+		run_passes(ir, &function->chunk);
+}
@@ -0,0 +1,76 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the optimization passes that run on a function's IR before it is lowered
+// to bytecode.
+
+#ifndef xanadu_optimizer_h
+#define xanadu_optimizer_h
+
+#include "ir.h"
+#include "object.h"
+
+#define OPT_LEVEL_NONE 0 // Lower the IR exactly as the parser built it
+#define OPT_LEVEL_DEFAULT \
+	1 // Constant folding, jump threading and dead code elimination
+#define OPT_LEVEL_INLINE 2 // Inlining of small top-level functions as well
+#define OPT_LEVEL_MAX 2 // Highest supported level
+
+// Longest function body, in instructions, that gets inlined.
+#define INLINE_MAX_INSTRUCTIONS 16
+
+// A top-level function whose body can be spliced into its callers.
+//
+// Only functions that return a single expression of their parameters,
+// constants and globals qualify: they don't call anything, so they can't
+// recurse, and they don't capture anything, so any closure of them behaves
+// the same. Calls are inlined behind a guard that checks the callee is still
+// this function and makes a regular call if it isn't.
+typedef struct {
+	ObjString *name; // Global the function was declared as
+	ObjFunction *function; // The function, which the guard compares against
+	IrInstr *code; // Body without the final OP_RETURN
+	int count; // Number of instructions in the body
+} InlineCandidate;
+
+// The inline candidates declared so far in the program being compiled.
+typedef struct {
+	VM *vm; // VM the candidates are allocated from
+	int count; // Number of candidates
+	int capacity; // Capacity of the candidates array
+	InlineCandidate *candidates; // Candidates in declaration order
+} InlineTable;
+
+// Initializes an empty table of inline candidates whose memory is charged
+// to `vm`.
+void init_inline_table(VM *vm, InlineTable *table);
+
+// Frees the candidates of a table and resets it.
+void free_inline_table(InlineTable *table);
+
+// Marks the functions and names of the candidates for the garbage collector.
+void mark_inline_table(VM *vm, InlineTable *table);
+
+// Registers a top-level function for inlining if its optimized and lowered IR
+// qualifies. A later declaration with the same name replaces the earlier one.
+//
+// Parameters:
+//   table - Table of candidates
+//   function - The compiled function, whose name is the global it's bound to
+//   ir - The function's IR after lower_ir()
+void add_inline_candidate(InlineTable *table, ObjFunction *function,
+			  IrFunction *ir);
+
+// Runs the passes enabled at `level` over the IR of a function.
+//
+// Parameters:
+//   ir - The IR to optimize in place
+//   function - The function being compiled. Its constant pool holds the IR's
+//              constants, folded constants are added to it
+//   inlines - Functions that can be inlined, or NULL
+//   level - Optimization level, from OPT_LEVEL_NONE to OPT_LEVEL_MAX
+void optimize_ir(IrFunction *ir, ObjFunction *function, InlineTable *inlines,
+		 int level);
+
+#endif
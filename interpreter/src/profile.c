@@ -0,0 +1,402 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the implementation of the sampling profiler. The
+// signal handler only reads the frames below the VM's frame count, which
+// call() fills before counting and switch_fiber() keeps consistent with the
+// frames array, so every frame it reads belongs to a call in progress.
+// Everything else, from resolving lines to writing the report, runs on the
+// VM's thread with the signal blocked or the timer stopped.
+
+// timer_create() delivering to a thread is a Linux extension
+#define _GNU_SOURCE
+
+#include "profile.h"
+
+#include "vm.h"
+#include "chunk.h"
+#include "object.h"
+#include "error.h"
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Older C libraries only name the thread of a signal event this way
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// Frames the buffer holds between two drains, samples that don't fit are
+// dropped
+#define BUFFER_FRAMES (1 << 20)
+
+// A call frame of a sample, or the header of a sample when `function` is
+// NULL. A header is followed by the frames of the sample from the
+// outermost.
+typedef struct {
+	ObjFunction *function; // Function being run, NULL for a header
+	int offset; // Instruction being run, or the frames after a header
+	int weight; // Intervals the sample of a header stands for
+} RawFrame;
+
+// A call stack or a location, with the samples counted under it
+typedef struct {
+	char *key; // Frames separated by semicolons, NULL for an empty entry
+	int length; // Length of the key
+	uint32_t hash; // Hash of the key
+	long count; // Samples in the stack, or samples whose innermost
+		    // frame is at the location
+	long total; // Samples whose stack contains the location
+} Tally;
+
+// Hash table of entries, grown to keep it at most half full
+typedef struct {
+	int count; // Entries in use
+	int capacity; // Number of entries, a power of two
+	Tally *entries; // The entries, NULL until the first is added
+} TallyTable;
+
+// State of the profiler, shared with the signal handler
+static struct {
+	VM *volatile vm; // VM being profiled, NULL when none is
+	timer_t timer; // Timer raising SIGPROF
+	struct sigaction previous; // Handler of SIGPROF before profiling
+	RawFrame *buffer; // Samples not resolved yet
+	volatile sig_atomic_t head; // Frames in the buffer
+	volatile sig_atomic_t dropped; // Samples that didn't fit
+	volatile sig_atomic_t outside; // Samples taken outside of any call
+	long samples; // Samples resolved
+	TallyTable stacks; // Samples by call stack
+	char *key; // Key of the stack being resolved
+	int keyCapacity; // Capacity of the key
+} profile;
+
+// Take a sample of the calls in progress. Runs in the signal handler.
+static void take_sample(int signal)
+{
+	(void)signal;
+	VM *vm = profile.vm;
+	if (vm == NULL)
+		return;
+
+	// Timers on processor time expire on scheduler ticks, which can be
+	// further apart than the interval, so a sample stands for every
+	// interval that passed since the last
+	int overrun = timer_getoverrun(profile.timer);
+	int weight = overrun > 0 ? overrun + 1 : 1;
+
+	int depth = vm->frameCount;
+	if (depth == 0) {
+		profile.outside += weight;
+		return;
+	}
+	if (profile.head + depth + 1 > BUFFER_FRAMES) {
+		profile.dropped += weight;
+		return;
+	}
+
+	CallFrame *frames = vm->frames;
+	RawFrame *sample = &profile.buffer[profile.head];
+	sample[0].function = NULL;
+	sample[0].offset = depth;
+	sample[0].weight = weight;
+	for (int i = 0; i < depth; i++) {
+		ObjFunction *function = frames[i].closure->function;
+		sample[i + 1].function = function;
+		// The instruction pointer is past the instruction being run
+		sample[i + 1].offset =
+			(int)(frames[i].ip - function->chunk.code) - 1;
+	}
+
+	atomic_signal_fence(memory_order_release);
+	profile.head += depth + 1;
+}
+
+// Hash a key with FNV-1a
+static uint32_t hash_key(const char *key, int length)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < length; i++) {
+		hash ^= (uint8_t)key[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+// Find the entry of a key, or the empty entry it would be added in
+static Tally *find_tally(Tally *entries, int capacity, const char *key,
+			 int length, uint32_t hash)
+{
+	uint32_t index = hash & (capacity - 1);
+	for (;;) {
+		Tally *entry = &entries[index];
+		if (entry->key == NULL ||
+		    (entry->hash == hash && entry->length == length &&
+		     memcmp(entry->key, key, length) == 0))
+			return entry;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+// Get the entry of a key, adding it with no samples if it is new
+static Tally *table_tally(TallyTable *table, const char *key, int length)
+{
+	if (2 * (table->count + 1) > table->capacity) {
+		int capacity = table->capacity < 64 ? 64 : table->capacity * 2;
+		Tally *entries = calloc(capacity, sizeof(Tally));
+		if (entries == NULL)
+			error_msg_exit("Failed to allocate memory in %s",
+				       __FILE__);
+		for (int i = 0; i < table->capacity; i++) {
+			Tally *entry = &table->entries[i];
+			if (entry->key != NULL)
+				*find_tally(entries, capacity, entry->key,
+					    entry->length, entry->hash) =
+					*entry;
+		}
+		free(table->entries);
+		table->entries = entries;
+		table->capacity = capacity;
+	}
+
+	uint32_t hash = hash_key(key, length);
+	Tally *entry = find_tally(table->entries, table->capacity, key, length,
+				  hash);
+	if (entry->key == NULL) {
+		entry->key = malloc(length + 1);
+		if (entry->key == NULL)
+			error_msg_exit("Failed to allocate memory in %s",
+				       __FILE__);
+		memcpy(entry->key, key, length);
+		entry->key[length] = '\0';
+		entry->length = length;
+		entry->hash = hash;
+		table->count++;
+	}
+	return entry;
+}
+
+// Free the keys and entries of a table
+static void free_tally_table(TallyTable *table)
+{
+	for (int i = 0; i < table->capacity; i++)
+		free(table->entries[i].key);
+	free(table->entries);
+	table->entries = NULL;
+	table->count = 0;
+	table->capacity = 0;
+}
+
+// Append a frame of a sample to the key being resolved
+static void append_frame(int *length, RawFrame *frame)
+{
+	ObjFunction *function = frame->function;
+	const char *name = function->name == NULL ? "script" :
+						    function->name->chars;
+	int offset = frame->offset;
+	if (offset < 0 || offset >= function->chunk.count)
+		offset = 0;
+	int line = get_line(&function->chunk, offset);
+
+	// A separator, the name, a colon, the line and the terminator
+	int needed = *length + (int)strlen(name) + 14;
+	if (needed > profile.keyCapacity) {
+		profile.keyCapacity = needed * 2;
+		profile.key = realloc(profile.key, profile.keyCapacity);
+		if (profile.key == NULL)
+			error_msg_exit("Failed to allocate memory in %s",
+				       __FILE__);
+	}
+
+	*length += sprintf(profile.key + *length, "%s%s:%d",
+			   *length > 0 ? ";" : "", name, line);
+}
+
+void drain_profile(VM *vm)
+{
+	// Samples taken after the check are of calls still in progress, whose
+	// functions the collection keeps
+	if (vm != profile.vm || vm == NULL || profile.head == 0)
+		return;
+
+	sigset_t blocked, previous;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGPROF);
+	pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+
+	for (int i = 0; i < profile.head; i += profile.buffer[i].offset + 1) {
+		int length = 0;
+		for (int j = 1; j <= profile.buffer[i].offset; j++)
+			append_frame(&length, &profile.buffer[i + j]);
+		table_tally(&profile.stacks, profile.key, length)->count +=
+			profile.buffer[i].weight;
+		profile.samples += profile.buffer[i].weight;
+	}
+	profile.head = 0;
+
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+bool start_profile(VM *vm)
+{
+	profile.buffer = malloc(sizeof(RawFrame) * BUFFER_FRAMES);
+	if (profile.buffer == NULL)
+		return false;
+	profile.head = 0;
+	profile.dropped = 0;
+	profile.outside = 0;
+	profile.samples = 0;
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = take_sample;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, &profile.previous) != 0) {
+		free(profile.buffer);
+		return false;
+	}
+
+	// The signal goes to the VM's thread, so the handler interrupts it
+	struct sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &profile.timer) !=
+	    0) {
+		sigaction(SIGPROF, &profile.previous, NULL);
+		free(profile.buffer);
+		return false;
+	}
+
+	profile.vm = vm;
+	struct itimerspec interval;
+	interval.it_interval.tv_sec = 0;
+	interval.it_interval.tv_nsec = PROFILE_INTERVAL_US * 1000;
+	interval.it_value = interval.it_interval;
+	timer_settime(profile.timer, 0, &interval, NULL);
+	return true;
+}
+
+// Order locations by their samples, then by their key
+static int compare_locations(const void *a, const void *b)
+{
+	const Tally *x = *(const Tally *const *)a;
+	const Tally *y = *(const Tally *const *)b;
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	if (x->total != y->total)
+		return x->total < y->total ? 1 : -1;
+	return strcmp(x->key, y->key);
+}
+
+// Check if the frame of a stack at `start` appears earlier in it
+static bool seen_before(const char *stack, int start, int length)
+{
+	for (int i = 0; i < start;) {
+		int end = i;
+		while (stack[end] != ';')
+			end++;
+		if (end - i == length &&
+		    memcmp(stack + i, stack + start, length) == 0)
+			return true;
+		i = end + 1;
+	}
+	return false;
+}
+
+// Write the locations with the most samples
+static void write_report(FILE *report)
+{
+	TallyTable locations = { 0, 0, NULL };
+
+	for (int i = 0; i < profile.stacks.capacity; i++) {
+		Tally *stack = &profile.stacks.entries[i];
+		if (stack->key == NULL)
+			continue;
+
+		// Recursive calls count once towards the total of a location
+		for (int start = 0; start < stack->length;) {
+			int end = start;
+			while (end < stack->length && stack->key[end] != ';')
+				end++;
+			Tally *location = table_tally(
+				&locations, stack->key + start, end - start);
+			if (!seen_before(stack->key, start, end - start))
+				location->total += stack->count;
+			if (end == stack->length)
+				location->count += stack->count;
+			start = end + 1;
+		}
+	}
+
+	Tally **sorted = malloc(sizeof(Tally *) * (locations.count + 1));
+	if (sorted == NULL)
+		error_msg_exit("Failed to allocate memory in %s", __FILE__);
+	int count = 0;
+	for (int i = 0; i < locations.capacity; i++) {
+		if (locations.entries[i].key != NULL)
+			sorted[count++] = &locations.entries[i];
+	}
+	qsort(sorted, count, sizeof(Tally *), compare_locations);
+
+	fprintf(report, "Profile: %ld samples of %d us of processor time\n",
+		profile.samples, PROFILE_INTERVAL_US);
+	fprintf(report, "%10s %7s %7s  %s\n", "samples", "self", "total",
+		"location");
+	double samples = profile.samples > 0 ? (double)profile.samples : 1;
+	for (int i = 0; i < count && i < PROFILE_REPORT_LINES; i++) {
+		fprintf(report, "%10ld %6.1f%% %6.1f%%  %s\n", sorted[i]->count,
+			100 * sorted[i]->count / samples,
+			100 * sorted[i]->total / samples, sorted[i]->key);
+	}
+	if (profile.outside > 0)
+		fprintf(report, "%ld samples outside of any call\n",
+			(long)profile.outside);
+	if (profile.dropped > 0)
+		fprintf(report, "%ld samples dropped, the buffer was full\n",
+			(long)profile.dropped);
+
+	free(sorted);
+	free_tally_table(&locations);
+}
+
+void stop_profile(VM *vm, FILE *report, const char *stacksPath)
+{
+	timer_delete(profile.timer);
+	drain_profile(vm);
+	profile.vm = NULL;
+	sigaction(SIGPROF, &profile.previous, NULL);
+
+	write_report(report);
+
+	FILE *stacks = fopen(stacksPath, "w");
+	if (stacks == NULL) {
+		fprintf(report, "Could not write the call stacks to \"%s\".\n",
+			stacksPath);
+	} else {
+		for (int i = 0; i < profile.stacks.capacity; i++) {
+			Tally *stack = &profile.stacks.entries[i];
+			if (stack->key != NULL)
+				fprintf(stacks, "%s %ld\n", stack->key,
+					stack->count);
+		}
+		fclose(stacks);
+		fprintf(report, "Call stacks written to \"%s\".\n",
+			stacksPath);
+	}
+
+	free_tally_table(&profile.stacks);
+	free(profile.buffer);
+	free(profile.key);
+	profile.buffer = NULL;
+	profile.key = NULL;
+	profile.keyCapacity = 0;
+}
@@ -0,0 +1,54 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the sampling profiler of `xi --profile`. A timer on the
+// processor time of the thread running the VM raises SIGPROF every
+// PROFILE_INTERVAL_US microseconds, and the signal handler copies the
+// function and instruction of each call frame into a buffer allocated
+// beforehand, without allocating or locking anything. The samples are
+// resolved to function names and lines before every garbage collection,
+// while the functions they point to can't have been freed yet, and are
+// added up by call stack.
+//
+// The profile is reported as the locations the most samples were taken in,
+// and as one line per call stack in the collapsed format that flame graph
+// tools read: the frames from the outermost, each `name:line`, separated by
+// semicolons and followed by the number of samples.
+
+#ifndef xanadu_profile_h
+#define xanadu_profile_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+// Processor time between two samples, in microseconds
+#define PROFILE_INTERVAL_US 1000
+
+// Locations listed by the report
+#define PROFILE_REPORT_LINES 20
+
+// Start sampling the calls of a VM run by the calling thread. A single VM
+// of the process can be profiled at a time.
+// Parameters:
+//   vm - The VM to sample
+// Returns:
+//   Whether the timer could be started, with errno set otherwise
+bool start_profile(VM *vm);
+
+// Resolve the samples taken so far, if the VM is being profiled. The
+// garbage collector calls it before freeing anything.
+// Parameters:
+//   vm - The VM that is about to collect garbage
+void drain_profile(VM *vm);
+
+// Stop sampling and report the profile
+// Parameters:
+//   vm - The VM being profiled
+//   report - Where the locations with the most samples are written
+//   stacksPath - File the collapsed call stacks are written to
+void stop_profile(VM *vm, FILE *report, const char *stacksPath);
+
+#endif
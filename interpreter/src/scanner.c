@@ -4,27 +4,110 @@
 
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "scanner.h"
 
+// The scanner skips whitespace, comments, strings and numbers a block of
+// characters at a time with SSE2 or AVX2 when the compiler targets them.
+// Blocks are only loaded while they fit before the end of the source and the
+// rest is scanned one character at a time, like everything when neither is
+// available or SCANNER_NO_SIMD is defined.
+#if defined(__AVX2__) && !defined(SCANNER_NO_SIMD)
+#include <immintrin.h>
+#define BLOCK_SIZE 32
+typedef __m256i Block;
+#elif defined(__SSE2__) && !defined(SCANNER_NO_SIMD)
+#include <emmintrin.h>
+#define BLOCK_SIZE 16
+typedef __m128i Block;
+#endif
+
+// Characters of a run that are scanned one by one before switching to blocks
+#define SHORT_RUN 8
+
 // Lexer's meta data
 typedef struct {
 	const char *start; // Start position
 	const char *current; // Current position on string
+	const char *end; // Terminating null character of the source string
 	int line; // line number in source file
 } Scanner;
 
-// Global scanner struct
-Scanner scanner;
+// Scanner of each thread, threads compile modules in parallel
+_Thread_local Scanner scanner;
 
 // Start up scanner
 void init_scanner(const char *source)
+{
+	init_scanner_at(source, strlen(source), 1);
+}
+
+// Initialize the scanner in the middle of a source string
+void init_scanner_at(const char *source, size_t length, int line)
 {
 	// initialize scanner meta data
 	scanner.start = source;
 	scanner.current = source;
-	scanner.line = 1;
+	scanner.end = source + length;
+	scanner.line = line;
+}
+
+#ifdef BLOCK_SIZE
+// Mask of a block whose characters all matched
+#define BLOCK_MASK ((uint32_t)((1ull << BLOCK_SIZE) - 1))
+
+#if BLOCK_SIZE == 32
+// Loads the block of characters starting at `p`
+static inline Block load_block(const char *p)
+{
+	return _mm256_loadu_si256((const __m256i *)p);
+}
+
+// Returns a mask with bit i set if character i of the block is `c`
+static inline uint32_t equal_mask(Block block, char c)
+{
+	return (uint32_t)_mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(block, _mm256_set1_epi8(c)));
+}
+
+// Returns a mask with bit i set if character i of the block is a digit
+static inline uint32_t digit_mask(Block block)
+{
+	Block above = _mm256_cmpgt_epi8(block, _mm256_set1_epi8('0' - 1));
+	Block below = _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), block);
+	return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(above, below));
+}
+#else
+// Loads the block of characters starting at `p`
+static inline Block load_block(const char *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+// Returns a mask with bit i set if character i of the block is `c`
+static inline uint32_t equal_mask(Block block, char c)
+{
+	return (uint32_t)_mm_movemask_epi8(
+		_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// Returns a mask with bit i set if character i of the block is a digit
+static inline uint32_t digit_mask(Block block)
+{
+	Block above = _mm_cmpgt_epi8(block, _mm_set1_epi8('0' - 1));
+	Block below = _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), block);
+	return (uint32_t)_mm_movemask_epi8(_mm_and_si128(above, below));
+}
+#endif
+
+// Returns the number of newlines among the first `length` characters of a
+// block, given the mask of its newlines
+static inline int count_newlines(uint32_t newlines, int length)
+{
+	return __builtin_popcount(newlines & (uint32_t)((1ull << length) - 1));
 }
+#endif
 
 // Check if at the end of source string
 static inline bool is_at_end(void)
@@ -90,6 +173,74 @@ static char peek_next(void)
 	return scanner.current[1];
 }
 
+// Skip a single space, tab, carriage return or newline, if there is one
+static inline bool skip_blank(void)
+{
+	switch (peek()) {
+	case '\n':
+		scanner.line++;
+		// fall through
+	case ' ':
+	case '\r':
+	case '\t':
+		advance();
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Skip a run of spaces, tabs, carriage returns and newlines
+static void skip_blanks(void)
+{
+	// Most runs are a space or a newline and some indentation, which are
+	// quicker to skip one by one than to load a block for
+	for (int i = 0; i < SHORT_RUN; i++) {
+		if (!skip_blank())
+			return;
+	}
+
+#ifdef BLOCK_SIZE
+	while (scanner.end - scanner.current >= BLOCK_SIZE) {
+		Block block = load_block(scanner.current);
+		uint32_t newlines = equal_mask(block, '\n');
+		uint32_t blanks = newlines | equal_mask(block, ' ') |
+				  equal_mask(block, '\t') |
+				  equal_mask(block, '\r');
+
+		if (blanks != BLOCK_MASK) {
+			int length = __builtin_ctz(~blanks);
+			scanner.line += count_newlines(newlines, length);
+			scanner.current += length;
+			return;
+		}
+		scanner.line += __builtin_popcount(newlines);
+		scanner.current += BLOCK_SIZE;
+	}
+#endif
+
+	while (skip_blank())
+		;
+}
+
+// Skip the rest of a line comment, up to the newline that ends it
+static void skip_comment(void)
+{
+#ifdef BLOCK_SIZE
+	while (scanner.end - scanner.current >= BLOCK_SIZE) {
+		uint32_t newlines = equal_mask(load_block(scanner.current), '\n');
+		if (newlines != 0) {
+			scanner.current += __builtin_ctz(newlines);
+			return;
+		}
+		scanner.current += BLOCK_SIZE;
+	}
+#endif
+
+	while (peek() != '\n' && !is_at_end())
+		advance();
+}
+
 // Skip all kinds of whitespace of source string
 static void skip_whitespace(void)
 {
@@ -99,17 +250,13 @@ static void skip_whitespace(void)
 		case ' ':
 		case '\r':
 		case '\t':
-			advance();
-			break;
 		case '\n':
-			scanner.line++;
-			advance();
+			skip_blanks();
 			break;
 		case '/': // Comments
 			if (peek_next() == '/') {
 				// A comment goes until the end of the line.
-				while (peek() != '\n' && !is_at_end())
-					advance();
+				skip_comment();
 			} else {
 				return;
 			}
@@ -120,14 +267,43 @@ static void skip_whitespace(void)
 	}
 }
 
+// Skip a character of a string literal, unless it is the closing quote
+static inline bool skip_string_char(void)
+{
+	if (peek() == '"' || is_at_end())
+		return false;
+
+	if (peek() == '\n')
+		scanner.line++;
+	advance();
+	return true;
+}
+
 // Get string type
 static Token string(void)
 {
-	while (peek() != '"' && !is_at_end()) {
-		if (peek() == '\n')
-			scanner.line++;
-		advance();
+	for (int i = 0; i < SHORT_RUN && skip_string_char(); i++)
+		;
+
+#ifdef BLOCK_SIZE
+	while (scanner.end - scanner.current >= BLOCK_SIZE) {
+		Block block = load_block(scanner.current);
+		uint32_t newlines = equal_mask(block, '\n');
+		uint32_t quotes = equal_mask(block, '"');
+
+		if (quotes != 0) {
+			int length = __builtin_ctz(quotes);
+			scanner.line += count_newlines(newlines, length);
+			scanner.current += length;
+			break;
+		}
+		scanner.line += __builtin_popcount(newlines);
+		scanner.current += BLOCK_SIZE;
 	}
+#endif
+
+	while (skip_string_char())
+		;
 
 	if (is_at_end())
 		return error_token("Unterminated string.");
@@ -143,19 +319,41 @@ static bool is_digit(char c)
 	return c >= '0' && c <= '9';
 }
 
-// Get number type
-static Token number(void)
+// Skip a run of digits
+static void skip_digits(void)
 {
+	for (int i = 0; i < SHORT_RUN; i++) {
+		if (!is_digit(peek()))
+			return;
+		advance();
+	}
+
+#ifdef BLOCK_SIZE
+	while (scanner.end - scanner.current >= BLOCK_SIZE) {
+		uint32_t digits = digit_mask(load_block(scanner.current));
+		if (digits != BLOCK_MASK) {
+			scanner.current += __builtin_ctz(~digits);
+			return;
+		}
+		scanner.current += BLOCK_SIZE;
+	}
+#endif
+
 	while (is_digit(peek()))
 		advance();
+}
+
+// Get number type
+static Token number(void)
+{
+	skip_digits();
 
 	// Look for a fractional part.
 	if (peek() == '.' && is_digit(peek_next())) {
 		// Consume the ".".
 		advance();
 
-		while (is_digit(peek()))
-			advance();
+		skip_digits();
 	}
 
 	return make_token(TOKEN_NUMBER);
@@ -167,81 +365,67 @@ static inline bool is_alpha(char c)
 	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-// Check if current string is the rest of a keyword
-static TokenType check_keyword(int start, int length, const char *rest,
-			       TokenType type)
-{
-	if (scanner.current - scanner.start == start + length &&
-	    memcmp(scanner.start + start, rest, length) == 0) {
-		return type;
-	}
+// Number of slots of the keyword table, a power of two
+#define KEYWORD_SLOTS 32
 
-	return TOKEN_IDENTIFIER;
-}
+// Longest keyword, `workingmans_grind`
+#define KEYWORD_MAX_LENGTH 17
+
+// Perfect hash of the keywords. Every keyword has at least two characters
+// and the length with the first two characters maps each to its own slot.
+#define KEYWORD_HASH(length, c0, c1) \
+	((3 * (length) + 7 * (c0) + (c1)) & (KEYWORD_SLOTS - 1))
 
-//TODO add all identifiers and fix start/length
+// A keyword and its slot in the keyword table
+#define KEYWORD(name, c0, c1, type)                              \
+	[KEYWORD_HASH(sizeof(name) - 1, c0, c1)] = { name,         \
+						      sizeof(name) - 1, \
+						      type }
+
+// Entry of the keyword table
+typedef struct {
+	const char *name; // Spelling of the keyword, NULL for an empty slot
+	int length; // Length of the keyword
+	TokenType type; // Token of the keyword
+} Keyword;
+
+// Keywords laid out by their hash at compile time. A keyword that hashed to
+// the slot of another would override it, which the build makes an error
+// with -Werror=override-init.
+static const Keyword keywords[KEYWORD_SLOTS] = {
+	KEYWORD("and", 'a', 'n', TOKEN_AND),
+	KEYWORD("blabla", 'b', 'l', TOKEN_PRINT),
+	KEYWORD("caravan", 'c', 'a', TOKEN_IMPORT),
+	KEYWORD("circumstances", 'c', 'i', TOKEN_FOR),
+	KEYWORD("counterpoint", 'c', 'o', TOKEN_ELSE),
+	KEYWORD("cygnus", 'c', 'y', TOKEN_NIL),
+	KEYWORD("freewill", 'f', 'r', TOKEN_IF),
+	KEYWORD("limelight", 'l', 'i', TOKEN_RETURN),
+	KEYWORD("or", 'o', 'r', TOKEN_OR),
+	KEYWORD("overtune", 'o', 'v', TOKEN_CLASS),
+	KEYWORD("subdivision", 's', 'u', TOKEN_FUN),
+	KEYWORD("syrinx", 's', 'y', TOKEN_SUPER),
+	KEYWORD("todays", 't', 'o', TOKEN_THIS),
+	KEYWORD("true", 't', 'r', TOKEN_TRUE),
+	KEYWORD("workingmans_grind", 'w', 'o', TOKEN_WHILE),
+	KEYWORD("yyz", 'y', 'y', TOKEN_VAR),
+};
+
+// Look up the scanned identifier in the keyword table, which takes a single
+// comparison with the keyword in its slot
 static TokenType identifier_type(void)
 {
-	switch (scanner.start[0]) {
-	case 'a':
-		return check_keyword(1, 2, "nd", TOKEN_AND);
-	case 'f':
-		return check_keyword(1, 7, "reewill", TOKEN_IF);
-	case 'c':
-		if (scanner.current - scanner.start > 1) {
-			switch (scanner.start[1]) {
-			case 'y':
-				return check_keyword(2, 4, "gnus", TOKEN_NIL);
-			case 'o':
-				return check_keyword(2, 10, "unterpoint",
-						     TOKEN_ELSE);
-			case 'i':
-				return check_keyword(2, 11, "rcumstances",
-						     TOKEN_FOR);
-			}
-		}
-		break;
-	case 'o':
-		if (scanner.current - scanner.start > 1) {
-			switch (scanner.start[1]) {
-			case 'r':
-				return check_keyword(2, 0, "r", TOKEN_OR);
-			case 'v':
-				return check_keyword(2, 6, "ertune",
-						     TOKEN_CLASS);
-			}
-		}
-		break;
-	case 'b':
-		return check_keyword(1, 5, "labla", TOKEN_PRINT);
-	case 'l':
-		return check_keyword(1, 8, "imelight", TOKEN_RETURN);
-	case 's':
-		if (scanner.current - scanner.start > 1) {
-			switch (scanner.start[1]) {
-			case 'u':
-				return check_keyword(2, 9, "bdivision",
-						     TOKEN_FUN);
-			case 'y':
-				return check_keyword(2, 4, "rinx", TOKEN_SUPER);
-			}
-		}
-		break;
-	case 'y':
-		return check_keyword(1, 2, "yz", TOKEN_VAR);
-	case 'w':
-		return check_keyword(1, 16, "orkingmans_grind", TOKEN_WHILE);
-	case 't':
-		if (scanner.current - scanner.start > 1) {
-			switch (scanner.start[1]) {
-			case 'o':
-				return check_keyword(2, 4, "days", TOKEN_THIS);
-			case 'r':
-				return check_keyword(2, 2, "ue", TOKEN_TRUE);
-			}
-		}
-		break;
-	}
+	int length = (int)(scanner.current - scanner.start);
+	if (length < 2 || length > KEYWORD_MAX_LENGTH)
+		return TOKEN_IDENTIFIER;
+
+	const Keyword *keyword = &keywords[KEYWORD_HASH(
+		length, (unsigned char)scanner.start[0],
+		(unsigned char)scanner.start[1])];
+	if (keyword->length == length &&
+	    memcmp(scanner.start, keyword->name, length) == 0)
+		return keyword->type;
+
 	return TOKEN_IDENTIFIER;
 }
 
@@ -277,6 +461,10 @@ Token scan_token(void)
 		return make_token(TOKEN_LEFT_BRACE);
 	case '}':
 		return make_token(TOKEN_RIGHT_BRACE);
+	case '[':
+		return make_token(TOKEN_LEFT_BRACKET);
+	case ']':
+		return make_token(TOKEN_RIGHT_BRACKET);
 	case ';':
 		return make_token(TOKEN_SEMICOLON);
 	case ',':
@@ -296,10 +484,26 @@ Token scan_token(void)
 	case '=':
 		return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
 	case '<':
+		if (match('<'))
+			return make_token(TOKEN_LESS_LESS);
 		return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
 	case '>':
+		if (match('>'))
+			return make_token(TOKEN_GREATER_GREATER);
 		return make_token(match('=') ? TOKEN_GREATER_EQUAL :
 					       TOKEN_GREATER);
+	case '%':
+		return make_token(TOKEN_PERCENT);
+	case '&':
+		return make_token(TOKEN_AMPERSAND);
+	case '|':
+		return make_token(TOKEN_PIPE);
+	case '^':
+		return make_token(TOKEN_CARET);
+	case '~':
+		if (match('/'))
+			return make_token(TOKEN_TILDE_SLASH);
+		break;
 	case ':':
 		return make_token(TOKEN_EXTENDS);
 	case '"':
@@ -12,6 +12,8 @@ typedef enum {
 	TOKEN_RIGHT_PAREN,
 	TOKEN_LEFT_BRACE,
 	TOKEN_RIGHT_BRACE,
+	TOKEN_LEFT_BRACKET,
+	TOKEN_RIGHT_BRACKET,
 	TOKEN_COMMA,
 	TOKEN_DOT,
 	TOKEN_MINUS,
@@ -20,6 +22,10 @@ typedef enum {
 	TOKEN_SLASH,
 	TOKEN_STAR,
 	TOKEN_EXTENDS,
+	TOKEN_PERCENT,
+	TOKEN_AMPERSAND,
+	TOKEN_PIPE,
+	TOKEN_CARET,
 	// One or two character tokens.
 	TOKEN_BANG,
 	TOKEN_BANG_EQUAL,
@@ -29,6 +35,9 @@ typedef enum {
 	TOKEN_GREATER_EQUAL,
 	TOKEN_LESS,
 	TOKEN_LESS_EQUAL,
+	TOKEN_LESS_LESS,
+	TOKEN_GREATER_GREATER,
+	TOKEN_TILDE_SLASH,
 	// Literals.
 	TOKEN_IDENTIFIER,
 	TOKEN_STRING,
@@ -41,6 +50,7 @@ typedef enum {
 	TOKEN_FOR,
 	TOKEN_FUN,
 	TOKEN_IF,
+	TOKEN_IMPORT,
 	TOKEN_NIL,
 	TOKEN_OR,
 	TOKEN_PRINT,
@@ -63,8 +73,12 @@ typedef struct {
 	int line; // Line number of token in source file
 } Token;
 
-// Start up scanner
+// Start up the scanner of the calling thread, each thread scanning its own
+// source
 void init_scanner(const char *source);
+// Start up scanner at `line` of a source string, from a point inside it
+// `length` characters before its end
+void init_scanner_at(const char *source, size_t length, int line);
 // Run scanner
 Token scan_token(void);
 
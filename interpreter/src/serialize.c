@@ -0,0 +1,637 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "serialize.h"
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+#include "module.h"
+
+// A bytecode file is an image that is mapped read-only and run in place.
+// It holds no pointers, only offsets from the start of the file, and is laid
+// out in the byte order and int size of the host that wrote it (a file from
+// another kind of host is treated as stale). After the header come:
+//
+//   constants  ImageConstant[constantCount], the pools of all functions
+//   functions  ImageFunction[functionCount], the script first
+//   lines      LineRun[lineCount], the line tables of all functions
+//   code       uint8_t[codeSize], the bytecode of all functions
+//   strings    char[stringSize], the characters of string constants
+//
+// Functions are numbered in the order they are first reached from the
+// script, and a function that is a constant of several others (like the
+// callee of an inlined call) is stored once, so it is a single object once
+// loaded.
+#define XAC_MAGIC "XAC\x1a"
+#define XAC_BYTE_ORDER 0x01020304u
+
+// Sections are aligned for their widest field.
+#define SECTION_ALIGNMENT 8
+
+// Marks a function without a name.
+#define NO_NAME UINT32_MAX
+
+// Header at the start of a bytecode file.
+typedef struct {
+	char magic[4]; // XAC_MAGIC
+	uint16_t version; // XAC_VERSION
+	uint8_t optLevel; // SourceKey.optLevel
+	uint8_t intSize; // sizeof(int) of the writer, the size of line run fields
+	uint32_t byteOrder; // XAC_BYTE_ORDER as written by the writer
+	uint32_t functionCount; // Entries in the functions section
+	uint64_t sourceHash; // SourceKey.hash
+	int64_t sourceMtime; // SourceKey.mtime
+	uint64_t fileSize; // Size of the whole file, to detect truncation
+	uint32_t constantCount; // Entries in the constants section
+	uint32_t lineCount; // Entries in the lines section
+	uint32_t codeSize; // Bytes in the code section
+	uint32_t stringSize; // Bytes in the strings section
+	uint32_t constantsOffset; // Offset of the constants section
+	uint32_t functionsOffset; // Offset of the functions section
+	uint32_t linesOffset; // Offset of the lines section
+	uint32_t codeOffset; // Offset of the code section
+	uint32_t stringsOffset; // Offset of the strings section
+	uint32_t reserved; // Pads the header to a multiple of 8 bytes
+} ImageHeader;
+
+// Tags of the constants in an image.
+typedef enum {
+	TAG_NIL,
+	TAG_FALSE,
+	TAG_TRUE,
+	TAG_NUMBER,
+	TAG_STRING,
+	TAG_FUNCTION,
+	TAG_INT
+} ConstantTag;
+
+// A constant in an image.
+typedef struct {
+	uint32_t tag; // ConstantTag
+	uint32_t length; // Length of a string
+	uint64_t payload; // Bits of a number, string offset or function index
+} ImageConstant;
+
+// A function in an image. Offsets are relative to their section.
+typedef struct {
+	uint32_t arity; // Number of parameters
+	uint32_t slotCount; // Stack slots used by locals
+	uint32_t upvalueCount; // Number of upvalues
+	uint32_t nameOffset; // Name in the strings section, or NO_NAME
+	uint32_t nameLength; // Length of the name
+	uint32_t codeOffset; // First byte of code
+	uint32_t codeLength; // Bytes of code
+	uint32_t firstLine; // Index of the first run of the line table
+	uint32_t lineLength; // Number of runs in the line table
+	uint32_t firstConstant; // Index of the first constant of the pool
+	uint32_t constantCount; // Number of constants in the pool
+	uint32_t reserved; // Pads the record to a multiple of 8 bytes
+} ImageFunction;
+
+// A mapped image. Images stay mapped until the VM is freed since the
+// functions created from them run their code in place.
+struct Image {
+	struct Image *next; // Next image mapped by the VM
+	const uint8_t *base; // Start of the mapping
+	size_t size; // Size of the mapping
+	const ImageConstant *constants; // Constants section
+	const ImageFunction *records; // Functions section
+	ObjFunction **functions; // Functions created so far, by index
+	uint32_t functionCount; // Number of functions in the image
+};
+
+// A growable output buffer. It doesn't go through reallocate() so that
+// writing a file never triggers a garbage collection.
+typedef struct {
+	uint8_t *bytes; // Bytes written so far
+	size_t count; // Number of bytes written
+	size_t capacity; // Capacity of the buffer
+	bool failed; // Whether an allocation failed
+} Buffer;
+
+// Functions reached from the script while writing, with their indexes
+// found through an open addressing hash set.
+typedef struct {
+	ObjFunction **functions; // Functions by index
+	int count; // Number of functions
+	int *slots; // Hash set of indexes into functions, -1 when empty
+	int slotCount; // Capacity of the hash set and the functions array
+	bool failed; // Whether an allocation failed
+} FunctionList;
+
+// Sections of an image being written.
+typedef struct {
+	Buffer constants;
+	Buffer functions;
+	Buffer lines;
+	Buffer code;
+	Buffer strings;
+} ImageWriter;
+
+// Hashes bytes with 64 bit FNV-1a.
+static uint64_t fnv1a(const uint8_t *bytes, size_t length)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+uint64_t hash_source(const char *source, size_t length)
+{
+	return fnv1a((const uint8_t *)source, length);
+}
+
+// Appends raw bytes to a buffer.
+static void put_bytes(Buffer *buffer, const void *bytes, size_t length)
+{
+	if (buffer->failed || length == 0)
+		return;
+
+	if (buffer->count + length > buffer->capacity) {
+		size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+		while (capacity < buffer->count + length)
+			capacity *= 2;
+
+		uint8_t *grown = realloc(buffer->bytes, capacity);
+		if (grown == NULL) {
+			buffer->failed = true;
+			return;
+		}
+		buffer->bytes = grown;
+		buffer->capacity = capacity;
+	}
+
+	memcpy(buffer->bytes + buffer->count, bytes, length);
+	buffer->count += length;
+}
+
+// Pads a buffer with zeros to a multiple of SECTION_ALIGNMENT.
+static void align_buffer(Buffer *buffer)
+{
+	static const uint8_t zeros[SECTION_ALIGNMENT] = { 0 };
+	size_t padding = -buffer->count & (SECTION_ALIGNMENT - 1);
+	put_bytes(buffer, zeros, padding);
+}
+
+// Returns the slot of a function in the hash set, which is empty if the
+// function hasn't been added.
+static int *find_function(FunctionList *list, ObjFunction *function)
+{
+	size_t hash = (size_t)(uintptr_t)function >> 4;
+	for (size_t i = hash & (list->slotCount - 1);;
+	     i = (i + 1) & (list->slotCount - 1)) {
+		int *slot = &list->slots[i];
+		if (*slot == -1 || list->functions[*slot] == function)
+			return slot;
+	}
+}
+
+// Returns the index of a function, adding it if it's new.
+static int add_function(FunctionList *list, ObjFunction *function)
+{
+	if (list->failed)
+		return 0;
+
+	// Keep the hash set at most half full
+	if ((list->count + 1) * 2 > list->slotCount) {
+		int slotCount = list->slotCount < 64 ? 64 : list->slotCount * 2;
+		int *slots = malloc(sizeof(int) * slotCount);
+		ObjFunction **functions =
+			realloc(list->functions, sizeof(ObjFunction *) * slotCount);
+		if (functions != NULL)
+			list->functions = functions;
+		if (slots == NULL || functions == NULL) {
+			free(slots);
+			list->failed = true;
+			return 0;
+		}
+
+		free(list->slots);
+		list->slots = slots;
+		list->slotCount = slotCount;
+		for (int i = 0; i < slotCount; i++)
+			slots[i] = -1;
+		for (int i = 0; i < list->count; i++)
+			*find_function(list, functions[i]) = i;
+	}
+
+	int *slot = find_function(list, function);
+	if (*slot == -1) {
+		*slot = list->count;
+		list->functions[list->count++] = function;
+	}
+	return *slot;
+}
+
+// Appends the characters of a string and returns their offset.
+static uint32_t put_string(ImageWriter *writer, ObjString *string)
+{
+	uint32_t offset = (uint32_t)writer->strings.count;
+	put_bytes(&writer->strings, string->chars, string->length);
+	return offset;
+}
+
+// Appends a constant. Functions are added to the list and referenced by
+// their index.
+static void put_constant(ImageWriter *writer, FunctionList *list, Value value)
+{
+	ImageConstant constant = { 0 };
+
+	if (IS_NIL(value)) {
+		constant.tag = TAG_NIL;
+	} else if (IS_BOOL(value)) {
+		constant.tag = AS_BOOL(value) ? TAG_TRUE : TAG_FALSE;
+	} else if (IS_INT(value)) {
+		constant.tag = TAG_INT;
+		memcpy(&constant.payload, &AS_INT(value), sizeof(int64_t));
+	} else if (IS_NUMBER(value)) {
+		double number = AS_NUMBER(value);
+		constant.tag = TAG_NUMBER;
+		memcpy(&constant.payload, &number, sizeof(number));
+	} else if (IS_STRING(value)) {
+		constant.tag = TAG_STRING;
+		constant.length = (uint32_t)AS_STRING(value)->length;
+		constant.payload = put_string(writer, AS_STRING(value));
+	} else if (IS_FUNCTION(value)) {
+		constant.tag = TAG_FUNCTION;
+		constant.payload = (uint64_t)add_function(list, AS_FUNCTION(value));
+	} else {
+		// The compiler doesn't put other objects in constant pools
+		list->failed = true;
+	}
+
+	put_bytes(&writer->constants, &constant, sizeof(constant));
+}
+
+// Appends a function's record, code, lines and constants.
+static void put_function(ImageWriter *writer, FunctionList *list,
+			 ObjFunction *function)
+{
+	Chunk *chunk = &function->chunk;
+	ImageFunction record = { 0 };
+
+	// A deferred body has no code to save yet
+	if (function->lazy != NULL)
+		list->failed = true;
+
+	record.arity = (uint32_t)function->arity;
+	record.slotCount = (uint32_t)function->slotCount;
+	record.upvalueCount = (uint32_t)function->upvalueCount;
+	record.nameOffset = NO_NAME;
+	if (function->name != NULL) {
+		record.nameLength = (uint32_t)function->name->length;
+		record.nameOffset = put_string(writer, function->name);
+	}
+
+	record.codeOffset = (uint32_t)writer->code.count;
+	record.codeLength = (uint32_t)chunk->count;
+	put_bytes(&writer->code, chunk->code, chunk->count);
+	record.firstLine = (uint32_t)(writer->lines.count / sizeof(LineRun));
+	record.lineLength = (uint32_t)chunk->lineCount;
+	put_bytes(&writer->lines, chunk->lines,
+		  sizeof(LineRun) * chunk->lineCount);
+
+	record.firstConstant =
+		(uint32_t)(writer->constants.count / sizeof(ImageConstant));
+	record.constantCount = (uint32_t)chunk->constants.count;
+	for (int i = 0; i < chunk->constants.count; i++)
+		put_constant(writer, list, chunk->constants.values[i]);
+
+	put_bytes(&writer->functions, &record, sizeof(record));
+}
+
+bool save_bytecode(ObjFunction *function, const SourceKey *key,
+		   const char *path)
+{
+	ImageWriter writer = { 0 };
+	FunctionList list = { 0 };
+
+	// Functions are appended to the list as their callers' constants are
+	// written, so this also visits every nested function.
+	add_function(&list, function);
+	for (int i = 0; i < list.count && !list.failed; i++)
+		put_function(&writer, &list, list.functions[i]);
+
+	Buffer *sections[] = { &writer.constants, &writer.functions,
+			       &writer.lines, &writer.code, &writer.strings };
+	int sectionCount = (int)(sizeof(sections) / sizeof(sections[0]));
+
+	ImageHeader header = { 0 };
+	memcpy(header.magic, XAC_MAGIC, sizeof(header.magic));
+	header.version = XAC_VERSION;
+	header.optLevel = key->optLevel;
+	header.intSize = (uint8_t)sizeof(int);
+	header.byteOrder = XAC_BYTE_ORDER;
+	header.functionCount = (uint32_t)list.count;
+	header.sourceHash = key->hash;
+	header.sourceMtime = key->mtime;
+	header.constantCount =
+		(uint32_t)(writer.constants.count / sizeof(ImageConstant));
+	header.lineCount = (uint32_t)(writer.lines.count / sizeof(LineRun));
+	header.codeSize = (uint32_t)writer.code.count;
+	header.stringSize = (uint32_t)writer.strings.count;
+
+	uint32_t *offsets[] = { &header.constantsOffset, &header.functionsOffset,
+				&header.linesOffset, &header.codeOffset,
+				&header.stringsOffset };
+	size_t offset = sizeof(header);
+	bool failed = list.failed;
+	for (int i = 0; i < sectionCount; i++) {
+		align_buffer(sections[i]);
+		failed = failed || sections[i]->failed;
+		*offsets[i] = (uint32_t)offset;
+		offset += sections[i]->count;
+	}
+	header.fileSize = offset;
+	failed = failed || offset > UINT32_MAX;
+
+	// Write next to the destination and move it in place once complete.
+	// The process id keeps concurrent writers out of each other's way.
+	size_t length = strlen(path) + 32;
+	char *temporary = failed ? NULL : malloc(length);
+	bool saved = false;
+	if (temporary != NULL) {
+		snprintf(temporary, length, "%s.%ld.tmp", path, (long)getpid());
+
+		FILE *file = fopen(temporary, "wb");
+		if (file != NULL) {
+			saved = fwrite(&header, sizeof(header), 1, file) == 1;
+			for (int i = 0; i < sectionCount; i++) {
+				saved = saved &&
+					fwrite(sections[i]->bytes, 1,
+					       sections[i]->count,
+					       file) == sections[i]->count;
+			}
+			saved = fclose(file) == 0 && saved;
+			saved = saved && rename(temporary, path) == 0;
+			if (!saved)
+				remove(temporary);
+		}
+	}
+
+	free(temporary);
+	for (int i = 0; i < sectionCount; i++)
+		free(sections[i]->bytes);
+	free(list.functions);
+	free(list.slots);
+	return saved;
+}
+
+// Returns whether `count` units starting at `offset` lie within a section
+// of `limit` units.
+static bool in_range(uint64_t offset, uint64_t count, uint64_t limit)
+{
+	return offset <= limit && count <= limit - offset;
+}
+
+// Returns whether an image is complete and consistent, so that the VM can
+// use its offsets without checking them again. The bytecode itself is
+// trusted like the output of the compiler.
+static bool validate_image(const uint8_t *base, size_t size,
+			   const SourceKey *key)
+{
+	if (size < sizeof(ImageHeader))
+		return false;
+
+	const ImageHeader *header = (const ImageHeader *)base;
+	if (memcmp(header->magic, XAC_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != XAC_VERSION || header->intSize != sizeof(int) ||
+	    header->byteOrder != XAC_BYTE_ORDER || header->fileSize != size ||
+	    header->functionCount == 0)
+		return false;
+
+	if (key != NULL &&
+	    (header->optLevel != key->optLevel ||
+	     header->sourceHash != key->hash ||
+	     header->sourceMtime != key->mtime))
+		return false;
+
+	// Sections must be aligned and within the file
+	if (!in_range(header->constantsOffset,
+		      (uint64_t)header->constantCount * sizeof(ImageConstant),
+		      size) ||
+	    !in_range(header->functionsOffset,
+		      (uint64_t)header->functionCount * sizeof(ImageFunction),
+		      size) ||
+	    !in_range(header->linesOffset,
+		      (uint64_t)header->lineCount * sizeof(LineRun), size) ||
+	    !in_range(header->codeOffset, header->codeSize, size) ||
+	    !in_range(header->stringsOffset, header->stringSize, size) ||
+	    ((header->constantsOffset | header->functionsOffset |
+	      header->linesOffset) &
+	     (SECTION_ALIGNMENT - 1)) != 0)
+		return false;
+
+	const ImageFunction *records =
+		(const ImageFunction *)(base + header->functionsOffset);
+	for (uint32_t i = 0; i < header->functionCount; i++) {
+		const ImageFunction *record = &records[i];
+		if (!in_range(record->codeOffset, record->codeLength,
+			      header->codeSize) ||
+		    !in_range(record->firstLine, record->lineLength,
+			      header->lineCount) ||
+		    !in_range(record->firstConstant, record->constantCount,
+			      header->constantCount) ||
+		    (record->nameOffset != NO_NAME &&
+		     !in_range(record->nameOffset, record->nameLength,
+			       header->stringSize)) ||
+		    record->upvalueCount > UINT16_COUNT)
+			return false;
+	}
+
+	const ImageConstant *constants =
+		(const ImageConstant *)(base + header->constantsOffset);
+	for (uint32_t i = 0; i < header->constantCount; i++) {
+		const ImageConstant *constant = &constants[i];
+		if (constant->tag > TAG_INT ||
+		    (constant->tag == TAG_STRING &&
+		     !in_range(constant->payload, constant->length,
+			       header->stringSize)) ||
+		    (constant->tag == TAG_FUNCTION &&
+		     constant->payload >= header->functionCount))
+			return false;
+	}
+
+	return true;
+}
+
+// Returns the function at `index` of an image, creating it on first use.
+// Its code and lines point into the image and its constants are loaded by
+// load_image_constants() when it's first called.
+static ObjFunction *image_function(VM *vm, Image *image, uint32_t index)
+{
+	if (image->functions[index] != NULL)
+		return image->functions[index];
+
+	const ImageHeader *header = (const ImageHeader *)image->base;
+	const ImageFunction *record = &image->records[index];
+
+	// Once it's in the table the function is a root, so creating its
+	// name can't collect it
+	ObjFunction *function = new_function(vm);
+	image->functions[index] = function;
+	function->arity = (int)record->arity;
+	function->slotCount = (int)record->slotCount;
+	function->upvalueCount = (int)record->upvalueCount;
+	function->chunk.code =
+		(uint8_t *)(image->base + header->codeOffset + record->codeOffset);
+	function->chunk.lines =
+		(LineRun *)(image->base + header->linesOffset) +
+		record->firstLine;
+	function->chunk.lineCount = (int)record->lineLength;
+	function->chunk.count = (int)record->codeLength;
+	function->image = image;
+	function->imageIndex = index;
+
+	if (record->nameOffset != NO_NAME) {
+		function->name = copy_string(
+			vm,
+			(const char *)image->base + header->stringsOffset +
+				record->nameOffset,
+			(int)record->nameLength);
+	}
+	return function;
+}
+
+void load_image_constants(VM *vm, ObjFunction *function)
+{
+	Image *image = function->image;
+	const ImageHeader *header = (const ImageHeader *)image->base;
+	const ImageFunction *record = &image->records[function->imageIndex];
+	const char *strings = (const char *)image->base + header->stringsOffset;
+
+	for (uint32_t i = 0; i < record->constantCount; i++) {
+		const ImageConstant *constant =
+			&image->constants[record->firstConstant + i];
+		Value value = NIL_VAL;
+
+		switch (constant->tag) {
+		case TAG_FALSE:
+			value = BOOL_VAL(false);
+			break;
+		case TAG_TRUE:
+			value = BOOL_VAL(true);
+			break;
+		case TAG_NUMBER: {
+			double number;
+			memcpy(&number, &constant->payload, sizeof(number));
+			value = NUMBER_VAL(number);
+			break;
+		}
+		case TAG_INT: {
+			int64_t integer;
+			memcpy(&integer, &constant->payload, sizeof(integer));
+			value = INT_VAL(integer);
+			break;
+		}
+		case TAG_STRING:
+			value = OBJ_VAL(copy_string(vm,
+						    strings + constant->payload,
+						    (int)constant->length));
+			break;
+		case TAG_FUNCTION:
+			value = OBJ_VAL(image_function(
+				vm, image, (uint32_t)constant->payload));
+			break;
+		}
+
+		add_constant(vm, &function->chunk, value);
+	}
+	function->image = NULL;
+}
+
+ObjFunction *load_bytecode(VM *vm, const char *path, const SourceKey *key)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat info;
+	void *base = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size > 0) {
+		base = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE,
+			    fd, 0);
+	}
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	size_t size = (size_t)info.st_size;
+	const ImageHeader *header = (const ImageHeader *)base;
+	Image *image = NULL;
+	if (validate_image(base, size, key)) {
+		image = malloc(sizeof(Image));
+		if (image != NULL) {
+			image->functions = calloc(header->functionCount,
+						  sizeof(ObjFunction *));
+			if (image->functions == NULL) {
+				free(image);
+				image = NULL;
+			}
+		}
+	}
+	if (image == NULL) {
+		munmap(base, size);
+		return NULL;
+	}
+
+	image->base = base;
+	image->size = size;
+	image->constants = (const ImageConstant *)(image->base +
+						   header->constantsOffset);
+	image->records = (const ImageFunction *)(image->base +
+						 header->functionsOffset);
+	image->functionCount = header->functionCount;
+	image->next = vm->images;
+	vm->images = image;
+
+	// Cached bytecode lies next to its source
+	set_program_directory(vm, path);
+	return image_function(vm, image, 0);
+}
+
+bool is_bytecode_file(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+
+	char magic[4];
+	bool matches = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+		       memcmp(magic, XAC_MAGIC, sizeof(magic)) == 0;
+	fclose(file);
+	return matches;
+}
+
+void mark_images(VM *vm)
+{
+	for (Image *image = vm->images; image != NULL; image = image->next) {
+		for (uint32_t i = 0; i < image->functionCount; i++)
+			mark_object(vm, (Obj *)image->functions[i]);
+	}
+}
+
+void free_images(VM *vm)
+{
+	Image *image = vm->images;
+	while (image != NULL) {
+		Image *next = image->next;
+		munmap((void *)image->base, image->size);
+		free(image->functions);
+		free(image);
+		image = next;
+	}
+	vm->images = NULL;
+}
@@ -0,0 +1,81 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the binary format of compiled programs (.xac files). A bytecode file is a
+// relocation-free image of a script function with its code, line tables and constants, including
+// nested functions and strings. It is mapped read-only and its code runs in place, so processes
+// running the same file share its pages and loading it copies nothing but constant pools.
+
+#ifndef xanadu_serialize_h
+#define xanadu_serialize_h
+
+#include "common.h"
+#include "object.h"
+
+// Version of the format, which must be bumped whenever the layout of the
+// file or the meaning of the bytecode changes. Files of other versions are
+// ignored and recompiled.
+#define XAC_VERSION 5
+
+// Extension appended to a source path to name its cached bytecode.
+#define XAC_EXTENSION "c"
+
+// A bytecode file mapped by load_bytecode().
+typedef struct Image Image;
+
+// Identifies the source a bytecode file was compiled from, and how.
+typedef struct {
+	uint64_t hash; // Hash of the source text, see hash_source()
+	int64_t mtime; // Modification time of the source file, in seconds
+	uint8_t optLevel; // Optimization level the source was compiled at
+} SourceKey;
+
+// Hashes source text for a SourceKey.
+uint64_t hash_source(const char *source, size_t length);
+
+// Writes a compiled script to a bytecode file. The file is written under a
+// temporary name and renamed, so concurrent readers never see it partially
+// written.
+//
+// Parameters:
+//   function - The script function returned by compile()
+//   key - The source it was compiled from
+//   path - Path of the bytecode file
+//
+// Returns:
+//   Whether the file was written
+bool save_bytecode(ObjFunction *function, const SourceKey *key,
+		   const char *path);
+
+// Maps a bytecode file and returns its script. The functions of the image
+// run their code from the mapping, and each function's constants, strings
+// included, are only created by load_image_constants() when it is first
+// called. The mapping lasts until free_images() is called for the VM.
+//
+// Parameters:
+//   vm - VM the functions of the image are created in
+//   path - Path of the bytecode file
+//   key - The source the file must have been compiled from, or NULL to
+//         accept any
+//
+// Returns:
+//   The script function, or NULL if the file is missing, of another
+//   version, stale or corrupt
+ObjFunction *load_bytecode(VM *vm, const char *path, const SourceKey *key);
+
+// Returns whether a file starts like a bytecode file.
+bool is_bytecode_file(const char *path);
+
+// Creates the constants of a function loaded from an image, which must be
+// done before it runs. The function must be reachable by the collector.
+void load_image_constants(VM *vm, ObjFunction *function);
+
+// Marks the functions created from the images mapped by a VM for the garbage
+// collector.
+void mark_images(VM *vm);
+
+// Unmaps every image of a VM. Their functions must have been freed.
+void free_images(VM *vm);
+
+#endif
@@ -0,0 +1,127 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source.h"
+
+// Bytes read at a time from streams
+#define SOURCE_CHUNK (64 * 1024)
+
+// Maps `size` bytes of a regular file with a null character after them.
+//
+// The file is mapped over a reservation of anonymous zeroed pages that is at
+// least a byte longer than the file. The part of the last file page past the
+// end of the file reads as zero, and a file that ends on a page boundary is
+// followed by the first page of the reservation instead, so the text is
+// terminated either way without copying it.
+static bool map_file(int fd, size_t size, Source *source)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t mapped = (size + 1 + page - 1) / page * page;
+
+	void *base = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+	if (base == MAP_FAILED)
+		return false;
+
+	if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+	    MAP_FAILED) {
+		int saved = errno;
+		munmap(base, mapped);
+		errno = saved;
+		return false;
+	}
+
+	source->chars = base;
+	source->length = size;
+	source->mapped = mapped;
+	return true;
+}
+
+// Reads a stream until its end, in chunks into a buffer that grows as
+// needed.
+static bool read_stream(int fd, Source *source)
+{
+	size_t capacity = SOURCE_CHUNK;
+	size_t length = 0;
+	char *buffer = malloc(capacity);
+	if (buffer == NULL)
+		return false;
+
+	for (;;) {
+		// Keep room for a whole chunk and the null character
+		if (capacity - length < SOURCE_CHUNK + 1) {
+			char *grown = realloc(buffer, capacity * 2);
+			if (grown == NULL) {
+				free(buffer);
+				errno = ENOMEM;
+				return false;
+			}
+			buffer = grown;
+			capacity *= 2;
+		}
+
+		ssize_t count = read(fd, buffer + length, SOURCE_CHUNK);
+		if (count == 0)
+			break;
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			int saved = errno;
+			free(buffer);
+			errno = saved;
+			return false;
+		}
+		length += (size_t)count;
+	}
+
+	buffer[length] = '\0';
+	source->chars = buffer;
+	source->length = length;
+	source->mapped = 0;
+	return true;
+}
+
+bool load_source(const char *path, Source *source)
+{
+	// Standard input is always streamed, it may be positioned anywhere
+	if (strcmp(path, STDIN_PATH) == 0)
+		return read_stream(STDIN_FILENO, source);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	// Empty files and anything but regular files, like pipes, are read,
+	// and so are files on file systems that can't map them
+	struct stat info;
+	bool loaded = false;
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+		loaded = map_file(fd, (size_t)info.st_size, source);
+	if (!loaded)
+		loaded = read_stream(fd, source);
+
+	int saved = errno;
+	close(fd);
+	errno = saved;
+	return loaded;
+}
+
+void free_source(Source *source)
+{
+	if (source->mapped > 0)
+		munmap((void *)source->chars, source->mapped);
+	else
+		free((void *)source->chars);
+	source->chars = NULL;
+	source->length = 0;
+	source->mapped = 0;
+}
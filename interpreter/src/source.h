@@ -0,0 +1,38 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the loading of source text. Regular files are mapped instead of read, and
+// pipes and terminals are read in chunks until their end, so sources of any size can be
+// compiled from standard input.
+
+#ifndef xanadu_source_h
+#define xanadu_source_h
+
+#include "common.h"
+
+// Path that names standard input.
+#define STDIN_PATH "-"
+
+// Source text in memory, always followed by a null character as the
+// scanner expects.
+typedef struct {
+	const char *chars; // The text
+	size_t length; // Length of the text
+	size_t mapped; // Size of the mapping holding the text, 0 if it was read
+} Source;
+
+// Loads a source file, or standard input if `path` is STDIN_PATH.
+//
+// Parameters:
+//   path - Path of the file
+//   source - Receives the text, which must be released with free_source()
+//
+// Returns:
+//   Whether the source was loaded, errno tells why not
+bool load_source(const char *path, Source *source);
+
+// Releases the text of a loaded source.
+void free_source(Source *source);
+
+#endif
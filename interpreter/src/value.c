@@ -2,6 +2,8 @@
 // Use of this source code is governed by an MIT
 // license that can be found in the LICENSE file.
 
+#include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -24,7 +26,7 @@ void init_value_array(ValueArray *array)
 // Parameters:
 //   array - Pointer to the ValueArray to which the value will be added.
 //   value - The Value to append.
-void write_value_array(ValueArray *array, Value value)
+void write_value_array(VM *vm, ValueArray *array, Value value)
 {
 	// Check if the array needs to be resized.
 	if (array->capacity < array->count + 1) {
@@ -32,7 +34,7 @@ void write_value_array(ValueArray *array, Value value)
 		array->capacity =
 			GROW_CAPACITY(oldCapacity); // Calculate new capacity.
 		array->values =
-			GROW_ARRAY(Value, array->values, oldCapacity,
+			GROW_ARRAY(vm, Value, array->values, oldCapacity,
 				   array->capacity); // Allocate new memory.
 	}
 
@@ -44,9 +46,9 @@ void write_value_array(ValueArray *array, Value value)
 // Free the memory allocated for a ValueArray and reinitialize it to an empty state.
 // Parameters:
 //   array - Pointer to the ValueArray to free.
-void free_value_array(ValueArray *array)
+void free_value_array(VM *vm, ValueArray *array)
 {
-	FREE_ARRAY(Value, array->values,
+	FREE_ARRAY(vm, Value, array->values,
 		   array->capacity); // Free the allocated memory.
 	init_value_array(array); // Reinitialize to an empty state.
 }
@@ -69,6 +71,10 @@ void print_value(Value value)
 		// Print the number value using default formatting.
 		printf("%g", AS_NUMBER(value));
 		break;
+	case VAL_INT:
+		// Print every digit of integers.
+		printf("%" PRId64, AS_INT(value));
+		break;
 	case VAL_OBJ:
 		// Print the object using its own print function.
 		print_object(value);
@@ -76,6 +82,45 @@ void print_value(Value value)
 	}
 }
 
+// Check if an integer and a double have the same value, without the
+// rounding of converting the integer.
+static bool int_equals_double(int64_t integer, double number)
+{
+	// 2^63 is the first double past the largest integer
+	return number >= (double)INT64_MIN && number < -(double)INT64_MIN &&
+	       number == (double)(int64_t)number &&
+	       (int64_t)number == integer;
+}
+
+// Compare an integer with a double that isn't NaN exactly, without rounding
+// the integer to a double. Returns a negative number, zero or a positive
+// number when the integer is less than, equal to or greater than the double.
+static int compare_int_double(int64_t integer, double number)
+{
+	// Doubles from 2^63 on are past every integer, and those below -2^63
+	// before every one
+	if (number >= -(double)INT64_MIN)
+		return -1;
+	if (number < (double)INT64_MIN)
+		return 1;
+
+	double whole = floor(number);
+	int64_t floored = (int64_t)whole;
+	if (integer != floored)
+		return integer < floored ? -1 : 1;
+	return number > whole ? -1 : 0;
+}
+
+bool mixed_less_than(Value a, Value b)
+{
+	// NaN is in no order with anything
+	if (IS_INT(a))
+		return !isnan(AS_NUMBER(b)) &&
+		       compare_int_double(AS_INT(a), AS_NUMBER(b)) < 0;
+	return !isnan(AS_NUMBER(a)) &&
+	       compare_int_double(AS_INT(b), AS_NUMBER(a)) > 0;
+}
+
 // Compare two Values for equality.
 // Returns true if both Values are of the same type and have equal content.
 // Parameters:
@@ -85,6 +130,12 @@ void print_value(Value value)
 //   true if the Values are equal, false otherwise.
 bool values_equal(Value a, Value b)
 {
+	// An integer equals a double with the same value.
+	if (IS_INT(a) && IS_DOUBLE(b))
+		return int_equals_double(AS_INT(a), AS_NUMBER(b));
+	if (IS_DOUBLE(a) && IS_INT(b))
+		return int_equals_double(AS_INT(b), AS_NUMBER(a));
+
 	// Check if the types of the two Values are the same.
 	if (a.type != b.type)
 		return false;
@@ -100,6 +151,9 @@ bool values_equal(Value a, Value b)
 	case VAL_NUMBER:
 		// Compare numeric values.
 		return AS_NUMBER(a) == AS_NUMBER(b);
+	case VAL_INT:
+		// Compare integer values.
+		return AS_INT(a) == AS_INT(b);
 	case VAL_OBJ:
 		// Compare object pointers (reference equality).
 		return AS_OBJ(a) == AS_OBJ(b);
@@ -107,3 +161,141 @@ bool values_equal(Value a, Value b)
 		return false; // Should never reach here, as all cases are covered.
 	}
 }
+
+// Convert a number to an integer for the bitwise operators. Integers convert
+// as they are and doubles only when they have a whole value that fits.
+static bool to_integer(Value value, int64_t *result)
+{
+	if (IS_INT(value)) {
+		*result = AS_INT(value);
+		return true;
+	}
+	double number = AS_NUMBER(value);
+	if (!(number >= (double)INT64_MIN && number < -(double)INT64_MIN) ||
+	    number != (double)(int64_t)number)
+		return false;
+	*result = (int64_t)number;
+	return true;
+}
+
+// Convert a whole double to an integer when it fits in one
+static Value whole_number(double number)
+{
+	if (number >= (double)INT64_MIN && number < -(double)INT64_MIN)
+		return INT_VAL((int64_t)number);
+	return NUMBER_VAL(number);
+}
+
+const char *modulo_numbers(Value a, Value b, Value *result)
+{
+	if (AS_NUMBER(b) == 0)
+		return "Division by zero.";
+
+	if (IS_INT(a) && IS_INT(b)) {
+		// INT64_MIN % -1 overflows in C, the remainder is 0 anyway
+		if (AS_INT(b) == -1) {
+			*result = INT_VAL(0);
+			return NULL;
+		}
+		int64_t remainder = AS_INT(a) % AS_INT(b);
+		if (remainder != 0 && (remainder < 0) != (AS_INT(b) < 0))
+			remainder += AS_INT(b);
+		*result = INT_VAL(remainder);
+		return NULL;
+	}
+
+	double remainder = fmod(AS_NUMBER(a), AS_NUMBER(b));
+	if (remainder != 0 && (remainder < 0) != (AS_NUMBER(b) < 0))
+		remainder += AS_NUMBER(b);
+	*result = NUMBER_VAL(remainder);
+	return NULL;
+}
+
+const char *floor_divide_numbers(Value a, Value b, Value *result)
+{
+	if (AS_NUMBER(b) == 0)
+		return "Division by zero.";
+
+	if (IS_INT(a) && IS_INT(b)) {
+		if (AS_INT(a) == INT64_MIN && AS_INT(b) == -1) {
+			*result = NUMBER_VAL(-(double)INT64_MIN);
+			return NULL;
+		}
+		int64_t quotient = AS_INT(a) / AS_INT(b);
+		if (AS_INT(a) % AS_INT(b) != 0 &&
+		    (AS_INT(a) < 0) != (AS_INT(b) < 0))
+			quotient--;
+		*result = INT_VAL(quotient);
+		return NULL;
+	}
+
+	*result = whole_number(floor(AS_NUMBER(a) / AS_NUMBER(b)));
+	return NULL;
+}
+
+const char *and_numbers(Value a, Value b, Value *result)
+{
+	int64_t x, y;
+	if (!to_integer(a, &x) || !to_integer(b, &y))
+		return "Operands must be integers.";
+	*result = INT_VAL(x & y);
+	return NULL;
+}
+
+const char *or_numbers(Value a, Value b, Value *result)
+{
+	int64_t x, y;
+	if (!to_integer(a, &x) || !to_integer(b, &y))
+		return "Operands must be integers.";
+	*result = INT_VAL(x | y);
+	return NULL;
+}
+
+const char *xor_numbers(Value a, Value b, Value *result)
+{
+	int64_t x, y;
+	if (!to_integer(a, &x) || !to_integer(b, &y))
+		return "Operands must be integers.";
+	*result = INT_VAL(x ^ y);
+	return NULL;
+}
+
+// Convert the operands of a shift, checking the count
+static const char *shift_operands(Value a, Value b, int64_t *x, int *count)
+{
+	int64_t y;
+	if (!to_integer(a, x) || !to_integer(b, &y))
+		return "Operands must be integers.";
+	if (y < 0 || y > 63)
+		return "Shift count must be between 0 and 63.";
+	*count = (int)y;
+	return NULL;
+}
+
+const char *shift_left_numbers(Value a, Value b, Value *result)
+{
+	int64_t x;
+	int count;
+	const char *error = shift_operands(a, b, &x, &count);
+	if (error != NULL)
+		return error;
+
+	// Shifting as unsigned avoids the undefined shift of negative values
+	int64_t shifted = (int64_t)((uint64_t)x << count);
+	if (shifted >> count == x)
+		*result = INT_VAL(shifted);
+	else
+		*result = NUMBER_VAL(ldexp((double)x, count));
+	return NULL;
+}
+
+const char *shift_right_numbers(Value a, Value b, Value *result)
+{
+	int64_t x;
+	int count;
+	const char *error = shift_operands(a, b, &x, &count);
+	if (error != NULL)
+		return error;
+	*result = INT_VAL(x >> count);
+	return NULL;
+}
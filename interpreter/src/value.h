@@ -16,6 +16,8 @@
 #define NIL_VAL ((Value){ VAL_NIL, { .number = 0 } })
 // Create a number Value
 #define NUMBER_VAL(value) ((Value){ VAL_NUMBER, { .number = value } })
+// Create an integer Value
+#define INT_VAL(value) ((Value){ VAL_INT, { .integer = value } })
 //##################################################
 
 // Macros for extracting C values from Xanadu values
@@ -23,8 +25,12 @@
 
 // Extract a boolean from a Value
 #define AS_BOOL(value) ((value).as.boolean)
-// Extract a number from a Value
-#define AS_NUMBER(value) ((value).as.number)
+// Extract a number from a Value, converting integers to doubles
+#define AS_NUMBER(value)                                              \
+	((value).type == VAL_INT ? (double)(value).as.integer : \
+				   (value).as.number)
+// Extract an integer from a Value
+#define AS_INT(value) ((value).as.integer)
 // Extract an object from a Value
 #define AS_OBJ(value) ((value).as.obj)
 //##################################################
@@ -36,8 +42,13 @@
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 // Check if the Value is nil
 #define IS_NIL(value) ((value).type == VAL_NIL)
-// Check if the Value is a number
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+// Check if the Value is a number, either a double or an integer
+#define IS_NUMBER(value) \
+	((value).type == VAL_NUMBER || (value).type == VAL_INT)
+// Check if the Value is an integer
+#define IS_INT(value) ((value).type == VAL_INT)
+// Check if the Value is a double
+#define IS_DOUBLE(value) ((value).type == VAL_NUMBER)
 // Check if the Value is an object
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 //##################################
@@ -52,18 +63,24 @@ typedef enum {
 	VAL_NIL, // Nil value
 	VAL_NUMBER, // Number value
 	VAL_OBJ, // Object value
+	VAL_INT, // Integer value, which becomes a double when it overflows
 } ValueType;
 
 // Forward declarations of object types
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+// Forward declaration of the virtual machine, which owns the memory of the
+// values it creates
+typedef struct VM VM;
+
 // Structure representing a Value in Xanadu VM
 typedef struct {
 	ValueType type; // Type of the value
 	union {
 		bool boolean; // Boolean value
 		double number; // Numeric value
+		int64_t integer; // Integer value
 		Obj *obj; // Object pointer
 	} as; // Union for holding the actual value
 } Value;
@@ -89,14 +106,16 @@ void init_value_array(ValueArray *array);
 
 // Add a new Value to the end of a ValueArray
 // Parameters:
+//   vm - The VM the array's memory is charged to
 //   array - The ValueArray to which the value will be added
 //   value - The Value to add
-void write_value_array(ValueArray *array, Value value);
+void write_value_array(VM *vm, ValueArray *array, Value value);
 
 // Free memory allocated for a ValueArray
 // Parameters:
+//   vm - The VM the array's memory is charged to
 //   array - The ValueArray to free
-void free_value_array(ValueArray *array);
+void free_value_array(VM *vm, ValueArray *array);
 
 // Print a Value to the standard output
 // Parameters:
@@ -111,4 +130,91 @@ void print_value(Value value);
 //   true if the Values are equal, false otherwise
 bool values_equal(Value a, Value b);
 
+// Arithmetic on numbers, shared by the VM and the optimizer so that folded
+// constants get the values the code would compute. Integers give integers
+// unless the result overflows, which gives a double. Operands must be
+// numbers.
+
+// Add two numbers
+static inline Value add_numbers(Value a, Value b)
+{
+	int64_t result;
+	if (IS_INT(a) && IS_INT(b) &&
+	    !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result))
+		return INT_VAL(result);
+	return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+// Subtract a number from another
+static inline Value subtract_numbers(Value a, Value b)
+{
+	int64_t result;
+	if (IS_INT(a) && IS_INT(b) &&
+	    !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result))
+		return INT_VAL(result);
+	return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+// Multiply two numbers
+static inline Value multiply_numbers(Value a, Value b)
+{
+	int64_t result;
+	if (IS_INT(a) && IS_INT(b) &&
+	    !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result))
+		return INT_VAL(result);
+	return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+// Divide a number by another, which always gives a double
+static inline Value divide_numbers(Value a, Value b)
+{
+	return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+// Negate a number
+static inline Value negate_number(Value a)
+{
+	if (IS_INT(a) && AS_INT(a) != INT64_MIN)
+		return INT_VAL(-AS_INT(a));
+	return NUMBER_VAL(-AS_NUMBER(a));
+}
+
+// Check if an integer and a double are in order, comparing them exactly
+bool mixed_less_than(Value a, Value b);
+
+// Check if a number is less than another, comparing integers exactly
+static inline bool less_than(Value a, Value b)
+{
+	if (IS_INT(a) && IS_INT(b))
+		return AS_INT(a) < AS_INT(b);
+	if (IS_DOUBLE(a) && IS_DOUBLE(b))
+		return AS_NUMBER(a) < AS_NUMBER(b);
+	return mixed_less_than(a, b);
+}
+
+// The operators below fail for some operands. They return the message of
+// the error, or NULL when they store the result.
+// Parameters:
+//   a - The left operand
+//   b - The right operand
+//   result - Where the result is stored
+
+// The remainder of a division, with the sign of the divisor
+const char *modulo_numbers(Value a, Value b, Value *result);
+
+// The quotient of a division rounded down, an integer unless it doesn't
+// fit in one
+const char *floor_divide_numbers(Value a, Value b, Value *result);
+
+// Bitwise and, or and exclusive or of two integers. Doubles with a whole
+// value count as integers.
+const char *and_numbers(Value a, Value b, Value *result);
+const char *or_numbers(Value a, Value b, Value *result);
+const char *xor_numbers(Value a, Value b, Value *result);
+
+// Shifts of an integer by 0 to 63 bits. Bits shifted out on the left make
+// the result a double, shifts to the right keep the sign.
+const char *shift_left_numbers(Value a, Value b, Value *result);
+const char *shift_right_numbers(Value a, Value b, Value *result);
+
 #endif
@@ -6,9 +6,15 @@
 #include "common.h"
 #include "debug.h"
 #include "vm.h"
+#include "module.h"
+#include "isolate.h"
+#include "loop.h"
+#include "floats.h"
+#include "serialize.h"
 #include "lookup_table.h"
 #include "object.h"
 #include "compiler.h"
+#include "optimizer.h"
 #include "memory.h"
 #include "value.h"
 
@@ -17,76 +23,178 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdarg.h>
-
-// Global Variables
-VM vm;
+#include <stdatomic.h>
 
 // Function declarations
 // Get stack value of specific distance
-static Value peek(int distance);
-// Throw runtime error and reset stack
-static void runtime_error(const char *format, ...);
+static Value peek(VM *vm, int distance);
+// Report a runtime error with a trace of the calls in progress
+static void runtime_error(VM *vm, const char *format, ...);
 // Check bool value of Value type
 static bool is_falsey(Value value);
-static bool call_value(Value callee, int argCount);
-static void define_native(const char *name, NativeFn function);
-static Value clock_native(int argCount, Value *args);
-static ObjUpvalue *capture_upvalue(Value *local);
-static void close_upvalues(Value *last);
-static void define_method(ObjString *name);
-static bool bind_method(ObjClass *klass, ObjString *name);
-static bool invoke(ObjString *name, int argCount);
-static bool invoke_from_class(ObjClass *klass, ObjString *name, int argCount);
+static bool call_value(VM *vm, Value callee, int argCount);
+static bool import_module(VM *vm, ObjString *path);
+static Value clock_native(VM *vm, int argCount, Value *args, void *data);
+static Value fiber_native(VM *vm, int argCount, Value *args, void *data);
+static Value yield_native(VM *vm, int argCount, Value *args, void *data);
+static Value done_native(VM *vm, int argCount, Value *args, void *data);
+static Value length_native(VM *vm, int argCount, Value *args, void *data);
+static Value append_native(VM *vm, int argCount, Value *args, void *data);
+static Value pop_native(VM *vm, int argCount, Value *args, void *data);
+static Value keys_native(VM *vm, int argCount, Value *args, void *data);
+static Value has_native(VM *vm, int argCount, Value *args, void *data);
+static Value remove_native(VM *vm, int argCount, Value *args, void *data);
+static bool element_index(VM *vm, int count, Value index, int *result);
+static bool is_map_key(Value key);
+static ObjUpvalue *capture_upvalue(VM *vm, Value *local);
+static ObjUpvalue *copy_upvalue(VM *vm, Value value);
+static void close_upvalues(VM *vm, Value *last);
+static bool grow_stack(VM *vm, ptrdiff_t slots);
+static bool resume_fiber(VM *vm, ObjFiber *fiber, int argCount);
+static void yield_fiber(VM *vm, Value value);
+static bool suspend_native(VM *vm, int argCount, Value result);
+static void finish_fiber(VM *vm);
+static void define_method(VM *vm, ObjString *name);
+static bool bind_method(VM *vm, ObjClass *klass, ObjString *name);
+static bool invoke(VM *vm, ObjString *name, int argCount);
+static bool invoke_from_class(VM *vm, ObjClass *klass, ObjString *name,
+			      int argCount);
+// Check that a value indexes one of the `count` elements of an array,
+// reporting an error otherwise
+static bool element_index(VM *vm, int count, Value index, int *result)
+{
+	if (IS_INT(index) && AS_INT(index) >= 0 && AS_INT(index) < count) {
+		*result = (int)AS_INT(index);
+		return true;
+	}
+	if (!IS_NUMBER(index)) {
+		runtime_error(vm, "Array index must be a number.");
+		return false;
+	}
+
+	double number = AS_NUMBER(index);
+	if (!(number >= 0 && number < count)) {
+		runtime_error(vm,
+			      "Array index %g is out of bounds for length %d.",
+			      number, count);
+		return false;
+	}
+	if (number != (int)number) {
+		runtime_error(vm, "Array index must be a whole number.");
+		return false;
+	}
+	*result = (int)number;
+	return true;
+}
+
+// Check if a value can be a key of a map. NaN isn't equal to itself, so it
+// couldn't be found again.
+static bool is_map_key(Value key)
+{
+	return !IS_NIL(key) &&
+	       !(IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key));
+}
+
 // Concatenate first 2 strings on the stack
-static void concatenate(void);
+static void concatenate(VM *vm);
 //######################
 
 // Function definition
 
-// Reset stack to initiale state
-static void reset_stack(void)
+// Reset stack to initiale state, that of the main fiber
+static void reset_stack(VM *vm)
 {
-	vm.stackTop = vm.stack;
-	vm.frameCount = 0;
-	vm.openUpvalues = NULL;
+	vm->stack = vm->mainStack;
+	vm->stackTop = vm->stack;
+	vm->stackEnd = vm->stack + STACK_MAX - STACK_HEADROOM;
+	vm->frames = vm->mainFrames;
+	vm->frameCount = 0;
+	vm->baseFrame = 0;
+	vm->nativeError = false;
+	vm->nativeExit = NATIVE_RETURN;
+	vm->openUpvalues = vm->mainUpvalues;
+	for (int i = 0; i < vm->openTop; i++)
+		vm->openUpvalues[i] = NULL;
+	vm->openTop = 0;
 }
 
 // Start up virtual machine
-void init_vm(void)
+void init_vm(VM *vm)
 {
-	// Set stack head pointer and stack size
-	reset_stack();
-
-	vm.objects = NULL;
-	vm.gray_count = 0;
-	vm.gray_capacity = 0;
-	vm.gray_stack = NULL;
-	vm.bytesAllocated = 0;
-	vm.nextGC = 1024 * 1024;
-
-	init_table(&vm.strings);
-
-	vm.init_string = NULL;
-	vm.init_string = copy_string("init", 4);
-
-	init_table(&vm.globals);
-
-	define_native("clock", clock_native);
+	// Set stack head pointer and stack size, clearing every open upvalue
+	// slot of memory that may not be zeroed
+	vm->openTop = STACK_MAX;
+	reset_stack(vm);
+	vm->fiber = NULL;
+	vm->mainFiber = NULL;
+
+	vm->objects = NULL;
+	vm->images = NULL;
+	vm->directory = NULL;
+	vm->loop = NULL;
+	vm->gray_count = 0;
+	vm->gray_capacity = 0;
+	vm->gray_stack = NULL;
+	vm->bytesAllocated = 0;
+	vm->nextGC = 1024 * 1024;
+	vm->optimizationLevel = OPT_LEVEL_DEFAULT;
+	vm->lazyCompilation = false;
+
+	// Every root is set before the first allocation can collect garbage
+	init_table(&vm->strings);
+	init_table(&vm->globals);
+	init_table(&vm->modules);
+	init_value_array(&vm->received);
+
+	vm->init_string = NULL;
+	vm->init_string = copy_string(vm, "init", 4);
+
+	// The main fiber runs on the VM's own stack, which never grows
+	ObjFiber *fiber = new_fiber(vm, NULL);
+	fiber->state = FIBER_RUNNING;
+	fiber->stack = vm->stack;
+	fiber->stackEnd = vm->stackEnd;
+	fiber->frames = vm->frames;
+	fiber->openUpvalues = vm->openUpvalues;
+	vm->mainFiber = fiber;
+	vm->fiber = fiber;
+
+	define_native(vm, "clock", clock_native, NULL, 0);
+	define_native(vm, "fiber", fiber_native, NULL, 0);
+	define_native(vm, "yield", yield_native, NULL, 0);
+	define_native(vm, "done", done_native, NULL, 0);
+	define_native(vm, "length", length_native, NULL, 0);
+	define_native(vm, "append", append_native, NULL, 0);
+	define_native(vm, "pop", pop_native, NULL, 0);
+	define_native(vm, "keys", keys_native, NULL, 0);
+	define_native(vm, "has", has_native, NULL, 0);
+	define_native(vm, "remove", remove_native, NULL, 0);
+	define_isolate_natives(vm);
+	define_loop_natives(vm);
+	define_float_natives(vm);
 }
 
 // Close virtual machine and free up memory
-void free_vm(void)
+void free_vm(VM *vm)
 {
-	free_table(&vm.globals);
-	free_table(&vm.strings);
-	vm.init_string = NULL;
-	free_objects();
+	free_loop(vm);
+	free_table(vm, &vm->globals);
+	free_table(vm, &vm->modules);
+	free_value_array(vm, &vm->received);
+	free_table(vm, &vm->strings);
+	vm->init_string = NULL;
+	free_objects(vm);
+	vm->fiber = NULL;
+	vm->mainFiber = NULL;
+	free_images(vm);
+	free(vm->directory);
+	vm->directory = NULL;
 }
 
 // Run compiled instructions on VM
-static InterpretResult run(void)
+static InterpretResult run(VM *vm)
 {
-	CallFrame *frame = &vm.frames[vm.frameCount - 1];
+	CallFrame *frame = &vm->frames[vm->frameCount - 1];
 
 	// marcos for vm instruction execution
 #define READ_STRING() AS_STRING(READ_CONSTANT())
@@ -96,23 +204,45 @@ static InterpretResult run(void)
 #define READ_SHORT() \
 	(frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 
+#define READ_UINT24()                                      \
+	(frame->ip += 3, (uint32_t)((frame->ip[-3] << 16) | \
+				    (frame->ip[-2] << 8) | frame->ip[-1]))
+
 #define READ_CONSTANT() \
 	(frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define BINARY_OP(valueType, op)                                    \
-	do {                                                        \
-		if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {   \
-			runtime_error("Operands must be numbers."); \
-			return INTERPRET_RUNTIME_ERROR;             \
-		}                                                   \
-		double b = AS_NUMBER(pop());                        \
-		double a = AS_NUMBER(pop());                        \
-		push(valueType(a op b));                            \
+// A binary operator on numbers, whose result is computed from `a` and `b`
+#define BINARY_OP(operation)                                                \
+	do {                                                                \
+		if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {   \
+			runtime_error(vm, "Operands must be numbers.");     \
+			return INTERPRET_RUNTIME_ERROR;                     \
+		}                                                           \
+		Value b = pop(vm);                                          \
+		Value a = pop(vm);                                          \
+		push(vm, operation);                                        \
+	} while (false)
+// A binary operator that fails for some numbers
+#define CHECKED_OP(operation)                                               \
+	do {                                                                \
+		if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {   \
+			runtime_error(vm, "Operands must be numbers.");     \
+			return INTERPRET_RUNTIME_ERROR;                     \
+		}                                                           \
+		Value result;                                               \
+		const char *error =                                         \
+			operation(peek(vm, 1), peek(vm, 0), &result);       \
+		if (error != NULL) {                                        \
+			runtime_error(vm, "%s", error);                     \
+			return INTERPRET_RUNTIME_ERROR;                     \
+		}                                                           \
+		vm->stackTop -= 2;                                          \
+		push(vm, result);                                           \
 	} while (false)
 	//#########################################
 	for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
 		printf("          ");
-		for (Value *slot = vm.stack; slot < vm.stackTop; ++slot) {
+		for (Value *slot = vm->stack; slot < vm->stackTop; ++slot) {
 			printf("[ ");
 			print_value(*slot);
 			printf(" ]");
@@ -129,23 +259,24 @@ static InterpretResult run(void)
 		switch (instruction = READ_BYTE()) {
 		case OP_CONSTANT: {
 			Value constant = READ_CONSTANT();
-			push(constant);
+			push(vm, constant);
 			break;
 		}
 		case OP_NIL:
-			push(NIL_VAL);
+			push(vm, NIL_VAL);
 			break;
 		case OP_TRUE:
-			push(BOOL_VAL(true));
+			push(vm, BOOL_VAL(true));
 			break;
 		case OP_FALSE:
-			push(BOOL_VAL(false));
+			push(vm, BOOL_VAL(false));
 			break;
 		case OP_SET_GLOBAL: {
 			ObjString *name = READ_STRING();
-			if (insert_into_table(&vm.globals, name, peek(0))) {
-				delete_from_table(&vm.globals, name);
-				runtime_error("Undefined variable '%s'.",
+			if (insert_into_table(vm, &vm->globals, name,
+					      peek(vm, 0))) {
+				delete_from_table(&vm->globals, name);
+				runtime_error(vm, "Undefined variable '%s'.",
 					      name->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
@@ -153,143 +284,306 @@ static InterpretResult run(void)
 		}
 		case OP_GET_SUPER: {
 			ObjString *name = READ_STRING();
-			ObjClass *superclass = AS_CLASS(pop());
+			ObjClass *superclass = AS_CLASS(pop(vm));
 
-			if (!bind_method(superclass, name)) {
+			if (!bind_method(vm, superclass, name)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
 		}
 		case OP_EQUAL: {
-			Value b = pop();
-			Value a = pop();
-			push(BOOL_VAL(values_equal(a, b)));
+			Value b = pop(vm);
+			Value a = pop(vm);
+			push(vm, BOOL_VAL(values_equal(a, b)));
 			break;
 		}
 		case OP_GET_PROPERTY: {
-			if (!IS_INSTANCE(peek(0))) {
+			if (!IS_INSTANCE(peek(vm, 0))) {
 				runtime_error(
-					"Only instances have properties.");
+					vm, "Only instances have properties.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			ObjInstance *instance = AS_INSTANCE(peek(0));
+			ObjInstance *instance = AS_INSTANCE(peek(vm, 0));
 			ObjString *name = READ_STRING();
 
 			Value value;
 			if (table_get_from_table(&instance->fields, name,
 						 &value)) {
-				pop(); // Instance.
-				push(value);
+				pop(vm); // Instance.
+				push(vm, value);
 				break;
 			}
 
-			if (!bind_method(instance->class_, name)) {
+			if (!bind_method(vm, instance->class_, name)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
 		}
 		case OP_SET_PROPERTY: {
-			if (!IS_INSTANCE(peek(1))) {
-				runtime_error("Only instances have fields.");
+			if (!IS_INSTANCE(peek(vm, 1))) {
+				runtime_error(vm,
+					      "Only instances have fields.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			ObjInstance *instance = AS_INSTANCE(peek(1));
-			insert_into_table(&instance->fields, READ_STRING(),
-					  peek(0));
-			Value value = pop();
-			pop();
-			push(value);
+			ObjInstance *instance = AS_INSTANCE(peek(vm, 1));
+			insert_into_table(vm, &instance->fields, READ_STRING(),
+					  peek(vm, 0));
+			Value value = pop(vm);
+			pop(vm);
+			push(vm, value);
+			break;
+		}
+		case OP_ARRAY: {
+			int count = READ_BYTE();
+			ObjArray *array = new_array(vm);
+			push(vm, OBJ_VAL(array));
+
+			// The elements stay on the stack while the array grows
+			if (count > 0) {
+				array->elements.values =
+					GROW_ARRAY(vm, Value, NULL, 0, count);
+				array->elements.capacity = count;
+				memcpy(array->elements.values,
+				       vm->stackTop - 1 - count,
+				       sizeof(Value) * count);
+				array->elements.count = count;
+			}
+			vm->stackTop -= count + 1;
+			push(vm, OBJ_VAL(array));
+			break;
+		}
+		case OP_MAP: {
+			int count = READ_BYTE();
+			ObjMap *map = new_map(vm);
+			push(vm, OBJ_VAL(map));
+
+			// The pairs stay on the stack while the map grows
+			Value *pairs = vm->stackTop - 1 - 2 * count;
+			for (int i = 0; i < count; i++) {
+				if (!is_map_key(pairs[2 * i])) {
+					runtime_error(vm, "Map keys can't be "
+							  "nil or NaN.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				insert_into_value_table(vm, &map->table,
+							pairs[2 * i],
+							pairs[2 * i + 1]);
+			}
+			vm->stackTop = pairs;
+			push(vm, OBJ_VAL(map));
+			break;
+		}
+		case OP_GET_INDEX: {
+			if (IS_MAP(peek(vm, 1))) {
+				ObjMap *map = AS_MAP(peek(vm, 1));
+				Value key = peek(vm, 0);
+				Value value = NIL_VAL;
+				if (is_map_key(key))
+					value_table_get(&map->table, key,
+							&value);
+				vm->stackTop -= 2;
+				push(vm, value);
+				break;
+			}
+			if (IS_FLOAT_ARRAY(peek(vm, 1))) {
+				ObjFloatArray *floats =
+					AS_FLOAT_ARRAY(peek(vm, 1));
+				int index;
+				if (!element_index(vm, floats->count,
+						   peek(vm, 0), &index))
+					return INTERPRET_RUNTIME_ERROR;
+				vm->stackTop -= 2;
+				push(vm, NUMBER_VAL(floats->values[index]));
+				break;
+			}
+			if (!IS_ARRAY(peek(vm, 1))) {
+				runtime_error(vm, "Only arrays and maps can be "
+						  "indexed.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			ObjArray *array = AS_ARRAY(peek(vm, 1));
+			int index;
+			if (!element_index(vm, array->elements.count,
+					   peek(vm, 0), &index))
+				return INTERPRET_RUNTIME_ERROR;
+			vm->stackTop -= 2;
+			push(vm, array->elements.values[index]);
+			break;
+		}
+		case OP_SET_INDEX: {
+			if (IS_MAP(peek(vm, 2))) {
+				if (!is_map_key(peek(vm, 1))) {
+					runtime_error(vm, "Map keys can't be "
+							  "nil or NaN.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				// The map, key and value stay on the stack
+				// while the map grows
+				insert_into_value_table(
+					vm, &AS_MAP(peek(vm, 2))->table,
+					peek(vm, 1), peek(vm, 0));
+				Value value = pop(vm);
+				vm->stackTop -= 2;
+				push(vm, value);
+				break;
+			}
+			if (IS_FLOAT_ARRAY(peek(vm, 2))) {
+				ObjFloatArray *floats =
+					AS_FLOAT_ARRAY(peek(vm, 2));
+				int index;
+				if (!element_index(vm, floats->count,
+						   peek(vm, 1), &index))
+					return INTERPRET_RUNTIME_ERROR;
+				if (!IS_NUMBER(peek(vm, 0))) {
+					runtime_error(vm, "Float arrays can "
+							  "only hold numbers.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				Value value = pop(vm);
+				floats->values[index] = AS_NUMBER(value);
+				vm->stackTop -= 2;
+				push(vm, value);
+				break;
+			}
+			if (!IS_ARRAY(peek(vm, 2))) {
+				runtime_error(vm, "Only arrays and maps can be "
+						  "indexed.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			ObjArray *array = AS_ARRAY(peek(vm, 2));
+			int index;
+			if (!element_index(vm, array->elements.count,
+					   peek(vm, 1), &index))
+				return INTERPRET_RUNTIME_ERROR;
+			Value value = pop(vm);
+			array->elements.values[index] = value;
+			vm->stackTop -= 2;
+			push(vm, value);
 			break;
 		}
 		case OP_GET_UPVALUE: {
 			uint8_t slot = READ_BYTE();
-			push(*frame->closure->upvalues[slot]->location);
+			push(vm, *frame->closure->upvalues[slot]->location);
 			break;
 		}
 		case OP_SET_UPVALUE: {
 			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(0);
+			*frame->closure->upvalues[slot]->location = peek(vm, 0);
 			break;
 		}
 		case OP_ADD: {
-			if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-				concatenate();
-			} else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-				double b = AS_NUMBER(pop());
-				double a = AS_NUMBER(pop());
-				push(NUMBER_VAL(a + b));
+			if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+				concatenate(vm);
+			} else if (IS_NUMBER(peek(vm, 0)) &&
+				   IS_NUMBER(peek(vm, 1))) {
+				Value b = pop(vm);
+				Value a = pop(vm);
+				push(vm, add_numbers(a, b));
 			} else {
-				runtime_error(
-					"Operands must be two numbers or two strings.");
+				runtime_error(vm, "Operands must be two numbers "
+						  "or two strings.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
 		}
 		case OP_GREATER:
-			BINARY_OP(BOOL_VAL, >);
+			BINARY_OP(BOOL_VAL(less_than(b, a)));
 			break;
 		case OP_LESS:
-			BINARY_OP(BOOL_VAL, <);
+			BINARY_OP(BOOL_VAL(less_than(a, b)));
 			break;
 		case OP_SUBTRACT:
-			BINARY_OP(NUMBER_VAL, -);
+			BINARY_OP(subtract_numbers(a, b));
 			break;
 		case OP_MULTIPLY:
-			BINARY_OP(NUMBER_VAL, *);
+			BINARY_OP(multiply_numbers(a, b));
 			break;
 		case OP_DIVIDE:
-			BINARY_OP(NUMBER_VAL, /);
+			BINARY_OP(divide_numbers(a, b));
+			break;
+		case OP_MODULO:
+			CHECKED_OP(modulo_numbers);
+			break;
+		case OP_FLOOR_DIVIDE:
+			CHECKED_OP(floor_divide_numbers);
+			break;
+		case OP_BIT_AND:
+			CHECKED_OP(and_numbers);
+			break;
+		case OP_BIT_OR:
+			CHECKED_OP(or_numbers);
+			break;
+		case OP_BIT_XOR:
+			CHECKED_OP(xor_numbers);
+			break;
+		case OP_SHIFT_LEFT:
+			CHECKED_OP(shift_left_numbers);
+			break;
+		case OP_SHIFT_RIGHT:
+			CHECKED_OP(shift_right_numbers);
 			break;
 		case OP_NOT:
-			push(BOOL_VAL(is_falsey(pop())));
+			push(vm, BOOL_VAL(is_falsey(pop(vm))));
 			break;
 		case OP_NEGATE:
-			if (!IS_NUMBER(peek(0))) {
-				runtime_error("Operand must be a number.");
+			if (!IS_NUMBER(peek(vm, 0))) {
+				runtime_error(vm, "Operand must be a number.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			push(NUMBER_VAL(-AS_NUMBER(pop())));
+			push(vm, negate_number(pop(vm)));
 			break;
 		case OP_PRINT: {
-			print_value(pop());
+			print_value(pop(vm));
 			printf("\n");
 			break;
 		}
 		case OP_GET_GLOBAL: {
 			ObjString *name = READ_STRING();
 			Value value;
-			if (!table_get_from_table(&vm.globals, name, &value)) {
-				runtime_error("Undefined variable '%s'.",
+			if (!table_get_from_table(&vm->globals, name, &value)) {
+				runtime_error(vm, "Undefined variable '%s'.",
 					      name->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			push(value);
+			push(vm, value);
 			break;
 		}
 		case OP_POP:
-			pop();
+			pop(vm);
 			break;
 		case OP_GET_LOCAL: {
 			uint8_t slot = READ_BYTE();
-			push(frame->slots[slot]);
+			push(vm, frame->slots[slot]);
 			break;
 		}
 		case OP_SET_LOCAL: {
 			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = peek(0);
+			frame->slots[slot] = peek(vm, 0);
+			break;
+		}
+		case OP_GET_LOCAL_LONG: {
+			uint16_t slot = READ_SHORT();
+			push(vm, frame->slots[slot]);
+			break;
+		}
+		case OP_SET_LOCAL_LONG: {
+			uint16_t slot = READ_SHORT();
+			frame->slots[slot] = peek(vm, 0);
 			break;
 		}
 		case OP_DEFINE_GLOBAL: {
 			ObjString *name = READ_STRING();
-			insert_into_table(&vm.globals, name, peek(0));
-			pop();
+			insert_into_table(vm, &vm->globals, name, peek(vm, 0));
+			pop(vm);
 			break;
 		}
 		case OP_JUMP_IF_FALSE: {
 			uint16_t offset = READ_SHORT();
-			if (is_falsey(peek(0)))
+			if (is_falsey(peek(vm, 0)))
 				frame->ip += offset;
 			break;
 		}
@@ -303,24 +597,81 @@ static InterpretResult run(void)
 			frame->ip -= offset;
 			break;
 		}
+		case OP_JUMP_IF_FALSE_LONG: {
+			uint32_t offset = READ_UINT24();
+			if (is_falsey(peek(vm, 0)))
+				frame->ip += offset;
+			break;
+		}
+		case OP_JUMP_LONG: {
+			uint32_t offset = READ_UINT24();
+			frame->ip += offset;
+			break;
+		}
+		case OP_LOOP_LONG: {
+			uint32_t offset = READ_UINT24();
+			frame->ip -= offset;
+			break;
+		}
 		case OP_CALL: {
 			int argCount = READ_BYTE();
-			if (!call_value(peek(argCount), argCount)) {
+			if (!call_value(vm, peek(vm, argCount), argCount)) {
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			// A fiber the host resumed may have yielded back to it
+			if (vm->frameCount == vm->baseFrame)
+				return INTERPRET_OK;
+			frame = &vm->frames[vm->frameCount - 1];
+			break;
+		}
+		case OP_INLINE_GUARD: {
+			ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+			int argCount = READ_BYTE();
+			uint16_t offset = READ_SHORT();
+			Value callee = peek(vm, argCount);
+
+			// Run the inlined body if the callee is still the function it came from
+			if (IS_CLOSURE(callee) &&
+			    AS_CLOSURE(callee)->function == function)
+				break;
+
+			// Otherwise make the call, returning past the inlined body
+			frame->ip += offset;
+			if (!call_value(vm, callee, argCount)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frameCount - 1];
+			if (vm->frameCount == vm->baseFrame)
+				return INTERPRET_OK;
+			frame = &vm->frames[vm->frameCount - 1];
+			break;
+		}
+		case OP_INLINE_EXIT: {
+			int argCount = READ_BYTE();
+			Value result = pop(vm);
+			vm->stackTop -= argCount + 1;
+			push(vm, result);
 			break;
 		}
 		case OP_CLOSURE: {
 			ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-			ObjClosure *closure = new_closure(function);
-			push(OBJ_VAL(closure));
+			// Functions that capture nothing don't need a closure each.
+			if (function->upvalueCount == 0) {
+				push(vm, OBJ_VAL(shared_closure(vm, function)));
+				break;
+			}
+			ObjClosure *closure = new_closure(vm, function);
+			push(vm, OBJ_VAL(closure));
 			for (int i = 0; i < closure->upvalueCount; i++) {
-				uint8_t isLocal = READ_BYTE();
-				uint8_t index = READ_BYTE();
-				if (isLocal) {
+				uint8_t flags = READ_BYTE();
+				uint16_t index = (flags & UPVALUE_LONG_INDEX) ?
+							 READ_SHORT() :
+							 READ_BYTE();
+				if (flags & UPVALUE_COPY) {
+					closure->upvalues[i] = copy_upvalue(
+						vm, frame->slots[index]);
+				} else if (flags & UPVALUE_LOCAL) {
 					closure->upvalues[i] = capture_upvalue(
-						frame->slots + index);
+						vm, frame->slots + index);
 				} else {
 					closure->upvalues[i] =
 						frame->closure->upvalues[index];
@@ -331,57 +682,70 @@ static InterpretResult run(void)
 		case OP_SUPER_INVOKE: {
 			ObjString *method = READ_STRING();
 			int argCount = READ_BYTE();
-			ObjClass *superclass = AS_CLASS(pop());
-			if (!invoke_from_class(superclass, method, argCount)) {
+			ObjClass *superclass = AS_CLASS(pop(vm));
+			if (!invoke_from_class(vm, superclass, method,
+					       argCount)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frameCount - 1];
+			frame = &vm->frames[vm->frameCount - 1];
 			break;
 		}
 		case OP_INVOKE: {
 			ObjString *method = READ_STRING();
 			int argCount = READ_BYTE();
-			if (!invoke(method, argCount)) {
+			if (!invoke(vm, method, argCount)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frameCount - 1];
+			if (vm->frameCount == vm->baseFrame)
+				return INTERPRET_OK;
+			frame = &vm->frames[vm->frameCount - 1];
 			break;
 		}
 		case OP_INHERIT: {
-			Value superclass = peek(1);
+			Value superclass = peek(vm, 1);
 			if (!IS_CLASS(superclass)) {
-				runtime_error("Superclass must be a class.");
+				runtime_error(vm,
+					      "Superclass must be a class.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			ObjClass *subclass = AS_CLASS(peek(0));
-			table_add_all(&AS_CLASS(superclass)->methods,
+			ObjClass *subclass = AS_CLASS(peek(vm, 0));
+			table_add_all(vm, &AS_CLASS(superclass)->methods,
 				      &subclass->methods);
-			pop(); // Subclass.
+			pop(vm); // Subclass.
 			break;
 		}
 		case OP_METHOD:
-			define_method(READ_STRING());
+			define_method(vm, READ_STRING());
 			break;
 		case OP_CLOSE_UPVALUE:
-			close_upvalues(vm.stackTop - 1);
-			pop();
+			close_upvalues(vm, vm->stackTop - 1);
+			pop(vm);
 			break;
 		case OP_CLASS:
-			push(OBJ_VAL(new_class(READ_STRING())));
+			push(vm, OBJ_VAL(new_class(vm, READ_STRING())));
+			break;
+		case OP_IMPORT: {
+			if (!import_module(vm, READ_STRING()))
+				return INTERPRET_RUNTIME_ERROR;
+			frame = &vm->frames[vm->frameCount - 1];
 			break;
+		}
 		case OP_RETURN: {
-			Value result = pop();
-			close_upvalues(frame->slots);
-			vm.frameCount--;
-			if (vm.frameCount == 0) {
-				pop();
+			Value result = pop(vm);
+			close_upvalues(vm, frame->slots);
+			vm->frameCount--;
+			vm->stackTop = frame->slots;
+			// A fiber whose function returned passes the result on
+			// to the fiber that resumed it
+			if (vm->frameCount == 0 && vm->fiber->caller != NULL)
+				finish_fiber(vm);
+			push(vm, result);
+			// Return to whoever called into the VM with the result
+			if (vm->frameCount == vm->baseFrame)
 				return INTERPRET_OK;
-			}
 
-			vm.stackTop = frame->slots;
-			push(result);
-			frame = &vm.frames[vm.frameCount - 1];
+			frame = &vm->frames[vm->frameCount - 1];
 			break;
 		}
 		}
@@ -391,184 +755,416 @@ static InterpretResult run(void)
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef CHECKED_OP
 #undef READ_SHORT
+#undef READ_UINT24
 }
 
 // Get stack value of specific distance
-static Value peek(int distance)
+static Value peek(VM *vm, int distance)
 {
-	return vm.stackTop[-1 - distance];
+	return vm->stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure *closure, int argCount)
+static bool call(VM *vm, ObjClosure *closure, int argCount)
 {
 	if (argCount != closure->function->arity) {
-		runtime_error("Expected %d arguments but got %d.",
+		runtime_error(vm, "Expected %d arguments but got %d.",
 			      closure->function->arity, argCount);
 		return false;
 	}
 
-	if (vm.frameCount == FRAMES_MAX) {
-		runtime_error("Stack overflow.");
+	// Deferred bodies are compiled on the first call, which sizes the frame
+	if (closure->function->lazy != NULL &&
+	    !compile_lazy_function(vm, closure->function)) {
+		runtime_error(vm, "Could not compile %s().",
+			      closure->function->name->chars);
 		return false;
 	}
 
-	CallFrame *frame = &vm.frames[vm.frameCount++];
+	Value *end = vm->stackTop - argCount - 1 + closure->function->slotCount;
+	if (vm->frameCount == FRAMES_MAX ||
+	    (end > vm->stackEnd && !grow_stack(vm, end - vm->stack))) {
+		runtime_error(vm, "Stack overflow.");
+		return false;
+	}
+
+	// Functions from a bytecode image get their constants on the first call
+	if (closure->function->image != NULL)
+		load_image_constants(vm, closure->function);
+
+	// The profiler reads the frames below the count from a signal handler,
+	// so the frame is filled before it is counted
+	CallFrame *frame = &vm->frames[vm->frameCount];
+	atomic_signal_fence(memory_order_acq_rel);
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
-	frame->slots = vm.stackTop - argCount - 1;
+	frame->slots = vm->stackTop - argCount - 1;
+	atomic_signal_fence(memory_order_release);
+	vm->frameCount++;
 	return true;
 }
 
-static bool call_value(Value callee, int argCount)
+// Run a module the first time it's imported. Its script is called like a
+// function without arguments, whose nil result is left in place of the
+// import. Later imports, including those of a module by modules it imports
+// while it runs, only push nil.
+static bool import_module(VM *vm, ObjString *path)
+{
+	Value module;
+	if (!table_get_from_table(&vm->modules, path, &module)) {
+		// Modules imported by bytecode files or the REPL weren't compiled
+		// with their program
+		if (!load_module(vm, path)) {
+			runtime_error(vm, "Could not load module \"%s\".",
+				      path->chars);
+			return false;
+		}
+		table_get_from_table(&vm->modules, path, &module);
+	}
+
+	if (!IS_FUNCTION(module)) {
+		push(vm, NIL_VAL);
+		return true;
+	}
+
+	ObjClosure *closure = new_closure(vm, AS_FUNCTION(module));
+	push(vm, OBJ_VAL(closure));
+	insert_into_table(vm, &vm->modules, path, BOOL_VAL(true));
+	return call(vm, closure, 0);
+}
+
+static bool call_value(VM *vm, Value callee, int argCount)
 {
 	if (IS_OBJ(callee)) {
 		switch (OBJ_TYPE(callee)) {
 		case OBJ_BOUND_METHOD: {
 			ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
-			vm.stackTop[-argCount - 1] = bound->receiver;
-			return call(bound->method, argCount);
+			vm->stackTop[-argCount - 1] = bound->receiver;
+			return call(vm, bound->method, argCount);
 		}
 		case OBJ_CLASS: {
 			ObjClass *klass = AS_CLASS(callee);
-			vm.stackTop[-argCount - 1] =
-				OBJ_VAL(new_instance(klass));
+			vm->stackTop[-argCount - 1] =
+				OBJ_VAL(new_instance(vm, klass));
 
 			// Call class initializer
 			Value initializer;
 			if (table_get_from_table(&klass->methods,
-						 vm.init_string,
+						 vm->init_string,
 						 &initializer)) {
-				return call(AS_CLOSURE(initializer), argCount);
+				return call(vm, AS_CLOSURE(initializer),
+					    argCount);
 			} else if (argCount != 0) {
 				runtime_error(
-					"Expected 0 arguments but got %d.",
+					vm, "Expected 0 arguments but got %d.",
 					argCount);
 				return false;
 			}
+			return true;
 		}
 		case OBJ_NATIVE: {
-			NativeFn native = AS_NATIVE(callee);
-			Value result = native(argCount, vm.stackTop - argCount);
-			vm.stackTop -= argCount + 1;
-			push(result);
+			ObjNative *native = AS_NATIVE(callee);
+			Value result = native->function(
+				vm, argCount, vm->stackTop - argCount,
+				native->data);
+			if (vm->nativeError) {
+				vm->nativeError = false;
+				return false;
+			}
+			if (vm->nativeExit != NATIVE_RETURN)
+				return suspend_native(vm, argCount, result);
+			vm->stackTop -= argCount + 1;
+			push(vm, result);
 			return true;
 		}
 		case OBJ_CLOSURE:
-			return call(AS_CLOSURE(callee), argCount);
+			return call(vm, AS_CLOSURE(callee), argCount);
+		case OBJ_FIBER:
+			return resume_fiber(vm, AS_FIBER(callee), argCount);
 		default:
 			break; // Non-callable object type.
 		}
 	}
-	runtime_error("Can only call functions and classes.");
+	runtime_error(vm, "Can only call functions and classes.");
 	return false;
 }
 
-static bool invoke_from_class(ObjClass *klass, ObjString *name, int argCount)
+static bool invoke_from_class(VM *vm, ObjClass *klass, ObjString *name,
+			      int argCount)
 {
 	Value method;
 	if (!table_get_from_table(&klass->methods, name, &method)) {
-		runtime_error("Undefined property '%s'.", name->chars);
+		runtime_error(vm, "Undefined property '%s'.", name->chars);
 		return false;
 	}
-	return call(AS_CLOSURE(method), argCount);
+	return call(vm, AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount)
+static bool invoke(VM *vm, ObjString *name, int argCount)
 {
-	Value receiver = peek(argCount);
+	Value receiver = peek(vm, argCount);
 
 	if (!IS_INSTANCE(receiver)) {
-		runtime_error("Only instances have methods.");
+		runtime_error(vm, "Only instances have methods.");
 		return false;
 	}
 	ObjInstance *instance = AS_INSTANCE(receiver);
 
 	Value value;
 	if (table_get_from_table(&instance->fields, name, &value)) {
-		vm.stackTop[-argCount - 1] = value;
-		return call_value(value, argCount);
+		vm->stackTop[-argCount - 1] = value;
+		return call_value(vm, value, argCount);
 	}
 
-	return invoke_from_class(instance->class_, name, argCount);
+	return invoke_from_class(vm, instance->class_, name, argCount);
 }
 
-static bool bind_method(ObjClass *klass, ObjString *name)
+static bool bind_method(VM *vm, ObjClass *klass, ObjString *name)
 {
 	Value method;
 	if (!table_get_from_table(&klass->methods, name, &method)) {
-		runtime_error("Undefined property '%s'.", name->chars);
+		runtime_error(vm, "Undefined property '%s'.", name->chars);
 		return false;
 	}
 
-	ObjBoundMethod *bound = new_bound_method(peek(0), AS_CLOSURE(method));
+	ObjBoundMethod *bound =
+		new_bound_method(vm, peek(vm, 0), AS_CLOSURE(method));
+
+	pop(vm);
+	push(vm, OBJ_VAL(bound));
+	return true;
+}
+
+// Open upvalues are indexed by the stack slot they point to, so closures
+// capturing the same variable find its upvalue without a search.
+static ObjUpvalue *capture_upvalue(VM *vm, Value *local)
+{
+	int slot = (int)(local - vm->stack);
+	if (vm->openUpvalues[slot] != NULL) {
+		return vm->openUpvalues[slot];
+	}
+
+	// Create new upvalue since it doesn't exist
+	ObjUpvalue *createdUpvalue = new_upvalue(vm, local);
+	createdUpvalue->fiber = vm->fiber;
+	vm->openUpvalues[slot] = createdUpvalue;
+	if (slot >= vm->openTop) {
+		vm->openTop = slot + 1;
+	}
+	return createdUpvalue;
+}
 
-	pop();
-	push(OBJ_VAL(bound));
+// Creates an upvalue that is closed over a copy of `value` from the start.
+// Used for locals that never change, which don't need to be shared.
+static ObjUpvalue *copy_upvalue(VM *vm, Value value)
+{
+	ObjUpvalue *upvalue = new_upvalue(vm, NULL);
+	upvalue->closed = value;
+	upvalue->location = &upvalue->closed;
+	return upvalue;
+}
+
+// Close the open upvalues of every slot from `last` up. Returns from frames
+// that sit above all open upvalues don't have any slots to look at.
+static void close_upvalues(VM *vm, Value *last)
+{
+	int first = (int)(last - vm->stack);
+	for (int slot = first; slot < vm->openTop; slot++) {
+		ObjUpvalue *upvalue = vm->openUpvalues[slot];
+		if (upvalue != NULL) {
+			upvalue->closed = *upvalue->location;
+			upvalue->location = &upvalue->closed;
+			upvalue->fiber = NULL;
+			vm->openUpvalues[slot] = NULL;
+		}
+	}
+	if (first < vm->openTop) {
+		vm->openTop = first;
+	}
+}
+
+// Save the registers of the running fiber and load those of `fiber`, which
+// runs from here on. Every pointer into a stack stays valid, as each
+// fiber has one of its own.
+static inline void switch_fiber(VM *vm, ObjFiber *fiber)
+{
+	ObjFiber *current = vm->fiber;
+	current->stackTop = vm->stackTop;
+	current->frameCount = vm->frameCount;
+	current->baseFrame = vm->baseFrame;
+	current->openTop = vm->openTop;
+
+	// The profiler never sees the frames of one fiber with the count of
+	// the other
+	vm->frameCount = 0;
+	atomic_signal_fence(memory_order_release);
+	vm->fiber = fiber;
+	vm->stack = fiber->stack;
+	vm->stackTop = fiber->stackTop;
+	vm->stackEnd = fiber->stackEnd;
+	vm->frames = fiber->frames;
+	atomic_signal_fence(memory_order_release);
+	vm->frameCount = fiber->frameCount;
+	vm->baseFrame = fiber->baseFrame;
+	vm->openUpvalues = fiber->openUpvalues;
+	vm->openTop = fiber->openTop;
+}
+
+// Grow the stack of the running fiber until `slots` slots fit below its
+// headroom, moving the frames and open upvalues that point into it. The
+// main fiber's stack is the VM's own and doesn't grow.
+static bool grow_stack(VM *vm, ptrdiff_t slots)
+{
+	ObjFiber *fiber = vm->fiber;
+	if (fiber->stackCapacity == 0 || slots > FRAME_SLOTS_MAX)
+		return false;
+
+	int oldCapacity = fiber->stackCapacity;
+	int capacity = oldCapacity;
+	while (capacity - STACK_HEADROOM < slots)
+		capacity = (capacity - STACK_HEADROOM) * 2 + STACK_HEADROOM;
+	if (capacity > STACK_MAX)
+		capacity = STACK_MAX;
+
+	// The old stack is freed once nothing points into it, so that any
+	// collection on the way sees every root
+	Value *old = vm->stack;
+	Value *stack = ALLOCATE(vm, Value, capacity);
+	memcpy(stack, old, sizeof(Value) * (vm->stackTop - old));
+	for (int i = 0; i < vm->frameCount; i++)
+		vm->frames[i].slots = stack + (vm->frames[i].slots - old);
+	for (int i = 0; i < vm->openTop; i++) {
+		if (vm->openUpvalues[i] != NULL)
+			vm->openUpvalues[i]->location = stack + i;
+	}
+	vm->stackTop = stack + (vm->stackTop - old);
+	vm->stack = stack;
+	vm->stackEnd = stack + capacity - STACK_HEADROOM;
+	fiber->stack = stack;
+	fiber->stackEnd = vm->stackEnd;
+	FREE_ARRAY(vm, Value, old, oldCapacity);
+
+	vm->openUpvalues = GROW_ARRAY(vm, ObjUpvalue *, vm->openUpvalues,
+				      oldCapacity, capacity);
+	for (int i = oldCapacity; i < capacity; i++)
+		vm->openUpvalues[i] = NULL;
+	fiber->openUpvalues = vm->openUpvalues;
+	fiber->stackCapacity = capacity;
 	return true;
 }
 
-static ObjUpvalue *capture_upvalue(Value *local)
+// Resume a fiber, passing it the argument of the call or nil without one.
+// The call is popped from the resuming fiber's stack, and the value the
+// resumed fiber yields or returns is pushed in its place when it switches
+// back.
+static bool resume_fiber(VM *vm, ObjFiber *fiber, int argCount)
 {
-	// Check for existing upvalue on linked list
-	ObjUpvalue *prevUpvalue = NULL;
-	ObjUpvalue *upvalue = vm.openUpvalues;
-	while (upvalue != NULL && upvalue->location > local) {
-		prevUpvalue = upvalue;
-		upvalue = upvalue->next;
+	if (argCount > 1) {
+		runtime_error(vm, "Expected 0 or 1 arguments but got %d.",
+			      argCount);
+		return false;
+	}
+	if (fiber->state == FIBER_RUNNING) {
+		runtime_error(vm, "Can't resume a running fiber.");
+		return false;
+	}
+	if (fiber->state == FIBER_WAITING) {
+		runtime_error(vm, "Can't resume a task, the event loop does.");
+		return false;
+	}
+	if (fiber->state == FIBER_DONE) {
+		runtime_error(vm, "Can't resume a finished fiber.");
+		return false;
 	}
 
-	if (upvalue != NULL && upvalue->location == local) {
-		return upvalue;
+	Value value = argCount == 1 ? peek(vm, 0) : NIL_VAL;
+	vm->stackTop -= argCount + 1;
+	fiber->caller = vm->fiber;
+	switch_fiber(vm, fiber);
+
+	// A new fiber starts by calling its function, which sits at the
+	// bottom of its stack, with the value if it takes one
+	if (fiber->state == FIBER_NEW) {
+		fiber->state = FIBER_RUNNING;
+		int arity = fiber->closure->function->arity;
+		if (arity == 1)
+			push(vm, value);
+		return call(vm, fiber->closure, arity);
 	}
 
-	// Create new upvalue since it doesn't exist
-	ObjUpvalue *createdUpvalue = new_upvalue(local);
-	// Insert it into the linked list
-	createdUpvalue->next = upvalue;
+	// A native that suspended it before finishing is called again
+	fiber->state = FIBER_RUNNING;
+	if (fiber->retryArgs >= 0) {
+		int retryArgs = fiber->retryArgs;
+		fiber->retryArgs = -1;
+		return call_value(vm, peek(vm, retryArgs), retryArgs);
+	}
+	push(vm, value);
+	return true;
+}
+
+// Suspend the running fiber and switch back to the one that resumed it,
+// which gets `value`
+static void yield_fiber(VM *vm, Value value)
+{
+	ObjFiber *fiber = vm->fiber;
+	ObjFiber *caller = fiber->caller;
+	fiber->caller = NULL;
+	fiber->state = FIBER_SUSPENDED;
+	switch_fiber(vm, caller);
+	push(vm, value);
+}
 
-	if (prevUpvalue == NULL) {
-		vm.openUpvalues = createdUpvalue;
+// Suspend the fiber of a native's call as the native asked. A yield
+// finishes the call with the native's result and hands that to the
+// resumer; a wait leaves the call on the stack to be made again.
+static bool suspend_native(VM *vm, int argCount, Value result)
+{
+	if (vm->nativeExit == NATIVE_YIELD) {
+		vm->stackTop -= argCount + 1;
 	} else {
-		prevUpvalue->next = createdUpvalue;
+		vm->fiber->retryArgs = argCount;
+		result = NIL_VAL;
 	}
-	return createdUpvalue;
+	vm->nativeExit = NATIVE_RETURN;
+	yield_fiber(vm, result);
+	return true;
 }
 
-static void close_upvalues(Value *last)
+// Finish the running fiber, whose frames are all gone, and switch back to
+// the one that resumed it
+static void finish_fiber(VM *vm)
 {
-	while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-		ObjUpvalue *upvalue = vm.openUpvalues;
-		upvalue->closed = *upvalue->location;
-		upvalue->location = &upvalue->closed;
-		vm.openUpvalues = upvalue->next;
-	}
+	ObjFiber *fiber = vm->fiber;
+	ObjFiber *caller = fiber->caller;
+	fiber->caller = NULL;
+	fiber->state = FIBER_DONE;
+	switch_fiber(vm, caller);
 }
 
-static void define_method(ObjString *name)
+static void define_method(VM *vm, ObjString *name)
 {
-	Value method = peek(0);
-	ObjClass *klass = AS_CLASS(peek(1));
-	insert_into_table(&klass->methods, name, method);
-	pop();
+	Value method = peek(vm, 0);
+	ObjClass *klass = AS_CLASS(peek(vm, 1));
+	insert_into_table(vm, &klass->methods, name, method);
+	pop(vm);
 }
 
-// Throw runtime error and reset stack
-static void runtime_error(const char *format, ...)
+// Report a runtime error with a trace of the calls in progress. The caller
+// unwinds them.
+static void report_error(VM *vm, const char *format, va_list args)
 {
-	va_list args;
-	va_start(args, format);
 	vfprintf(stderr, format, args);
-	va_end(args);
 	fputs("\n", stderr);
 
-	for (int i = vm.frameCount - 1; i >= 0; i--) {
-		CallFrame *frame = &vm.frames[i];
+	for (int i = vm->frameCount - 1; i >= 0; i--) {
+		CallFrame *frame = &vm->frames[i];
 		ObjFunction *function = frame->closure->function;
 		size_t instruction = frame->ip - function->chunk.code - 1;
 
 		fprintf(stderr, "[line %d] in ",
-			function->chunk.lines[instruction]);
+			get_line(&function->chunk, (int)instruction));
 
 		if (function->name == NULL) {
 			fprintf(stderr, "script\n");
@@ -576,33 +1172,132 @@ static void runtime_error(const char *format, ...)
 			fprintf(stderr, "%s()\n", function->name->chars);
 		}
 	}
+}
+
+// Report a runtime error with a trace of the calls in progress
+static void runtime_error(VM *vm, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	report_error(vm, format, args);
+	va_end(args);
+}
+
+// Report a runtime error from a native function, whose call fails once it
+// returns
+Value native_error(VM *vm, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	report_error(vm, format, args);
+	va_end(args);
 
-	reset_stack();
+	vm->nativeError = true;
+	return NIL_VAL;
 }
 
-static void define_native(const char *name, NativeFn function)
+// Check if the running fiber can be suspended: it isn't the main fiber and
+// no native is calling back into the VM on its stack
+bool can_yield(VM *vm)
 {
-	push(OBJ_VAL(copy_string(name, (int)strlen(name))));
-	push(OBJ_VAL(new_native(function)));
-	insert_into_table(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-	pop();
-	pop();
+	return vm->fiber->caller != NULL && vm->baseFrame == -1;
+}
+
+// Suspend the fiber that called the running native once the native
+// returns, handing `value` to the fiber that resumed it
+Value native_yield(VM *vm, Value value)
+{
+	if (vm->fiber->caller == NULL)
+		return native_error(vm, "Can't yield from the main fiber.");
+	if (vm->baseFrame != -1)
+		return native_error(vm, "Can't yield across a native call.");
+
+	vm->nativeExit = NATIVE_YIELD;
+	return value;
+}
+
+// Suspend the fiber that called the running native once the native
+// returns, without finishing the call, which is made again when the fiber
+// is resumed. The fiber must be able to yield.
+Value native_wait(VM *vm)
+{
+	vm->nativeExit = NATIVE_WAIT;
+	return NIL_VAL;
+}
+
+// Define a global holding a native function. The name and the native are
+// kept on the stack while they are allocated, on top of whatever is there.
+void define_native(VM *vm, const char *name, NativeFn function, void *data,
+		   size_t dataSize)
+{
+	push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+	push(vm, OBJ_VAL(new_native(vm, function, data, dataSize)));
+	insert_into_table(vm, &vm->globals, AS_STRING(peek(vm, 1)),
+			  peek(vm, 0));
+	pop(vm);
+	pop(vm);
 }
 
 // Interpret given string
-InterpretResult interpret(const char *source)
+InterpretResult interpret(VM *vm, const char *source)
 {
-	ObjFunction *function = compile(source);
+	ObjFunction *function = compile(vm, source);
 	if (function == NULL)
 		return INTERPRET_COMPILE_ERROR;
 
-	push(OBJ_VAL(function));
-	ObjClosure *closure = new_closure(function);
-	pop();
-	push(OBJ_VAL(closure));
-	call(closure, 0);
+	return interpret_function(vm, function);
+}
 
-	return run();
+// Run an already compiled top-level script function
+InterpretResult interpret_function(VM *vm, ObjFunction *function)
+{
+	push(vm, OBJ_VAL(function));
+	ObjClosure *closure = new_closure(vm, function);
+	pop(vm);
+	push(vm, OBJ_VAL(closure));
+
+	Value result;
+	return call_function(vm, 0, &result);
+}
+
+// Call the value below the top `argCount` values of the stack with them as
+// its arguments and run the VM until it returns. Calls nest, so a native can
+// call back into the VM; a runtime error only unwinds the innermost call.
+InterpretResult call_function(VM *vm, int argCount, Value *result)
+{
+	// The stack of a fiber moves when it grows
+	ObjFiber *fiber = vm->fiber;
+	int base = (int)(vm->stackTop - argCount - 1 - vm->stack);
+	int outerBase = vm->baseFrame;
+	vm->baseFrame = vm->frameCount;
+
+	InterpretResult status = INTERPRET_OK;
+	if (!call_value(vm, vm->stack[base], argCount)) {
+		status = INTERPRET_RUNTIME_ERROR;
+	} else if (vm->frameCount > vm->baseFrame) {
+		// Natives and classes without an initializer are done already
+		status = run(vm);
+	}
+
+	if (status == INTERPRET_OK) {
+		*result = pop(vm);
+	} else {
+		// Fibers resumed during the call that haven't switched back
+		// fail with it
+		while (vm->fiber != fiber) {
+			close_upvalues(vm, vm->stack);
+			vm->stackTop = vm->stack;
+			vm->frameCount = 0;
+			finish_fiber(vm);
+		}
+		close_upvalues(vm, vm->stack + base);
+		vm->frameCount = vm->baseFrame;
+		vm->stackTop = vm->stack + base;
+		*result = NIL_VAL;
+	}
+
+	vm->baseFrame = outerBase;
+	return status;
 }
 
 // Check bool value of Value type
@@ -612,41 +1307,157 @@ static bool is_falsey(Value value)
 }
 
 // Concatenate first 2 strings on the stack
-static void concatenate(void)
+static void concatenate(VM *vm)
 {
-	ObjString *b = AS_STRING(pop());
-	ObjString *a = AS_STRING(pop());
+	// Leave the operands on the stack so the collector can see them
+	ObjString *b = AS_STRING(peek(vm, 0));
+	ObjString *a = AS_STRING(peek(vm, 1));
 
 	int length = a->length + b->length;
-	char *chars = ALLOCATE(char, length + 1);
+	char *chars = ALLOCATE(vm, char, length + 1);
 	memcpy(chars, a->chars, a->length);
 	memcpy(chars + a->length, b->chars, b->length);
 	chars[length] = '\0';
 
-	ObjString *result = take_string(chars, length);
+	ObjString *result = take_string(vm, chars, length);
 
-	pop();
-	pop();
+	pop(vm);
+	pop(vm);
 
-	push(OBJ_VAL(result));
+	push(vm, OBJ_VAL(result));
 }
 
-static Value clock_native(int argCount, Value *args)
+static Value clock_native(VM *vm, int argCount, Value *args, void *data)
 {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// Create a fiber that runs a function of at most one parameter, which
+// gets the value the fiber is first resumed with
+static Value fiber_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_CLOSURE(args[0]) ||
+	    AS_CLOSURE(args[0])->function->arity > 1)
+		return native_error(
+			vm, "Expected a function of at most one parameter.");
+
+	return OBJ_VAL(new_fiber(vm, AS_CLOSURE(args[0])));
+}
+
+// Hand a value, or nil without one, to the fiber that resumed the running
+// one
+static Value yield_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount > 1)
+		return native_error(vm, "Expected 0 or 1 arguments but got %d.",
+				    argCount);
+	return native_yield(vm, argCount == 1 ? args[0] : NIL_VAL);
+}
+
+// Check if a fiber's function has returned or failed
+static Value done_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_FIBER(args[0]))
+		return native_error(vm, "Expected a fiber.");
+
+	return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+// Get the number of elements of an array or float array, keys of a map or
+// characters of a string
+static Value length_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount == 1 && IS_ARRAY(args[0]))
+		return INT_VAL(AS_ARRAY(args[0])->elements.count);
+	if (argCount == 1 && IS_MAP(args[0]))
+		return INT_VAL(AS_MAP(args[0])->table.size);
+	if (argCount == 1 && IS_FLOAT_ARRAY(args[0]))
+		return INT_VAL(AS_FLOAT_ARRAY(args[0])->count);
+	if (argCount == 1 && IS_STRING(args[0]))
+		return INT_VAL(AS_STRING(args[0])->length);
+	return native_error(vm, "Expected an array, a map or a string.");
+}
+
+// Add a value to the end of an array
+static Value append_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 2 || !IS_ARRAY(args[0]))
+		return native_error(vm, "Expected an array and a value.");
+
+	// Both arguments are on the stack while the array grows
+	write_value_array(vm, &AS_ARRAY(args[0])->elements, args[1]);
+	return NIL_VAL;
+}
+
+// Remove the last element of an array and return it
+static Value pop_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_ARRAY(args[0]))
+		return native_error(vm, "Expected an array.");
+
+	ValueArray *elements = &AS_ARRAY(args[0])->elements;
+	if (elements->count == 0)
+		return native_error(vm, "Can't pop from an empty array.");
+	return elements->values[--elements->count];
+}
+
+// Get an array of the keys of a map, in no particular order
+static Value keys_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 1 || !IS_MAP(args[0]))
+		return native_error(vm, "Expected a map.");
+
+	ValueTable *table = &AS_MAP(args[0])->table;
+	ObjArray *array = new_array(vm);
+	if (table->size == 0)
+		return OBJ_VAL(array);
+
+	push(vm, OBJ_VAL(array));
+	array->elements.values = GROW_ARRAY(vm, Value, NULL, 0, table->size);
+	array->elements.capacity = table->size;
+	for (int i = 0; i < table->capacity; i++) {
+		if (!IS_NIL(table->entries[i].key))
+			array->elements.values[array->elements.count++] =
+				table->entries[i].key;
+	}
+	pop(vm);
+	return OBJ_VAL(array);
+}
+
+// Check if a map has a key
+static Value has_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 2 || !IS_MAP(args[0]))
+		return native_error(vm, "Expected a map and a key.");
+
+	Value value;
+	return BOOL_VAL(is_map_key(args[1]) &&
+			value_table_get(&AS_MAP(args[0])->table, args[1],
+					&value));
+}
+
+// Remove a key from a map, returning whether it was there
+static Value remove_native(VM *vm, int argCount, Value *args, void *data)
+{
+	if (argCount != 2 || !IS_MAP(args[0]))
+		return native_error(vm, "Expected a map and a key.");
+
+	return BOOL_VAL(is_map_key(args[1]) &&
+			delete_from_value_table(&AS_MAP(args[0])->table,
+						args[1]));
+}
+
 // Push onto VM stack
-void push(Value value)
+void push(VM *vm, Value value)
 {
-	*vm.stackTop = value;
-	vm.stackTop++;
+	*vm->stackTop = value;
+	vm->stackTop++;
 }
 
 // Pop from VM stack
-Value pop(void)
+Value pop(VM *vm)
 {
-	--vm.stackTop;
-	return *vm.stackTop;
+	--vm->stackTop;
+	return *vm->stackTop;
 }
 //####################
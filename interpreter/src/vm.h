@@ -14,44 +14,92 @@
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
-typedef struct {
-	ObjClosure *closure;
-	uint8_t *ip;
-	Value *slots;
-} CallFrame;
-
-// Virtual machine meta data
-typedef struct {
+// Slots every stack keeps free above the ones its calls reserve, for the
+// values natives push while they run
+#define STACK_HEADROOM UINT8_COUNT
+
+// Most slots a single call can reserve, which every stack has room for
+#define FRAME_SLOTS_MAX (STACK_MAX - STACK_HEADROOM)
+
+// Slots a new fiber's calls can reserve before its stack grows
+#define FIBER_STACK_MIN 64
+
+// What the call of a native does once the native returns
+typedef enum {
+	NATIVE_RETURN, // Returns the native's result
+	NATIVE_YIELD, // Returns it and yields it to the fiber's resumer
+	NATIVE_WAIT, // Yields nil and is made again when the fiber resumes
+} NativeExit;
+
+// Virtual machine meta data. A VM owns every object it creates, so any
+// number of them can run in one process, each on one thread at a time.
+// The stack, frames and open upvalues are those of the running fiber, and
+// switching fibers swaps them.
+struct VM {
 	Chunk *chunk; // Byte code chunk
 	uint8_t *ip; // Unique vm id
-	Value stack[STACK_MAX]; // Stack dynamic array pointer
+	Value *stack; // Value stack of the running fiber
 	Value *stackTop; // Stack's head pointer
-	CallFrame frames[FRAMES_MAX];
+	Value *stackEnd; // Calls may not use the slots from here up
+	CallFrame *frames; // Call frames of the running fiber
 	int frameCount;
+	int baseFrame; // Frames below the innermost call into the VM
+	ObjUpvalue **openUpvalues; // Open upvalue of each stack slot, or NULL
+	int openTop; // Slots from here up have no open upvalue
+	ObjFiber *fiber; // The running fiber
+	ObjFiber *mainFiber; // Fiber of programs and host calls
+	bool nativeError; // Whether the running native reported an error
+	NativeExit nativeExit; // What the running native's call does next
 	Table strings; // Hash table
 	Table globals; // Hash table of global variables
+	Table modules; // Compiled modules by path, true once they ran
+	ValueArray received; // Objects of a message while it's decoded
+	char *directory; // Directory of the program's file, NULL if unknown
+	struct Loop *loop; // Event loop of the tasks, NULL until first used
 	Obj *objects; // Head of object list
-	ObjUpvalue *openUpvalues; // Array of open up values
+	struct Image *images; // Bytecode images mapped by load_bytecode()
 	ObjString *init_string;
 	int gray_count;
 	int gray_capacity;
 	Obj **gray_stack;
 	size_t bytesAllocated;
 	size_t nextGC;
-} VM;
-
-// Global to program vm struct
-extern VM vm;
+	int optimizationLevel; // Passes the compiler runs before lowering
+	bool lazyCompilation; // Whether the compiler defers function bodies
+	Value mainStack[STACK_MAX]; // Stack of the main fiber
+	CallFrame mainFrames[FRAMES_MAX]; // Call frames of the main fiber
+	ObjUpvalue *mainUpvalues[STACK_MAX]; // Open upvalues of the main fiber
+};
 
 // Start up virtual machine
-void init_vm(void);
+void init_vm(VM *vm);
 // Close virtual machine and free up memory
-void free_vm(void);
+void free_vm(VM *vm);
 // Interpret given string
-InterpretResult interpret(const char *source);
+InterpretResult interpret(VM *vm, const char *source);
+// Run an already compiled top-level script function
+InterpretResult interpret_function(VM *vm, ObjFunction *function);
+// Call the value below the top `argCount` values of the stack with them as
+// arguments, popping all of them and storing the returned value in `result`
+InterpretResult call_function(VM *vm, int argCount, Value *result);
+// Report a runtime error from a native function, which returns the
+// value this returns right after and makes its call fail
+Value native_error(VM *vm, const char *format, ...);
+// Check if the running fiber can be suspended by a native it called
+bool can_yield(VM *vm);
+// Make the call of the running native yield the value it returns, which
+// it returns right after, reporting an error if the fiber can't yield
+Value native_yield(VM *vm, Value value);
+// Make the call of the running native suspend its fiber, which must be able
+// to yield, and be made again when the fiber resumes. The native returns
+// what this returns right after.
+Value native_wait(VM *vm);
+// Define a global native function that is passed `data` on every call
+void define_native(VM *vm, const char *name, NativeFn function, void *data,
+		   size_t dataSize);
 // Push onto VM stack
-void push(Value value);
+void push(VM *vm, Value value);
 // Pop from VM stack
-Value pop(void);
+Value pop(VM *vm);
 
 #endif
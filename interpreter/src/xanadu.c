@@ -0,0 +1,233 @@
+// Copyright 2024 Dimitrios Papakonstantinou. All rights reserved.
+// Use of this source code is governed by a MIT
+// license that can be found in the LICENSE file.
+//
+// This file contains the implementation of the embedding interface declared
+// in xanadu.h. The public value type has the layout of the VM's own, so
+// values are converted by copying them, and calls from the host push their
+// arguments straight onto the VM's stack.
+
+#include "xanadu.h"
+
+#include "vm.h"
+#include "compiler.h"
+#include "memory.h"
+#include "loop.h"
+#include "module.h"
+#include "object.h"
+#include "optimizer.h"
+#include "serialize.h"
+#include "source.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(sizeof(XanaduValue) == sizeof(Value) &&
+		       sizeof(((XanaduValue *)0)->as) ==
+			       sizeof(((Value *)0)->as),
+	       "XanaduValue must have the layout of Value");
+_Static_assert((int)XANADU_VAL_BOOL == (int)VAL_BOOL &&
+		       (int)XANADU_VAL_NIL == (int)VAL_NIL &&
+		       (int)XANADU_VAL_NUMBER == (int)VAL_NUMBER &&
+		       (int)XANADU_VAL_OBJ == (int)VAL_OBJ,
+	       "XanaduValueType must match ValueType");
+_Static_assert((int)XANADU_OK == (int)INTERPRET_OK &&
+		       (int)XANADU_COMPILE_ERROR ==
+			       (int)INTERPRET_COMPILE_ERROR &&
+		       (int)XANADU_RUNTIME_ERROR ==
+			       (int)INTERPRET_RUNTIME_ERROR,
+	       "XanaduResult must match InterpretResult");
+
+// A native registered by the host, called through call_host()
+typedef struct {
+	XanaduNative function; // The host's function
+	void *data; // Data the host registered it with
+} HostNative;
+
+// Convert a value of the host into one of the VM
+static inline Value from_host(XanaduValue value)
+{
+	Value result;
+	result.type = (ValueType)value.type;
+	memcpy(&result.as, &value.as, sizeof(result.as));
+	return result;
+}
+
+// Convert a value of the VM into one of the host. Hosts see integers as
+// numbers.
+static inline XanaduValue to_host(Value value)
+{
+	if (IS_INT(value))
+		return XANADU_NUMBER_VAL(AS_NUMBER(value));
+
+	XanaduValue result;
+	result.type = (XanaduValueType)value.type;
+	memcpy(&result.as, &value.as, sizeof(result.as));
+	return result;
+}
+
+// Native function of every host native, which converts the arguments and
+// calls the host's function
+static Value call_host(VM *vm, int argCount, Value *args, void *data)
+{
+	HostNative *host = (HostNative *)data;
+	XanaduValue hostArgs[UINT8_COUNT];
+
+	for (int i = 0; i < argCount; i++)
+		hostArgs[i] = to_host(args[i]);
+
+	return from_host(host->function(vm, argCount, hostArgs, host->data));
+}
+
+// Create a VM
+XanaduVM *xanadu_new_vm(void)
+{
+	VM *vm = malloc(sizeof(VM));
+	if (vm == NULL)
+		return NULL;
+
+	init_vm(vm);
+	return vm;
+}
+
+// Free a VM and every object it owns
+void xanadu_free_vm(XanaduVM *vm)
+{
+	free_vm(vm);
+	free(vm);
+}
+
+// Set the optimization level of the code compiled from now on
+void xanadu_set_optimization_level(XanaduVM *vm, int level)
+{
+	if (level < OPT_LEVEL_NONE)
+		level = OPT_LEVEL_NONE;
+	if (level > OPT_LEVEL_MAX)
+		level = OPT_LEVEL_MAX;
+	set_optimization_level(vm, level);
+}
+
+// Let the tasks a program started finish once its script ran, failing
+// like the script if one of them does
+static XanaduResult finish_tasks(XanaduVM *vm, InterpretResult result)
+{
+	if (result == INTERPRET_OK && !run_loop(vm))
+		result = INTERPRET_RUNTIME_ERROR;
+	return (XanaduResult)result;
+}
+
+// Compile and run source code as a program, then the tasks it started
+XanaduResult xanadu_run_source(XanaduVM *vm, const char *source)
+{
+	return finish_tasks(vm, interpret(vm, source));
+}
+
+// Run a source or bytecode file as a program, then the tasks it started
+XanaduResult xanadu_run_file(XanaduVM *vm, const char *path)
+{
+	ObjFunction *function;
+
+	if (strcmp(path, STDIN_PATH) != 0 && is_bytecode_file(path)) {
+		function = load_bytecode(vm, path, NULL);
+		if (function == NULL) {
+			fprintf(stderr, "Could not load bytecode file \"%s\".\n",
+				path);
+			return XANADU_COMPILE_ERROR;
+		}
+	} else {
+		Source source;
+		if (!load_source(path, &source)) {
+			fprintf(stderr, "Could not read file \"%s\": %s.\n",
+				path, strerror(errno));
+			return XANADU_COMPILE_ERROR;
+		}
+
+		function = compile_program(vm, source.chars, path);
+		free_source(&source);
+		if (function == NULL)
+			return XANADU_COMPILE_ERROR;
+	}
+
+	return finish_tasks(vm, interpret_function(vm, function));
+}
+
+// Look up a global variable
+bool xanadu_get_global(XanaduVM *vm, const char *name, XanaduValue *value)
+{
+	ObjString *key = copy_string(vm, name, (int)strlen(name));
+
+	Value global;
+	if (!table_get_from_table(&vm->globals, key, &global))
+		return false;
+
+	*value = to_host(global);
+	return true;
+}
+
+// Define or assign a global variable. The value is pushed first, since it
+// may only be reachable from the host while the name is allocated.
+void xanadu_set_global(XanaduVM *vm, const char *name, XanaduValue value)
+{
+	push(vm, from_host(value));
+	push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+	insert_into_table(vm, &vm->globals, AS_STRING(vm->stackTop[-1]),
+			  vm->stackTop[-2]);
+	pop(vm);
+	pop(vm);
+}
+
+// Call a value with arguments
+XanaduResult xanadu_call(XanaduVM *vm, XanaduValue callee, int argCount,
+			 const XanaduValue *args, XanaduValue *result)
+{
+	// The callee and its arguments have to fit on the stack
+	if (argCount < 0 ||
+	    argCount >= vm->stackEnd - vm->stackTop) {
+		fprintf(stderr, "Stack overflow.\n");
+		*result = XANADU_NIL_VAL;
+		return XANADU_RUNTIME_ERROR;
+	}
+
+	push(vm, from_host(callee));
+	for (int i = 0; i < argCount; i++)
+		push(vm, from_host(args[i]));
+
+	Value value;
+	InterpretResult status = call_function(vm, argCount, &value);
+	*result = to_host(value);
+	return (XanaduResult)status;
+}
+
+// Define a global native function. Its record of the host's function is
+// freed with the native, the data stays the host's.
+void xanadu_define_native(XanaduVM *vm, const char *name,
+			  XanaduNative function, void *data)
+{
+	HostNative *host = ALLOCATE(vm, HostNative, 1);
+	host->function = function;
+	host->data = data;
+	define_native(vm, name, call_host, host, sizeof(HostNative));
+}
+
+// Create a string
+XanaduValue xanadu_string(XanaduVM *vm, const char *chars, int length)
+{
+	return to_host(OBJ_VAL(copy_string(vm, chars, length)));
+}
+
+// Check if a value is a string
+bool xanadu_is_string(XanaduValue value)
+{
+	return IS_STRING(from_host(value));
+}
+
+// Get the characters of a string value
+const char *xanadu_string_chars(XanaduValue value, int *length)
+{
+	ObjString *string = AS_STRING(from_host(value));
+	if (length != NULL)
+		*length = string->length;
+	return string->chars;
+}